@@ -0,0 +1,91 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <voxtrees.h>
+#include <gettime.h>
+
+#define SIDE 300
+#define HEIGHT 50
+#define STROKES 2000
+#define RADIUS 6
+
+/*
+  Simulate an editing tool: each stroke adds or removes a ball of voxels
+  at a random place on a terrain.
+*/
+static size_t make_stroke (vox_dot *set, int seed)
+{
+    int i, j, k, x, y, z;
+    size_t n = 0;
+
+    srand (seed);
+    x = rand() % SIDE; y = rand() % SIDE; z = rand() % HEIGHT;
+    for (i=-RADIUS; i<=RADIUS; i++)
+        for (j=-RADIUS; j<=RADIUS; j++)
+            for (k=-RADIUS; k<=RADIUS; k++)
+                if (i*i + j*j + k*k <= RADIUS*RADIUS)
+                {
+                    vox_dot_set (set[n], x+i, y+j, z+k);
+                    n++;
+                }
+    return n;
+}
+
+static struct vox_node* make_terrain ()
+{
+    vox_dot *dots = vox_alloc (sizeof (vox_dot)*SIDE*SIDE*HEIGHT);
+    struct vox_node *tree;
+    int i, j, k;
+    size_t n = 0;
+
+    srand (1);
+    for (i=0; i<SIDE; i++)
+        for (j=0; j<SIDE; j++)
+            for (k=0; k<HEIGHT - rand() % 10; k++)
+            {
+                vox_dot_set (dots[n], i, j, k);
+                n++;
+            }
+    tree = vox_make_tree (dots, n);
+    free (dots);
+    return tree;
+}
+
+int main ()
+{
+    vox_dot *set = vox_alloc (sizeof (vox_dot) * (2*RADIUS+1)*(2*RADIUS+1)*(2*RADIUS+1));
+    struct vox_node *tree;
+    double time;
+    size_t i, j, n, changed;
+
+    vox_dot_set (vox_voxel, 1, 1, 1);
+
+    tree = make_terrain ();
+    changed = 0;
+    time = gettime();
+    for (i=0; i<STROKES; i++)
+    {
+        n = make_stroke (set, i);
+        for (j=0; j<n; j++)
+            changed += (i % 2) ? vox_delete_voxel (&tree, set[j]) : vox_insert_voxel (&tree, set[j]);
+    }
+    time = gettime() - time;
+    printf ("Voxel by voxel: %lu voxels changed in %f seconds, %lu voxels in tree\n",
+            changed, time, vox_voxels_in_tree (tree));
+    vox_destroy_tree (tree);
+
+    tree = make_terrain ();
+    changed = 0;
+    time = gettime();
+    for (i=0; i<STROKES; i++)
+    {
+        n = make_stroke (set, i);
+        changed += (i % 2) ? vox_delete_voxels (&tree, set, n) : vox_insert_voxels (&tree, set, n);
+    }
+    time = gettime() - time;
+    printf ("Batches: %lu voxels changed in %f seconds, %lu voxels in tree\n",
+            changed, time, vox_voxels_in_tree (tree));
+    vox_destroy_tree (tree);
+
+    free (set);
+    return 0;
+}
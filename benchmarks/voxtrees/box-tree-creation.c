@@ -0,0 +1,96 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <voxtrees.h>
+#include <gettime.h>
+
+#define SIDE 256
+#define BLOCKS 200
+#define RAYS 1000000
+#define FILENAME "box-tree-creation.tree"
+
+/*
+  A blocky scene: boxes of random sizes at random places (not aligned with
+  anything). Compare trees made by vox_make_tree() and
+  vox_make_tree_boxes().
+*/
+static size_t make_blocks (vox_dot *set)
+{
+    unsigned char *grid = calloc (SIDE*SIDE*SIDE, 1);
+    int b, i, j, k, min[3], size[3];
+    size_t n = 0;
+
+    srand (1);
+    for (b=0; b<BLOCKS; b++)
+    {
+        for (i=0; i<3; i++)
+        {
+            size[i] = rand() % 40 + 5;
+            min[i] = rand() % (SIDE - size[i]);
+        }
+        for (i=min[0]; i<min[0]+size[0]; i++)
+            for (j=min[1]; j<min[1]+size[1]; j++)
+                for (k=min[2]; k<min[2]+size[2]; k++) grid[(i*SIDE + j)*SIDE + k] = 1;
+    }
+    for (i=0; i<SIDE; i++)
+        for (j=0; j<SIDE; j++)
+            for (k=0; k<SIDE; k++)
+                if (grid[(i*SIDE + j)*SIDE + k])
+                {
+                    vox_dot_set (set[n], i, j, k);
+                    n++;
+                }
+    free (grid);
+    return n;
+}
+
+static void run (const char *name, struct vox_node* (*make) (vox_dot*, size_t),
+                 const vox_dot *voxels, vox_dot *set, size_t n,
+                 const vox_dot *origins, const vox_dot *dirs)
+{
+    struct vox_node *tree;
+    struct stat st;
+    double time;
+    vox_dot res;
+    int i, hits = 0;
+
+    memcpy (set, voxels, n*sizeof(vox_dot));
+    time = gettime();
+    tree = make (set, n);
+    printf ("%s: built in %f seconds, ", name, gettime() - time);
+    if (vox_save_tree (tree, FILENAME, NULL) && stat (FILENAME, &st) == 0)
+        printf ("%lli bytes saved, ", (long long)st.st_size);
+    remove (FILENAME);
+
+    time = gettime();
+    for (i=0; i<RAYS; i++)
+        hits += vox_ray_tree_intersection (tree, origins[i], dirs[i], res) != NULL;
+    printf ("%i rays of %i hit in %f seconds\n", hits, RAYS, gettime() - time);
+    vox_destroy_tree (tree);
+}
+
+int main ()
+{
+    vox_dot *voxels = vox_alloc (SIDE*SIDE*SIDE * sizeof (vox_dot));
+    vox_dot *set = vox_alloc (SIDE*SIDE*SIDE * sizeof (vox_dot));
+    vox_dot *origins = vox_alloc (RAYS * sizeof (vox_dot));
+    vox_dot *dirs = vox_alloc (RAYS * sizeof (vox_dot));
+    size_t n = make_blocks (voxels);
+    int i;
+
+    for (i=0; i<RAYS; i++)
+    {
+        vox_dot_set (origins[i], -SIDE, SIDE/2 + 0.3, SIDE/2 + 0.7);
+        vox_dot_set (dirs[i], SIDE, rand() % SIDE - SIDE/2, rand() % SIDE - SIDE/2);
+    }
+    printf ("%zu voxels\n", n);
+    run ("Ordinary tree", vox_make_tree, voxels, set, n, origins, dirs);
+    run ("Tree with boxes", vox_make_tree_boxes, voxels, set, n, origins, dirs);
+
+    free (voxels);
+    free (set);
+    free (origins);
+    free (dirs);
+    return 0;
+}
@@ -0,0 +1,95 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <voxtrees.h>
+#include <gettime.h>
+
+#define GRID 16
+#define STEP 32
+#define RAYS 1000000
+#define FILENAME "dag-compression.tree"
+
+/*
+  A hall with GRID x GRID identical pillars. Compare the size of the saved
+  tree with memory used by a DAG and compare search time.
+*/
+static size_t make_pillar (vox_dot *set, float x, float y)
+{
+    size_t n = 0;
+    int i, j, k;
+
+    for (k=0; k<64; k++)
+        for (i=0; i<8; i++)
+            for (j=0; j<8; j++)
+                if ((i-4)*(i-4) + (j-4)*(j-4) < 9 || (i + j + k) % 7 == 0)
+                {
+                    vox_dot_set (set[n], x+i, y+j, k);
+                    n++;
+                }
+    return n;
+}
+
+int main ()
+{
+    vox_dot *set = vox_alloc (GRID*GRID*8*8*64 * sizeof (vox_dot));
+    vox_dot *origins = vox_alloc (RAYS * sizeof (vox_dot));
+    vox_dot *dirs = vox_alloc (RAYS * sizeof (vox_dot));
+    struct vox_node *tree, *frozen;
+    struct vox_dag *dag;
+    struct stat st;
+    vox_dot res;
+    double time;
+    size_t n = 0;
+    int i, j, hits;
+
+    for (i=0; i<GRID; i++)
+        for (j=0; j<GRID; j++) n += make_pillar (set + n, STEP*i, STEP*j);
+    tree = vox_make_tree (set, n);
+    frozen = vox_freeze_tree (tree);
+    free (set);
+
+    time = gettime();
+    dag = vox_make_dag (tree);
+    time = gettime() - time;
+    printf ("%zu voxels, DAG built in %f seconds\n", n, time);
+    if (!vox_save_tree (tree, FILENAME, NULL) || stat (FILENAME, &st) < 0)
+    {
+        fprintf (stderr, "Cannot save the tree\n");
+        return 1;
+    }
+    remove (FILENAME);
+    printf ("Saved tree: %lli bytes, DAG: %zu bytes\n",
+            (long long)st.st_size, vox_dag_size (dag));
+
+    srand (1);
+    for (i=0; i<RAYS; i++)
+    {
+        vox_dot_set (origins[i], -10.3, -10.7, 70.1);
+        vox_dot_set (dirs[i], rand() % 1000, rand() % 1000, -(rand() % 100) - 1);
+    }
+
+    hits = 0;
+    time = gettime();
+    for (i=0; i<RAYS; i++)
+        hits += vox_ray_tree_intersection (tree, origins[i], dirs[i], res) != NULL;
+    printf ("Ordinary tree: %i rays of %i hit in %f seconds\n", hits, RAYS, gettime() - time);
+
+    hits = 0;
+    time = gettime();
+    for (i=0; i<RAYS; i++)
+        hits += vox_ray_tree_intersection (frozen, origins[i], dirs[i], res) != NULL;
+    printf ("Frozen tree: %i rays of %i hit in %f seconds\n", hits, RAYS, gettime() - time);
+
+    hits = 0;
+    time = gettime();
+    for (i=0; i<RAYS; i++)
+        hits += vox_ray_dag_intersection (dag, origins[i], dirs[i], res);
+    printf ("DAG: %i rays of %i hit in %f seconds\n", hits, RAYS, gettime() - time);
+
+    vox_destroy_dag (dag);
+    vox_destroy_tree (tree);
+    vox_destroy_tree (frozen);
+    free (origins);
+    free (dirs);
+    return 0;
+}
@@ -0,0 +1,44 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <voxtrees.h>
+#include <gettime.h>
+
+#define N 200000
+#define RAYS 2000000
+
+/*
+  A thin spiral inserted voxel by voxel makes a deep tree with many small
+  nodes. Rays go from the axis of the spiral outwards, so most of them
+  cross many nodes before they hit anything (or miss).
+*/
+int main ()
+{
+    struct vox_node *tree = NULL;
+    vox_dot dot, origin, dir, res;
+    double time;
+    int i, hits = 0;
+
+    for (i=0; i<N; i++)
+    {
+        vox_dot_set (dot, (int)(i/100.0 * cosf (i/1000.0)), (int)(i/100.0 * sinf (i/1000.0)),
+                     i/1000);
+        vox_insert_voxel (&tree, dot);
+    }
+    printf ("%zu voxels inserted\n", vox_voxels_in_tree (tree));
+
+    srand (1);
+    time = gettime();
+    for (i=0; i<RAYS; i++)
+    {
+        vox_dot_set (origin, 0.3, 0.7, rand() % 200);
+        vox_dot_set (dir, (float)rand()/RAND_MAX - 0.5, (float)rand()/RAND_MAX - 0.5,
+                     ((float)rand()/RAND_MAX - 0.5) / 10);
+        if (vox_ray_tree_intersection (tree, origin, dir, res) != NULL) hits++;
+    }
+    time = gettime() - time;
+    printf ("%i rays, %i hits, %f seconds\n", RAYS, hits, time);
+
+    vox_destroy_tree (tree);
+    return 0;
+}
@@ -0,0 +1,104 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <voxtrees.h>
+#include <gettime.h>
+
+#define SIDE 256
+#define SAMPLESIZE 2
+#define RAYS 100000
+#define FILENAME "density-tree.raw"
+
+/*
+  A head-like dataset: noisy "skin" shell with denser "bone" ball inside.
+  Compare changing the threshold of a density tree with rebuilding an
+  ordinary tree for each threshold.
+*/
+static unsigned int thresholds[] = {10000, 30000, 50000};
+
+static void make_rays (vox_dot *origins, vox_dot *dirs)
+{
+    int i;
+
+    srand (2);
+    for (i=0; i<RAYS; i++)
+    {
+        vox_dot_set (origins[i], -SIDE, SIDE/2, SIDE/2);
+        vox_dot_set (dirs[i], SIDE, rand() % SIDE - SIDE/2, rand() % SIDE - SIDE/2);
+    }
+}
+
+int main ()
+{
+    unsigned int dim[3] = {SIDE, SIDE, SIDE};
+    vox_dot *origins = vox_alloc (RAYS * sizeof (vox_dot));
+    vox_dot *dirs = vox_alloc (RAYS * sizeof (vox_dot));
+    struct vox_density_tree *dtree;
+    struct vox_node *tree;
+    const char *error;
+    vox_dot res;
+    double time;
+    FILE *file;
+    int i, j, k, t, hits;
+
+    file = fopen (FILENAME, "w");
+    if (file == NULL)
+    {
+        perror ("Cannot create dataset");
+        return 1;
+    }
+    srand (1);
+    for (i=0; i<SIDE; i++)
+        for (j=0; j<SIDE; j++)
+            for (k=0; k<SIDE; k++)
+            {
+                int x = i - SIDE/2, y = j - SIDE/2, z = k - SIDE/2;
+                int r2 = x*x + y*y + z*z;
+                unsigned int sample = rand() % 5000;
+                if (r2 < SIDE*SIDE/4) sample += 10000 + rand() % 10000;
+                if (r2 < SIDE*SIDE/9) sample += 30000;
+                fputc (sample & 0xff, file);
+                fputc (sample >> 8, file);
+            }
+    fclose (file);
+    make_rays (origins, dirs);
+
+    time = gettime();
+    dtree = vox_read_density_data (FILENAME, dim, SAMPLESIZE, &error);
+    time = gettime() - time;
+    if (dtree == NULL)
+    {
+        fprintf (stderr, "Cannot read dataset: %s\n", error);
+        return 1;
+    }
+    printf ("Density tree built in %f seconds\n", time);
+
+    for (t=0; t<3; t++)
+    {
+        hits = 0;
+        time = gettime();
+        for (i=0; i<RAYS; i++)
+            hits += vox_ray_density_intersection (dtree, thresholds[t], 65535,
+                                                  origins[i], dirs[i], res);
+        time = gettime() - time;
+        printf ("Threshold %u, density tree: %i rays of %i hit in %f seconds\n",
+                thresholds[t], hits, RAYS, time);
+
+        time = gettime();
+        tree = vox_read_raw_data_range (FILENAME, dim, SAMPLESIZE, thresholds[t], 65535, &error);
+        printf ("Threshold %u, ordinary tree: rebuilt in %f seconds, ",
+                thresholds[t], gettime() - time);
+        hits = 0;
+        time = gettime();
+        for (i=0; i<RAYS; i++)
+            hits += vox_ray_tree_intersection (tree, origins[i], dirs[i], res) != NULL;
+        time = gettime() - time;
+        printf ("%i rays of %i hit in %f seconds\n", hits, RAYS, time);
+        vox_destroy_tree (tree);
+    }
+
+    vox_destroy_density_tree (dtree);
+    remove (FILENAME);
+    free (origins);
+    free (dirs);
+    return 0;
+}
@@ -0,0 +1,71 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <voxtrees.h>
+#include <gettime.h>
+
+#define SIDE 200
+#define N 2000000
+#define RAYS 2000000
+#define BALLS 2000000
+
+/*
+  Compare geometry kernels for all instruction sets supported by the CPU.
+  The same tree is built and searched with each of them.
+*/
+static const char *isa_names[] = {"Generic", "SSE", "AVX2", "AVX-512"};
+
+int main ()
+{
+    vox_dot *set = vox_alloc (sizeof(vox_dot)*N);
+    vox_dot *dots = vox_alloc (sizeof(vox_dot)*N);
+    enum vox_isa isa;
+    struct vox_node *tree;
+    vox_dot origin, dir, res;
+    double build, search, balls;
+    int i, hits, collisions;
+
+    srand (1);
+    for (i=0; i<N; i++)
+        vox_dot_set (set[i], rand() % (SIDE*10), rand() % SIDE, rand() % SIDE);
+
+    printf ("Default: %s\n", isa_names[vox_current_isa()]);
+    for (isa = VOX_ISA_GENERIC; isa <= VOX_ISA_AVX512; isa++)
+    {
+        if (!vox_use_isa (isa)) continue;
+
+        memcpy (dots, set, sizeof(vox_dot)*N);
+        build = gettime();
+        tree = vox_make_tree (dots, N);
+        build = gettime() - build;
+
+        srand (2);
+        hits = 0;
+        search = gettime();
+        for (i=0; i<RAYS; i++)
+        {
+            vox_dot_set (origin, -SIDE, rand() % SIDE, rand() % SIDE);
+            vox_dot_set (dir, 1, (float)rand()/RAND_MAX - 0.5, (float)rand()/RAND_MAX - 0.5);
+            if (vox_ray_tree_intersection (tree, origin, dir, res) != NULL) hits++;
+        }
+        search = gettime() - search;
+
+        srand (3);
+        collisions = 0;
+        balls = gettime();
+        for (i=0; i<BALLS; i++)
+        {
+            vox_dot_set (origin, rand() % (SIDE*10), rand() % SIDE, rand() % SIDE);
+            collisions += vox_tree_ball_collidep (tree, origin, 1.5);
+        }
+        balls = gettime() - balls;
+
+        printf ("%-8s: building %f, %i rays (%i hits) %f, %i balls (%i collisions) %f seconds\n",
+                isa_names[isa], build, RAYS, hits, search, BALLS, collisions, balls);
+        vox_destroy_tree (tree);
+    }
+
+    free (set);
+    free (dots);
+    return 0;
+}
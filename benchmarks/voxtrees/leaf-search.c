@@ -0,0 +1,54 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <voxtrees.h>
+#include <gettime.h>
+
+#define SIDE 200
+#define N 1000000
+#define RAYS 2000000
+
+/*
+  A sparse random cloud: most leafs are full and rays pass through many of
+  them before they hit a voxel, so the time is spent mostly in leafs.
+*/
+static double search_time (const struct vox_node *tree, int *hits)
+{
+    vox_dot origin, dir, res;
+    double time;
+    int i;
+
+    srand (2);
+    *hits = 0;
+    time = gettime();
+    for (i=0; i<RAYS; i++)
+    {
+        vox_dot_set (origin, -SIDE, rand() % SIDE, rand() % SIDE);
+        vox_dot_set (dir, 1, (float)rand()/RAND_MAX - 0.5, (float)rand()/RAND_MAX - 0.5);
+        if (vox_ray_tree_intersection (tree, origin, dir, res) != NULL) (*hits)++;
+    }
+    return gettime() - time;
+}
+
+int main ()
+{
+    vox_dot *dots = vox_alloc (sizeof(vox_dot)*N);
+    struct vox_node *tree, *frozen;
+    double time;
+    int i, hits;
+
+    srand (1);
+    for (i=0; i<N; i++)
+        vox_dot_set (dots[i], rand() % (SIDE*10), rand() % SIDE, rand() % SIDE);
+    tree = vox_make_tree (dots, N);
+    frozen = vox_freeze_tree (tree);
+    free (dots);
+
+    time = search_time (tree, &hits);
+    printf ("Ordinary tree: %i rays, %i hits, %f seconds\n", RAYS, hits, time);
+    time = search_time (frozen, &hits);
+    printf ("Frozen tree:   %i rays, %i hits, %f seconds\n", RAYS, hits, time);
+
+    vox_destroy_tree (tree);
+    vox_destroy_tree (frozen);
+    return 0;
+}
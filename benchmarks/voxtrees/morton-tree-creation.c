@@ -0,0 +1,43 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <voxtrees.h>
+#include <gettime.h>
+
+#define N 10000000
+#define SIDE 1024
+
+int main ()
+{
+    vox_dot *dots = vox_alloc (sizeof(vox_dot)*N);
+    vox_dot *copy = vox_alloc (sizeof(vox_dot)*N);
+    struct vox_node *tree;
+    double time;
+    int i;
+    vox_dot_set (vox_voxel, 1, 1, 1);
+
+    // Dots on a bounded grid, like data from vox_read_raw_data()
+    for (i=0; i<N; i++)
+        vox_dot_set (dots[i], rand() % SIDE, rand() % SIDE, rand() % SIDE);
+    memcpy (copy, dots, sizeof(vox_dot)*N);
+
+    time = gettime();
+    tree = vox_make_tree (copy, N);
+    time = gettime() - time;
+    printf ("vox_make_tree() took %f seconds. "
+            "Number of voxels in tree %lu\n",
+            time, vox_voxels_in_tree (tree));
+    vox_destroy_tree (tree);
+
+    time = gettime();
+    tree = vox_make_tree_morton (dots, N);
+    time = gettime() - time;
+    printf ("vox_make_tree_morton() took %f seconds. "
+            "Number of voxels in tree %lu\n",
+            time, vox_voxels_in_tree (tree));
+    vox_destroy_tree (tree);
+
+    free (dots);
+    free (copy);
+    return 0;
+}
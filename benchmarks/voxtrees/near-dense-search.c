@@ -0,0 +1,54 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <voxtrees.h>
+#include <gettime.h>
+
+#define RAYS 2000000
+#define SIDE 200
+// Percent of occupied voxels
+#define FILL 80
+
+int main ()
+{
+    vox_dot *dots = vox_alloc (sizeof(vox_dot)*SIDE*SIDE*SIDE);
+    vox_dot origin, dir, res;
+    struct vox_node *tree;
+    struct rusage usage;
+    double time;
+    int i, j, k, hits = 0;
+    size_t n = 0;
+    vox_dot_set (vox_voxel, 1, 1, 1);
+
+    // A cube with random holes
+    for (i=0; i<SIDE; i++)
+        for (j=0; j<SIDE; j++)
+            for (k=0; k<SIDE; k++)
+                if (rand() % 100 < FILL)
+                {
+                    vox_dot_set (dots[n], i, j, k);
+                    n++;
+                }
+
+    time = gettime();
+    tree = vox_make_tree (dots, n);
+    time = gettime() - time;
+    free (dots);
+    getrusage (RUSAGE_SELF, &usage);
+    printf ("Tree with %lu voxels built in %f seconds, max RSS %li KB\n",
+            vox_voxels_in_tree (tree), time, usage.ru_maxrss);
+
+    srand (1);
+    time = gettime();
+    for (i=0; i<RAYS; i++)
+    {
+        vox_dot_set (origin, -SIDE, rand() % SIDE, rand() % SIDE);
+        vox_dot_set (dir, 1, (float)rand()/RAND_MAX - 0.5, (float)rand()/RAND_MAX - 0.5);
+        if (vox_ray_tree_intersection (tree, origin, dir, res) != NULL) hits++;
+    }
+    time = gettime() - time;
+    printf ("%i rays, %i hits, %f seconds\n", RAYS, hits, time);
+
+    vox_destroy_tree (tree);
+    return 0;
+}
@@ -0,0 +1,70 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <voxtrees.h>
+#include <gettime.h>
+
+#define SIDE 512
+#define IMAGE 512
+#define FRAMES 5
+
+/*
+  A hilly landscape seen from above at an angle. Rays go through pixels of
+  a IMAGE x IMAGE screen. Compare tracing rays one by one with tracing
+  packets of 4x4 pixels.
+*/
+static void pixel_dir (int x, int y, vox_dot dir)
+{
+    vox_dot_set (dir, 1, (float)x/IMAGE - 0.5, (float)y/IMAGE - 1);
+}
+
+int main ()
+{
+    vox_dot *set = vox_alloc (SIDE*SIDE*4 * sizeof (vox_dot));
+    vox_dot origin, dirs[16], res[16];
+    const struct vox_node *leafs[16];
+    struct vox_node *tree;
+    double time;
+    size_t n = 0;
+    int i, j, k, f, hits;
+
+    for (i=0; i<SIDE; i++)
+        for (j=0; j<SIDE; j++)
+        {
+            int h = 20 + 15*sinf (i/30.0) * cosf (j/40.0);
+            for (k=h-4; k<h; k++)
+            {
+                vox_dot_set (set[n], i, j, k);
+                n++;
+            }
+        }
+    tree = vox_make_tree (set, n);
+    free (set);
+    vox_dot_set (origin, -50.3, SIDE/2 + 0.1, 150.2);
+
+    hits = 0;
+    time = gettime();
+    for (f=0; f<FRAMES; f++)
+        for (i=0; i<IMAGE; i++)
+            for (j=0; j<IMAGE; j++)
+            {
+                pixel_dir (i, j, dirs[0]);
+                hits += vox_ray_tree_intersection (tree, origin, dirs[0], res[0]) != NULL;
+            }
+    printf ("Rays one by one: %i hits in %f seconds\n", hits, gettime() - time);
+
+    hits = 0;
+    time = gettime();
+    for (f=0; f<FRAMES; f++)
+        for (i=0; i<IMAGE; i+=4)
+            for (j=0; j<IMAGE; j+=4)
+            {
+                for (k=0; k<16; k++) pixel_dir (i + k%4, j + k/4, dirs[k]);
+                hits += __builtin_popcount (vox_ray_tree_intersection_packet (tree, origin, dirs, 16,
+                                                                              res, leafs));
+            }
+    printf ("4x4 packets:     %i hits in %f seconds\n", hits, gettime() - time);
+
+    vox_destroy_tree (tree);
+    return 0;
+}
@@ -1,15 +1,25 @@
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <voxtrees.h>
 #include <gettime.h>
 
 #define N 10000000
+
+static long max_rss ()
+{
+    struct rusage usage;
+    getrusage (RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
 int main ()
 {
     vox_dot dot;
     int i;
     double time;
-    struct vox_node *tree = NULL;
+    struct vox_node *tree = NULL, *copy;
 
     vox_dot_set (vox_voxel, 1, 1, 1);
     srand (123);
@@ -23,6 +33,13 @@ int main ()
     printf ("Insertion time %f (\"random\" pattern). "
             "Voxels in tree %lu\n",
             time, vox_voxels_in_tree (tree));
+    printf ("Maximal resident set size after insertion %li kB\n", max_rss ());
+
+    copy = vox_rebuild_tree (tree);
+    time = gettime();
+    vox_destroy_tree (copy);
+    time = gettime() - time;
+    printf ("Destruction time %f (\"random\" pattern)\n", time);
 
     srand (123);
     time = gettime();
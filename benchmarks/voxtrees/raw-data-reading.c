@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <voxtrees.h>
+#include <gettime.h>
+
+#define SIDE 256
+#define SAMPLESIZE 2
+#define THRESHOLD 30000
+#define FILENAME "raw-data-reading.raw"
+
+/*
+  Compare vox_read_raw_data() with vox_read_raw_data_range() and
+  vox_read_raw_data_lut() on a dataset with noisy ball inside and on a
+  dataset with solid ball inside.
+*/
+static void read_dataset (const unsigned int dim[])
+{
+    static unsigned char lut[65536];
+    struct vox_node *tree;
+    const char *error;
+    double time;
+    int i;
+
+    time = gettime();
+    tree = vox_read_raw_data (FILENAME, dim, SAMPLESIZE,
+                              ^(unsigned int sample) {return sample >= THRESHOLD;},
+                              &error);
+    time = gettime() - time;
+    printf ("vox_read_raw_data(): %lu voxels in %f seconds\n",
+            vox_voxels_in_tree (tree), time);
+    vox_destroy_tree (tree);
+
+    time = gettime();
+    tree = vox_read_raw_data_range (FILENAME, dim, SAMPLESIZE, THRESHOLD, 65535, &error);
+    time = gettime() - time;
+    printf ("vox_read_raw_data_range(): %lu voxels in %f seconds\n",
+            vox_voxels_in_tree (tree), time);
+    vox_destroy_tree (tree);
+
+    for (i=0; i<65536; i++) lut[i] = (i >= THRESHOLD);
+    time = gettime();
+    tree = vox_read_raw_data_lut (FILENAME, dim, SAMPLESIZE, lut, &error);
+    time = gettime() - time;
+    printf ("vox_read_raw_data_lut(): %lu voxels in %f seconds\n",
+            vox_voxels_in_tree (tree), time);
+    vox_destroy_tree (tree);
+}
+
+static int write_dataset (int solid)
+{
+    FILE *file;
+    int i, j, k;
+
+    file = fopen (FILENAME, "w");
+    if (file == NULL)
+    {
+        perror ("Cannot create dataset");
+        return 0;
+    }
+    srand (1);
+    for (i=0; i<SIDE; i++)
+        for (j=0; j<SIDE; j++)
+            for (k=0; k<SIDE; k++)
+            {
+                int x = i - SIDE/2, y = j - SIDE/2, z = k - SIDE/2;
+                unsigned int sample = rand() % THRESHOLD;
+                if (x*x + y*y + z*z < SIDE*SIDE/4)
+                    sample += solid ? THRESHOLD : rand() % THRESHOLD;
+                fputc (sample & 0xff, file);
+                fputc (sample >> 8, file);
+            }
+    fclose (file);
+    return 1;
+}
+
+int main ()
+{
+    unsigned int dim[3] = {SIDE, SIDE, SIDE};
+
+    printf ("Noisy ball\n");
+    if (!write_dataset (0)) return 1;
+    read_dataset (dim);
+
+    printf ("Solid ball\n");
+    if (!write_dataset (1)) return 1;
+    read_dataset (dim);
+
+    remove (FILENAME);
+    return 0;
+}
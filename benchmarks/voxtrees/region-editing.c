@@ -0,0 +1,84 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <voxtrees.h>
+#include <gettime.h>
+
+#define SIDE 256
+#define HOLE 64
+#define HOLES 100
+
+int main ()
+{
+    struct vox_node *tree, *rebuilt;
+    struct vox_box box, hole;
+    vox_dot dot, center;
+    double time;
+    size_t count;
+    int i, j, k, n;
+
+    vox_dot_set (vox_voxel, 1, 1, 1);
+    vox_dot_set (box.min, 0, 0, 0);
+    vox_dot_set (box.max, SIDE, SIDE, SIDE);
+
+    // Carve holes voxel by voxel
+    tree = vox_make_dense_leaf (&box);
+    srand (1);
+    count = 0;
+    time = gettime();
+    for (n=0; n<HOLES/10; n++)
+    {
+        vox_dot_set (hole.min, rand() % (SIDE-HOLE), rand() % (SIDE-HOLE), rand() % (SIDE-HOLE));
+        for (i=0; i<HOLE; i++)
+            for (j=0; j<HOLE; j++)
+                for (k=0; k<HOLE; k++)
+                {
+                    vox_dot_set (dot, hole.min[0] + i, hole.min[1] + j, hole.min[2] + k);
+                    count += vox_delete_voxel (&tree, dot);
+                }
+    }
+    time = gettime() - time;
+    printf ("%i holes carved voxel by voxel in %f seconds, %lu voxels deleted\n",
+            HOLES/10, time, count);
+    vox_destroy_tree (tree);
+
+    // Carve holes with vox_delete_box()
+    tree = vox_make_dense_leaf (&box);
+    srand (1);
+    count = 0;
+    time = gettime();
+    for (n=0; n<HOLES; n++)
+    {
+        vox_dot_set (hole.min, rand() % (SIDE-HOLE), rand() % (SIDE-HOLE), rand() % (SIDE-HOLE));
+        vox_dot_set (hole.max, hole.min[0] + HOLE, hole.min[1] + HOLE, hole.min[2] + HOLE);
+        count += vox_delete_box (&tree, &hole);
+    }
+    time = gettime() - time;
+    printf ("%i holes carved with vox_delete_box() in %f seconds, %lu voxels deleted\n",
+            HOLES, time, count);
+    vox_destroy_tree (tree);
+
+    // Balls
+    tree = vox_make_dense_leaf (&box);
+    srand (1);
+    count = 0;
+    time = gettime();
+    for (n=0; n<HOLES; n++)
+    {
+        vox_dot_set (center, rand() % SIDE, rand() % SIDE, rand() % SIDE);
+        count += (n % 2) ? vox_insert_ball (&tree, center, HOLE/4) :
+            vox_delete_ball (&tree, center, HOLE/2);
+    }
+    time = gettime() - time;
+    printf ("%i balls inserted or deleted in %f seconds, %lu voxels changed, %lu voxels in tree\n",
+            HOLES, time, count, vox_voxels_in_tree (tree));
+
+    // Dense leafs left after editing are not expanded to voxels
+    time = gettime();
+    rebuilt = vox_rebuild_tree (tree);
+    time = gettime() - time;
+    printf ("The tree is rebuilt in %f seconds\n", time);
+    vox_destroy_tree (rebuilt);
+    vox_destroy_tree (tree);
+
+    return 0;
+}
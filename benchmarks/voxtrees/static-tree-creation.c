@@ -1,15 +1,88 @@
+#ifdef __FreeBSD__
+#include <sys/param.h>
+#include <sys/cpuset.h>
+#else
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+#include <sys/wait.h>
+#include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <voxtrees.h>
 #include <gettime.h>
 
 #define N 10000000
+
+/*
+ * Allow the calling process to run only on the first ncpu CPUs. Worker
+ * threads created after this call inherit this restriction.
+ */
+static int restrict_cpus (int ncpu)
+{
+    int i;
+#ifdef __FreeBSD__
+    cpuset_t mask;
+    CPU_ZERO (&mask);
+    for (i=0; i<ncpu; i++) CPU_SET (i, &mask);
+    return cpuset_setaffinity (CPU_LEVEL_WHICH, CPU_WHICH_PID, -1,
+                               sizeof (mask), &mask);
+#else
+    cpu_set_t mask;
+    CPU_ZERO (&mask);
+    for (i=0; i<ncpu; i++) CPU_SET (i, &mask);
+    return sched_setaffinity (0, sizeof (mask), &mask);
+#endif
+}
+
+/*
+ * Build the tree in a child process restricted to ncpu CPUs and return
+ * the time taken or a negative value on failure. The tree is built in a
+ * separate process, because threads of the dispatch pool are created only
+ * once.
+ */
+static double creation_time (vox_dot *dots, int ncpu)
+{
+    int fds[2];
+    double time = -1;
+    pid_t pid;
+
+    if (pipe (fds) == -1) return -1;
+    pid = fork();
+    if (pid == 0) {
+        struct vox_node *tree;
+
+        close (fds[0]);
+        if (restrict_cpus (ncpu) == 0) {
+            time = gettime();
+            tree = vox_make_tree (dots, N);
+            time = gettime() - time;
+            if (ncpu == 1)
+                printf ("Static tree creation took %f seconds. "
+                        "Number of voxels in tree %lu\n",
+                        time, vox_voxels_in_tree (tree));
+            vox_destroy_tree (tree);
+        }
+        fflush (stdout);
+        write (fds[1], &time, sizeof (time));
+        _exit (0);
+    }
+
+    close (fds[1]);
+    if (pid > 0) {
+        if (read (fds[0], &time, sizeof (time)) != sizeof (time)) time = -1;
+        waitpid (pid, NULL, 0);
+    }
+    close (fds[0]);
+
+    return time;
+}
+
 int main ()
 {
     vox_dot *dots = vox_alloc (sizeof(vox_dot)*N);
-    int i;
-    double time;
-    struct vox_node *tree;
+    int i, ncpu = sysconf (_SC_NPROCESSORS_ONLN);
+    double time, serial_time = -1;
     vox_dot_set (vox_voxel, 1, 1, 1);
 
     for (i=0; i<N; i++)
@@ -18,14 +91,18 @@ int main ()
         vox_dot_set (dots[i], rand(), rand(), rand());
     }
 
-    time = gettime();
-    tree = vox_make_tree (dots, N);
-    time = gettime() - time;
-
-    printf ("Static tree creation took %f seconds. "
-            "Number of voxels in tree %lu\n",
-            time, vox_voxels_in_tree (tree));
-    vox_destroy_tree (tree);
+    for (i=1; i<=ncpu; i++)
+    {
+        fflush (stdout);
+        time = creation_time (dots, i);
+        if (time < 0) {
+            fprintf (stderr, "Cannot run the benchmark on %i CPU(s)\n", i);
+            break;
+        }
+        if (i == 1) serial_time = time;
+        printf ("%i CPU(s): %f seconds, speedup %.2f\n", i, time, serial_time / time);
+    }
+    free (dots);
 
     return 0;
 }
@@ -0,0 +1,76 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <voxtrees.h>
+#include <gettime.h>
+
+#define SIDE 256
+#define FILENAME "tree-loading.tree"
+
+/*
+  Compare building a tree of a noisy ball with loading the same tree from
+  a file.
+*/
+int main ()
+{
+    vox_dot *dots = vox_alloc (sizeof (vox_dot)*SIDE*SIDE*SIDE);
+    struct vox_node *tree, *loaded;
+    const char *error;
+    vox_dot origin, dir, res;
+    double time;
+    size_t n = 0, hits = 0;
+    int i, j, k;
+
+    srand (1);
+    for (i=0; i<SIDE; i++)
+        for (j=0; j<SIDE; j++)
+            for (k=0; k<SIDE; k++)
+            {
+                int x = i - SIDE/2, y = j - SIDE/2, z = k - SIDE/2;
+                if (x*x + y*y + z*z < SIDE*SIDE/4 && rand() % 4)
+                {
+                    vox_dot_set (dots[n], i, j, k);
+                    n++;
+                }
+            }
+
+    time = gettime();
+    tree = vox_make_tree (dots, n);
+    time = gettime() - time;
+    printf ("Tree of %lu voxels built in %f seconds\n", n, time);
+    free (dots);
+
+    time = gettime();
+    if (!vox_save_tree (tree, FILENAME, &error))
+    {
+        fprintf (stderr, "Cannot save the tree: %s\n", error);
+        return 1;
+    }
+    time = gettime() - time;
+    printf ("Tree saved in %f seconds\n", time);
+
+    time = gettime();
+    loaded = vox_load_tree (FILENAME, &error);
+    if (loaded == NULL)
+    {
+        fprintf (stderr, "Cannot load the tree: %s\n", error);
+        return 1;
+    }
+    time = gettime() - time;
+    printf ("Tree loaded in %f seconds\n", time);
+
+    // The first search in the loaded tree reads pages of the file
+    time = gettime();
+    for (i=0; i<1000000; i++)
+    {
+        vox_dot_set (origin, -10, rand() % SIDE, rand() % SIDE);
+        vox_dot_set (dir, 1, (float)rand()/RAND_MAX - 0.5, (float)rand()/RAND_MAX - 0.5);
+        hits += vox_ray_tree_intersection (loaded, origin, dir, res) != NULL;
+    }
+    time = gettime() - time;
+    printf ("1000000 rays cast in the loaded tree in %f seconds, %lu hits\n", time, hits);
+
+    vox_destroy_tree (tree);
+    vox_destroy_tree (loaded);
+    remove (FILENAME);
+    return 0;
+}
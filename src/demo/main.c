@@ -7,6 +7,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
+#include <limits.h>
 
 #include <SDL2/SDL.h>
 #include <iniparser.h>
@@ -28,22 +30,15 @@ static void usage ()
 
 static void amend_box (struct vox_node **tree, vox_dot center, int size, int add)
 {
-    int i,j,k;
-    vox_dot dot;
-    for (i=-size; i<size; i++)
+    struct vox_box box;
+    int i;
+    for (i=0; i<3; i++)
     {
-        for (j=-size; j<size; j++)
-        {
-            for (k=-size; k<size; k++)
-            {
-                dot[0] = center[0] + i*vox_voxel[0];
-                dot[1] = center[1] + j*vox_voxel[1];
-                dot[2] = center[2] + k*vox_voxel[2];
-                if (add) vox_insert_voxel (tree, dot);
-                else vox_delete_voxel (tree, dot);
-            }
-        }
+        box.min[i] = floorf (center[i] / vox_voxel[i]) * vox_voxel[i] - size*vox_voxel[i];
+        box.max[i] = box.min[i] + 2*size*vox_voxel[i];
     }
+    if (add) vox_insert_box (tree, &box);
+    else vox_delete_box (tree, &box);
 }
 
 int main (int argc, char *argv[])
@@ -164,9 +159,8 @@ int main (int argc, char *argv[])
     vox_find_data_file (dataset_name, dataset_path);
     printf ("Reading raw data\n");
     const char *errorstr;
-    tree = vox_read_raw_data (dataset_path, (unsigned int*)dim, samplesize,
-                              ^(unsigned int sample){return sample > (unsigned int) threshold;},
-                              &errorstr);
+    tree = vox_read_raw_data_range (dataset_path, (unsigned int*)dim, samplesize,
+                                    threshold + 1, UINT_MAX, &errorstr);
     if (tree == NULL)
     {
         fprintf (stderr, "Cannot read dataset: %s\n", errorstr);
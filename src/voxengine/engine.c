@@ -113,9 +113,8 @@ static void execute_init (struct vox_engine *engine)
         luaL_error (L, "Error executing init function: %s", lua_tostring (L, -1));
 
     if (!(engine->flags & VOX_ENGINE_DEBUG)) {
-        /* Copy context group. */
-        struct context_data *data = luaL_checkudata (L, 1, CONTEXT_META);
-        engine->rendering_queue = data->rendering_queue;
+        /* Remember context data to pin the tree for rendering. */
+        engine->context_data = luaL_checkudata (L, 1, CONTEXT_META);
 
         /* Check that we have the world properly set up */
         lua_getfield (L, 1, "tree");
@@ -233,6 +232,8 @@ static void create_lua_context (struct vox_engine *engine)
 
         data->rendering_group = dispatch_group_create ();
         data->rendering_queue = dispatch_queue_create ("scene operations", 0);
+        data->versions = NULL;
+        data->snapshot = NULL;
     }
 }
 
@@ -304,14 +305,19 @@ vox_engine_status vox_engine_tick (struct vox_engine *engine)
      */
     if (!(engine->flags & VOX_ENGINE_DEBUG)) {
         /*
-         * If we have a queue associated with the tree (this is so if we use
-         * thread-safe scene proxy in the world table), enqueue the rendering
-         * operation to that queue and wait for its completion. This will assure us
-         * that the tree is in consistent state while the rendering is performed.
+         * Render the latest version of the tree. Modifications made through
+         * the scene proxy create new versions instead of changing the tree in
+         * place, so we do not need to wait for them to complete. The rendered
+         * version stays pinned until the next frame, because collision
+         * detection in the tick function works with it too.
          */
-        dispatch_sync (engine->rendering_queue, ^{
-                vox_render (engine->ctx);
-            });
+        struct context_data *data = engine->context_data;
+        struct vox_node *snapshot = vox_acquire_version (data->versions);
+        vox_context_set_scene (engine->ctx, snapshot);
+        vox_release_version (data->versions, data->snapshot);
+        data->snapshot = snapshot;
+
+        vox_render (engine->ctx);
         vox_redraw (engine->ctx);
 
         res = execute_tick (engine);
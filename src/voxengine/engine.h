@@ -20,7 +20,7 @@
 struct vox_engine {
     struct vox_rnd_ctx *ctx;
     lua_State *L;
-    dispatch_queue_t rendering_queue;
+    struct context_data *context_data;
     unsigned int width, height;
     unsigned int flags;
 };
@@ -55,7 +55,7 @@ struct cameradata
 
 struct scene_proxydata
 {
-    struct vox_node *tree;
+    struct vox_tree_versions *versions;
     struct vox_rnd_ctx *context;
     dispatch_group_t scene_group;
     dispatch_queue_t scene_sync_queue;
@@ -66,10 +66,14 @@ struct context_data
     struct vox_rnd_ctx *context;
     dispatch_group_t rendering_group;
     dispatch_queue_t rendering_queue;
+    struct vox_tree_versions *versions;
+    struct vox_node *snapshot; // Version of the tree pinned for rendering
 };
 
 #define TREE_META "voxtrees.vox_node"
 #define DOTSET_META "voxtrees.dotset"
+#define DENSITY_TREE_META "voxtrees.density_tree"
+#define DAG_META "voxtrees.dag"
 #define CAMERA_META "voxrnd.camera"
 #define CD_META "voxrnd.cd"
 #define SCENE_PROXY_META "voxrnd.scene_proxy"
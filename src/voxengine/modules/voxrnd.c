@@ -5,6 +5,7 @@
 #include <voxtrees.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include "../modules.h"
 
 static int get_position (lua_State *L)
@@ -202,15 +203,16 @@ static int l_scene_proxy_insert (lua_State *L)
     /*
      * Enqueue insertion to a synchronous queue associated with the tree. The
      * insertion will be performed when there are no other jobs in the tree
-     * group. For example if there is tree rebuilding or rendering in progress,
-     * wait for its completion first, and then insert a voxel.
+     * group. For example if there is tree rebuilding in progress, wait for its
+     * completion first, and then insert a voxel. Rendering is not waited for:
+     * the insertion creates a new version of the tree, leaving the rendered
+     * one intact. The engine picks up the new version on the next frame.
      */
     dispatch_group_notify (data->scene_group, data->scene_sync_queue, ^{
             vox_dot dot;
             vox_dot_set (dot, x, y, z);
-            vox_insert_voxel (&(data->tree), dot);
-            *ndata = data->tree;
-            vox_context_set_scene (data->context, data->tree);
+            vox_versions_insert_voxel (data->versions, dot);
+            *ndata = vox_latest_version (data->versions);
         });
 
     return 0;
@@ -230,9 +232,8 @@ static int l_scene_proxy_delete (lua_State *L)
     dispatch_group_notify (data->scene_group, data->scene_sync_queue, ^{
             vox_dot dot;
             vox_dot_set (dot, x, y, z);
-            vox_delete_voxel (&(data->tree), dot);
-            *ndata = data->tree;
-            vox_context_set_scene (data->context, data->tree);
+            vox_versions_delete_voxel (data->versions, dot);
+            *ndata = vox_latest_version (data->versions);
         });
 
     return 0;
@@ -253,13 +254,21 @@ static int l_scene_proxy_rebuild (lua_State *L)
     dispatch_group_async (data->scene_group,
                           dispatch_get_global_queue
                           (DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^{
-                              struct vox_node *new_tree = vox_rebuild_tree (data->tree);
+                              /* Let already enqueued modifications complete */
+                              __block struct vox_node *tree;
                               dispatch_sync (data->scene_sync_queue, ^{
-                                      vox_destroy_tree (data->tree);
-                                      data->tree = new_tree;
+                                      tree = vox_acquire_version (data->versions);
+                                  });
+                              struct vox_node *new_tree = vox_rebuild_tree (tree);
+                              vox_release_version (data->versions, tree);
+                              dispatch_sync (data->scene_sync_queue, ^{
+                                      /*
+                                       * The old tree is freed when nobody
+                                       * renders it anymore.
+                                       */
+                                      vox_versions_replace_tree (data->versions, new_tree);
                                       /* Update lua reference */
                                       *ndata = new_tree;
-                                      vox_context_set_scene (data->context, new_tree);
                                   });
                           });
     return 0;
@@ -283,7 +292,8 @@ static int l_scene_proxy_ray_intersection (lua_State *L)
             vox_dot origin, dir, res;
             vox_dot_set (origin, o1, o2, o3);
             vox_dot_set (dir, d1, d2, d3);
-            leaf = vox_ray_tree_intersection (data->tree, origin, dir, res);
+            leaf = vox_ray_tree_intersection (vox_latest_version (data->versions),
+                                              origin, dir, res);
             r1 = res[0]; r2 = res[1]; r3 = res[2];
         });
 
@@ -301,13 +311,23 @@ static int l_scene_proxy_len (lua_State *L)
      * queue.
      */
     dispatch_sync (data->scene_sync_queue, ^{
-            len = vox_voxels_in_tree (data->tree);
+            len = vox_voxels_in_tree (vox_latest_version (data->versions));
         });
 
     lua_pushinteger (L, len);
     return 1;
 }
 
+static int l_scene_proxy_destroy (lua_State *L)
+{
+    struct scene_proxydata *data = luaL_checkudata (L, 1, SCENE_PROXY_META);
+
+    /* The latest version is owned by the tree object and is not freed here */
+    dispatch_group_wait (data->scene_group, DISPATCH_TIME_FOREVER);
+    vox_destroy_tree_versions (data->versions);
+    return 0;
+}
+
 /*
  * Unfortunately, this is not actually a proxy, as it does not translate all
  * method calls to underlying tree. It just overwrites some methods of the tree
@@ -315,6 +335,7 @@ static int l_scene_proxy_len (lua_State *L)
  */
 static const struct luaL_Reg scene_proxy_methods [] = {
     {"__tostring", l_scene_proxy_tostring},
+    {"__gc", l_scene_proxy_destroy},
     {"__len", l_scene_proxy_len},
     {"rebuild", l_scene_proxy_rebuild},
     {"insert", l_scene_proxy_insert},
@@ -363,7 +384,7 @@ static int l_context_newindex (lua_State *L)
 
         /* Provide access to the tree via asyncronous proxy */
         struct scene_proxydata *pdata = lua_newuserdata (L, sizeof (struct scene_proxydata));
-        pdata->tree = scene;
+        pdata->versions = vox_make_tree_versions (scene);
         pdata->context = ctx;
         pdata->scene_group = data->rendering_group;
         pdata->scene_sync_queue = data->rendering_queue;
@@ -374,7 +395,12 @@ static int l_context_newindex (lua_State *L)
          * dispatch_group_notify) because it will mess with lua state.
          */
         dispatch_group_wait (data->rendering_group, DISPATCH_TIME_FOREVER);
-        vox_context_set_scene (ctx, pdata->tree);
+        /* Pin the new tree until the engine pins it for the first frame */
+        if (data->versions != NULL)
+            vox_release_version (data->versions, data->snapshot);
+        data->versions = pdata->versions;
+        data->snapshot = vox_acquire_version (data->versions);
+        vox_context_set_scene (ctx, data->snapshot);
 
         luaL_getmetatable (L, SCENE_PROXY_META);
         lua_pushvalue (L, 3);
@@ -387,6 +413,21 @@ static int l_context_newindex (lua_State *L)
 
         lua_pushvalue (L, 3);
         lua_setfield (L, -2, "camera");
+    } else if (strcmp (field, "density") == 0) {
+        /* nil renders the scene again */
+        struct vox_density_tree **ddata = lua_isnil (L, 3) ? NULL :
+            luaL_checkudata (L, 3, DENSITY_TREE_META);
+        vox_context_set_density_tree (ctx, (ddata != NULL) ? *ddata : NULL);
+
+        lua_pushvalue (L, 3);
+        lua_setfield (L, -2, "density");
+    } else if (strcmp (field, "dag") == 0) {
+        /* nil renders the scene again */
+        struct vox_dag **ddata = lua_isnil (L, 3) ? NULL : luaL_checkudata (L, 3, DAG_META);
+        vox_context_set_dag (ctx, (ddata != NULL) ? *ddata : NULL);
+
+        lua_pushvalue (L, 3);
+        lua_setfield (L, -2, "dag");
     } else if (strcmp (field, "light_manager") == 0) {
         struct vox_light_manager **lmdata = luaL_checkudata (L, 3, LIGHT_MANAGER_META);
         vox_context_set_light_manager (ctx, *lmdata);
@@ -413,6 +454,28 @@ static int l_context_rendering_mode (lua_State *L)
     return 1;
 }
 
+static int l_context_density_threshold (lua_State *L)
+{
+    struct context_data *data = luaL_checkudata (L, 1, CONTEXT_META);
+    struct vox_rnd_ctx *ctx = data->context;
+    lua_Integer min = luaL_checkinteger (L, 2);
+    lua_Integer max;
+
+    /* Like in read_raw_data_ranged, maximum is not included */
+    if (lua_isnoneornil (L, 3)) max = (lua_Integer)UINT_MAX + 1;
+    else max = luaL_checkinteger (L, 3);
+    if (min < 0) min = 0;
+    if (max > (lua_Integer)UINT_MAX + 1) max = (lua_Integer)UINT_MAX + 1;
+    if (max <= min) {
+        /* Nothing is solid */
+        min = 1;
+        max = 1;
+    }
+
+    vox_context_set_density_threshold (ctx, min, max - 1);
+    return 0;
+}
+
 static int l_context_screenshot (lua_State *L)
 {
     int res;
@@ -434,6 +497,7 @@ static const struct luaL_Reg context_methods [] = {
     {"__newindex", l_context_newindex},
     {"get_geometry", l_context_geometry},
     {"rendering_mode", l_context_rendering_mode},
+    {"density_threshold", l_context_density_threshold},
     {"screenshot", l_context_screenshot},
     {NULL, NULL}
 };
@@ -8,6 +8,7 @@
 #include "../modules.h"
 
 #include <stdlib.h>
+#include <limits.h>
 #ifdef __FreeBSD__
 #include <malloc_np.h>
 #endif
@@ -68,6 +69,17 @@ static int rebuildtree (lua_State *L)
     return 0;
 }
 
+static int freezetree (lua_State *L)
+{
+    struct vox_node **data = luaL_checkudata (L, 1, TREE_META);
+    struct vox_node *newtree = vox_freeze_tree (*data);
+    if (newtree == NULL && *data != NULL)
+        return luaL_error (L, "Cannot freeze the tree");
+    vox_destroy_tree (*data);
+    *data = newtree;
+    return 0;
+}
+
 static int deletetree (lua_State *L)
 {
     struct vox_node **data = luaL_checkudata (L, 1, TREE_META);
@@ -79,6 +91,50 @@ static int deletetree (lua_State *L)
     return 1;
 }
 
+static int insertboxtree (lua_State *L)
+{
+    struct vox_node **data = luaL_checkudata (L, 1, TREE_META);
+    struct vox_box box;
+
+    READ_DOT (box.min, 2);
+    READ_DOT (box.max, 3);
+    lua_pushinteger (L, vox_insert_box (data, &box));
+    return 1;
+}
+
+static int deleteboxtree (lua_State *L)
+{
+    struct vox_node **data = luaL_checkudata (L, 1, TREE_META);
+    struct vox_box box;
+
+    READ_DOT (box.min, 2);
+    READ_DOT (box.max, 3);
+    lua_pushinteger (L, vox_delete_box (data, &box));
+    return 1;
+}
+
+static int insertballtree (lua_State *L)
+{
+    struct vox_node **data = luaL_checkudata (L, 1, TREE_META);
+    vox_dot center;
+
+    READ_DOT (center, 2);
+    float radius = luaL_checknumber (L, 3);
+    lua_pushinteger (L, vox_insert_ball (data, center, radius));
+    return 1;
+}
+
+static int deleteballtree (lua_State *L)
+{
+    struct vox_node **data = luaL_checkudata (L, 1, TREE_META);
+    vox_dot center;
+
+    READ_DOT (center, 2);
+    float radius = luaL_checknumber (L, 3);
+    lua_pushinteger (L, vox_delete_ball (data, center, radius));
+    return 1;
+}
+
 static int printtree (lua_State *L)
 {
     struct vox_node **data = luaL_checkudata (L, 1, TREE_META);
@@ -113,15 +169,57 @@ static int l_tree_ray_intersection (lua_State *L)
     return 1;
 }
 
+static int savetree (lua_State *L)
+{
+    struct vox_node **data = luaL_checkudata (L, 1, TREE_META);
+    const char *filename = luaL_checkstring (L, 2);
+    const char *errorstr;
+
+    if (vox_save_tree (*data, filename, &errorstr))
+    {
+        lua_pushboolean (L, 1);
+        return 1;
+    }
+
+    lua_pushnil (L);
+    lua_pushstring (L, errorstr);
+    return 2;
+}
+
+static int dagtree (lua_State *L)
+{
+    struct vox_node **data = luaL_checkudata (L, 1, TREE_META);
+    struct vox_dag *dag = vox_make_dag (*data);
+    if (dag == NULL)
+    {
+        lua_pushnil (L);
+        lua_pushstring (L, (*data == NULL) ? "The tree is empty" : "Not enough memory");
+        return 2;
+    }
+
+    struct vox_dag **dagdata = lua_newuserdata (L, sizeof (struct vox_dag*));
+    *dagdata = dag;
+    luaL_getmetatable (L, DAG_META);
+    lua_setmetatable (L, -2);
+    return 1;
+}
+
 static const struct luaL_Reg tree_methods [] = {
     {"__len", counttree},
     {"__tostring", printtree},
     {"__gc", destroytree},
     {"insert", inserttree},
     {"delete", deletetree},
+    {"insert_box", insertboxtree},
+    {"delete_box", deleteboxtree},
+    {"insert_ball", insertballtree},
+    {"delete_ball", deleteballtree},
     {"rebuild", rebuildtree},
+    {"freeze", freezetree},
+    {"save", savetree},
     {"bounding_box", bbtree},
     {"ray_intersection", l_tree_ray_intersection},
+    {"dag", dagtree},
     {NULL, NULL}
 };
 
@@ -264,28 +362,73 @@ static int voxelsize (lua_State *L)
     return 0;
 }
 
+/*
+ * Test a sample with a function or a table of ranges {min, max}, each giving
+ * solid samples min <= sample < max, at index idx of the stack.
+ */
+static int test_sample (lua_State *L, int idx, unsigned int sample)
+{
+    int res = 0;
+
+    if (lua_isfunction (L, idx))
+    {
+        lua_pushvalue (L, idx);
+        lua_pushinteger (L, sample);
+        if (lua_pcall (L, 1, 1, 0))
+            luaL_error (L, "Error executing callback: %s",
+                        lua_tostring (L, -1));
+        res = lua_toboolean (L, -1);
+        lua_pop (L, 1);
+    }
+    else
+    {
+        lua_Integer i, n = luaL_len (L, idx);
+        for (i=1; i<=n && !res; i++)
+        {
+            lua_geti (L, idx, i);
+            lua_geti (L, -1, 1);
+            lua_geti (L, -2, 2);
+            res = (lua_Integer)sample >= luaL_checkinteger (L, -2) &&
+                (lua_Integer)sample < luaL_checkinteger (L, -1);
+            lua_pop (L, 3);
+        }
+    }
+
+    return res;
+}
+
 static int read_raw_data (lua_State *L)
 {
     const char *filename = luaL_checkstring (L, 1);
     vox_dot dim;
     READ_DOT (dim, 2);
     unsigned int samplesize = luaL_checkinteger (L, 3);
+    luaL_argcheck (L, lua_isfunction (L, 4) || lua_istable (L, 4), 4,
+                   "function or table of ranges expected");
     const char *errorstr;
     unsigned int d[3];
     d[0] = dim[0]; d[1] = dim[1]; d[2] = dim[2];
     int res;
+    struct vox_node *tree;
+
+    if (samplesize == 1 || samplesize == 2)
+    {
+        /*
+         * Test each possible value of a sample only once and read the file
+         * with a lookup table. test_sample() can raise an error, so the
+         * table is a userdata which is collected by GC in this case.
+         */
+        unsigned int i, nvalues = 1 << 8*samplesize;
+        unsigned char *lut = lua_newuserdata (L, nvalues);
+        for (i=0; i<nvalues; i++) lut[i] = test_sample (L, 4, i);
+        tree = vox_read_raw_data_lut (filename, d, samplesize, lut, &errorstr);
+        lua_pop (L, 1);
+    }
+    else tree = vox_read_raw_data (filename, d, samplesize,
+                                   ^(unsigned int sample) {
+                                       return test_sample (L, 4, sample);
+                                   }, &errorstr);
 
-    struct vox_node *tree = vox_read_raw_data (filename, d, samplesize,
-                                               ^(unsigned int sample) {
-                                                   lua_pushvalue (L, -1);
-                                                   lua_pushinteger (L, sample);
-                                                   if (lua_pcall (L, 1, 1, 0))
-                                                       luaL_error (L, "Error executing callback: %s",
-                                                                   lua_tostring (L, -1));
-                                                   int res = lua_toboolean (L, -1);
-                                                   lua_pop (L, 1);
-                                                   return res;
-                                               }, &errorstr);
     if (tree != NULL)
     {
         res = 1;
@@ -309,10 +452,10 @@ static int read_raw_data_ranged (lua_State *L)
     vox_dot dim;
     READ_DOT (dim, 2);
     unsigned int samplesize = luaL_checkinteger (L, 3);
-    unsigned int min, max;
-    if (lua_isnoneornil (L, 4)) min = 1 << (8*samplesize-1);
+    lua_Integer min, max;
+    if (lua_isnoneornil (L, 4)) min = (lua_Integer)1 << (8*samplesize-1);
     else min = luaL_checkinteger (L, 4);
-    if (lua_isnoneornil (L, 5)) max = 1<<8*samplesize;
+    if (lua_isnoneornil (L, 5)) max = (lua_Integer)1 << 8*samplesize;
     else max = luaL_checkinteger (L, 5);
 
     const char *errorstr;
@@ -320,10 +463,39 @@ static int read_raw_data_ranged (lua_State *L)
     d[0] = dim[0]; d[1] = dim[1]; d[2] = dim[2];
     int res;
 
-    struct vox_node *tree = vox_read_raw_data (filename, d, samplesize,
-                                               ^(unsigned int sample) {
-                                                   return (sample >= min) ? (sample < max) : 0;
-                                               }, &errorstr);
+    /* vox_read_raw_data_range() takes the range with inclusive maximum */
+    if (min < 0) min = 0;
+    if (max > (lua_Integer)UINT_MAX + 1) max = (lua_Integer)UINT_MAX + 1;
+    if (max <= min) {
+        min = 1;
+        max = 1;
+    }
+    struct vox_node *tree = vox_read_raw_data_range (filename, d, samplesize,
+                                                     min, max - 1, &errorstr);
+    if (tree != NULL)
+    {
+        res = 1;
+        newtree (L);
+        struct vox_node **data = luaL_checkudata (L, -1, TREE_META);
+        *data = tree;
+    }
+    else
+    {
+        res = 2;
+        lua_pushnil (L);
+        lua_pushstring (L, errorstr);
+    }
+
+    return res;
+}
+
+static int load_tree (lua_State *L)
+{
+    const char *filename = luaL_checkstring (L, 1);
+    const char *errorstr;
+    int res;
+
+    struct vox_node *tree = vox_load_tree (filename, &errorstr);
     if (tree != NULL)
     {
         res = 1;
@@ -341,6 +513,141 @@ static int read_raw_data_ranged (lua_State *L)
     return res;
 }
 
+static int destroydensitytree (lua_State *L)
+{
+    struct vox_density_tree **data = luaL_checkudata (L, 1, DENSITY_TREE_META);
+    vox_destroy_density_tree (*data);
+
+    return 0;
+}
+
+static int printdensitytree (lua_State *L)
+{
+    struct vox_density_tree **data = luaL_checkudata (L, 1, DENSITY_TREE_META);
+    lua_pushfstring (L, "<density tree %p>", *data);
+    return 1;
+}
+
+static int rangedensitytree (lua_State *L)
+{
+    struct vox_density_tree **data = luaL_checkudata (L, 1, DENSITY_TREE_META);
+    unsigned int min, max;
+
+    /* Like in read_raw_data_ranged, maximum is not included */
+    vox_density_tree_range (*data, &min, &max);
+    lua_pushinteger (L, min);
+    lua_pushinteger (L, (lua_Integer)max + 1);
+    return 2;
+}
+
+static int bbdensitytree (lua_State *L)
+{
+    struct vox_density_tree **data = luaL_checkudata (L, 1, DENSITY_TREE_META);
+    struct vox_box bb;
+
+    vox_density_tree_bounding_box (*data, &bb);
+    WRITE_DOT (bb.min);
+    WRITE_DOT (bb.max);
+
+    return 2;
+}
+
+static const struct luaL_Reg density_tree_methods [] = {
+    {"__tostring", printdensitytree},
+    {"__gc", destroydensitytree},
+    {"range", rangedensitytree},
+    {"bounding_box", bbdensitytree},
+    {NULL, NULL}
+};
+
+static int destroydag (lua_State *L)
+{
+    struct vox_dag **data = luaL_checkudata (L, 1, DAG_META);
+    vox_destroy_dag (*data);
+
+    return 0;
+}
+
+static int printdag (lua_State *L)
+{
+    struct vox_dag **data = luaL_checkudata (L, 1, DAG_META);
+    lua_pushfstring (L, "<dag %p, %d voxels, %d bytes>", *data,
+                     (int)vox_voxels_in_dag (*data), (int)vox_dag_size (*data));
+    return 1;
+}
+
+static int countdag (lua_State *L)
+{
+    struct vox_dag **data = luaL_checkudata (L, 1, DAG_META);
+    lua_pushinteger (L, vox_voxels_in_dag (*data));
+    return 1;
+}
+
+static int bbdag (lua_State *L)
+{
+    struct vox_dag **data = luaL_checkudata (L, 1, DAG_META);
+    struct vox_box bb;
+
+    vox_dag_bounding_box (*data, &bb);
+    WRITE_DOT (bb.min);
+    WRITE_DOT (bb.max);
+
+    return 2;
+}
+
+static int l_dag_ray_intersection (lua_State *L)
+{
+    struct vox_dag **data = luaL_checkudata (L, 1, DAG_META);
+    vox_dot origin, dir, res;
+    READ_DOT (origin, 2);
+    READ_DOT (dir, 3);
+
+    if (vox_ray_dag_intersection (*data, origin, dir, res)) WRITE_DOT (res);
+    else lua_pushnil (L);
+
+    return 1;
+}
+
+static const struct luaL_Reg dag_methods [] = {
+    {"__len", countdag},
+    {"__tostring", printdag},
+    {"__gc", destroydag},
+    {"bounding_box", bbdag},
+    {"ray_intersection", l_dag_ray_intersection},
+    {NULL, NULL}
+};
+
+static int read_density_data (lua_State *L)
+{
+    const char *filename = luaL_checkstring (L, 1);
+    vox_dot dim;
+    READ_DOT (dim, 2);
+    unsigned int samplesize = luaL_checkinteger (L, 3);
+
+    const char *errorstr;
+    unsigned int d[3];
+    d[0] = dim[0]; d[1] = dim[1]; d[2] = dim[2];
+    int res;
+
+    struct vox_density_tree *tree = vox_read_density_data (filename, d, samplesize, &errorstr);
+    if (tree != NULL)
+    {
+        res = 1;
+        struct vox_density_tree **data = lua_newuserdata (L, sizeof (struct vox_density_tree*));
+        *data = tree;
+        luaL_getmetatable (L, DENSITY_TREE_META);
+        lua_setmetatable (L, -2);
+    }
+    else
+    {
+        res = 2;
+        lua_pushnil (L);
+        lua_pushstring (L, errorstr);
+    }
+
+    return res;
+}
+
 static int find_data_file (lua_State *L)
 {
     char fullpath[MAXPATHLEN];
@@ -370,6 +677,8 @@ static const struct luaL_Reg voxtrees [] = {
     {"voxelsize", voxelsize},
     {"read_raw_data", read_raw_data},
     {"read_raw_data_ranged", read_raw_data_ranged},
+    {"load_tree", load_tree},
+    {"read_density_data", read_density_data},
     {"find_data_file", find_data_file},
     {NULL, NULL}
 };
@@ -386,6 +695,16 @@ int luaopen_voxtrees (lua_State *L)
     lua_setfield (L, -2, "__index");
     luaL_setfuncs (L, dotset_methods, 0);
 
+    luaL_newmetatable(L, DENSITY_TREE_META);
+    lua_pushvalue (L, -1);
+    lua_setfield (L, -2, "__index");
+    luaL_setfuncs (L, density_tree_methods, 0);
+
+    luaL_newmetatable(L, DAG_META);
+    lua_pushvalue (L, -1);
+    lua_setfield (L, -2, "__index");
+    luaL_setfuncs (L, dag_methods, 0);
+
     luaL_newlib (L, voxtrees);
     return 1;
 }
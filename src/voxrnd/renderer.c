@@ -5,6 +5,7 @@
 #endif
 #include <stdlib.h>
 #include <assert.h>
+#include <limits.h>
 #include <vn3d/vn3d.h>
 
 #include "renderer.h"
@@ -76,6 +77,8 @@ static struct vox_rnd_ctx* allocate_context ()
     memset (ctx, 0, sizeof (*ctx));
     ctx->texture = initialize_texture();
     ctx->quality = VOX_QUALITY_ADAPTIVE;
+    ctx->density_min = 1;
+    ctx->density_max = UINT_MAX;
 
     return ctx;
 }
@@ -176,6 +179,22 @@ void vox_context_set_light_manager (struct vox_rnd_ctx *ctx, struct vox_light_ma
     ctx->light_manager = light_manager;
 }
 
+void vox_context_set_density_tree (struct vox_rnd_ctx *ctx, const struct vox_density_tree *density)
+{
+    ctx->density = density;
+}
+
+void vox_context_set_density_threshold (struct vox_rnd_ctx *ctx, unsigned int min, unsigned int max)
+{
+    ctx->density_min = min;
+    ctx->density_max = max;
+}
+
+void vox_context_set_dag (struct vox_rnd_ctx *ctx, const struct vox_dag *dag)
+{
+    ctx->dag = dag;
+}
+
 int vox_context_set_quality (struct vox_rnd_ctx *ctx, unsigned int quality)
 {
     /* Ray merge mode check */
@@ -205,6 +224,10 @@ void vox_render (struct vox_rnd_ctx *ctx)
     int quality = ctx->quality;
     int rnd_mode = quality & VOX_QUALITY_MODE_MASK;
     int merge_mode = quality & VOX_QUALITY_RM_MASK;
+    const struct vox_density_tree *density = ctx->density;
+    unsigned int density_min = ctx->density_min;
+    unsigned int density_max = ctx->density_max;
+    const struct vox_dag *dag = ctx->dag;
 
     /*
       Render the scene running multiple tasks in parallel. Each task renders a
@@ -235,6 +258,29 @@ void vox_render (struct vox_rnd_ctx *ctx)
 
                         camera->iface->get_position (camera, origin);
                         WITH_STAT (VOXRND_BLOCKS_TRACED());
+
+                        if (density != NULL) {
+                            /*
+                             * Nodes of a density tree are not leafs of ordinary
+                             * tree, so they cannot be reused. Trace every pixel.
+                             */
+                            for (i=0; i<16; i++) {
+                                camera->iface->screen2world (camera, dir1, i%4 + xstart, i/4 + ystart);
+                                if (vox_ray_density_intersection (density, density_min, density_max,
+                                                                  origin, dir1, inter1))
+                                    output[cs][i] = get_color (ctx, inter1);
+                            }
+                            return;
+                        }
+                        if (dag != NULL) {
+                            // The same for DAGs: their leafs are shared and have no position
+                            for (i=0; i<16; i++) {
+                                camera->iface->screen2world (camera, dir1, i%4 + xstart, i/4 + ystart);
+                                if (vox_ray_dag_intersection (dag, origin, dir1, inter1))
+                                    output[cs][i] = get_color (ctx, inter1);
+                            }
+                            return;
+                        }
                         int block_merge_mode = 0;
 
                         if (block_rnd_mode == VOX_QUALITY_ADAPTIVE) {
@@ -281,6 +327,48 @@ void vox_render (struct vox_rnd_ctx *ctx)
                         }
                         WITH_STAT (if (block_merge_mode) VOXRND_RAYMERGE_BLOCK ());
 
+#ifdef SSE_INTRIN
+                        if (!block_merge_mode) {
+                            /*
+                             * Trace all remaining pixels of the block with one packet of
+                             * rays. Without SSE this is slower than tracing them one by one.
+                             * In fast mode the packet starts at the leaf found for the
+                             * first pixel, and rays which miss that leaf are traced one by
+                             * one, reusing the leaf of the previous such ray.
+                             */
+                            vox_dot dirs[16], inters[16];
+                            const struct vox_node *leafs[16];
+                            int seeded = block_rnd_mode == VOX_QUALITY_FAST && leaf != NULL;
+                            unsigned int hits;
+                            int n = iend - istart;
+
+                            for (i=0; i<n; i++) {
+                                int p = rendering_order[i+istart];
+                                camera->iface->screen2world (camera, dirs[i], p%4 + xstart, p/4 + ystart);
+                            }
+                            hits = vox_ray_tree_intersection_packet ((seeded)? leaf: ctx->scene, origin,
+                                                                     dirs, n, inters, leafs);
+                            if (seeded) {
+                                leaf = NULL;
+                                for (i=0; i<n; i++) {
+                                    if (hits & (1 << i)) continue;
+                                    WITH_STAT (leafs_changed++);
+                                    if (leaf != NULL)
+                                        leaf = vox_ray_tree_intersection (leaf, origin, dirs[i], inters[i]);
+                                    if (leaf == NULL)
+                                        leaf = vox_ray_tree_intersection (ctx->scene, origin, dirs[i], inters[i]);
+                                    if (leaf != NULL) hits |= 1 << i;
+                                }
+                            }
+                            for (i=0; i<n; i++) {
+                                if (hits & (1 << i))
+                                    output[cs][rendering_order[i+istart]] = get_color (ctx, inters[i]);
+                            }
+                            WITH_STAT (VOXRND_BLOCK_LEAFS_CHANGED (leafs_changed));
+                            return;
+                        }
+#endif
+
                         int prev_p = 0;
                         /* istart and iend have been adjusted to a not yet drawn region. */
                         for (i=istart; i<iend; i++) {
@@ -7,6 +7,8 @@
 
 #include <SDL2/SDL.h>
 #include "../voxtrees/tree.h"
+#include "../voxtrees/density.h"
+#include "../voxtrees/dag.h"
 #include "camera.h"
 #include "lights.h"
 
@@ -30,6 +32,9 @@ struct vox_rnd_ctx
     struct vox_camera *camera;
 
     struct vox_light_manager *light_manager;
+    const struct vox_density_tree *density;
+    unsigned int density_min, density_max;
+    const struct vox_dag *dag;
     Uint8 *texture;
     square *square_output;
     unsigned int squares_num, ws;
@@ -69,6 +74,27 @@ struct vox_rnd_ctx
        To set this value, use vox_context_set_light_manager() rather than writing to
        this field directly.
     **/
+
+    const struct vox_density_tree *density;
+    /**< \brief A density tree which is rendered instead of the scene, if any.
+
+       To set this value, use vox_context_set_density_tree() rather than writing to
+       this field directly.
+    **/
+
+    unsigned int density_min, density_max;
+    /**< \brief Range of solid samples in the density tree.
+
+       To set these values, use vox_context_set_density_threshold() rather than
+       writing to these fields directly.
+    **/
+
+    const struct vox_dag *dag;
+    /**< \brief A DAG which is rendered instead of the scene, if any.
+
+       To set this value, use vox_context_set_dag() rather than writing to
+       this field directly.
+    **/
 };
 #endif
 
@@ -184,6 +210,40 @@ VOX_EXPORT void vox_context_set_camera (struct vox_rnd_ctx *ctx, struct vox_came
 VOX_EXPORT void vox_context_set_light_manager (struct vox_rnd_ctx *ctx,
                                                struct vox_light_manager *light_manager);
 
+/**
+   \brief Density tree setter for renderer context
+
+   If the density tree is not NULL, it is rendered instead of the scene. Samples
+   with values in the range set by vox_context_set_density_threshold() are
+   solid. The tree is not copied, so it must not be destroyed while the context
+   uses it.
+**/
+VOX_EXPORT void vox_context_set_density_tree (struct vox_rnd_ctx *ctx,
+                                              const struct vox_density_tree *density);
+
+/**
+   \brief Set range of solid samples in the density tree
+
+   Samples with values from min to max (inclusive) are rendered as solid
+   voxels. The range can be changed between frames at no cost, the density tree
+   is not rebuilt. By default, all samples with non-zero values are solid.
+
+   \param ctx The renderer's context.
+   \param min Minimal value of a solid sample.
+   \param max Maximal value of a solid sample.
+**/
+VOX_EXPORT void vox_context_set_density_threshold (struct vox_rnd_ctx *ctx,
+                                                   unsigned int min, unsigned int max);
+
+/**
+   \brief DAG setter for renderer context
+
+   If the DAG is not NULL, it is rendered instead of the scene (but a density
+   tree, if set, takes precedence). The DAG is not copied, so it must not be
+   destroyed while the context uses it.
+**/
+VOX_EXPORT void vox_context_set_dag (struct vox_rnd_ctx *ctx, const struct vox_dag *dag);
+
 /**
    \brief Set quality of the renderer
 
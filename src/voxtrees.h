@@ -9,6 +9,8 @@
 #include "voxtrees/search.h"
 #include "voxtrees/geom.h"
 #include "voxtrees/datareader.h"
+#include "voxtrees/density.h"
+#include "voxtrees/dag.h"
 #include "voxtrees/mtree.h"
 
 #endif
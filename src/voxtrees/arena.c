@@ -0,0 +1,218 @@
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+/*
+  Slabs are aligned on their size, so a slab which contains an object can be
+  found by clearing lower bits of the object's address. Objects in slabs are
+  aligned on 16 bytes. Slabs are mapped directly with mmap(), because
+  aligned_alloc() wastes too much memory for big alignments. Pages of a slab
+  which are not used yet do not consume any memory, so even small trees can
+  have big slabs.
+*/
+#define SLAB_SIZE (1 << 20)
+#define ALIGN16(size) (((size) + 0xf) & ~(size_t)0xf)
+
+struct slab
+{
+    struct vox_arena *arena;
+    struct slab *next;
+};
+
+#define SLAB_HEADER ALIGN16 (sizeof (struct slab))
+
+struct large_block
+{
+    struct vox_arena *arena;
+    struct large_block *prev;
+    struct large_block *next;
+};
+
+#define LARGE_HEADER ALIGN16 (sizeof (struct large_block))
+
+struct vox_arena
+{
+    struct slab *slabs;
+    char *free_start, *free_end; // Not yet used space of the last slab
+    void *free_lists[ARENA_CLASSES];
+    struct large_block *large;
+};
+
+static const size_t class_sizes[ARENA_CLASSES] = {
+    ALIGN16 (offsetof (struct vox_node, data)),
+    ALIGN16 (offsetof (struct vox_node, data) + sizeof (vox_dot*)),
+    ALIGN16 (offsetof (struct vox_node, data) + sizeof (vox_brick_data)),
+    ALIGN16 (offsetof (struct vox_node, data) + sizeof (vox_inner_data)),
+    ALIGN16 (VOX_MAX_DOTS * sizeof (vox_dot))
+};
+
+struct vox_arena* arena_new ()
+{
+    return calloc (1, sizeof (struct vox_arena));
+}
+
+void arena_destroy (struct vox_arena *arena)
+{
+    struct slab *slab, *next_slab;
+    struct large_block *block, *next_block;
+
+    for (slab = arena->slabs; slab != NULL; slab = next_slab)
+    {
+        next_slab = slab->next;
+        munmap (slab, SLAB_SIZE);
+    }
+    for (block = arena->large; block != NULL; block = next_block)
+    {
+        next_block = block->next;
+        free (block);
+    }
+    free (arena);
+}
+
+struct vox_arena* arena_of (const void *ptr)
+{
+    const struct slab *slab = (void*)((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1));
+    return slab->arena;
+}
+
+static struct slab* map_slab ()
+{
+    char *ptr, *slab;
+
+    // Map twice as much memory and unmap unaligned parts
+    ptr = mmap (NULL, 2*SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (ptr == MAP_FAILED) abort ();
+    slab = (char*)(((uintptr_t)ptr + SLAB_SIZE - 1) & ~(uintptr_t)(SLAB_SIZE - 1));
+    if (slab != ptr)
+    {
+        munmap (ptr, slab - ptr);
+        munmap (slab + SLAB_SIZE, ptr + SLAB_SIZE - slab);
+    }
+    else munmap (slab + SLAB_SIZE, SLAB_SIZE);
+
+    return (struct slab*)slab;
+}
+
+static void add_slab (struct vox_arena *arena)
+{
+    struct slab *slab = map_slab ();
+
+    slab->arena = arena;
+    slab->next = arena->slabs;
+    arena->slabs = slab;
+    arena->free_start = (char*)slab + SLAB_HEADER;
+    arena->free_end = (char*)slab + SLAB_SIZE;
+}
+
+void* arena_alloc (struct vox_arena *arena, int cls)
+{
+    void *ptr = arena->free_lists[cls];
+    size_t size;
+
+    if (ptr != NULL)
+    {
+        arena->free_lists[cls] = *(void**)ptr;
+        return ptr;
+    }
+
+    size = class_sizes[cls];
+    if (arena->free_end - arena->free_start < (ptrdiff_t)size) add_slab (arena);
+    ptr = arena->free_start;
+    arena->free_start += size;
+
+    return ptr;
+}
+
+void arena_free (void *ptr, int cls)
+{
+    struct vox_arena *arena = arena_of (ptr);
+
+    *(void**)ptr = arena->free_lists[cls];
+    arena->free_lists[cls] = ptr;
+}
+
+void* arena_alloc_large (struct vox_arena *arena, size_t size)
+{
+    struct large_block *block = vox_alloc (LARGE_HEADER + size);
+
+    block->arena = arena;
+    block->prev = NULL;
+    block->next = arena->large;
+    if (arena->large != NULL) arena->large->prev = block;
+    arena->large = block;
+
+    return (char*)block + LARGE_HEADER;
+}
+
+void arena_free_large (void *ptr)
+{
+    struct large_block *block = (void*)((char*)ptr - LARGE_HEADER);
+
+    if (block->prev != NULL) block->prev->next = block->next;
+    else block->arena->large = block->next;
+    if (block->next != NULL) block->next->prev = block->prev;
+    free (block);
+}
+
+void arena_merge (struct vox_arena *dst, struct vox_arena *src)
+{
+    struct slab *slab, *last_slab = NULL;
+    struct large_block *block, *last_block = NULL;
+    void *ptr, *next;
+    int i;
+
+    for (slab = src->slabs; slab != NULL; slab = slab->next)
+    {
+        slab->arena = dst;
+        last_slab = slab;
+    }
+
+    if (last_slab != NULL)
+    {
+        /*
+          Continue allocation in the last slab of src if it has more free
+          space. Slabs are prepended to the list, so the last slab of an
+          arena is always at the head.
+        */
+        if (dst->slabs == NULL ||
+            src->free_end - src->free_start > dst->free_end - dst->free_start)
+        {
+            last_slab->next = dst->slabs;
+            dst->slabs = src->slabs;
+            dst->free_start = src->free_start;
+            dst->free_end = src->free_end;
+        }
+        else
+        {
+            last_slab->next = dst->slabs->next;
+            dst->slabs->next = src->slabs;
+        }
+    }
+
+    for (i=0; i<ARENA_CLASSES; i++)
+    {
+        for (ptr = src->free_lists[i]; ptr != NULL; ptr = next)
+        {
+            next = *(void**)ptr;
+            *(void**)ptr = dst->free_lists[i];
+            dst->free_lists[i] = ptr;
+        }
+    }
+
+    for (block = src->large; block != NULL; block = block->next)
+    {
+        block->arena = dst;
+        last_block = block;
+    }
+    if (last_block != NULL)
+    {
+        last_block->next = dst->large;
+        if (dst->large != NULL) dst->large->prev = last_block;
+        dst->large = src->large;
+    }
+
+    free (src);
+}
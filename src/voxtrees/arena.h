@@ -0,0 +1,75 @@
+/**
+   @file arena.h
+   @brief Memory allocator for tree nodes
+
+   Every tree has its own arena. Nodes and arrays of voxels in leaf nodes
+   are allocated in big aligned slabs, so the arena of any node can be found
+   by the node's address and the whole tree can be freed by freeing slabs of
+   its arena. This is internal header which is not installed.
+**/
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include "tree.h"
+
+/*
+  Size classes of the arena. There are four node flavours (dense leaf, leaf,
+  brick and inner node) and leaf arrays of VOX_MAX_DOTS voxels.
+*/
+enum
+{
+    ARENA_DENSE_LEAF,
+    ARENA_LEAF,
+    ARENA_BRICK,
+    ARENA_INNER,
+    ARENA_DOTS,
+    ARENA_CLASSES
+};
+
+struct vox_arena;
+
+/*
+  Create a new empty arena.
+*/
+struct vox_arena* arena_new ();
+
+/*
+  Free all memory allocated in the arena and the arena itself.
+*/
+void arena_destroy (struct vox_arena *arena);
+
+/*
+  Return the arena where ptr was allocated with arena_alloc().
+*/
+struct vox_arena* arena_of (const void *ptr);
+
+/*
+  Allocate an object of size class cls in the arena.
+*/
+void* arena_alloc (struct vox_arena *arena, int cls);
+
+/*
+  Return an object of size class cls to the arena where it was allocated.
+*/
+void arena_free (void *ptr, int cls);
+
+/*
+  Allocate a 16-byte aligned block of arbitrary size in the arena. Used for
+  arrays of voxels which do not fit in ARENA_DOTS class.
+*/
+void* arena_alloc_large (struct vox_arena *arena, size_t size);
+
+/*
+  Free a block allocated with arena_alloc_large().
+*/
+void arena_free_large (void *ptr);
+
+/*
+  Move everything allocated in src to dst and destroy src. Arenas cannot be
+  accessed from more than one thread, so parallel builders allocate in
+  separate arenas and merge them after that.
+*/
+void arena_merge (struct vox_arena *dst, struct vox_arena *src);
+
+#endif
@@ -0,0 +1,386 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "geom.h"
+#include "search.h"
+#include "dag.h"
+
+/*
+  DAGs are made by hash consing: each node is made of its children (which
+  are already in the DAG) and looked up in a hash table of nodes. If the
+  same node is already there, it is reused.
+*/
+struct dag_entry
+{
+    uint64_t hash;
+    uint32_t id;
+};
+
+struct dag_builder
+{
+    struct vox_dag *dag;
+    size_t nodes_size, dots_size; // Allocated space
+    struct dag_entry *table;
+    size_t table_size, table_used; // table_size is a power of 2
+    int failed;
+};
+
+static void grid_coords (const vox_dot dot, int32_t res[])
+{
+    int i;
+    for (i=0; i<3; i++) res[i] = lrintf (dot[i] / vox_voxel[i]);
+}
+
+static int compare_coords (const void *a, const void *b)
+{
+    const int32_t *c1 = a, *c2 = b;
+    int i;
+
+    for (i=0; i<3; i++)
+        if (c1[i] != c2[i]) return (c1[i] < c2[i]) ? -1 : 1;
+    return 0;
+}
+
+// FNV-1a
+static uint64_t hash_bytes (uint64_t hash, const void *data, size_t n)
+{
+    const unsigned char *bytes = data;
+    size_t i;
+
+    for (i=0; i<n; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+// Hash of a node and its voxels. Indices of voxels do not matter.
+static uint64_t node_hash (const struct vox_dag *dag, const struct vox_dag_node *node)
+{
+    struct vox_dag_node copy = *node;
+    uint64_t hash;
+
+    if (node->flags & VOX_LEAF) copy.data.dots = 0;
+    hash = hash_bytes (0xcbf29ce484222325, &copy, sizeof (copy));
+    if (node->flags & VOX_LEAF)
+        hash = hash_bytes (hash, dag->dots[node->data.dots], node->dots_num * sizeof (dag->dots[0]));
+    return hash;
+}
+
+static int same_nodes (const struct vox_dag *dag, const struct vox_dag_node *node1,
+                       const struct vox_dag_node *node2)
+{
+    struct vox_dag_node copy1 = *node1, copy2 = *node2;
+
+    if (!(node1->flags & VOX_LEAF)) return memcmp (node1, node2, sizeof (*node1)) == 0;
+    copy1.data.dots = copy2.data.dots = 0;
+    return memcmp (&copy1, &copy2, sizeof (copy1)) == 0 &&
+        memcmp (dag->dots[node1->data.dots], dag->dots[node2->data.dots],
+                node1->dots_num * sizeof (dag->dots[0])) == 0;
+}
+
+static int grow_table (struct dag_builder *builder)
+{
+    size_t size = builder->table_size * 2, i, j;
+    struct dag_entry *table = malloc (size * sizeof (struct dag_entry));
+
+    if (table == NULL) return 0;
+    for (i=0; i<size; i++) table[i].id = DAG_NO_CHILD;
+    for (i=0; i<builder->table_size; i++)
+    {
+        if (builder->table[i].id == DAG_NO_CHILD) continue;
+        for (j = builder->table[i].hash & (size-1); table[j].id != DAG_NO_CHILD;
+             j = (j+1) & (size-1));
+        table[j] = builder->table[i];
+    }
+    free (builder->table);
+    builder->table = table;
+    builder->table_size = size;
+    return 1;
+}
+
+/*
+  Return the index of the node in the DAG, adding it if needed. Voxels of
+  a new leaf are already stored after the last voxel of the DAG.
+*/
+static uint32_t intern_node (struct dag_builder *builder, const struct vox_dag_node *node)
+{
+    struct vox_dag *dag = builder->dag;
+    uint64_t hash = node_hash (dag, node);
+    size_t i, mask = builder->table_size - 1;
+    uint32_t id;
+
+    for (i = hash & mask; builder->table[i].id != DAG_NO_CHILD; i = (i+1) & mask)
+        if (builder->table[i].hash == hash &&
+            same_nodes (dag, dag->nodes + builder->table[i].id, node))
+            return builder->table[i].id;
+
+    if (dag->nodes_num == builder->nodes_size)
+    {
+        size_t size = 2*builder->nodes_size;
+        struct vox_dag_node *nodes = realloc (dag->nodes, size * sizeof (struct vox_dag_node));
+        if (nodes == NULL) goto failure;
+        dag->nodes = nodes;
+        builder->nodes_size = size;
+    }
+    id = dag->nodes_num++;
+    dag->nodes[id] = *node;
+    if (node->flags & VOX_LEAF) dag->dots_num += node->dots_num;
+
+    builder->table[i].hash = hash;
+    builder->table[i].id = id;
+    builder->table_used++;
+    if (2*builder->table_used > builder->table_size && !(grow_table (builder))) goto failure;
+    return id;
+
+failure:
+    builder->failed = 1;
+    return DAG_NO_CHILD;
+}
+
+// origin is the minimal corner of the tree's bounding box on the grid
+static uint32_t add_tree (struct dag_builder *builder, const struct vox_node *tree,
+                          const int32_t origin[])
+{
+    struct vox_dag *dag = builder->dag;
+    struct vox_dag_node node;
+    int32_t max[3], child_origin[3];
+    unsigned int i, j;
+
+    if (builder->failed) return DAG_NO_CHILD;
+
+    memset (&node, 0, sizeof (node));
+    grid_coords (tree->bounding_box.max, max);
+    for (i=0; i<3; i++) node.size[i] = max[i] - origin[i];
+    node.dots_num = tree->dots_num;
+
+    if (tree->flags & VOX_DENSE_LEAF) node.flags = VOX_DENSE_LEAF;
+    else if (tree->flags & VOX_LEAF)
+    {
+        vox_dot buffer[VOX_MAX_DOTS];
+        vox_dot *dots = leaf_dots (tree, buffer);
+
+        if (dag->dots_num + tree->dots_num > builder->dots_size)
+        {
+            size_t size = 2*builder->dots_size + tree->dots_num;
+            int32_t (*new_dots)[3] = realloc (dag->dots, size * sizeof (dag->dots[0]));
+            if (new_dots == NULL)
+            {
+                builder->failed = 1;
+                return DAG_NO_CHILD;
+            }
+            dag->dots = new_dots;
+            builder->dots_size = size;
+        }
+
+        // Voxels of the new leaf go to the end of the array (in canonical order)
+        node.flags = VOX_LEAF;
+        node.data.dots = dag->dots_num;
+        for (i=0; i<tree->dots_num; i++)
+        {
+            grid_coords (dots[i], dag->dots[dag->dots_num + i]);
+            for (j=0; j<3; j++) dag->dots[dag->dots_num + i][j] -= origin[j];
+        }
+        qsort (dag->dots + dag->dots_num, tree->dots_num, sizeof (dag->dots[0]), compare_coords);
+    }
+    else if (tree->flags & VOX_BRICK)
+    {
+        node.flags = VOX_BRICK;
+        grid_coords (tree->data.brick.origin, node.data.brick.origin);
+        for (i=0; i<3; i++) node.data.brick.origin[i] -= origin[i];
+        node.data.brick.mask = tree->data.brick.mask;
+    }
+    else
+    {
+        for (i=0; i<VOX_NS; i++)
+        {
+            const struct vox_node *child = VOX_CHILD (tree, i);
+            if (VOX_FULLP (child))
+            {
+                grid_coords (child->bounding_box.min, child_origin);
+                for (j=0; j<3; j++) node.data.inner.offsets[i][j] = child_origin[j] - origin[j];
+                node.data.inner.children[i] = add_tree (builder, child, child_origin);
+            }
+            else node.data.inner.children[i] = DAG_NO_CHILD;
+        }
+        if (builder->failed) return DAG_NO_CHILD;
+    }
+
+    return intern_node (builder, &node);
+}
+
+struct vox_dag* vox_make_dag (const struct vox_node *tree)
+{
+    struct dag_builder builder;
+    struct vox_dag *dag;
+    int32_t origin[3];
+    size_t i;
+
+    if (!(VOX_FULLP (tree))) return NULL;
+
+    dag = malloc (sizeof (struct vox_dag));
+    if (dag == NULL) return NULL;
+    memset (dag, 0, sizeof (struct vox_dag));
+    memset (&builder, 0, sizeof (builder));
+    builder.dag = dag;
+    builder.nodes_size = 1024;
+    builder.dots_size = 1024;
+    builder.table_size = 2048;
+    dag->nodes = malloc (builder.nodes_size * sizeof (struct vox_dag_node));
+    dag->dots = malloc (builder.dots_size * sizeof (dag->dots[0]));
+    builder.table = malloc (builder.table_size * sizeof (struct dag_entry));
+    if (dag->nodes == NULL || dag->dots == NULL || builder.table == NULL)
+    {
+        builder.failed = 1;
+        goto done;
+    }
+    for (i=0; i<builder.table_size; i++) builder.table[i].id = DAG_NO_CHILD;
+
+    grid_coords (tree->bounding_box.min, origin);
+    vox_dot_set (dag->origin,
+                 origin[0]*vox_voxel[0], origin[1]*vox_voxel[1], origin[2]*vox_voxel[2]);
+    dag->root = add_tree (&builder, tree, origin);
+
+    if (!builder.failed)
+    {
+        // Give back unused space
+        void *ptr = realloc (dag->nodes, dag->nodes_num * sizeof (struct vox_dag_node));
+        if (ptr != NULL) dag->nodes = ptr;
+        if (dag->dots_num > 0)
+        {
+            ptr = realloc (dag->dots, dag->dots_num * sizeof (dag->dots[0]));
+            if (ptr != NULL) dag->dots = ptr;
+        }
+    }
+
+done:
+    free (builder.table);
+    if (builder.failed)
+    {
+        vox_destroy_dag (dag);
+        dag = NULL;
+    }
+    return dag;
+}
+
+void vox_destroy_dag (struct vox_dag *dag)
+{
+    free (dag->nodes);
+    free (dag->dots);
+    free (dag);
+}
+
+size_t vox_dag_size (const struct vox_dag *dag)
+{
+    return sizeof (struct vox_dag) +
+        dag->nodes_num * sizeof (struct vox_dag_node) +
+        dag->dots_num * sizeof (dag->dots[0]);
+}
+
+size_t vox_voxels_in_dag (const struct vox_dag *dag)
+{
+    return dag->nodes[dag->root].dots_num;
+}
+
+void vox_dag_bounding_box (const struct vox_dag *dag, struct vox_box *box)
+{
+    const struct vox_dag_node *root = dag->nodes + dag->root;
+
+    vox_dot_copy (box->min, dag->origin);
+    vox_dot_set (box->max,
+                 dag->origin[0] + root->size[0]*vox_voxel[0],
+                 dag->origin[1] + root->size[1]*vox_voxel[1],
+                 dag->origin[2] + root->size[2]*vox_voxel[2]);
+}
+
+/*
+  base is the absolute position of the node's origin. Leafs and bricks are
+  converted to ordinary nodes at their absolute positions and searched
+  with vox_ray_tree_intersection().
+*/
+static int dag_intersection (const struct vox_dag *dag, uint32_t id, const vox_dot base,
+                             const vox_dot origin, const struct vox_ray *ray, vox_dot res)
+{
+    const struct vox_dag_node *node = dag->nodes + id;
+    struct vox_node tmp;
+    vox_dot entry, child_base;
+    unsigned int i, n;
+
+    vox_dot_copy (tmp.bounding_box.min, base);
+    vox_dot_set (tmp.bounding_box.max,
+                 base[0] + node->size[0]*vox_voxel[0],
+                 base[1] + node->size[1]*vox_voxel[1],
+                 base[2] + node->size[2]*vox_voxel[2]);
+    if (!(hit_box (&(tmp.bounding_box), origin, ray, entry))) return 0;
+
+    if (node->flags & VOX_DENSE_LEAF)
+    {
+        vox_dot_copy (res, entry);
+        return 1;
+    }
+    else if (node->flags & VOX_LEAF)
+    {
+        vox_dot buffer[VOX_MAX_DOTS];
+        vox_dot *dots = buffer;
+        const int32_t (*coords)[3] = dag->dots + node->data.dots;
+        int found;
+
+        // Overflow leafs have more than VOX_MAX_DOTS voxels
+        if (node->dots_num > VOX_MAX_DOTS)
+        {
+            dots = vox_alloc (sizeof (vox_dot) * node->dots_num);
+            if (dots == NULL) return 0;
+        }
+        for (i=0; i<node->dots_num; i++)
+            vox_dot_set (dots[i],
+                         base[0] + coords[i][0]*vox_voxel[0],
+                         base[1] + coords[i][1]*vox_voxel[1],
+                         base[2] + coords[i][2]*vox_voxel[2]);
+        tmp.flags = VOX_LEAF;
+        tmp.dots_num = node->dots_num;
+        tmp.data.dots = dots;
+        found = ray_tree_intersection (&tmp, entry, ray, res) != NULL;
+        if (dots != buffer) free (dots);
+        return found;
+    }
+    else if (node->flags & VOX_BRICK)
+    {
+        tmp.flags = VOX_BRICK;
+        tmp.dots_num = node->dots_num;
+        vox_dot_set (tmp.data.brick.origin,
+                     base[0] + node->data.brick.origin[0]*vox_voxel[0],
+                     base[1] + node->data.brick.origin[1]*vox_voxel[1],
+                     base[2] + node->data.brick.origin[2]*vox_voxel[2]);
+        tmp.data.brick.mask = node->data.brick.mask;
+        return ray_tree_intersection (&tmp, entry, ray, res) != NULL;
+    }
+
+    /*
+      Bit i of a subspace is set for the lower half along axis i. A ray can
+      go from child a to child b only if b is farther along all axes where
+      they differ, so children visited in this order are visited front to
+      back.
+    */
+    for (n=0; n<VOX_NS; n++)
+    {
+        i = n ^ ray->mask ^ (VOX_NS-1);
+        if (node->data.inner.children[i] == DAG_NO_CHILD) continue;
+        vox_dot_set (child_base,
+                     base[0] + node->data.inner.offsets[i][0]*vox_voxel[0],
+                     base[1] + node->data.inner.offsets[i][1]*vox_voxel[1],
+                     base[2] + node->data.inner.offsets[i][2]*vox_voxel[2]);
+        if (dag_intersection (dag, node->data.inner.children[i], child_base,
+                              entry, ray, res)) return 1;
+    }
+    return 0;
+}
+
+int vox_ray_dag_intersection (const struct vox_dag *dag, const vox_dot origin,
+                              const vox_dot dir, vox_dot res)
+{
+    struct vox_ray ray;
+
+    make_ray (&ray, dir);
+    return dag_intersection (dag, dag->root, dag->origin, origin, &ray, res);
+}
@@ -0,0 +1,108 @@
+/**
+   @file dag.h
+   @brief Sparse voxel DAGs
+
+   A DAG is a compressed read-only form of a tree. Subtrees which differ
+   only by their position share one node, so scenes with many repeated
+   objects (walls, pillars, etc.) need much less memory.
+**/
+#ifndef __DAG_H_
+#define __DAG_H_
+
+#include <stdint.h>
+#include "tree.h"
+
+#ifdef VOXTREES_SOURCE
+#define DAG_NO_CHILD UINT32_MAX
+
+/*
+  All coordinates are integer numbers of voxels relative to the origin of
+  the node, which is the minimal corner of its bounding box. Children are
+  placed at offsets from the origin of their parent, so the same node can
+  be a child of many parents (or of one parent many times) at different
+  places.
+*/
+struct vox_dag_node
+{
+    unsigned int flags; // VOX_LEAF, VOX_DENSE_LEAF, VOX_BRICK or 0 for inner nodes
+    unsigned int dots_num;
+    int32_t size[3]; // Size of the bounding box
+    union
+    {
+        struct
+        {
+            uint32_t children[VOX_NS]; // Indices in nodes array or DAG_NO_CHILD
+            int32_t offsets[VOX_NS][3];
+        } inner;
+        struct
+        {
+            int32_t origin[3];
+            uint64_t mask;
+        } brick;
+        uint32_t dots; // Index of the first voxel of a leaf in dots array
+    } data;
+};
+
+struct vox_dag
+{
+    vox_dot origin; // Origin of the root node
+    uint32_t root;
+    struct vox_dag_node *nodes;
+    int32_t (*dots)[3];
+    size_t nodes_num, dots_num;
+};
+#else
+struct vox_dag;
+#endif
+
+/**
+   \brief Compress a tree into a DAG.
+
+   Subtrees of the tree are hashed and structurally identical subtrees
+   (which have the same voxels relative to their bounding boxes) are stored
+   only once. The tree may be frozen and it is not changed. Voxels must lie
+   on the grid of vox_voxel (this is always true for voxels inserted in the
+   tree with voxtrees functions).
+
+   \return A new DAG or NULL if the tree is empty or there is not enough
+   memory.
+**/
+VOX_EXPORT struct vox_dag* vox_make_dag (const struct vox_node *tree);
+
+/**
+   \brief Destroy a DAG.
+**/
+VOX_EXPORT void vox_destroy_dag (struct vox_dag *dag);
+
+/**
+   \brief Return memory used by a DAG in bytes.
+**/
+VOX_EXPORT size_t vox_dag_size (const struct vox_dag *dag);
+
+/**
+   \brief Return the number of voxels in a DAG.
+**/
+VOX_EXPORT size_t vox_voxels_in_dag (const struct vox_dag *dag);
+
+/**
+   \brief Make a bounding box of a DAG.
+**/
+VOX_EXPORT void vox_dag_bounding_box (const struct vox_dag *dag, struct vox_box *box);
+
+/**
+   \brief Find intersection of a DAG and a ray.
+
+   This is like vox_ray_tree_intersection() for the tree the DAG is made
+   of. Absolute positions of nodes are tracked while descending the DAG.
+
+   \param dag a DAG
+   \param origin starting point of the ray
+   \param dir direction of the ray
+   \param res where the intersection is stored
+
+   \return 1 if the intersection is found, 0 otherwise.
+**/
+VOX_EXPORT int vox_ray_dag_intersection (const struct vox_dag *dag, const vox_dot origin,
+                                         const vox_dot dir, vox_dot res);
+
+#endif
@@ -1,89 +1,572 @@
+#ifdef USE_GCD
+#include <dispatch/dispatch.h>
+#else
+#include "../gcd-stubs.c"
+#endif
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
 #include "tree.h"
+#include "arena.h"
+#include "geom.h"
 #include "datareader.h"
 
-struct vox_node* vox_read_raw_data (const char *filename, unsigned int dim[],
-                                    unsigned int samplesize, int (^test)(unsigned int sample),
-                                    const char **error)
-{
 #define SETERROR(x) if (error != NULL) *error = (x)
 #define SETSYSERROR() if (error != NULL) *error = strerror(errno)
 
+/*
+  Samples are tested in chunks of SAMPLE_CHUNK samples, giving a bit mask of
+  solid samples in the chunk. Samples are little-endian. A sample is solid
+  if the block returns non-zero for it or, if there is no block, if its
+  entry in lut is not zero or, if there is no lut, if it is in the range
+  [min, max].
+*/
+#define SAMPLE_CHUNK 16
+
+struct sample_test
+{
+    uint32_t min, max;
+    const unsigned char *lut;
+    int (^block)(unsigned int sample);
+};
+
+static uint32_t read_sample (const unsigned char *data, unsigned int samplesize)
+{
+    uint32_t value = 0;
+    unsigned int l;
+
+    for (l=0; l<samplesize; l++) value |= (uint32_t)data[l] << (8*l);
+    return value;
+}
+
+static int solid_sample (uint32_t value, const struct sample_test *test)
+{
+    if (test->block != NULL) return test->block (value);
+    return (test->lut != NULL) ? test->lut[value] : (value >= test->min && value <= test->max);
+}
+
+static unsigned int chunk_mask (const unsigned char *data, unsigned int samplesize,
+                                const struct sample_test *test)
+{
+    unsigned int i, mask = 0;
+    uint32_t value, min = test->min, max = test->max;
+
+    if (test->block != NULL)
+    {
+        for (i=0; i<SAMPLE_CHUNK; i++)
+            if (test->block (read_sample (data + samplesize*i, samplesize))) mask |= 1U << i;
+        return mask;
+    }
+
+    if (test->lut != NULL)
+    {
+        // Solid and empty samples are mixed in noisy data, so do not branch
+        if (samplesize == 1)
+            for (i=0; i<SAMPLE_CHUNK; i++)
+                mask |= (unsigned int)(test->lut[data[i]] != 0) << i;
+        else
+            for (i=0; i<SAMPLE_CHUNK; i++)
+                mask |= (unsigned int)(test->lut[read_sample (data + 2*i, 2)] != 0) << i;
+        return mask;
+    }
+
+#ifdef SSE_INTRIN
+    /*
+      Unsigned x is in range if max (x, min) = x and min (x, max) = x. The
+      results for wider samples are packed to bytes with signed saturation,
+      which keeps 0 and -1 as they are.
+    */
+    __m128i v0, v1, v2, v3, m0, m1, m2, m3, lo, hi;
+    switch (samplesize)
+    {
+    case 1:
+        lo = _mm_set1_epi8 (min); hi = _mm_set1_epi8 (max);
+        v0 = _mm_loadu_si128 ((const __m128i*)data);
+        m0 = _mm_and_si128 (_mm_cmpeq_epi8 (_mm_max_epu8 (v0, lo), v0),
+                            _mm_cmpeq_epi8 (_mm_min_epu8 (v0, hi), v0));
+        return _mm_movemask_epi8 (m0);
+    case 2:
+        lo = _mm_set1_epi16 (min); hi = _mm_set1_epi16 (max);
+        v0 = _mm_loadu_si128 ((const __m128i*)data);
+        v1 = _mm_loadu_si128 ((const __m128i*)data + 1);
+        m0 = _mm_and_si128 (_mm_cmpeq_epi16 (_mm_max_epu16 (v0, lo), v0),
+                            _mm_cmpeq_epi16 (_mm_min_epu16 (v0, hi), v0));
+        m1 = _mm_and_si128 (_mm_cmpeq_epi16 (_mm_max_epu16 (v1, lo), v1),
+                            _mm_cmpeq_epi16 (_mm_min_epu16 (v1, hi), v1));
+        return _mm_movemask_epi8 (_mm_packs_epi16 (m0, m1));
+    case 4:
+        lo = _mm_set1_epi32 (min); hi = _mm_set1_epi32 (max);
+        v0 = _mm_loadu_si128 ((const __m128i*)data);
+        v1 = _mm_loadu_si128 ((const __m128i*)data + 1);
+        v2 = _mm_loadu_si128 ((const __m128i*)data + 2);
+        v3 = _mm_loadu_si128 ((const __m128i*)data + 3);
+        m0 = _mm_and_si128 (_mm_cmpeq_epi32 (_mm_max_epu32 (v0, lo), v0),
+                            _mm_cmpeq_epi32 (_mm_min_epu32 (v0, hi), v0));
+        m1 = _mm_and_si128 (_mm_cmpeq_epi32 (_mm_max_epu32 (v1, lo), v1),
+                            _mm_cmpeq_epi32 (_mm_min_epu32 (v1, hi), v1));
+        m2 = _mm_and_si128 (_mm_cmpeq_epi32 (_mm_max_epu32 (v2, lo), v2),
+                            _mm_cmpeq_epi32 (_mm_min_epu32 (v2, hi), v2));
+        m3 = _mm_and_si128 (_mm_cmpeq_epi32 (_mm_max_epu32 (v3, lo), v3),
+                            _mm_cmpeq_epi32 (_mm_min_epu32 (v3, hi), v3));
+        return _mm_movemask_epi8 (_mm_packs_epi16 (_mm_packs_epi32 (m0, m1),
+                                                   _mm_packs_epi32 (m2, m3)));
+    }
+#endif
+
+    for (i=0; i<SAMPLE_CHUNK; i++)
+    {
+        switch (samplesize)
+        {
+        case 1:
+            value = data[i];
+            break;
+        case 2:
+            value = read_sample (data + 2*i, 2);
+            break;
+        case 4:
+            value = read_sample (data + 4*i, 4);
+            break;
+        default:
+            value = read_sample (data + samplesize*i, samplesize);
+        }
+        mask |= (unsigned int)(value >= min && value <= max) << i;
+    }
+    return mask;
+}
+
+/*
+  Scan a row of len samples with coordinates (i, j, k) ... (i, j, k+len-1)
+  and store solid voxels in res. Return the number of solid voxels.
+*/
+static size_t scan_row (const unsigned char *row, unsigned int len, unsigned int samplesize,
+                        const struct sample_test *test, unsigned int i, unsigned int j,
+                        unsigned int k, vox_dot *res)
+{
+    size_t n = 0;
+    unsigned int l, mask;
+
+    for (l=0; l+SAMPLE_CHUNK<=len; l+=SAMPLE_CHUNK)
+    {
+        mask = chunk_mask (row + l*samplesize, samplesize, test);
+        while (mask != 0)
+        {
+            unsigned int bit = __builtin_ctz (mask);
+            vox_dot_set (res[n], i*vox_voxel[0], j*vox_voxel[1], (k+l+bit)*vox_voxel[2]);
+            n++;
+            mask &= mask - 1;
+        }
+    }
+
+    for (; l<len; l++)
+    {
+        if (solid_sample (read_sample (row + l*samplesize, samplesize), test))
+        {
+            vox_dot_set (res[n], i*vox_voxel[0], j*vox_voxel[1], (k+l)*vox_voxel[2]);
+            n++;
+        }
+    }
+
+    return n;
+}
+
+/*
+  Volume mapped to memory. If parallel is non-zero, parts of the volume are
+  read by many threads at once.
+*/
+struct volume
+{
+    const unsigned char *data;
+    unsigned int dim[3];
+    unsigned int samplesize;
+    struct sample_test test;
+    int parallel;
+    int failed; // Not enough memory for a brick
+};
+
+/*
+  Make a tree of a brick from voxels of all its solid samples. This is used
+  with test blocks, so each sample is tested only once.
+*/
+static struct vox_node* read_brick_voxels (struct volume *volume, const unsigned int lo[],
+                                           const unsigned int hi[])
+{
+    struct vox_node *tree;
+    size_t n = 0, row_size = (size_t)volume->dim[2]*volume->samplesize;
+    vox_dot *array = vox_alloc ((size_t)(hi[0]-lo[0])*(hi[1]-lo[1])*(hi[2]-lo[2])*sizeof (vox_dot));
+    unsigned int i, j;
+
+    if (array == NULL)
+    {
+        volume->failed = 1;
+        return NULL;
+    }
+
+    for (i=lo[0]; i<hi[0]; i++)
+        for (j=lo[1]; j<hi[1]; j++)
+            n += scan_row (volume->data + (i*(size_t)volume->dim[1] + j)*row_size +
+                           lo[2]*volume->samplesize,
+                           hi[2]-lo[2], volume->samplesize, &(volume->test), i, j, lo[2],
+                           array + n);
+
+    tree = vox_make_tree_morton (array, n);
+    free (array);
+    return tree;
+}
+
+/*
+  Otherwise, a brick is divided into cells of CELL_SIDE^3 samples and solid
+  samples in each cell are counted first. Cells with no solid samples are
+  skipped, cells (and groups of cells) with only solid samples become dense
+  leafs without making any voxels. Voxels are made only for cells with some
+  solid samples. All nodes of a brick are allocated in one arena.
+*/
+#define CELL_SIDE SAMPLE_CHUNK
+
+struct brick
+{
+    struct volume *volume;
+    struct vox_arena *arena;
+    unsigned int lo[3], hi[3]; // Samples of the brick
+    unsigned int cells[3]; // Number of cells along each axis
+    unsigned int *counts; // Solid samples in each cell
+    vox_dot *buffer; // Voxels of one cell
+};
+
+static unsigned int* cell_count (struct brick *brick, unsigned int ci, unsigned int cj,
+                                 unsigned int ck)
+{
+    return brick->counts + ((size_t)ci*brick->cells[1] + cj)*brick->cells[2] + ck;
+}
+
+static void count_cells (struct brick *brick)
+{
+    struct volume *volume = brick->volume;
+    size_t row_size = (size_t)volume->dim[2]*volume->samplesize;
+    unsigned int i, j, l, len = brick->hi[2] - brick->lo[2];
+    const unsigned char *row;
+
+    for (i=brick->lo[0]; i<brick->hi[0]; i++)
+    {
+        for (j=brick->lo[1]; j<brick->hi[1]; j++)
+        {
+            unsigned int *counts = cell_count (brick, (i - brick->lo[0]) / CELL_SIDE,
+                                               (j - brick->lo[1]) / CELL_SIDE, 0);
+            row = volume->data + (i*(size_t)volume->dim[1] + j)*row_size +
+                brick->lo[2]*volume->samplesize;
+            for (l=0; l+SAMPLE_CHUNK<=len; l+=SAMPLE_CHUNK)
+                counts[l/CELL_SIDE] += __builtin_popcount (chunk_mask (row + l*volume->samplesize,
+                                                                       volume->samplesize,
+                                                                       &(volume->test)));
+            for (; l<len; l++)
+                counts[l/CELL_SIDE] += solid_sample (read_sample (row + l*volume->samplesize,
+                                                                  volume->samplesize),
+                                                     &(volume->test));
+        }
+    }
+}
+
+static struct vox_node* read_cells (struct brick *brick, const unsigned int clo[],
+                                    const unsigned int chi[])
+{
+    struct volume *volume = brick->volume;
+    struct vox_node *children[VOX_NS];
+    unsigned int lo[3], hi[3], cmid[3], child_lo[3], child_hi[3];
+    unsigned int i, j, k, idx;
+    size_t count = 0, samples = 1, n = 0;
+    size_t row_size = (size_t)volume->dim[2]*volume->samplesize;
+    struct vox_box box;
+    vox_dot center;
+
+    for (i=clo[0]; i<chi[0]; i++)
+        for (j=clo[1]; j<chi[1]; j++)
+            for (k=clo[2]; k<chi[2]; k++) count += *cell_count (brick, i, j, k);
+    if (count == 0) return NULL;
+
+    for (i=0; i<3; i++)
+    {
+        lo[i] = brick->lo[i] + clo[i]*CELL_SIDE;
+        hi[i] = brick->lo[i] + chi[i]*CELL_SIDE;
+        if (hi[i] > brick->hi[i]) hi[i] = brick->hi[i];
+        samples *= hi[i] - lo[i];
+    }
+
+    if (count == samples)
+    {
+        vox_dot_set (box.min, lo[0]*vox_voxel[0], lo[1]*vox_voxel[1], lo[2]*vox_voxel[2]);
+        vox_dot_set (box.max, hi[0]*vox_voxel[0], hi[1]*vox_voxel[1], hi[2]*vox_voxel[2]);
+        return make_dense_leaf (brick->arena, &box);
+    }
+
+    if (chi[0] - clo[0] == 1 && chi[1] - clo[1] == 1 && chi[2] - clo[2] == 1)
+    {
+        for (i=lo[0]; i<hi[0]; i++)
+            for (j=lo[1]; j<hi[1]; j++)
+                n += scan_row (volume->data + (i*(size_t)volume->dim[1] + j)*row_size +
+                               lo[2]*volume->samplesize,
+                               hi[2]-lo[2], volume->samplesize, &(volume->test), i, j, lo[2],
+                               brick->buffer + n);
+        return make_tree (brick->arena, brick->buffer, n);
+    }
+
+    // Divide cells like read_part() divides samples
+    for (i=0; i<3; i++) cmid[i] = clo[i] + (chi[i]-clo[i]+1)/2;
+    vox_dot_set (center,
+                 (brick->lo[0] + cmid[0]*CELL_SIDE)*vox_voxel[0],
+                 (brick->lo[1] + cmid[1]*CELL_SIDE)*vox_voxel[1],
+                 (brick->lo[2] + cmid[2]*CELL_SIDE)*vox_voxel[2]);
+    for (idx=0; idx<VOX_NS; idx++)
+    {
+        for (i=0; i<3; i++)
+        {
+            child_lo[i] = (idx & (1<<i)) ? clo[i] : cmid[i];
+            child_hi[i] = (idx & (1<<i)) ? cmid[i] : chi[i];
+        }
+        children[idx] = (child_lo[0] < child_hi[0] && child_lo[1] < child_hi[1] &&
+                         child_lo[2] < child_hi[2]) ?
+            read_cells (brick, child_lo, child_hi) : NULL;
+    }
+    return join_trees (center, children);
+}
+
+static struct vox_node* read_brick (struct volume *volume, const unsigned int lo[],
+                                    const unsigned int hi[])
+{
     struct vox_node *tree = NULL;
-    int fd = open (filename, O_RDONLY);
-    if (fd == -1) {
-        SETSYSERROR();
+    struct brick brick;
+    unsigned int clo[3] = {0, 0, 0};
+    int i;
+
+    if (volume->test.block != NULL) return read_brick_voxels (volume, lo, hi);
+
+    brick.volume = volume;
+    for (i=0; i<3; i++)
+    {
+        brick.lo[i] = lo[i];
+        brick.hi[i] = hi[i];
+        brick.cells[i] = (hi[i] - lo[i] + CELL_SIDE - 1) / CELL_SIDE;
+    }
+    brick.counts = calloc ((size_t)brick.cells[0]*brick.cells[1]*brick.cells[2],
+                           sizeof (unsigned int));
+    brick.buffer = vox_alloc (CELL_SIDE*CELL_SIDE*CELL_SIDE*sizeof (vox_dot));
+    brick.arena = arena_new ();
+    if (brick.counts == NULL || brick.buffer == NULL || brick.arena == NULL)
+    {
+        volume->failed = 1;
+        if (brick.arena != NULL) arena_destroy (brick.arena);
         goto done;
     }
-    vox_dot *array;
 
-#define BUFSIZE 4096
-    unsigned char buf[BUFSIZE];
-    ssize_t end = 0;
-    ssize_t pos = 0;
+    count_cells (&brick);
+    tree = read_cells (&brick, clo, brick.cells);
+    if (!(VOX_FULLP (tree))) arena_destroy (brick.arena);
+
+done:
+    free (brick.counts);
+    free (brick.buffer);
+    return tree;
+}
 
-    unsigned int i,j,k,l,n = dim[0]*dim[1]*dim[2];
-    size_t counter = 0;
-    unsigned int value;
+/*
+  Make a tree of samples from lo to hi (hi is not included). Big parts of
+  the volume are divided at the middle into 8 parts, whose trees are joined.
+  Voxels with coordinates less than the middle go to the subspace with the
+  corresponding bit set, like in any other inner node.
+*/
+static struct vox_node* read_part (struct volume *volume, const unsigned int lo[],
+                                   const unsigned int hi[])
+{
+    struct vox_node *children[VOX_NS];
+    struct vox_node **children_ptr = children;
+    unsigned int mid_array[3];
+    unsigned int *mid = mid_array;
+    vox_dot center;
+    int i;
 
+    if ((size_t)(hi[0]-lo[0])*(hi[1]-lo[1])*(hi[2]-lo[2]) <= VOX_READER_BRICK_SAMPLES)
+        return read_brick (volume, lo, hi);
+
+    for (i=0; i<3; i++) mid[i] = lo[i] + (hi[i]-lo[i]+1)/2;
+    vox_dot_set (center, mid[0]*vox_voxel[0], mid[1]*vox_voxel[1], mid[2]*vox_voxel[2]);
+
+    void (^read_child)(size_t) = ^(size_t idx) {
+        unsigned int child_lo[3], child_hi[3];
+        int d;
+        for (d=0; d<3; d++)
+        {
+            child_lo[d] = (idx & (1<<d)) ? lo[d] : mid[d];
+            child_hi[d] = (idx & (1<<d)) ? mid[d] : hi[d];
+        }
+        children_ptr[idx] = (child_lo[0] < child_hi[0] && child_lo[1] < child_hi[1] &&
+                             child_lo[2] < child_hi[2]) ?
+            read_part (volume, child_lo, child_hi) : NULL;
+    };
+
+    if (volume->parallel)
+        dispatch_apply (VOX_NS, dispatch_get_global_queue (DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+                        read_child);
+    else for (i=0; i<VOX_NS; i++) read_child (i);
+
+    return join_trees (center, children);
+}
+
+unsigned char* map_raw_data (const char *filename, const unsigned int dim[],
+                             unsigned int samplesize, const char **error)
+{
+    size_t size = (size_t)dim[0]*dim[1]*dim[2]*samplesize;
+    unsigned char *data;
     struct stat sb;
-    if (fstat (fd, &sb) == -1) {
+    int fd;
+
+    fd = open (filename, O_RDONLY);
+    if (fd == -1)
+    {
+        SETSYSERROR();
+        return NULL;
+    }
+    if (fstat (fd, &sb) == -1)
+    {
         SETSYSERROR();
-        goto closefd;
+        close (fd);
+        return NULL;
     }
-    if (n*samplesize != sb.st_size) {
+    if (size == 0 || size != (size_t)sb.st_size)
+    {
         SETERROR ("Wrong size of dataset");
-        goto closefd;
+        close (fd);
+        return NULL;
     }
 
-    array = vox_alloc (n*sizeof(vox_dot));
-    if (array == NULL) {
+    data = mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (data == MAP_FAILED)
+    {
         SETSYSERROR();
-        goto freemem;
-    }
-
-    for (i=0; i<dim[0]; i++) {
-        for (j=0; j<dim[1]; j++) {
-            for (k=0; k<dim[2]; k++) {
-                value = 0;
-                for (l=0; l<samplesize; l++) {
-                    if (pos==end) {
-                        ssize_t res = read (fd, buf, BUFSIZE);
-                        if (res <= 0) {
-                            SETSYSERROR();
-                            goto freemem;
-                        }
-                        end = res;
-                        pos = 0;
-                    }
-                    value |= buf[pos] << (8*l);
-                    pos++;
-                }
-                if (test (value)) {
-                    array[counter][0] = i*vox_voxel[0];
-                    array[counter][1] = j*vox_voxel[1];
-                    array[counter][2] = k*vox_voxel[2];
-                    counter++;
-                }
-            }
-        }
+        return NULL;
     }
-    tree = vox_make_tree (array, counter);
+    return data;
+}
+
+static struct vox_node* read_volume (const char *filename, unsigned int dim[],
+                                     unsigned int samplesize, struct sample_test test,
+                                     int parallel, const char **error)
+{
+    struct vox_node *tree;
+    struct volume volume;
+    unsigned int lo[3] = {0, 0, 0};
+    size_t size = (size_t)dim[0]*dim[1]*dim[2]*samplesize;
+    unsigned char *data;
+
+    // Number of voxels in a node must fit into dots_num
+    if ((size_t)dim[0]*dim[1]*dim[2] > UINT_MAX)
+    {
+        SETERROR ("Dataset is too big");
+        return NULL;
+    }
+
+    data = map_raw_data (filename, dim, samplesize, error);
+    if (data == NULL) return NULL;
+    /*
+      Bricks are read by many threads at once, so ask the kernel to read
+      ahead the whole file. In serial case bricks are still visited out of
+      file order (the volume is split along every axis), and neighbouring
+      bricks share pages, so keep the default read-ahead and do not let the
+      kernel drop pages early.
+    */
+    madvise (data, size, parallel ? MADV_WILLNEED : MADV_NORMAL);
+
+    volume.data = data;
+    memcpy (volume.dim, dim, sizeof (volume.dim));
+    volume.samplesize = samplesize;
+    volume.test = test;
+    volume.parallel = parallel;
+    volume.failed = 0;
+    tree = read_part (&volume, lo, dim);
+    munmap (data, size);
+
+    if (volume.failed)
+    {
+        SETERROR ("Not enough memory");
+        vox_destroy_tree (tree);
+        tree = NULL;
+    }
+    else if (tree == NULL) SETERROR ("No solid voxels in dataset");
 
-freemem:
-    free (array);
-closefd:
-    close (fd);
-done:
     return tree;
 }
 
+struct vox_node* vox_read_raw_data (const char *filename, unsigned int dim[],
+                                    unsigned int samplesize, int (^test)(unsigned int sample),
+                                    const char **error)
+{
+    struct sample_test sample_test;
+
+    if (samplesize < 1 || samplesize > 4)
+    {
+        SETERROR ("Wrong sample size");
+        return NULL;
+    }
+
+    // The test block can be not thread-safe
+    sample_test.min = 0;
+    sample_test.max = 0;
+    sample_test.lut = NULL;
+    sample_test.block = test;
+    return read_volume (filename, dim, samplesize, sample_test, 0, error);
+}
+
+struct vox_node* vox_read_raw_data_range (const char *filename, unsigned int dim[],
+                                          unsigned int samplesize,
+                                          unsigned int min, unsigned int max,
+                                          const char **error)
+{
+    struct sample_test test;
+
+    if (samplesize < 1 || samplesize > 4)
+    {
+        SETERROR ("Wrong sample size");
+        return NULL;
+    }
+
+    if (samplesize < 4 && max >= 1U << 8*samplesize) max = (1U << 8*samplesize) - 1;
+    if (min > max)
+    {
+        SETERROR ("No solid voxels in dataset");
+        return NULL;
+    }
+
+    test.min = min;
+    test.max = max;
+    test.lut = NULL;
+    test.block = NULL;
+    return read_volume (filename, dim, samplesize, test, 1, error);
+}
+
+struct vox_node* vox_read_raw_data_lut (const char *filename, unsigned int dim[],
+                                        unsigned int samplesize, const unsigned char lut[],
+                                        const char **error)
+{
+    struct sample_test test;
+
+    if (samplesize < 1 || samplesize > 2)
+    {
+        SETERROR ("Wrong sample size");
+        return NULL;
+    }
+
+    test.min = 0;
+    test.max = 0;
+    test.lut = lut;
+    test.block = NULL;
+    return read_volume (filename, dim, samplesize, test, 1, error);
+}
+
 static int check_file (const char* filename)
 {
     struct stat sb;
@@ -21,6 +21,12 @@
 
    FIXME: The array of samples is stored on disk in row-major order.
 
+   The file is mapped to memory and read in bricks of at most
+   VOX_READER_BRICK_SAMPLES samples. A tree is built for each brick and
+   these trees are joined together, so memory is needed only for voxels of
+   one brick besides the resulting tree. The test block is called from one
+   thread.
+
    \param filename a name of data file.
    \param dim array dimensions.
    \param samplesize size of a sample in bytes
@@ -37,6 +43,64 @@ VOX_EXPORT struct vox_node* vox_read_raw_data (const char *filename, unsigned in
                                                int (^test)(unsigned int sample),
                                                const char **error);
 
+/**
+   \brief Build a tree from raw density file, using a range of solid samples.
+
+   This is like vox_read_raw_data() with test function which checks that
+   min <= sample <= max, but much faster. The file is mapped to memory and
+   scanned by all available CPU cores (if voxtrees is built with GCD
+   support). Samples of 1, 2 and 4 bytes are compared with the range with
+   SSE instructions.
+
+   \param filename a name of data file.
+   \param dim array dimensions.
+   \param samplesize size of a sample in bytes (from 1 to 4)
+   \param min minimal value of a solid sample
+   \param max maximal value of a solid sample
+   \param error pointer to error string.
+
+   \return A newly created tree or NULL in case of error or if there are no
+   solid samples. In this case, error will be set to an internal static
+   string, describing the error.
+**/
+VOX_EXPORT struct vox_node* vox_read_raw_data_range (const char *filename, unsigned int dim[],
+                                                     unsigned int samplesize,
+                                                     unsigned int min, unsigned int max,
+                                                     const char **error);
+
+/**
+   \brief Build a tree from raw density file, using a lookup table.
+
+   This is like vox_read_raw_data() with test function which returns
+   lut[sample], but much faster. It works only for 1 and 2 byte samples.
+   The file is read in parallel, like in vox_read_raw_data_range().
+
+   \param filename a name of data file.
+   \param dim array dimensions.
+   \param samplesize size of a sample in bytes (1 or 2)
+   \param lut lookup table with 256 (for 1 byte samples) or 65536 (for 2 byte
+          samples) entries. Non-zero entries correspond to solid samples.
+   \param error pointer to error string.
+
+   \return A newly created tree or NULL in case of error or if there are no
+   solid samples. In this case, error will be set to an internal static
+   string, describing the error.
+**/
+VOX_EXPORT struct vox_node* vox_read_raw_data_lut (const char *filename, unsigned int dim[],
+                                                   unsigned int samplesize,
+                                                   const unsigned char lut[],
+                                                   const char **error);
+
+#ifdef VOXTREES_SOURCE
+/*
+  Map a raw data file of dim[0]*dim[1]*dim[2] samples to memory (read
+  only). Return NULL and set error if the file cannot be mapped or has a
+  wrong size.
+*/
+unsigned char* map_raw_data (const char *filename, const unsigned int dim[],
+                             unsigned int samplesize, const char **error);
+#endif
+
 /**
    \brief Find a full path of a data file.
 
@@ -0,0 +1,333 @@
+#ifdef USE_GCD
+#include <dispatch/dispatch.h>
+#else
+#include "../gcd-stubs.c"
+#endif
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "geom.h"
+#include "datareader.h"
+#include "density.h"
+
+#define SETERROR(x) if (error != NULL) *error = (x)
+
+static uint32_t read_sample (const unsigned char *data, unsigned int samplesize)
+{
+    uint32_t value = 0;
+    unsigned int l;
+
+    for (l=0; l<samplesize; l++) value |= (uint32_t)data[l] << (8*l);
+    return value;
+}
+
+static size_t density_size (const struct vox_density_tree *tree)
+{
+    return (size_t)tree->dim[0]*tree->dim[1]*tree->dim[2]*tree->samplesize;
+}
+
+static struct vox_density_range* node_range (const struct vox_density_tree *tree,
+                                             unsigned int level, const unsigned int node[])
+{
+    const unsigned int *ldim = tree->ldim[level];
+    return tree->ranges[level] + ((size_t)node[0]*ldim[1] + node[1])*ldim[2] + node[2];
+}
+
+/*
+  Compute ranges of level 0 nodes with first index bi. Each row of samples
+  is split between DENSITY_BLOCK nodes.
+*/
+static void fill_bottom_level (struct vox_density_tree *tree, unsigned int bi)
+{
+    const unsigned int *dim = tree->dim;
+    unsigned int samplesize = tree->samplesize;
+    unsigned int node[3] = {bi, 0, 0};
+    unsigned int i, j, k, ihi;
+    struct vox_density_range *range = NULL;
+    const unsigned char *row;
+    uint32_t value;
+
+    for (node[1]=0; node[1]<tree->ldim[0][1]; node[1]++)
+        for (node[2]=0; node[2]<tree->ldim[0][2]; node[2]++)
+        {
+            range = node_range (tree, 0, node);
+            range->min = UINT32_MAX;
+            range->max = 0;
+        }
+
+    ihi = (bi+1)*DENSITY_BLOCK;
+    if (ihi > dim[0]) ihi = dim[0];
+    for (i=bi*DENSITY_BLOCK; i<ihi; i++)
+        for (j=0; j<dim[1]; j++)
+        {
+            node[1] = j / DENSITY_BLOCK;
+            row = tree->data + ((size_t)i*dim[1] + j)*dim[2]*samplesize;
+            for (k=0; k<dim[2]; k++)
+            {
+                if (k % DENSITY_BLOCK == 0)
+                {
+                    node[2] = k / DENSITY_BLOCK;
+                    range = node_range (tree, 0, node);
+                }
+                value = read_sample (row + k*samplesize, samplesize);
+                if (value < range->min) range->min = value;
+                if (value > range->max) range->max = value;
+            }
+        }
+}
+
+static void fill_level (struct vox_density_tree *tree, unsigned int level)
+{
+    unsigned int node[3], child[3];
+    struct vox_density_range *range, *child_range;
+    int idx, i;
+
+    for (node[0]=0; node[0]<tree->ldim[level][0]; node[0]++)
+        for (node[1]=0; node[1]<tree->ldim[level][1]; node[1]++)
+            for (node[2]=0; node[2]<tree->ldim[level][2]; node[2]++)
+            {
+                range = node_range (tree, level, node);
+                range->min = UINT32_MAX;
+                range->max = 0;
+                for (idx=0; idx<VOX_NS; idx++)
+                {
+                    for (i=0; i<3; i++) child[i] = 2*node[i] + ((idx >> i) & 1);
+                    if (child[0] >= tree->ldim[level-1][0] ||
+                        child[1] >= tree->ldim[level-1][1] ||
+                        child[2] >= tree->ldim[level-1][2]) continue;
+                    child_range = node_range (tree, level-1, child);
+                    if (child_range->min < range->min) range->min = child_range->min;
+                    if (child_range->max > range->max) range->max = child_range->max;
+                }
+            }
+}
+
+struct vox_density_tree* vox_read_density_data (const char *filename,
+                                                const unsigned int dim[],
+                                                unsigned int samplesize,
+                                                const char **error)
+{
+    struct vox_density_tree *tree;
+    unsigned int level, i, more;
+    size_t count;
+
+    if (samplesize < 1 || samplesize > 4)
+    {
+        SETERROR ("Wrong sample size");
+        return NULL;
+    }
+
+    tree = malloc (sizeof (struct vox_density_tree));
+    if (tree == NULL)
+    {
+        SETERROR ("Not enough memory");
+        return NULL;
+    }
+    memset (tree, 0, sizeof (struct vox_density_tree));
+    memcpy (tree->dim, dim, sizeof (tree->dim));
+    tree->samplesize = samplesize;
+    tree->data = map_raw_data (filename, dim, samplesize, error);
+    if (tree->data == NULL)
+    {
+        free (tree);
+        return NULL;
+    }
+    madvise (tree->data, density_size (tree), MADV_WILLNEED);
+
+    for (i=0; i<3; i++) tree->ldim[0][i] = (dim[i] + DENSITY_BLOCK - 1) / DENSITY_BLOCK;
+    level = 0;
+    do
+    {
+        count = (size_t)tree->ldim[level][0]*tree->ldim[level][1]*tree->ldim[level][2];
+        tree->ranges[level] = malloc (count * sizeof (struct vox_density_range));
+        if (tree->ranges[level] == NULL)
+        {
+            tree->levels = level;
+            vox_destroy_density_tree (tree);
+            SETERROR ("Not enough memory");
+            return NULL;
+        }
+        more = 0;
+        for (i=0; i<3; i++)
+        {
+            tree->ldim[level+1][i] = (tree->ldim[level][i] + 1) / 2;
+            more |= tree->ldim[level][i] > 1;
+        }
+        level++;
+    } while (more);
+    tree->levels = level;
+
+    dispatch_apply (tree->ldim[0][0], dispatch_get_global_queue (DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+                    ^(size_t bi) {
+                        fill_bottom_level (tree, bi);
+                    });
+    for (level=1; level<tree->levels; level++) fill_level (tree, level);
+
+    return tree;
+}
+
+void vox_destroy_density_tree (struct vox_density_tree *tree)
+{
+    unsigned int level;
+
+    for (level=0; level<tree->levels; level++) free (tree->ranges[level]);
+    munmap (tree->data, density_size (tree));
+    free (tree);
+}
+
+void vox_density_tree_range (const struct vox_density_tree *tree,
+                             unsigned int *min, unsigned int *max)
+{
+    const struct vox_density_range *range = tree->ranges[tree->levels-1];
+
+    *min = range->min;
+    *max = range->max;
+}
+
+void vox_density_tree_bounding_box (const struct vox_density_tree *tree,
+                                    struct vox_box *box)
+{
+    vox_dot_set (box->min, 0, 0, 0);
+    vox_dot_set (box->max,
+                 tree->dim[0]*vox_voxel[0],
+                 tree->dim[1]*vox_voxel[1],
+                 tree->dim[2]*vox_voxel[2]);
+}
+
+struct density_ray
+{
+    vox_dot origin;
+    struct vox_ray line;
+    uint32_t min, max;
+};
+
+/*
+  Walk through samples from lo to hi (exclusive) with 3D DDA starting from
+  entry (which is on the bounding box of these samples or inside it) and
+  stop at the first solid sample. This is like brick_intersection() in
+  search.c.
+*/
+static int block_intersection (const struct vox_density_tree *tree,
+                               const struct density_ray *ray,
+                               const unsigned int lo[], const unsigned int hi[],
+                               const vox_dot entry, vox_dot res)
+{
+    int cell[VOX_N], step[VOX_N], axis = -1;
+    float next[VOX_N], delta[VOX_N], t = 0;
+    uint32_t value;
+    unsigned int i;
+
+    for (i=0; i<VOX_N; i++)
+    {
+        float pos = entry[i] / vox_voxel[i];
+        if (ray->line.dir[i] < 0)
+        {
+            cell[i] = ceilf (pos) - 1;
+            step[i] = -1;
+        }
+        else
+        {
+            cell[i] = floorf (pos);
+            step[i] = 1;
+        }
+        // Rounding errors can put the entry point slightly outside
+        if (cell[i] < (int)lo[i]) cell[i] = lo[i];
+        if (cell[i] >= (int)hi[i]) cell[i] = hi[i] - 1;
+
+        if (ray->line.dir[i] == 0)
+        {
+            next[i] = INFINITY;
+            delta[i] = INFINITY;
+        }
+        else
+        {
+            next[i] = ((cell[i] + (step[i] > 0)) * vox_voxel[i] - entry[i]) *
+                ray->line.inv_dir[i];
+            delta[i] = vox_voxel[i] * fabsf (ray->line.inv_dir[i]);
+        }
+    }
+
+    while (1)
+    {
+        value = read_sample (tree->data +
+                             (((size_t)cell[0]*tree->dim[1] + cell[1])*tree->dim[2] + cell[2]) *
+                             tree->samplesize, tree->samplesize);
+        if (value >= ray->min && value <= ray->max)
+        {
+            vox_dot_copy (res, entry);
+            for (i=0; i<VOX_N; i++) res[i] += t*ray->line.dir[i];
+            // Put the entry point exactly on the face of the voxel
+            if (axis >= 0)
+                res[axis] = (cell[axis] + (step[axis] < 0)) * vox_voxel[axis];
+            return 1;
+        }
+
+        axis = (next[0] < next[1]) ? 0 : 1;
+        axis = (next[2] < next[axis]) ? 2 : axis;
+        cell[axis] += step[axis];
+        if (next[axis] == INFINITY ||
+            cell[axis] < (int)lo[axis] || cell[axis] >= (int)hi[axis]) return 0;
+        t = next[axis];
+        next[axis] += delta[axis];
+    }
+}
+
+static int node_intersection (const struct vox_density_tree *tree,
+                              const struct density_ray *ray,
+                              unsigned int level, const unsigned int node[], vox_dot res)
+{
+    const struct vox_density_range *range = node_range (tree, level, node);
+    unsigned int lo[3], hi[3], child[3];
+    struct vox_box box;
+    vox_dot entry;
+    int n, idx, i;
+
+    // Empty space skipping
+    if (range->max < ray->min || range->min > ray->max) return 0;
+
+    for (i=0; i<3; i++)
+    {
+        lo[i] = node[i] * (DENSITY_BLOCK << level);
+        hi[i] = lo[i] + (DENSITY_BLOCK << level);
+        if (hi[i] > tree->dim[i]) hi[i] = tree->dim[i];
+    }
+    vox_dot_set (box.min, lo[0]*vox_voxel[0], lo[1]*vox_voxel[1], lo[2]*vox_voxel[2]);
+    vox_dot_set (box.max, hi[0]*vox_voxel[0], hi[1]*vox_voxel[1], hi[2]*vox_voxel[2]);
+    if (!(hit_box (&box, ray->origin, &(ray->line), entry))) return 0;
+
+    if (level == 0) return block_intersection (tree, ray, lo, hi, entry, res);
+
+    /*
+      A ray can go from child a to child b only if b is farther along all
+      axes where they differ, so children visited in this order are visited
+      front to back.
+    */
+    for (n=0; n<VOX_NS; n++)
+    {
+        idx = n ^ ray->line.mask;
+        for (i=0; i<3; i++) child[i] = 2*node[i] + ((idx >> i) & 1);
+        if (child[0] >= tree->ldim[level-1][0] ||
+            child[1] >= tree->ldim[level-1][1] ||
+            child[2] >= tree->ldim[level-1][2]) continue;
+        if (node_intersection (tree, ray, level-1, child, res)) return 1;
+    }
+    return 0;
+}
+
+int vox_ray_density_intersection (const struct vox_density_tree *tree,
+                                  unsigned int min, unsigned int max,
+                                  const vox_dot origin, const vox_dot dir,
+                                  vox_dot res)
+{
+    unsigned int root[3] = {0, 0, 0};
+    struct density_ray ray;
+
+    vox_dot_copy (ray.origin, origin);
+    make_ray (&(ray.line), dir);
+    ray.min = min;
+    ray.max = max;
+
+    return node_intersection (tree, &ray, tree->levels-1, root, res);
+}
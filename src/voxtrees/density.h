@@ -0,0 +1,107 @@
+/**
+   @file density.h
+   @brief Density trees
+
+   A density tree keeps all samples of a raw density file together with
+   minimal and maximal values of samples in each octree node. Unlike a
+   tree built by vox_read_raw_data(), it does not decide which samples are
+   solid when it is built: a range of solid values is passed to each search
+   instead, so it can be changed at any moment without reading the data
+   again.
+**/
+#ifndef __DENSITY_H_
+#define __DENSITY_H_
+
+#include <stdint.h>
+#include "params.h"
+
+#ifdef VOXTREES_SOURCE
+#define DENSITY_BLOCK 8 /* Samples along each side of a bottom level node */
+
+struct vox_density_range
+{
+    uint32_t min, max;
+};
+
+struct vox_density_tree
+{
+    unsigned char *data; // Samples, mapped from the file
+    unsigned int dim[3];
+    unsigned int samplesize;
+    unsigned int levels;
+    /*
+      Level 0 nodes cover DENSITY_BLOCK^3 samples, each node of level l+1
+      covers 8 nodes of level l. The last level has only one node.
+    */
+    unsigned int ldim[32][3];
+    struct vox_density_range *ranges[32];
+};
+#else
+struct vox_density_tree;
+#endif
+
+/**
+   \brief Build a density tree from raw density file.
+
+   The file has the same format as in vox_read_raw_data(). It is mapped to
+   memory and stays mapped until the tree is destroyed. Minimal and maximal
+   values of samples are computed in parallel (if voxtrees is built with
+   GCD support).
+
+   \param filename a name of data file.
+   \param dim array dimensions.
+   \param samplesize size of a sample in bytes (from 1 to 4)
+   \param error pointer to error string.
+
+   \return A newly created density tree or NULL in case of error. In the
+   latter case, error will be set to an internal static string, describing
+   the error.
+**/
+VOX_EXPORT struct vox_density_tree* vox_read_density_data (const char *filename,
+                                                           const unsigned int dim[],
+                                                           unsigned int samplesize,
+                                                           const char **error);
+
+/**
+   \brief Destroy a density tree.
+**/
+VOX_EXPORT void vox_destroy_density_tree (struct vox_density_tree *tree);
+
+/**
+   \brief Get minimal and maximal values of samples in a density tree.
+**/
+VOX_EXPORT void vox_density_tree_range (const struct vox_density_tree *tree,
+                                        unsigned int *min, unsigned int *max);
+
+/**
+   \brief Make a bounding box of a density tree.
+
+   Sample (i, j, k) is a voxel with minimal corner (i*vox_voxel[0],
+   j*vox_voxel[1], k*vox_voxel[2]), like in vox_read_raw_data().
+**/
+VOX_EXPORT void vox_density_tree_bounding_box (const struct vox_density_tree *tree,
+                                               struct vox_box *box);
+
+/**
+   \brief Find intersection of a ray and solid samples of a density tree.
+
+   Samples with values from min to max (inclusive) are solid. Nodes which
+   have no samples in this range are skipped as a whole. Unlike
+   vox_ray_tree_intersection(), a ray which only touches an edge of a solid
+   voxel may miss it.
+
+   \param tree a density tree
+   \param min minimal value of a solid sample
+   \param max maximal value of a solid sample
+   \param origin starting point of the ray
+   \param dir direction of the ray
+   \param res where the intersection is stored
+
+   \return 1 if the intersection is found, 0 otherwise.
+**/
+VOX_EXPORT int vox_ray_density_intersection (const struct vox_density_tree *tree,
+                                             unsigned int min, unsigned int max,
+                                             const vox_dot origin, const vox_dot dir,
+                                             vox_dot res);
+
+#endif
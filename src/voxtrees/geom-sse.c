@@ -81,7 +81,17 @@ int get_corrected_subspace_idx (const vox_dot center, const vox_dot dot, const v
     return mask_bits_set (idx);
 }
 
-int hit_box (const struct vox_box *box, const vox_dot origin, const vox_dot dir, vox_dot res)
+void make_ray (struct vox_ray *ray, const vox_dot dir)
+{
+    __v4sf d = _mm_load_ps (dir);
+    __v4sf zero = _mm_set_ps1 (0);
+    _mm_store_ps (ray->dir, d);
+    _mm_store_ps (ray->inv_dir, _mm_blendv_ps (_mm_set_ps1 (1) / d, zero, d == zero));
+    ray->mask = mask_bits_set (d < zero);
+}
+
+int hit_box (const struct vox_box *box, const vox_dot origin, const struct vox_ray *ray,
+             vox_dot res)
 {
     __v4sf o = _mm_load_ps (origin);
     __v4sf fit = fit_into_box (box, o);
@@ -91,11 +101,10 @@ int hit_box (const struct vox_box *box, const vox_dot origin, const vox_dot dir,
         _mm_store_ps (res, o);
         return 1;
     }
-    __v4sf d = _mm_load_ps (dir);
-    __v4sf mask = d == _mm_set_ps1(0);
+    __v4sf d = _mm_load_ps (ray->dir);
 
-    // Replace infinities (they can appear if d == 0) with zeros
-    __v4sf dist = _mm_blendv_ps (sub / d, _mm_set_ps1(0), mask);
+    // inv_dir is zero if d == 0, so there are no infinities here
+    __v4sf dist = sub * _mm_load_ps (ray->inv_dir);
 
     // Find the maximum distance
     __v4sf max1 = _mm_shuffle_ps (dist, dist, _MM_SHUFFLE (3, 1, 0, 2));
@@ -115,7 +124,7 @@ int hit_box (const struct vox_box *box, const vox_dot origin, const vox_dot dir,
     return 1;
 }
 
-int hit_plane_within_box (const vox_dot origin, const vox_dot dir, const vox_dot planedot,
+int hit_plane_within_box (const vox_dot origin, const struct vox_ray *ray, const vox_dot planedot,
                           int planenum, vox_dot res, const struct vox_box *box)
 {
     float k;
@@ -123,14 +132,15 @@ int hit_plane_within_box (const vox_dot origin, const vox_dot dir, const vox_dot
     /*
       k == 0 means that origin lays on the plane.
       This is a special case which is not handeled here.
-      Just return that there is no intersection.
+      Just return that there is no intersection. A ray parallel to the plane
+      (with zero inv_dir) does not intersect it either.
     */
-    if ((k == 0) ||
-        (dir[planenum] < 0) != (k < 0)) return 0;
-    k = k / dir[planenum];
+    if ((k == 0) || (ray->inv_dir[planenum] == 0) ||
+        ((ray->mask >> planenum) & 1) != (k < 0)) return 0;
+    k = k * ray->inv_dir[planenum];
 
     __v4sf o = _mm_load_ps (origin);
-    __v4sf d = _mm_load_ps (dir);
+    __v4sf d = _mm_load_ps (ray->dir);
     __v4sf kv = _mm_set_ps1 (k);
     __v4sf r = kv*d + o;
     __v4sf lt = r < _mm_load_ps (box->min);
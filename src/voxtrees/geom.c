@@ -66,7 +66,8 @@ int get_corrected_subspace_idx (const vox_dot center, const vox_dot dot, const v
 
 // Most of the following code is taken from C Graphics Gems
 // See C Graphics Gems code for explanation
-int hit_box (const struct vox_box *box, const vox_dot origin, const vox_dot dir, vox_dot res)
+int hit_box (const struct vox_box *box, const vox_dot origin, const struct vox_ray *ray,
+             vox_dot res)
 {
     float max_dist, tmp;
     int i, plane_num;
@@ -76,7 +77,7 @@ int hit_box (const struct vox_box *box, const vox_dot origin, const vox_dot dir,
     max_dist = -1;
     for (i=0; i<VOX_N; i++)
     {
-        tmp = (res[i] - origin[i])/dir[i];
+        tmp = (res[i] - origin[i]) * ray->inv_dir[i];
         if (tmp > max_dist)
         {
             plane_num = i;
@@ -89,7 +90,7 @@ int hit_box (const struct vox_box *box, const vox_dot origin, const vox_dot dir,
     {
         if (i != plane_num)
         {
-            tmp = origin[i] + max_dist*dir[i];
+            tmp = origin[i] + max_dist*ray->dir[i];
             if ((tmp < box->min[i]) || (tmp > box->max[i])) return 0;
             res[i] = tmp;
         }
@@ -98,7 +99,7 @@ int hit_box (const struct vox_box *box, const vox_dot origin, const vox_dot dir,
     return 1;
 }
 
-int hit_plane_within_box (const vox_dot origin, const vox_dot dir, const vox_dot planedot,
+int hit_plane_within_box (const vox_dot origin, const struct vox_ray *ray, const vox_dot planedot,
                           int planenum, vox_dot res, const struct vox_box *box)
 {
     int i;
@@ -107,16 +108,17 @@ int hit_plane_within_box (const vox_dot origin, const vox_dot dir, const vox_dot
     /*
       k == 0 means that origin lays on the plane.
       This is a special case which is not handeled here.
-      Just return that there is no intersection.
+      Just return that there is no intersection. A ray parallel to the plane
+      (with zero inv_dir) does not intersect it either.
     */
-    if ((k == 0) ||
-        (dir[planenum] < 0) != (k < 0)) return 0;
+    if ((k == 0) || (ray->inv_dir[planenum] == 0) ||
+        ((ray->mask >> planenum) & 1) != (k < 0)) return 0;
 
-    k = k / dir[planenum];
+    k = k * ray->inv_dir[planenum];
 
     for (i=0; i<VOX_N; i++)
     {
-        res[i] = origin[i] + k*dir[i];
+        res[i] = origin[i] + k*ray->dir[i];
         if ((res[i] < box->min[i]) || (res[i] > box->max[i])) return 0;
     }
     return 1;
@@ -146,6 +148,19 @@ float vox_sqr_norm (const vox_dot dot)
     return res;
 }
 
+void make_ray (struct vox_ray *ray, const vox_dot dir)
+{
+    int i;
+
+    vox_dot_copy (ray->dir, dir);
+    ray->mask = 0;
+    for (i=0; i<VOX_N; i++)
+    {
+        ray->inv_dir[i] = (dir[i] == 0) ? 0 : 1 / dir[i];
+        ray->mask |= (dir[i] < 0) << i;
+    }
+}
+
 int box_ball_interp (const struct vox_box *box, const vox_dot center, float radius)
 {
     vox_dot fitted;
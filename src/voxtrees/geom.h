@@ -72,6 +72,36 @@ VOX_EXPORT float vox_sqr_metric (const vox_dot dot1, const vox_dot dot2);
 **/
 VOX_EXPORT float vox_sqr_norm (const vox_dot dot);
 
+/**
+   \brief Instruction sets which geometry kernels can use.
+**/
+enum vox_isa
+{
+    VOX_ISA_GENERIC, /**< \brief Plain C (the library is built without SSE_INTRIN) */
+    VOX_ISA_SSE,     /**< \brief SSE4.1 */
+    VOX_ISA_AVX2,    /**< \brief AVX2 */
+    VOX_ISA_AVX512   /**< \brief AVX-512F */
+};
+
+/**
+   \brief Choose an instruction set for geometry kernels.
+
+   When the library is loaded, it chooses the widest instruction set
+   supported by the CPU. This function can be used to switch to another one
+   (e.g. for benchmarking). Results of all library functions do not depend on
+   the instruction set. Do not call it while trees are built or searched in
+   other threads.
+
+   \return 1 on success, 0 if the instruction set is not supported by the CPU
+   or by this build of the library.
+**/
+VOX_EXPORT int vox_use_isa (enum vox_isa isa);
+
+/**
+   \brief Instruction set used by geometry kernels.
+**/
+VOX_EXPORT enum vox_isa vox_current_isa ();
+
 #ifdef VOXTREES_SOURCE
 
 /**
@@ -94,16 +124,31 @@ VOX_EXPORT int get_subspace_idx (const vox_dot center, const vox_dot dot); // KL
 int get_corrected_subspace_idx (const vox_dot center, const vox_dot dot, const vox_dot direction);
 
 
+/*
+ * A ray direction with precomputed data for intersection tests. inv_dir[i]
+ * is 1/dir[i] or zero if dir[i] is zero, so the tests need no division. Bit
+ * i of mask is set if the ray goes in negative direction along axis i.
+ */
+struct vox_ray
+{
+    vox_dot dir;
+    vox_dot inv_dir;
+    int mask;
+};
+
+void make_ray (struct vox_ray *ray, const vox_dot dir);
+
 /**
    \brief Find intersection of a ray and an axis-aligned box.
    
    \param box a box to be checked
    \param origin a starting point of the ray
-   \param dir the direction
+   \param ray the direction
    \param res where intersection is stored
    \return 1 if intersection is found, 0 otherwise
 **/
-int hit_box (const struct vox_box *box, const vox_dot origin, const vox_dot dir, vox_dot res);
+int hit_box (const struct vox_box *box, const vox_dot origin, const struct vox_ray *ray,
+             vox_dot res);
 
 /**
    \brief Find intersection of a ray and a plane.
@@ -112,14 +157,14 @@ int hit_box (const struct vox_box *box, const vox_dot origin, const vox_dot dir,
    Plane must be axis-aligned.
    
    \param origin a starting point of the ray
-   \param dir the direction
+   \param ray the direction
    \param planedot a dot on the plane
    \param planenum an axis number the plane is aligned with
    \param res where intersection is stored
    \param box a box
    \return 1 if intersection is found, 0 otherwise
 **/
-int hit_plane_within_box (const vox_dot origin, const vox_dot dir, const vox_dot planedot,
+int hit_plane_within_box (const vox_dot origin, const struct vox_ray *ray, const vox_dot planedot,
                           int planenum, vox_dot res, const struct vox_box *box);
 
 /**
@@ -134,6 +179,30 @@ void closest_vertex (const struct vox_box *box, const vox_dot dot, vox_dot res);
 int divide_box (const struct vox_box *box, const vox_dot center, struct vox_box *res, int idx);
 void get_dimensions (const struct vox_box *box, size_t dim[]);
 int stripep (const struct vox_box *box, int *which);
+
+/*
+ * Kernels which process many voxels at once (see kernels.c). closest_on_ray
+ * returns the index of the voxel in a leaf with n voxels which the ray
+ * enters first (as found with hit_box() and vox_abs_metric()), or -1.
+ * voxels_near_ball is a quick test of voxels i to i+width-1 against a
+ * ball. It returns a mask with bit k set if voxel i+k may intersect the
+ * ball, so it must be checked by box_ball_interp().
+ */
+struct geom_kernels
+{
+    enum vox_isa isa;
+    unsigned int width;
+    void (*find_center) (const vox_dot set[], size_t n, const struct vox_box *box, vox_dot res);
+    void (*bounding_box) (const vox_dot set[], size_t n, struct vox_box *box);
+    int (*closest_on_ray) (const vox_dot dots[], unsigned int n,
+                           const vox_dot origin, const struct vox_ray *ray);
+    unsigned int (*voxels_near_ball) (const vox_dot dots[], unsigned int i, unsigned int n,
+                                      const vox_dot center, float radius);
+};
+
+extern const struct geom_kernels *geom_kernels;
+int closest_voxel_on_ray (const vox_dot dots[], unsigned int n,
+                          const vox_dot origin, const struct vox_ray *ray);
 #endif
 
 #endif
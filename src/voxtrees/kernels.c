@@ -0,0 +1,841 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+
+#include "geom.h"
+#ifdef SSE_INTRIN
+#include <immintrin.h>
+#endif
+
+/*
+ * Kernels which process many voxels at once. There are SSE, AVX2 and
+ * AVX-512 versions of them. The wider ones are compiled with target
+ * attributes, so the library can be built for any x86-64 CPU with SSE4.1,
+ * and the widest version supported by the CPU is chosen when the library is
+ * loaded.
+ *
+ * All versions of a kernel give the same results, so a tree built on one
+ * machine is the same as built on any other one.
+ */
+
+// Voxel i of a leaf or the last one if there are less than i+1 voxels
+#define LEAF_DOT(dots, i, n) dots[((i) < (n)) ? (i) : (n) - 1]
+
+/*
+  The search for the closest voxel on the ray done one voxel at a time.
+  This is the kernel when there is no SIMD.
+*/
+int closest_voxel_on_ray (const vox_dot dots[], unsigned int n,
+                          const vox_dot origin, const struct vox_ray *ray)
+{
+    struct vox_box voxel;
+    vox_dot inter;
+    float dist, closest = INFINITY;
+    unsigned int i;
+    int res = -1;
+
+    for (i=0; i<n; i++)
+    {
+        vox_dot_copy (voxel.min, dots[i]);
+        vox_dot_add (voxel.min, vox_voxel, voxel.max);
+        if (!hit_box (&voxel, origin, ray, inter)) continue;
+        dist = vox_abs_metric (origin, inter);
+        if (dist == 0) return i;
+        if (dist < closest)
+        {
+            closest = dist;
+            res = i;
+        }
+    }
+    return res;
+}
+
+#ifdef SSE_INTRIN
+/*
+  Thresholds for the test which rejects voxels not intersecting the
+  bounding cube of a ball: a voxel at dot may intersect the ball only if
+  lo[j] <= dot[j] <= hi[j] for each axis. The cube is enlarged a bit, so
+  rounding errors never reject a voxel which box_ball_interp() accepts.
+*/
+static void ball_slabs (const vox_dot center, float radius, float lo[], float hi[])
+{
+    unsigned int j;
+
+    radius = fabsf (radius);
+    for (j=0; j<VOX_N; j++)
+    {
+        float slack = vox_voxel[j]/16 + (radius + fabsf (center[j])) / 65536;
+        lo[j] = center[j] - radius - vox_voxel[j] - slack;
+        hi[j] = center[j] + radius + slack;
+    }
+}
+
+/*
+  Voxels are summed into four partial sums (by the index modulo 4) in all
+  versions of find_center(), then the sums are added as (s0 + s1) + (s2 + s3).
+  Coordinates are taken relative to the minimal corner of the bounding box to
+  reduce computational error.
+*/
+static void center_from_sum (__v4sf sum, size_t n, const struct vox_box *box, vox_dot res)
+{
+    __v4sf min = _mm_load_ps (box->min);
+    __v4sf voxel = _mm_load_ps (vox_voxel);
+
+    sum /= _mm_set_ps1 (n);
+    sum += min;
+
+    /*
+     * Align the center of division, so any voxel belongs to only one subspace
+     * entirely. Faces of voxels may be the exception though
+     */
+    _mm_store_ps (res, _mm_ceil_ps (sum / voxel) * voxel);
+}
+
+static void find_center_sse (const vox_dot set[], size_t n, const struct vox_box *box, vox_dot res)
+{
+    __v4sf min = _mm_load_ps (box->min);
+    __v4sf s0 = _mm_setzero_ps(), s1 = s0, s2 = s0, s3 = s0;
+    size_t i;
+
+    for (i=0; i+4<=n; i+=4)
+    {
+        s0 += _mm_load_ps (set[i]) - min;
+        s1 += _mm_load_ps (set[i+1]) - min;
+        s2 += _mm_load_ps (set[i+2]) - min;
+        s3 += _mm_load_ps (set[i+3]) - min;
+    }
+    if (i < n)   s0 += _mm_load_ps (set[i]) - min;
+    if (i+1 < n) s1 += _mm_load_ps (set[i+1]) - min;
+    if (i+2 < n) s2 += _mm_load_ps (set[i+2]) - min;
+    center_from_sum ((s0 + s1) + (s2 + s3), n, box, res);
+}
+
+static void bounding_box_sse (const vox_dot set[], size_t n, struct vox_box *box)
+{
+    size_t i;
+    __v4sf min = _mm_load_ps (set[0]);
+    __v4sf max = min;
+
+    for (i=1; i<n; i++)
+    {
+        min = _mm_min_ps (min, _mm_load_ps (set[i]));
+        max = _mm_max_ps (max, _mm_load_ps (set[i]));
+    }
+    max += _mm_load_ps (vox_voxel);
+
+    _mm_store_ps (box->min, min);
+    _mm_store_ps (box->max, max);
+}
+
+/*
+  Load voxels i to i+3 of a leaf as vectors of x, y and z (structure of
+  arrays). Lanes past the end of the leaf hold the last voxel.
+*/
+static void load_leaf_sse (const vox_dot dots[], unsigned int i, unsigned int n, __v4sf c[])
+{
+    __m128 w;
+
+    c[0] = _mm_load_ps (dots[i]);
+    c[1] = _mm_load_ps (LEAF_DOT (dots, i+1, n));
+    c[2] = _mm_load_ps (LEAF_DOT (dots, i+2, n));
+    w = _mm_load_ps (LEAF_DOT (dots, i+3, n));
+    _MM_TRANSPOSE4_PS (c[0], c[1], c[2], w);
+}
+
+/*
+  A quick test of four voxels with minimal corners c. Distances along the
+  ray to the faces of the voxels are found together. The voxels are
+  enlarged a bit, so rounding errors never reject a voxel which hit_box()
+  accepts. Return a mask with bit k set if voxel k may be hit.
+*/
+static unsigned int voxels_on_ray_sse (const __v4sf c[], const vox_dot origin, const struct vox_ray *ray)
+{
+    __v4sf lo, hi, tnear, tfar, zero = _mm_set_ps1 (0);
+    unsigned int j;
+
+    tnear = _mm_set_ps1 (-INFINITY);
+    tfar = _mm_set_ps1 (INFINITY);
+    for (j=0; j<VOX_N; j++)
+    {
+        lo = c[j] - _mm_set_ps1 (origin[j] + vox_voxel[j]/16);
+        hi = c[j] - _mm_set_ps1 (origin[j] - vox_voxel[j] - vox_voxel[j]/16);
+        if (ray->inv_dir[j] == 0)
+            // The ray is parallel to the faces and must lie between them
+            tfar = _mm_blendv_ps (_mm_set_ps1 (-1), tfar, _mm_and_ps (lo <= zero, hi >= zero));
+        else
+        {
+            lo *= _mm_set_ps1 (ray->inv_dir[j]);
+            hi *= _mm_set_ps1 (ray->inv_dir[j]);
+            tnear = _mm_max_ps (tnear, _mm_min_ps (lo, hi));
+            tfar = _mm_min_ps (tfar, _mm_max_ps (lo, hi));
+        }
+    }
+    return _mm_movemask_ps (_mm_and_ps (tnear <= tfar, tfar >= zero));
+}
+
+/*
+  Distances from the origin to the points where the ray enters four voxels
+  with minimal corners c, or infinity for voxels the ray misses. This is
+  hit_box() followed by vox_abs_metric() done in four lanes at once. All
+  operations are the same and are done in the same order, so the distances
+  are exactly those which the scalar functions give. The hit point is
+  multiplied and added in separate statements: AVX-512 code may use FMA,
+  and compilers fuse operations only within one expression by default.
+*/
+static __v4sf entry_distances_sse (const __v4sf c[], const vox_dot origin, const struct vox_ray *ray)
+{
+    __v4sf fit[VOX_N], dist[VOX_N], max[VOX_N], o, t, hit, zero = _mm_setzero_ps ();
+    __v4sf inside = (__v4sf)_mm_set1_epi32 (-1), outside = zero, res = zero;
+    __v4sf abs_mask = (__v4sf)_mm_set1_epi32 (0x7fffffff);
+    unsigned int j;
+
+    for (j=0; j<VOX_N; j++)
+    {
+        o = _mm_set_ps1 (origin[j]);
+        max[j] = c[j] + _mm_set_ps1 (vox_voxel[j]);
+        fit[j] = _mm_min_ps (_mm_max_ps (o, c[j]), max[j]);
+        inside = _mm_and_ps (inside, fit[j] - o == zero);
+        dist[j] = (fit[j] - o) * _mm_set_ps1 (ray->inv_dir[j]);
+    }
+    t = _mm_max_ps (_mm_max_ps (dist[0], dist[1]), dist[2]);
+    for (j=0; j<VOX_N; j++)
+    {
+        o = _mm_set_ps1 (origin[j]);
+        hit = t * _mm_set_ps1 (ray->dir[j]);
+        hit = _mm_blendv_ps (hit + o, fit[j], dist[j] == t);
+        outside = _mm_or_ps (outside, _mm_or_ps (hit < c[j], hit > max[j]));
+        res += _mm_and_ps (o - hit, abs_mask);
+    }
+    res = _mm_blendv_ps (_mm_set_ps1 (INFINITY), res, _mm_andnot_ps (outside, t > zero));
+    return _mm_blendv_ps (res, zero, inside);
+}
+
+static float min_lane_sse (__v4sf v)
+{
+    v = _mm_min_ps (v, _mm_shuffle_ps (v, v, _MM_SHUFFLE (1, 0, 3, 2)));
+    v = _mm_min_ps (v, _mm_shuffle_ps (v, v, _MM_SHUFFLE (2, 3, 0, 1)));
+    return v[0];
+}
+
+static int min_index_sse (__m128i v)
+{
+    v = _mm_min_epi32 (v, _mm_shuffle_epi32 (v, _MM_SHUFFLE (1, 0, 3, 2)));
+    v = _mm_min_epi32 (v, _mm_shuffle_epi32 (v, _MM_SHUFFLE (2, 3, 0, 1)));
+    return _mm_cvtsi128_si32 (v);
+}
+
+/*
+  Find the voxel of a leaf with the closest entry point. Each lane keeps
+  the closest voxel it has seen, and the lanes are reduced at the end. Like
+  in a sequential search, the voxel with the lowest index wins if distances
+  are equal (lanes past the end of the leaf hold the last voxel again and
+  never win over it), and the search stops at a voxel which contains the
+  origin. Return the index of the voxel or -1 if the ray misses all voxels.
+*/
+static int closest_on_ray_sse (const vox_dot dots[], unsigned int n,
+                               const vox_dot origin, const struct vox_ray *ray)
+{
+    __v4sf c[VOX_N], dist, closer, best = _mm_set_ps1 (INFINITY);
+    __m128i idx = _mm_setr_epi32 (0, 1, 2, 3), best_idx = idx;
+    unsigned int i;
+    float min;
+
+    for (i=0; i<n; i+=4, idx = _mm_add_epi32 (idx, _mm_set1_epi32 (4)))
+    {
+        load_leaf_sse (dots, i, n, c);
+        if (voxels_on_ray_sse (c, origin, ray) == 0) continue;
+        dist = entry_distances_sse (c, origin, ray);
+        closer = dist < best;
+        best = _mm_blendv_ps (best, dist, closer);
+        best_idx = (__m128i)_mm_blendv_ps ((__v4sf)best_idx, (__v4sf)idx, closer);
+        if (_mm_movemask_ps (dist == _mm_setzero_ps ())) break;
+    }
+
+    min = min_lane_sse (best);
+    if (min == INFINITY) return -1;
+    return min_index_sse ((__m128i)_mm_blendv_ps ((__v4sf)_mm_set1_epi32 (INT_MAX), (__v4sf)best_idx,
+                                                  best == _mm_set_ps1 (min)));
+}
+
+/*
+  A quick test for a ball: reject four voxels starting from i which do not
+  intersect the bounding cube of the ball (see ball_slabs()).
+*/
+static unsigned int voxels_near_ball_sse (const vox_dot dots[], unsigned int i, unsigned int n,
+                                          const vox_dot center, float radius)
+{
+    __v4sf c[VOX_N], inside = (__v4sf)_mm_set1_epi32 (-1);
+    float lo[VOX_N], hi[VOX_N];
+    unsigned int j;
+
+    load_leaf_sse (dots, i, n, c);
+
+    ball_slabs (center, radius, lo, hi);
+    for (j=0; j<VOX_N; j++)
+        inside = _mm_and_ps (inside, _mm_and_ps (c[j] >= _mm_set_ps1 (lo[j]),
+                                                 c[j] <= _mm_set_ps1 (hi[j])));
+    return _mm_movemask_ps (inside);
+}
+
+/*
+  Loops over big sets of voxels in AVX2 and AVX-512 kernels use aligned
+  loads, because loads which cross cache lines are much slower. If the set
+  is not aligned, a loop starts at the aligned address a few (skip) dots
+  before the set, and lanes of dots outside of the set are masked. Masked
+  loads never touch memory of the masked lanes.
+*/
+static size_t aligned_skip (const vox_dot set[], size_t alignment)
+{
+    return ((uintptr_t)set & (alignment - 1)) / sizeof (vox_dot);
+}
+
+static const vox_dot* set_base (const vox_dot set[], size_t skip)
+{
+    return (const vox_dot*)((uintptr_t)set - skip * sizeof (vox_dot));
+}
+
+// Bit k is set if dot from+k counted from the aligned address is in the set
+static unsigned int valid_dots (size_t from, size_t skip, size_t end)
+{
+    unsigned int k, valid = 0;
+
+    for (k=0; k<4; k++)
+        if (from + k >= skip && from + k < end) valid |= 1 << k;
+    return valid;
+}
+
+/*
+  AVX2 versions. A 256 bit register holds two dots, so voxels are
+  processed in groups of eight. Ordinary leafs have no more than
+  VOX_MAX_DOTS voxels, so leaf scans fall back to narrower versions if
+  there are only a few voxels left: filling wide registers costs more than
+  the test itself.
+*/
+// Two dots from d counted from the aligned address, zero if they are not in the set
+__attribute__((target("avx2")))
+static __m256 center_block_avx2 (const vox_dot base[], size_t d, size_t skip, size_t end, __m256 min)
+{
+    unsigned int valid = valid_dots (d, skip, end) & 3;
+    __m256i m = _mm256_setr_epi32 (-(valid & 1), -(valid & 1), -(valid & 1), -(valid & 1),
+                                   -(valid >> 1), -(valid >> 1), -(valid >> 1), -(valid >> 1));
+    return _mm256_and_ps (_mm256_maskload_ps (base[d], m) - min, _mm256_castsi256_ps (m));
+}
+
+__attribute__((target("avx2")))
+static void find_center_avx2 (const vox_dot set[], size_t n, const struct vox_box *box, vox_dot res)
+{
+    __m256 min = _mm256_broadcast_ps ((const __m128*)box->min);
+    __m256 s0 = _mm256_setzero_ps(), s1 = s0;
+    __m128 part[4];
+    size_t skip = aligned_skip (set, 32), end = n + skip, i = 0;
+    const vox_dot *base = set_base (set, skip);
+
+    if (skip != 0)
+    {
+        s0 += center_block_avx2 (base, 0, skip, end, min);
+        s1 += center_block_avx2 (base, 2, skip, end, min);
+        i = 4;
+    }
+    for (; i+4<=end; i+=4)
+    {
+        s0 += _mm256_load_ps (base[i]) - min;
+        s1 += _mm256_load_ps (base[i+2]) - min;
+    }
+    if (i < end)
+    {
+        s0 += center_block_avx2 (base, i, skip, end, min);
+        s1 += center_block_avx2 (base, i+2, skip, end, min);
+    }
+
+    // Partial sum j is in part (j + skip) mod 4
+    part[0] = _mm256_castps256_ps128 (s0);
+    part[1] = _mm256_extractf128_ps (s0, 1);
+    part[2] = _mm256_castps256_ps128 (s1);
+    part[3] = _mm256_extractf128_ps (s1, 1);
+    center_from_sum ((part[skip] + part[(1+skip) & 3]) + (part[(2+skip) & 3] + part[(3+skip) & 3]),
+                     n, box, res);
+}
+
+__attribute__((target("avx2")))
+static void bounding_box_avx2 (const vox_dot set[], size_t n, struct vox_box *box)
+{
+    __m256 first = _mm256_broadcast_ps ((const __m128*)set[0]);
+    __m256 min = first, max = first, d;
+    __m128 min4, max4;
+    size_t skip = aligned_skip (set, 32), end = n + skip, i;
+    const vox_dot *base = set_base (set, skip);
+
+    for (i=0; i<end; i+=2)
+    {
+        if (i >= skip && i + 2 <= end) d = _mm256_load_ps (base[i]);
+        else
+        {
+            // Lanes of missing dots are filled with the first one
+            unsigned int valid = valid_dots (i, skip, end) & 3;
+            __m256i m = _mm256_setr_epi32 (-(valid & 1), -(valid & 1), -(valid & 1), -(valid & 1),
+                                           -(valid >> 1), -(valid >> 1), -(valid >> 1), -(valid >> 1));
+            d = _mm256_blendv_ps (first, _mm256_maskload_ps (base[i], m), _mm256_castsi256_ps (m));
+        }
+        min = _mm256_min_ps (min, d);
+        max = _mm256_max_ps (max, d);
+    }
+    min4 = _mm_min_ps (_mm256_castps256_ps128 (min), _mm256_extractf128_ps (min, 1));
+    max4 = _mm_max_ps (_mm256_castps256_ps128 (max), _mm256_extractf128_ps (max, 1));
+    max4 += _mm_load_ps (vox_voxel);
+
+    _mm_store_ps (box->min, min4);
+    _mm_store_ps (box->max, max4);
+}
+
+/*
+  Load voxels i to i+7 of a leaf as vectors of x, y and z. Voxels i+k and
+  i+k+4 are in the low and the high half of row k, so _MM_TRANSPOSE4_PS()
+  is done in both halves at once.
+*/
+__attribute__((target("avx2")))
+static void load_leaf_avx2 (const vox_dot dots[], unsigned int i, unsigned int n, __m256 c[])
+{
+    __m256 r[4], t[4];
+    unsigned int k;
+
+    for (k=0; k<4; k++)
+        r[k] = _mm256_insertf128_ps (_mm256_castps128_ps256 (_mm_load_ps (LEAF_DOT (dots, i+k, n))),
+                                     _mm_load_ps (LEAF_DOT (dots, i+k+4, n)), 1);
+    t[0] = _mm256_unpacklo_ps (r[0], r[1]);
+    t[1] = _mm256_unpacklo_ps (r[2], r[3]);
+    t[2] = _mm256_unpackhi_ps (r[0], r[1]);
+    t[3] = _mm256_unpackhi_ps (r[2], r[3]);
+    c[0] = _mm256_shuffle_ps (t[0], t[1], 0x44);
+    c[1] = _mm256_shuffle_ps (t[0], t[1], 0xee);
+    c[2] = _mm256_shuffle_ps (t[2], t[3], 0x44);
+}
+
+__attribute__((target("avx2")))
+static unsigned int voxels_on_ray_avx2 (const __m256 c[], const vox_dot origin, const struct vox_ray *ray)
+{
+    __m256 lo, hi, tnear, tfar, zero = _mm256_setzero_ps ();
+    unsigned int j;
+
+    tnear = _mm256_set1_ps (-INFINITY);
+    tfar = _mm256_set1_ps (INFINITY);
+    for (j=0; j<VOX_N; j++)
+    {
+        lo = c[j] - _mm256_set1_ps (origin[j] + vox_voxel[j]/16);
+        hi = c[j] - _mm256_set1_ps (origin[j] - vox_voxel[j] - vox_voxel[j]/16);
+        if (ray->inv_dir[j] == 0)
+            tfar = _mm256_blendv_ps (_mm256_set1_ps (-1), tfar,
+                                     _mm256_and_ps (_mm256_cmp_ps (lo, zero, _CMP_LE_OQ),
+                                                    _mm256_cmp_ps (hi, zero, _CMP_GE_OQ)));
+        else
+        {
+            lo *= _mm256_set1_ps (ray->inv_dir[j]);
+            hi *= _mm256_set1_ps (ray->inv_dir[j]);
+            tnear = _mm256_max_ps (tnear, _mm256_min_ps (lo, hi));
+            tfar = _mm256_min_ps (tfar, _mm256_max_ps (lo, hi));
+        }
+    }
+    return _mm256_movemask_ps (_mm256_and_ps (_mm256_cmp_ps (tnear, tfar, _CMP_LE_OQ),
+                                              _mm256_cmp_ps (tfar, zero, _CMP_GE_OQ)));
+}
+
+__attribute__((target("avx2")))
+static __m256 entry_distances_avx2 (const __m256 c[], const vox_dot origin, const struct vox_ray *ray)
+{
+    __m256 fit[VOX_N], dist[VOX_N], max[VOX_N], o, t, hit, zero = _mm256_setzero_ps ();
+    __m256 inside = _mm256_castsi256_ps (_mm256_set1_epi32 (-1)), outside = zero, res = zero;
+    __m256 abs_mask = _mm256_castsi256_ps (_mm256_set1_epi32 (0x7fffffff));
+    unsigned int j;
+
+    for (j=0; j<VOX_N; j++)
+    {
+        o = _mm256_set1_ps (origin[j]);
+        max[j] = c[j] + _mm256_set1_ps (vox_voxel[j]);
+        fit[j] = _mm256_min_ps (_mm256_max_ps (o, c[j]), max[j]);
+        inside = _mm256_and_ps (inside, _mm256_cmp_ps (fit[j] - o, zero, _CMP_EQ_OQ));
+        dist[j] = (fit[j] - o) * _mm256_set1_ps (ray->inv_dir[j]);
+    }
+    t = _mm256_max_ps (_mm256_max_ps (dist[0], dist[1]), dist[2]);
+    for (j=0; j<VOX_N; j++)
+    {
+        o = _mm256_set1_ps (origin[j]);
+        hit = t * _mm256_set1_ps (ray->dir[j]);
+        hit = _mm256_blendv_ps (hit + o, fit[j], _mm256_cmp_ps (dist[j], t, _CMP_EQ_OQ));
+        outside = _mm256_or_ps (outside, _mm256_or_ps (_mm256_cmp_ps (hit, c[j], _CMP_LT_OQ),
+                                                       _mm256_cmp_ps (hit, max[j], _CMP_GT_OQ)));
+        res += _mm256_and_ps (o - hit, abs_mask);
+    }
+    res = _mm256_blendv_ps (_mm256_set1_ps (INFINITY), res,
+                            _mm256_andnot_ps (outside, _mm256_cmp_ps (t, zero, _CMP_GT_OQ)));
+    return _mm256_blendv_ps (res, zero, inside);
+}
+
+__attribute__((target("avx2")))
+static int closest_on_ray_avx2 (const vox_dot dots[], unsigned int n,
+                                const vox_dot origin, const struct vox_ray *ray)
+{
+    __m256 c[VOX_N], dist, closer, best = _mm256_set1_ps (INFINITY);
+    __m256i idx = _mm256_setr_epi32 (0, 1, 2, 3, 4, 5, 6, 7), best_idx = idx;
+    unsigned int i;
+    float min;
+
+    if (n <= 4) return closest_on_ray_sse (dots, n, origin, ray);
+    for (i=0; i<n; i+=8, idx = _mm256_add_epi32 (idx, _mm256_set1_epi32 (8)))
+    {
+        load_leaf_avx2 (dots, i, n, c);
+        if (voxels_on_ray_avx2 (c, origin, ray) == 0) continue;
+        dist = entry_distances_avx2 (c, origin, ray);
+        closer = _mm256_cmp_ps (dist, best, _CMP_LT_OQ);
+        best = _mm256_blendv_ps (best, dist, closer);
+        best_idx = _mm256_castps_si256 (_mm256_blendv_ps (_mm256_castsi256_ps (best_idx),
+                                                          _mm256_castsi256_ps (idx), closer));
+        if (_mm256_movemask_ps (_mm256_cmp_ps (dist, _mm256_setzero_ps (), _CMP_EQ_OQ))) break;
+    }
+
+    min = min_lane_sse (_mm_min_ps (_mm256_castps256_ps128 (best), _mm256_extractf128_ps (best, 1)));
+    if (min == INFINITY) return -1;
+    best_idx = _mm256_castps_si256 (_mm256_blendv_ps (_mm256_castsi256_ps (_mm256_set1_epi32 (INT_MAX)),
+                                                      _mm256_castsi256_ps (best_idx),
+                                                      _mm256_cmp_ps (best, _mm256_set1_ps (min), _CMP_EQ_OQ)));
+    return min_index_sse (_mm_min_epi32 (_mm256_castsi256_si128 (best_idx),
+                                         _mm256_extracti128_si256 (best_idx, 1)));
+}
+
+__attribute__((target("avx2")))
+static unsigned int voxels_near_ball_avx2 (const vox_dot dots[], unsigned int i, unsigned int n,
+                                           const vox_dot center, float radius)
+{
+    __m256 c[VOX_N], inside = _mm256_castsi256_ps (_mm256_set1_epi32 (-1));
+    float lo[VOX_N], hi[VOX_N];
+    unsigned int j;
+
+    if (n - i <= 4) return voxels_near_ball_sse (dots, i, n, center, radius);
+    load_leaf_avx2 (dots, i, n, c);
+    ball_slabs (center, radius, lo, hi);
+    for (j=0; j<VOX_N; j++)
+        inside = _mm256_and_ps (inside,
+                                _mm256_and_ps (_mm256_cmp_ps (c[j], _mm256_set1_ps (lo[j]), _CMP_GE_OQ),
+                                               _mm256_cmp_ps (c[j], _mm256_set1_ps (hi[j]), _CMP_LE_OQ)));
+    return _mm256_movemask_ps (inside);
+}
+
+/*
+  AVX-512 versions. A 512 bit register holds four dots, so voxels are
+  processed in groups of sixteen.
+*/
+// Mask of lanes of up to four dots
+static __mmask16 dots_mask (unsigned int valid)
+{
+    __mmask16 m = 0;
+    unsigned int k;
+
+    for (k=0; k<4; k++)
+        if (valid & (1 << k)) m |= 0xf << 4*k;
+    return m;
+}
+
+__attribute__((target("avx512f")))
+static void find_center_avx512 (const vox_dot set[], size_t n, const struct vox_box *box, vox_dot res)
+{
+    __m512 min = _mm512_broadcast_f32x4 (_mm_load_ps (box->min));
+    __m512 s = _mm512_setzero_ps ();
+    __m128 part[4];
+    size_t skip = aligned_skip (set, 64), end = n + skip, i;
+    const vox_dot *base = set_base (set, skip);
+
+    for (i=0; i<end; i+=4)
+    {
+        if (i >= skip && i + 4 <= end) s += _mm512_load_ps (base[i]) - min;
+        else
+        {
+            __mmask16 m = dots_mask (valid_dots (i, skip, end));
+            s += _mm512_maskz_sub_ps (m, _mm512_maskz_load_ps (m, base[i]), min);
+        }
+    }
+
+    // Partial sum j is in part (j + skip) mod 4
+    part[0] = _mm512_extractf32x4_ps (s, 0);
+    part[1] = _mm512_extractf32x4_ps (s, 1);
+    part[2] = _mm512_extractf32x4_ps (s, 2);
+    part[3] = _mm512_extractf32x4_ps (s, 3);
+    center_from_sum ((part[skip] + part[(1+skip) & 3]) + (part[(2+skip) & 3] + part[(3+skip) & 3]),
+                     n, box, res);
+}
+
+__attribute__((target("avx512f")))
+static void bounding_box_avx512 (const vox_dot set[], size_t n, struct vox_box *box)
+{
+    __m512 first = _mm512_broadcast_f32x4 (_mm_load_ps (set[0]));
+    __m512 min = first, max = first, d;
+    __m128 min4, max4;
+    size_t skip = aligned_skip (set, 64), end = n + skip, i;
+    const vox_dot *base = set_base (set, skip);
+
+    for (i=0; i<end; i+=4)
+    {
+        if (i >= skip && i + 4 <= end) d = _mm512_load_ps (base[i]);
+        else
+            // Lanes of missing dots are filled with the first one
+            d = _mm512_mask_load_ps (first, dots_mask (valid_dots (i, skip, end)), base[i]);
+        min = _mm512_min_ps (min, d);
+        max = _mm512_max_ps (max, d);
+    }
+    min4 = _mm_min_ps (_mm_min_ps (_mm512_extractf32x4_ps (min, 0), _mm512_extractf32x4_ps (min, 1)),
+                       _mm_min_ps (_mm512_extractf32x4_ps (min, 2), _mm512_extractf32x4_ps (min, 3)));
+    max4 = _mm_max_ps (_mm_max_ps (_mm512_extractf32x4_ps (max, 0), _mm512_extractf32x4_ps (max, 1)),
+                       _mm_max_ps (_mm512_extractf32x4_ps (max, 2), _mm512_extractf32x4_ps (max, 3)));
+    max4 += _mm_load_ps (vox_voxel);
+
+    _mm_store_ps (box->min, min4);
+    _mm_store_ps (box->max, max4);
+}
+
+/*
+  Like load_leaf_avx2(), but for voxels i to i+15. Row k holds voxels i+k,
+  i+k+4, i+k+8 and i+k+12.
+*/
+__attribute__((target("avx512f")))
+static void load_leaf_avx512 (const vox_dot dots[], unsigned int i, unsigned int n, __m512 c[])
+{
+    __m512 r[4], t[4];
+    unsigned int k;
+
+    for (k=0; k<4; k++)
+    {
+        r[k] = _mm512_castps128_ps512 (_mm_load_ps (LEAF_DOT (dots, i+k, n)));
+        r[k] = _mm512_insertf32x4 (r[k], _mm_load_ps (LEAF_DOT (dots, i+k+4, n)), 1);
+        r[k] = _mm512_insertf32x4 (r[k], _mm_load_ps (LEAF_DOT (dots, i+k+8, n)), 2);
+        r[k] = _mm512_insertf32x4 (r[k], _mm_load_ps (LEAF_DOT (dots, i+k+12, n)), 3);
+    }
+    t[0] = _mm512_unpacklo_ps (r[0], r[1]);
+    t[1] = _mm512_unpacklo_ps (r[2], r[3]);
+    t[2] = _mm512_unpackhi_ps (r[0], r[1]);
+    t[3] = _mm512_unpackhi_ps (r[2], r[3]);
+    c[0] = _mm512_shuffle_ps (t[0], t[1], 0x44);
+    c[1] = _mm512_shuffle_ps (t[0], t[1], 0xee);
+    c[2] = _mm512_shuffle_ps (t[2], t[3], 0x44);
+}
+
+__attribute__((target("avx512f")))
+static unsigned int voxels_on_ray_avx512 (const __m512 c[], const vox_dot origin, const struct vox_ray *ray)
+{
+    __m512 lo, hi, tnear, tfar, zero = _mm512_setzero_ps ();
+    __mmask16 inside = 0xffff;
+    unsigned int j;
+
+    tnear = _mm512_set1_ps (-INFINITY);
+    tfar = _mm512_set1_ps (INFINITY);
+    for (j=0; j<VOX_N; j++)
+    {
+        lo = c[j] - _mm512_set1_ps (origin[j] + vox_voxel[j]/16);
+        hi = c[j] - _mm512_set1_ps (origin[j] - vox_voxel[j] - vox_voxel[j]/16);
+        if (ray->inv_dir[j] == 0)
+            inside &= _mm512_cmp_ps_mask (lo, zero, _CMP_LE_OQ) &
+                _mm512_cmp_ps_mask (hi, zero, _CMP_GE_OQ);
+        else
+        {
+            lo *= _mm512_set1_ps (ray->inv_dir[j]);
+            hi *= _mm512_set1_ps (ray->inv_dir[j]);
+            tnear = _mm512_max_ps (tnear, _mm512_min_ps (lo, hi));
+            tfar = _mm512_min_ps (tfar, _mm512_max_ps (lo, hi));
+        }
+    }
+    return inside & _mm512_cmp_ps_mask (tnear, tfar, _CMP_LE_OQ) &
+        _mm512_cmp_ps_mask (tfar, zero, _CMP_GE_OQ);
+}
+
+__attribute__((target("avx512f")))
+static __m512 entry_distances_avx512 (const __m512 c[], const vox_dot origin, const struct vox_ray *ray)
+{
+    __m512 fit[VOX_N], dist[VOX_N], max[VOX_N], o, t, hit, zero = _mm512_setzero_ps ();
+    __m512 res = zero;
+    __mmask16 inside = 0xffff, outside = 0;
+    unsigned int j;
+
+    for (j=0; j<VOX_N; j++)
+    {
+        o = _mm512_set1_ps (origin[j]);
+        max[j] = c[j] + _mm512_set1_ps (vox_voxel[j]);
+        fit[j] = _mm512_min_ps (_mm512_max_ps (o, c[j]), max[j]);
+        inside &= _mm512_cmp_ps_mask (fit[j] - o, zero, _CMP_EQ_OQ);
+        dist[j] = (fit[j] - o) * _mm512_set1_ps (ray->inv_dir[j]);
+    }
+    t = _mm512_max_ps (_mm512_max_ps (dist[0], dist[1]), dist[2]);
+    for (j=0; j<VOX_N; j++)
+    {
+        o = _mm512_set1_ps (origin[j]);
+        hit = t * _mm512_set1_ps (ray->dir[j]);
+        hit = _mm512_mask_blend_ps (_mm512_cmp_ps_mask (dist[j], t, _CMP_EQ_OQ), hit + o, fit[j]);
+        outside |= _mm512_cmp_ps_mask (hit, c[j], _CMP_LT_OQ) | _mm512_cmp_ps_mask (hit, max[j], _CMP_GT_OQ);
+        res += _mm512_abs_ps (o - hit);
+    }
+    res = _mm512_mask_blend_ps (~outside & _mm512_cmp_ps_mask (t, zero, _CMP_GT_OQ),
+                                _mm512_set1_ps (INFINITY), res);
+    return _mm512_mask_blend_ps (inside, res, zero);
+}
+
+__attribute__((target("avx512f")))
+static int closest_on_ray_avx512 (const vox_dot dots[], unsigned int n,
+                                  const vox_dot origin, const struct vox_ray *ray)
+{
+    __m512 c[VOX_N], dist, best = _mm512_set1_ps (INFINITY);
+    __m512i idx = _mm512_setr_epi32 (0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m512i best_idx = idx;
+    __mmask16 closer;
+    unsigned int i;
+    float min;
+
+    if (n <= 4) return closest_on_ray_sse (dots, n, origin, ray);
+    if (n <= 8) return closest_on_ray_avx2 (dots, n, origin, ray);
+    for (i=0; i<n; i+=16, idx = _mm512_add_epi32 (idx, _mm512_set1_epi32 (16)))
+    {
+        load_leaf_avx512 (dots, i, n, c);
+        if (voxels_on_ray_avx512 (c, origin, ray) == 0) continue;
+        dist = entry_distances_avx512 (c, origin, ray);
+        closer = _mm512_cmp_ps_mask (dist, best, _CMP_LT_OQ);
+        best = _mm512_mask_mov_ps (best, closer, dist);
+        best_idx = _mm512_mask_mov_epi32 (best_idx, closer, idx);
+        if (_mm512_cmp_ps_mask (dist, _mm512_setzero_ps (), _CMP_EQ_OQ)) break;
+    }
+
+    min = _mm512_reduce_min_ps (best);
+    if (min == INFINITY) return -1;
+    return _mm512_mask_reduce_min_epi32 (_mm512_cmp_ps_mask (best, _mm512_set1_ps (min), _CMP_EQ_OQ),
+                                         best_idx);
+}
+
+__attribute__((target("avx512f")))
+static unsigned int voxels_near_ball_avx512 (const vox_dot dots[], unsigned int i, unsigned int n,
+                                             const vox_dot center, float radius)
+{
+    __m512 c[VOX_N];
+    __mmask16 inside = 0xffff;
+    float lo[VOX_N], hi[VOX_N];
+    unsigned int j;
+
+    if (n - i <= 4) return voxels_near_ball_sse (dots, i, n, center, radius);
+    if (n - i <= 8) return voxels_near_ball_avx2 (dots, i, n, center, radius);
+    load_leaf_avx512 (dots, i, n, c);
+    ball_slabs (center, radius, lo, hi);
+    for (j=0; j<VOX_N; j++)
+        inside &= _mm512_cmp_ps_mask (c[j], _mm512_set1_ps (lo[j]), _CMP_GE_OQ) &
+            _mm512_cmp_ps_mask (c[j], _mm512_set1_ps (hi[j]), _CMP_LE_OQ);
+    return inside;
+}
+
+static const struct geom_kernels sse_kernels = {
+    VOX_ISA_SSE, 4,
+    find_center_sse, bounding_box_sse, closest_on_ray_sse, voxels_near_ball_sse
+};
+
+static const struct geom_kernels avx2_kernels = {
+    VOX_ISA_AVX2, 8,
+    find_center_avx2, bounding_box_avx2, closest_on_ray_avx2, voxels_near_ball_avx2
+};
+
+static const struct geom_kernels avx512_kernels = {
+    VOX_ISA_AVX512, 16,
+    find_center_avx512, bounding_box_avx512, closest_on_ray_avx512, voxels_near_ball_avx512
+};
+
+const struct geom_kernels *geom_kernels = &sse_kernels;
+
+#else /* SSE_INTRIN */
+static void find_center_generic (const vox_dot set[], size_t n, const struct vox_box *box, vox_dot res)
+{
+    size_t i;
+    memset (res, 0, sizeof(vox_dot));
+    vox_dot tmp;
+
+    for (i=0; i<n; i++) {
+        vox_dot_sub (set[i], box->min, tmp);
+        vox_dot_add (tmp, res, res);
+    }
+    for (i=0; i<VOX_N; i++) res[i] = ceilf ((res[i]/n + box->min[i])/vox_voxel[i])*vox_voxel[i];
+}
+
+static void bounding_box_generic (const vox_dot set[], size_t n, struct vox_box *box)
+{
+    size_t i;
+    int j;
+
+    vox_dot_copy (box->min, set[0]);
+    vox_dot_copy (box->max, set[0]);
+
+    for (i=0; i<n; i++)
+    {
+        for (j=0; j<VOX_N; j++)
+        {
+            if (set[i][j] < box->min[j]) box->min[j] = set[i][j];
+            else if (set[i][j] > box->max[j]) box->max[j] = set[i][j];
+        }
+    }
+    vox_dot_add (box->max, vox_voxel, box->max);
+}
+
+// Without SIMD quick tests are not quicker than the exact ones
+static unsigned int voxels_near_ball_generic (const vox_dot dots[], unsigned int i, unsigned int n,
+                                              const vox_dot center, float radius)
+{
+    return ~0u;
+}
+
+static const struct geom_kernels generic_kernels = {
+    VOX_ISA_GENERIC, 32,
+    find_center_generic, bounding_box_generic, closest_voxel_on_ray, voxels_near_ball_generic
+};
+
+const struct geom_kernels *geom_kernels = &generic_kernels;
+#endif /* SSE_INTRIN */
+
+static int isa_supported (enum vox_isa isa)
+{
+#ifdef SSE_INTRIN
+    __builtin_cpu_init ();
+    switch (isa)
+    {
+    case VOX_ISA_SSE:
+        // The library does not work without it anyway
+        return 1;
+    case VOX_ISA_AVX2:
+        return __builtin_cpu_supports ("avx2");
+    case VOX_ISA_AVX512:
+        return __builtin_cpu_supports ("avx512f");
+    default:
+        return 0;
+    }
+#else
+    return isa == VOX_ISA_GENERIC;
+#endif
+}
+
+int vox_use_isa (enum vox_isa isa)
+{
+    if (!isa_supported (isa)) return 0;
+#ifdef SSE_INTRIN
+    switch (isa)
+    {
+    case VOX_ISA_AVX512:
+        geom_kernels = &avx512_kernels;
+        break;
+    case VOX_ISA_AVX2:
+        geom_kernels = &avx2_kernels;
+        break;
+    default:
+        geom_kernels = &sse_kernels;
+    }
+#endif
+    return 1;
+}
+
+enum vox_isa vox_current_isa ()
+{
+    return geom_kernels->isa;
+}
+
+ __attribute__((constructor))
+static void choose_kernels ()
+{
+    if (!vox_use_isa (VOX_ISA_AVX512)) vox_use_isa (VOX_ISA_AVX2);
+}
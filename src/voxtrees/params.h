@@ -28,6 +28,43 @@
 **/
 #define VOX_MAX_DOTS 7
 
+/**
+   \brief Minimal number of voxels in a set for parallel tree construction.
+
+   vox_make_tree() builds subtrees of a node in parallel if the node
+   contains at least this number of voxels. Smaller sets are processed
+   serially, because the scheduling overhead outweighs the gain.
+**/
+#define VOX_PARALLEL_THRESHOLD 100000
+
+/**
+   \brief Maximal number of voxels in automatically rebuilt subtrees.
+
+   vox_insert_voxel() and vox_delete_voxel() rebuild a subtree in place
+   if the path to the edited voxel in it is much longer than in a
+   balanced tree with the same number of voxels. Bigger subtrees are
+   never rebuilt automatically, so editing never stalls for long.
+**/
+#define VOX_REBUILD_MAX_VOXELS 100000
+
+/**
+   \brief Minimal number of voxels in a box found by vox_make_tree_boxes().
+
+   Smaller solid boxes are not worth a dense leaf of their own, because
+   a leaf or a brick holds them just as well.
+**/
+#define VOX_MIN_BOX_VOXELS 64
+
+/**
+   \brief Maximal number of samples in a brick of raw data.
+
+   Raw data readers divide the volume into bricks of at most this number
+   of samples, build a tree of each brick and join these trees. Only voxels
+   of the bricks being processed are kept in memory, not voxels of the
+   whole volume.
+**/
+#define VOX_READER_BRICK_SAMPLES (128*128*128)
+
 #endif /* VOXTREES_SOURCE */
 
 // Global vars
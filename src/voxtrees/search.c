@@ -5,151 +5,473 @@
 #include "search.h"
 #include "probes.h"
 
-const struct vox_node*
-vox_ray_tree_intersection (const struct vox_node *tree, const vox_dot origin,
-                           const vox_dot dir, vox_dot res)
+/*
+  Voxels of a brick which have coordinate k along the axis.
+*/
+static uint64_t brick_slab (int axis, int k)
 {
-    vox_dot bb_inter;
+    // Voxels with zero coordinate along each axis
+    static const uint64_t planes[VOX_N] = {
+        0x1111111111111111, 0x000f000f000f000f, 0x000000000000ffff
+    };
+    return (k >= 0 && k < VOX_BRICK_SIDE) ? planes[axis] << (k << (2*axis)) : 0;
+}
+
+/*
+  Walk through cells of a brick with 3D DDA starting from origin (which is
+  on the brick's bounding box) and stop at the first occupied cell. Voxels
+  are closed boxes, like in the leaf search, so a ray which starts on a face
+  between two cells or goes along it touches both of them.
+*/
+static int brick_intersection (const struct vox_node *brick, const vox_dot origin,
+                               const struct vox_ray *ray, vox_dot res)
+{
+    const float *dir = ray->dir;
+    const vox_brick_data *data = &(brick->data.brick);
+    int cell[VOX_N], step[VOX_N], axis = -1;
+    float next[VOX_N], delta[VOX_N], t = 0;
+    uint64_t slab[VOX_N];
     unsigned int i;
-    vox_dot *plane_inter;
-    int *plane_inter_idx, tmp2;
-    const struct vox_node *leaf = NULL;
 
-    /*
-     * After hit_box call we can take bb_inter as a new ray origin.
-     * This will help us with little optimization technik.
-     */
-    if (!(VOX_FULLP (tree)) ||
-        !(hit_box (&(tree->bounding_box), origin, dir, bb_inter)))
+    for (i=0; i<VOX_N; i++)
     {
-        WITH_STAT (VOXTREES_RTI_EARLY_EXIT());
-        goto end;
+        float pos = (origin[i] - data->origin[i]) / vox_voxel[i];
+        if (dir[i] < 0)
+        {
+            cell[i] = ceilf (pos) - 1;
+            step[i] = -1;
+        }
+        else
+        {
+            cell[i] = floorf (pos);
+            step[i] = 1;
+        }
+        slab[i] = brick_slab (i, cell[i]);
+        if (pos == floorf (pos)) slab[i] |= brick_slab (i, cell[i] - step[i]);
+
+        if (dir[i] == 0)
+        {
+            next[i] = INFINITY;
+            delta[i] = INFINITY;
+        }
+        else
+        {
+            next[i] = (data->origin[i] + (cell[i] + (step[i] > 0)) * vox_voxel[i] -
+                       origin[i]) * ray->inv_dir[i];
+            delta[i] = vox_voxel[i] * fabsf (ray->inv_dir[i]);
+        }
     }
+
+    while (1)
+    {
+        if (data->mask & slab[0] & slab[1] & slab[2])
+        {
+            vox_dot_copy (res, origin);
+            for (i=0; i<VOX_N; i++) res[i] += t*dir[i];
+            // Put the entry point exactly on the face of the voxel
+            if (axis >= 0)
+                res[axis] = data->origin[axis] +
+                    (cell[axis] + (step[axis] < 0)) * vox_voxel[axis];
+            return 1;
+        }
+
+        axis = (next[0] < next[1]) ? 0 : 1;
+        axis = (next[2] < next[axis]) ? 2 : axis;
+        cell[axis] += step[axis];
+        if (next[axis] == INFINITY ||
+            cell[axis] < 0 || cell[axis] >= VOX_BRICK_SIDE) return 0;
+        // After the first step the ray is off faces it started on, unless it goes along them
+        if (t == 0)
+            for (i=0; i<VOX_N; i++)
+                if (dir[i] != 0) slab[i] = brick_slab (i, cell[i]);
+        slab[axis] = brick_slab (axis, cell[axis]);
+        t = next[axis];
+        next[axis] += delta[axis];
+    }
+}
+
+/*
+  Search in a leaf (of any kind) whose bounding box is entered by the ray at
+  bb_inter.
+*/
+static const struct vox_node* leaf_intersection (const struct vox_node *tree, const vox_dot bb_inter,
+                                                 const struct vox_ray *ray, vox_dot res)
+{
     /*
      * If ray hits bounding box of a dense leaf, then it hits anything inside it.
      */
     if (tree->flags & VOX_DENSE_LEAF)
     {
-        leaf = tree;
         vox_dot_copy (res, bb_inter);
         WITH_STAT (VOXTREES_RTI_EARLY_EXIT());
-        goto end;
+        return tree;
     }
 
-    if (tree->flags & VOX_LEAF)
+    if (tree->flags & VOX_BRICK)
+        return (brick_intersection (tree, bb_inter, ray, res)) ? tree : NULL;
+
+    /*
+     * Do O(tree->dots_num) search for intersections with voxels stored in the
+     * leaf and return closest one. All voxels are compared at once (see
+     * kernels.c), then the intersection with the closest one is found.
+     */
+    vox_dot buffer[VOX_MAX_DOTS];
+    vox_dot *dots = leaf_dots (tree, buffer);
+    struct vox_box voxel;
+    int i;
+
+    WITH_STAT (VOXTREES_RTI_VOXELS_TRAVERSED(tree->dots_num));
+    i = geom_kernels->closest_on_ray (dots, tree->dots_num, bb_inter, ray);
+    if (i < 0) return NULL;
+    vox_dot_copy (voxel.min, dots[i]);
+    vox_dot_add (voxel.min, vox_voxel, voxel.max);
+    if (!hit_box (&voxel, bb_inter, ray, res))
     {
         /*
-         * If passed argument is a tree leaf, do O(tree->dots_num) search for intersections
-         * with voxels stored in the leaf and return closest one.
+         * The kernel and hit_box() were rounded differently (e.g. the
+         * compiler fused a multiplication and an addition in only one of
+         * them) and the ray just grazes the voxel. Search again one voxel at
+         * a time.
          */
-        float dist_closest = INFINITY, dist_far;
-        vox_dot *dots = tree->data.dots;
-        struct vox_box *voxel = alloca (sizeof (struct vox_box));
-        vox_dot far_inter;
+        i = closest_voxel_on_ray (dots, tree->dots_num, bb_inter, ray);
+        if (i < 0) return NULL;
+        vox_dot_copy (voxel.min, dots[i]);
+        vox_dot_add (voxel.min, vox_voxel, voxel.max);
+        hit_box (&voxel, bb_inter, ray, res);
+    }
+    /*
+     * The search stops at a voxel whose intersection lies on the node's
+     * bounding box, because you cannot get any closer. This works on very
+     * rare occasions in normal scenes, but helps a lot in certain conditions.
+     */
+    WITH_STAT (if (vox_abs_metric (bb_inter, res) == 0)
+                   VOXTREES_RTI_VOXELS_SKIPPED (tree->dots_num-i-1));
+    return tree;
+}
 
-        WITH_STAT (VOXTREES_RTI_VOXELS_TRAVERSED(tree->dots_num));
-        for (i=0; i<tree->dots_num; i++)
+/*
+  The search is iterative. Each inner node on the path from the root has a
+  frame in a fixed stack which holds the entry point into the node and
+  intersections of the ray with dividing planes which are not visited yet.
+  Deeper subtrees (which are rare) are searched with a new stack.
+*/
+#define SEARCH_STACK_SIZE 64
+
+struct search_frame
+{
+    vox_dot entry; // Entry point into the node's bounding box
+    vox_dot plane_inter[VOX_N];
+    int plane_idx[VOX_N];
+    const struct vox_node *node;
+    unsigned int planes, next;
+    int subspace;
+};
+
+/*
+  Find intersections of the ray which enters the node at frame->entry with
+  dividing planes of the node and sort them by distance from the entry.
+*/
+static void find_plane_intersections (struct search_frame *frame, const struct vox_ray *ray)
+{
+    const struct vox_node *tree = frame->node;
+    float dist[VOX_N], tmpd;
+    unsigned int i, j;
+    vox_dot tmp;
+    int tmpi;
+
+    frame->planes = 0;
+    frame->next = 0;
+    for (i=0; i<VOX_N; i++)
+    {
+        frame->plane_idx[frame->planes] = i;
+        if (hit_plane_within_box (frame->entry, ray, tree->data.inner.center, i,
+                                  frame->plane_inter[frame->planes], &(tree->bounding_box)))
+        {
+            dist[frame->planes] = vox_abs_metric (frame->entry, frame->plane_inter[frame->planes]);
+            frame->planes++;
+        }
+    }
+
+    // Closest intersections go first
+    for (i=0; i<frame->planes; i++)
+    {
+        for (j=i+1; j<frame->planes; j++)
         {
-            vox_dot_copy (voxel->min, dots[i]);
-            vox_dot_add (voxel->min, vox_voxel, voxel->max);
-            if (hit_box (voxel, bb_inter, dir, far_inter))
+            if (dist[j] < dist[i])
             {
-                dist_far = vox_abs_metric (bb_inter, far_inter);
-                /*
-                 * This is the optimization I mentioned earlier.
-                 * If a distance between the node's bounding box and newly found
-                 * intersection is zero, than you cannot get any closer, so return
-                 * it. This works on very rare occasions in normal scenes, but helps a lot
-                 * in certain conditions. The branch should be predictible.
-                 */
-                if (dist_far == 0)
-                {
-                    vox_dot_copy (res, far_inter);
-                    leaf = tree;
-                    WITH_STAT (VOXTREES_RTI_VOXELS_SKIPPED (tree->dots_num-i-1));
-                    goto end;
-                }
-                if (dist_far < dist_closest)
-                {
-                    dist_closest = dist_far;
-                    vox_dot_copy (res, far_inter);
-                    leaf = tree;
-                }
+                vox_dot_copy (tmp, frame->plane_inter[j]);
+                vox_dot_copy (frame->plane_inter[j], frame->plane_inter[i]);
+                vox_dot_copy (frame->plane_inter[i], tmp);
+                tmpi = frame->plane_idx[j];
+                frame->plane_idx[j] = frame->plane_idx[i];
+                frame->plane_idx[i] = tmpi;
+                tmpd = dist[j];
+                dist[j] = dist[i];
+                dist[i] = tmpd;
             }
         }
-        goto end;
     }
+}
 
-    // not a leaf. bb_inter holds an entry point into node's bounding box
-    const vox_inner_data *inner = &(tree->data.inner);
-    // Find subspace index of the entry point, corrected by direction, if needed.
-    int subspace = get_corrected_subspace_idx (inner->center, bb_inter, dir);
+const struct vox_node*
+ray_tree_intersection (const struct vox_node *tree, const vox_dot origin,
+                       const struct vox_ray *ray, vox_dot res)
+{
+    struct search_frame stack[SEARCH_STACK_SIZE];
+    struct search_frame *frame;
+    const struct vox_node *leaf;
+    const float *entry = origin;
+    vox_dot bb_inter;
+    int depth = 0;
 
-    /*
-     * Look if we are lucky and the ray hits any box before it traverses the dividing
-     * planes (in other words it hits a box close enough to the entry point).
-     */
-    if ((leaf = vox_ray_tree_intersection (inner->children[subspace], bb_inter, dir,
-                                           res)))
+    // A single leaf does not need the stack
+    if (VOX_FULLP (tree) && (tree->flags & VOX_LEAF_MASK))
     {
-        WITH_STAT (VOXTREES_RTI_FIRST_SUBSPACE());
-        goto end;
+        if (hit_box (&(tree->bounding_box), origin, ray, bb_inter))
+            return leaf_intersection (tree, bb_inter, ray, res);
+        WITH_STAT (VOXTREES_RTI_EARLY_EXIT());
+        return NULL;
     }
-    
-    /*
-     * No luck, search for intersections of the ray and all N axis-aligned dividing planes
-     * for our N-dimentional space. If such an intersection is inside the node (it means,
-     * inside its bounding box), add it to plane_inter and mark with number of plane where
-     * intersection is occured.
-     */
-    plane_inter = alloca (sizeof (vox_dot) * VOX_N);
-    plane_inter_idx = alloca (sizeof (vox_dot) * VOX_N);
-    unsigned int plane_counter = 0;
-    for (i=0; i<VOX_N; i++)
+
+    while (1)
     {
-        plane_inter_idx[plane_counter] = i;
-        if (hit_plane_within_box (bb_inter, dir, inner->center, i, plane_inter[plane_counter],
-                                  &(tree->bounding_box))) plane_counter++;
+        /*
+         * After hit_box call we can take bb_inter as a new ray origin.
+         */
+        if (!(VOX_FULLP (tree)) ||
+            !(hit_box (&(tree->bounding_box), entry, ray, bb_inter)))
+        {
+            WITH_STAT (VOXTREES_RTI_EARLY_EXIT());
+        }
+        else if (tree->flags & VOX_LEAF_MASK)
+        {
+            if ((leaf = leaf_intersection (tree, bb_inter, ray, res)) != NULL) goto found;
+        }
+        else if (depth == SEARCH_STACK_SIZE)
+        {
+            if ((leaf = ray_tree_intersection (tree, bb_inter, ray, res)) != NULL) goto found;
+        }
+        else
+        {
+            /*
+             * Not a leaf. Look if we are lucky and the ray hits any box in
+             * the subspace of the entry point (corrected by direction, if
+             * needed) before it traverses the dividing planes.
+             */
+            frame = &(stack[depth++]);
+            frame->node = tree;
+            vox_dot_copy (frame->entry, bb_inter);
+            frame->subspace = get_corrected_subspace_idx (tree->data.inner.center, bb_inter, ray->dir);
+            frame->planes = 0;
+            frame->next = 0;
+            tree = VOX_CHILD (tree, frame->subspace);
+            entry = frame->entry;
+            continue;
+        }
+
+        /*
+         * No luck in the last child. Go to the next child of the innermost node
+         * which has one. Children are visited in the order in which the ray
+         * crosses the dividing planes, so they are visited front to back.
+         */
+        while (depth > 0)
+        {
+            frame = &(stack[depth-1]);
+            // The plane intersections are found only if they are needed
+            if (frame->next == 0 && frame->planes == 0) find_plane_intersections (frame, ray);
+            if (frame->next < frame->planes)
+            {
+                // Convert a plane number into a subspace index
+                frame->subspace ^= 1 << frame->plane_idx[frame->next];
+                tree = VOX_CHILD (frame->node, frame->subspace);
+                entry = frame->plane_inter[frame->next];
+                frame->next++;
+                break;
+            }
+            WITH_STAT (VOXTREES_RTI_WORST_CASE());
+            depth--;
+        }
+        if (depth == 0) return NULL;
+    }
+
+found:
+#ifdef STATISTICS
+    // The intersection is found in the first subspace of these nodes
+    for (; depth > 0; depth--)
+        if (stack[depth-1].next == 0) VOXTREES_RTI_FIRST_SUBSPACE();
+#endif
+    return leaf;
+}
+
+const struct vox_node*
+vox_ray_tree_intersection (const struct vox_node *tree, const vox_dot origin,
+                           const vox_dot dir, vox_dot res)
+{
+    struct vox_ray ray;
+
+    make_ray (&ray, dir);
+    return ray_tree_intersection (tree, origin, &ray, res);
+}
+
+/*
+  Packet traversal. All rays of a packet start at one origin. Inverse
+  directions are stored by axis (structure of arrays), so one bounding box is
+  tested against VOX_PACKET_SIZE rays with a few vector operations. A ray is
+  active in a node if it hits the node's bounding box before its closest
+  intersection found so far. Children are visited front to back for the
+  first active ray (they are visited in some order for others and the
+  closest intersection is kept), and only while some ray is active.
+*/
+struct ray_packet
+{
+    float inv_dir[VOX_N][VOX_PACKET_SIZE] __attribute__((aligned(16)));
+    float closest[VOX_PACKET_SIZE] __attribute__((aligned(16)));
+    vox_dot origin;
+    struct vox_ray rays[VOX_PACKET_SIZE];
+    const vox_dot *dirs;
+    vox_dot *res;
+    const struct vox_node **leafs;
+};
+
+#ifdef SSE_INTRIN
+static unsigned int packet_hit_box (const struct ray_packet *packet, const struct vox_box *box,
+                                    unsigned int active)
+{
+    unsigned int i, j, hits = 0;
+
+    for (i=0; i<VOX_PACKET_SIZE; i+=4)
+    {
+        __v4sf tmin = _mm_set_ps1 (0), tmax = _mm_set_ps1 (INFINITY);
+        if (((active >> i) & 0xf) == 0) continue;
+        for (j=0; j<VOX_N; j++)
+        {
+            __v4sf inv = _mm_load_ps (packet->inv_dir[j] + i);
+            __v4sf t1 = (_mm_set_ps1 (box->min[j]) - _mm_set_ps1 (packet->origin[j])) * inv;
+            __v4sf t2 = (_mm_set_ps1 (box->max[j]) - _mm_set_ps1 (packet->origin[j])) * inv;
+            tmin = _mm_max_ps (tmin, _mm_min_ps (t1, t2));
+            tmax = _mm_min_ps (tmax, _mm_max_ps (t1, t2));
+        }
+        __v4sf hit = _mm_and_ps (tmin <= tmax, tmin < _mm_load_ps (packet->closest + i));
+        hits |= _mm_movemask_ps (hit) << i;
     }
+    return hits & active;
+}
+#else
+static unsigned int packet_hit_box (const struct ray_packet *packet, const struct vox_box *box,
+                                    unsigned int active)
+{
+    unsigned int i, j, hits = 0;
+    float t1, t2, tmin, tmax;
 
-    for (i=0; i<plane_counter; i++)
+    for (i=0; i<VOX_PACKET_SIZE; i++)
     {
-        /*
-          We want the closest intersection to be found,
-          so find closest remaining intersection with dividing planes.
-        */
-        unsigned int j;
-        vox_dot tmp;
-        for (j=i+1; j<plane_counter; j++)
-        {
-            if (vox_abs_metric (bb_inter, plane_inter[j]) < vox_abs_metric (bb_inter, plane_inter[i]))
+        if (!(active & (1 << i))) continue;
+        tmin = 0;
+        tmax = INFINITY;
+        for (j=0; j<VOX_N; j++)
+        {
+            t1 = (box->min[j] - packet->origin[j]) * packet->inv_dir[j][i];
+            t2 = (box->max[j] - packet->origin[j]) * packet->inv_dir[j][i];
+            if (t1 > t2)
             {
-                vox_dot_copy (tmp, plane_inter[j]);
-                vox_dot_copy (plane_inter[j], plane_inter[i]);
-                vox_dot_copy (plane_inter[i], tmp);
-                tmp2 = plane_inter_idx[j];
-                plane_inter_idx[j] = plane_inter_idx[i];
-                plane_inter_idx[i] = tmp2;
+                float tmp = t1;
+                t1 = t2;
+                t2 = tmp;
             }
+            tmin = (t1 > tmin) ? t1 : tmin;
+            tmax = (t2 < tmax) ? t2 : tmax;
         }
+        if (tmin <= tmax && tmin < packet->closest[i]) hits |= 1 << i;
+    }
+    return hits;
+}
+#endif
 
-        // Convert a plane number into a subspace index
-        subspace = subspace ^ (1 << plane_inter_idx[i]);
+static void packet_leaf_intersection (struct ray_packet *packet, const struct vox_node *leaf,
+                                      unsigned int active)
+{
+    const float *dir;
+    vox_dot inter;
+    float t;
+    int i;
 
-        /*
-         * For each intersection with dividing plane call vox_ray_tree_intersection
-         * recursively, using child node specified by subspace index. If an intersection
-         * is found, return. Note, what we specify an entry point to that child as a new
-         * ray origin.
-         */
-        if ((leaf = vox_ray_tree_intersection (inner->children[subspace], plane_inter[i], dir,
-                                               res)))
-            goto end;
+    while (active)
+    {
+        i = __builtin_ctz (active);
+        active &= active - 1;
+        dir = packet->dirs[i];
+        if (ray_tree_intersection (leaf, packet->origin, &(packet->rays[i]), inter) == NULL)
+            continue;
+        // Distance along the ray in units of dir
+        t = ((inter[0] - packet->origin[0])*dir[0] +
+             (inter[1] - packet->origin[1])*dir[1] +
+             (inter[2] - packet->origin[2])*dir[2]) /
+            (dir[0]*dir[0] + dir[1]*dir[1] + dir[2]*dir[2]);
+        if (t < packet->closest[i])
+        {
+            packet->closest[i] = t;
+            vox_dot_copy (packet->res[i], inter);
+            packet->leafs[i] = leaf;
+        }
     }
-    WITH_STAT (VOXTREES_RTI_WORST_CASE());
+}
 
-end:
-    return leaf;
+static void packet_intersection (struct ray_packet *packet, const struct vox_node *tree,
+                                 unsigned int active)
+{
+    const float *dir;
+    int mask, n;
+
+    if (!(VOX_FULLP (tree))) return;
+    active = packet_hit_box (packet, &(tree->bounding_box), active);
+    if (active == 0) return;
+
+    if (tree->flags & VOX_LEAF_MASK)
+    {
+        packet_leaf_intersection (packet, tree, active);
+        return;
+    }
+
+    // Subspace bit i is set for the lower half, which is in front if dir[i] >= 0
+    dir = packet->dirs[__builtin_ctz (active)];
+    mask = (dir[0] >= 0) | (dir[1] >= 0) << 1 | (dir[2] >= 0) << 2;
+    for (n=0; n<VOX_NS; n++)
+        packet_intersection (packet, VOX_CHILD (tree, n ^ mask), active);
+}
+
+unsigned int vox_ray_tree_intersection_packet (const struct vox_node *tree, const vox_dot origin,
+                                               const vox_dot dirs[], unsigned int n,
+                                               vox_dot res[], const struct vox_node *leafs[])
+{
+    struct ray_packet packet;
+    unsigned int i, j, hits = 0;
+
+    if (n > VOX_PACKET_SIZE) n = VOX_PACKET_SIZE;
+    vox_dot_copy (packet.origin, origin);
+    packet.dirs = dirs;
+    packet.res = res;
+    packet.leafs = leafs;
+    for (i=0; i<VOX_PACKET_SIZE; i++)
+    {
+        // Unused rays are never active
+        packet.closest[i] = (i < n) ? INFINITY : -1;
+        for (j=0; j<VOX_N; j++)
+            /*
+              A huge number instead of infinity for zero components, so that
+              a ray lying on a face of a box (0 * inf) does not give NaN.
+            */
+            packet.inv_dir[j][i] = (i < n && dirs[i][j] != 0) ? 1 / dirs[i][j] : 1e30;
+    }
+    for (i=0; i<n; i++)
+    {
+        make_ray (&(packet.rays[i]), dirs[i]);
+        leafs[i] = NULL;
+    }
+
+    packet_intersection (&packet, tree, (1 << n) - 1);
+    for (i=0; i<n; i++)
+        if (leafs[i] != NULL) hits |= 1 << i;
+    return hits;
 }
 
 int vox_tree_ball_collidep (const struct vox_node *tree, const vox_dot center, float radius)
@@ -161,21 +483,36 @@ int vox_tree_ball_collidep (const struct vox_node *tree, const vox_dot center, f
         if (tree->flags & VOX_DENSE_LEAF) return 1;
         if (tree->flags & VOX_LEAF)
         {
-            vox_dot *dots = tree->data.dots;
+            vox_dot *dots = leaf_dots (tree, alloca (sizeof (vox_dot) * VOX_MAX_DOTS));
             struct vox_box *voxel = alloca (sizeof (struct vox_box));
+            unsigned int candidates = 0, width = geom_kernels->width;
             for (i=0; i<tree->dots_num; i++)
             {
+                if (i % width == 0)
+                    candidates = geom_kernels->voxels_near_ball (dots, i, tree->dots_num,
+                                                                 center, radius);
+                if (!(candidates & (1u << (i % width)))) continue;
                 vox_dot_copy (voxel->min, dots[i]);
                 vox_dot_add (voxel->min, vox_voxel, voxel->max);
                 if (box_ball_interp (voxel, center, radius)) return 1;
             }
         }
+        else if (tree->flags & VOX_BRICK)
+        {
+            struct vox_box *voxel = alloca (sizeof (struct vox_box));
+            uint64_t mask;
+            for (mask = tree->data.brick.mask; mask != 0; mask &= mask - 1)
+            {
+                brick_voxel (tree, __builtin_ctzll (mask), voxel->min);
+                vox_dot_add (voxel->min, vox_voxel, voxel->max);
+                if (box_ball_interp (voxel, center, radius)) return 1;
+            }
+        }
         else
         {
-            vox_inner_data inner = tree->data.inner;
             for (i=0; i<VOX_NS; i++)
             {
-                if (vox_tree_ball_collidep (inner.children[i], center, radius)) return 1;
+                if (vox_tree_ball_collidep (VOX_CHILD (tree, i), center, radius)) return 1;
             }
         }
     }
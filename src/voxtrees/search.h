@@ -25,6 +25,47 @@ VOX_EXPORT const struct vox_node*
 vox_ray_tree_intersection (const struct vox_node* tree, const vox_dot origin,
                            const vox_dot dir, vox_dot res);
 
+#ifdef VOXTREES_SOURCE
+#include "geom.h"
+
+/*
+  Like vox_ray_tree_intersection() for a ray with precomputed inverse
+  direction. This is used by other searches to prepare the ray only once.
+*/
+const struct vox_node*
+ray_tree_intersection (const struct vox_node* tree, const vox_dot origin,
+                       const struct vox_ray *ray, vox_dot res);
+#endif
+
+/**
+   \brief Maximal number of rays in a packet.
+**/
+#define VOX_PACKET_SIZE 16
+
+/**
+   \brief Find intersections of a tree and a packet of rays.
+
+   All rays start at the same origin. This is faster than calling
+   vox_ray_tree_intersection() for each ray if the rays have close
+   directions (e.g. rays through neighbouring pixels), because each node
+   is visited once for the whole packet and its bounding box is tested
+   against all rays at once. The closest intersection is found for each
+   ray.
+
+   \param tree a tree
+   \param origin starting point of the rays
+   \param dirs directions of the rays
+   \param n number of rays (not more than VOX_PACKET_SIZE)
+   \param res where intersections are stored
+   \param leafs where leafs with intersections (or NULL) are stored
+
+   \return a bit mask of rays which hit the tree
+**/
+VOX_EXPORT unsigned int
+vox_ray_tree_intersection_packet (const struct vox_node *tree, const vox_dot origin,
+                                  const vox_dot dirs[], unsigned int n,
+                                  vox_dot res[], const struct vox_node *leafs[]);
+
 /**
    \brief Find out if a ball collides with voxels in a tree
 
@@ -1,10 +1,25 @@
+#ifdef USE_GCD
+#include <dispatch/dispatch.h>
+#else
+#include "../gcd-stubs.c"
+#endif
 #include <math.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "tree.h"
+#include "arena.h"
 #include "geom.h"
 #include "probes.h"
 
@@ -28,49 +43,6 @@ static void update_fill_ratio (const struct vox_box *box, size_t n)
 #endif
 
 #ifdef SSE_INTRIN
-static void find_center (const vox_dot set[], size_t n, const struct vox_box *box, vox_dot res)
-{
-    size_t i;
-    __v4sf len = _mm_set_ps1 (n);
-    __v4sf sum = _mm_set_ps1 (0.0);
-    __v4sf voxel = _mm_load_ps (vox_voxel);
-    __v4sf min = _mm_load_ps (box->min);
-
-    /*
-     * Subtract bounding box minimal value from voxel coordinates to reduce
-     * computational error. I add it again after division by len.
-     */
-    for (i=0; i<n; i++) sum += (_mm_load_ps (set[i]) - min);
-    sum /= len;
-    sum += min;
-
-    /*
-     * Align the center of division, so any voxel belongs to only one subspace
-     * entirely. Faces of voxels may be the exception though
-     */
-    __v4sf resv = sum / voxel;
-    resv = _mm_ceil_ps (resv) * voxel;
-
-    _mm_store_ps (res, resv);
-}
-
-static void calc_bounding_box (const vox_dot set[], size_t n, struct vox_box *box)
-{
-    size_t i;
-    __v4sf min = _mm_load_ps (set[0]);
-    __v4sf max = min;
-
-    for (i=1; i<n; i++)
-    {
-        min = _mm_min_ps (min, _mm_load_ps (set[i]));
-        max = _mm_max_ps (max, _mm_load_ps (set[i]));
-    }
-    max += _mm_load_ps (vox_voxel);
-
-    _mm_store_ps (box->min, min);
-    _mm_store_ps (box->max, max);
-}
-
 /*
   SIMD version of this function. For use in SIMD code.
 */
@@ -84,6 +56,9 @@ static size_t sort_set (vox_dot set[], size_t n, size_t offset, int subspace, co
 {
     size_t i, counter = offset;
     __v4sf center_, boundary_dot, dot;
+
+    // Nothing is left to sort
+    if (offset == n) return n;
     center_ = _mm_load_ps (center);
     boundary_dot = _mm_load_ps (set[offset]);
 
@@ -94,7 +69,12 @@ static size_t sort_set (vox_dot set[], size_t n, size_t offset, int subspace, co
         {
             _mm_store_ps (set[counter], dot);
             _mm_store_ps (set[i], boundary_dot);
-            boundary_dot = _mm_load_ps (set[++counter]);
+            /*
+             * Do not read past the end of the set. This also matters when
+             * the neighbouring memory belongs to a subtree which is being
+             * built in parallel.
+             */
+            if (++counter < n) boundary_dot = _mm_load_ps (set[counter]);
         }
     }
 
@@ -109,6 +89,37 @@ static void vox_align (vox_dot dot)
     _mm_store_ps (dot, tmp*voxel);
 }
 
+/*
+  Position of a voxel on the grid of vox_voxel. q must have room for 4
+  elements.
+*/
+static void quantize_dot (const vox_dot dot, int q[])
+{
+    __v4sf d = _mm_floor_ps (_mm_load_ps (dot) / _mm_load_ps (vox_voxel));
+    _mm_storeu_si128 ((__m128i*)q, _mm_cvtps_epi32 (d));
+}
+
+static void decode_leaf (const struct vox_node *leaf, vox_dot *dots)
+{
+    __v4sf voxel = _mm_load_ps (vox_voxel);
+    __v4sf base = _mm_round_ps (_mm_load_ps (leaf->bounding_box.min) / voxel,
+                                _MM_FROUND_TO_NEAREST_INT);
+    const void *data = &(leaf->data);
+    __m128i q;
+    unsigned int i;
+
+    // The fourth coordinate is always zero (vox_voxel[3] is zero)
+    base = _mm_blend_ps (base, _mm_setzero_ps(), 8);
+    for (i=0; i<leaf->dots_num; i++)
+    {
+        if (leaf->flags & VOX_QUANT8)
+            q = _mm_cvtepu8_epi32 (_mm_cvtsi32_si128 (((const uint32_t*)data)[i]));
+        else
+            q = _mm_cvtepu16_epi32 (_mm_loadl_epi64 ((const __m128i*)((const uint64_t*)data + i)));
+        _mm_store_ps (dots[i], (base + _mm_cvtepi32_ps (q)) * voxel);
+    }
+}
+
 static void update_bounding_box (struct vox_box *box, const vox_dot dot)
 {
     __v4sf d = _mm_load_ps (dot);
@@ -122,38 +133,6 @@ static void update_bounding_box (struct vox_box *box, const vox_dot dot)
 }
 
 #else /* SSE_INTRIN */
-static void find_center (const vox_dot set[], size_t n, const struct vox_box *box, vox_dot res)
-{
-    size_t i;
-    memset (res, 0, sizeof(vox_dot));
-    vox_dot tmp;
-
-    for (i=0; i<n; i++) {
-        vox_dot_sub (set[i], box->min, tmp);
-        vox_dot_add (tmp, res, res);
-    }
-    for (i=0; i<VOX_N; i++) res[i] = ceilf ((res[i]/n + box->min[i])/vox_voxel[i])*vox_voxel[i];
-}
-
-static void calc_bounding_box (const vox_dot set[], size_t n, struct vox_box *box)
-{
-    size_t i;
-    int j;
-    
-    vox_dot_copy (box->min, set[0]);
-    vox_dot_copy (box->max, set[0]);
-
-    for (i=0; i<n; i++)
-    {
-        for (j=0; j<VOX_N; j++)
-        {
-            if (set[i][j] < box->min[j]) box->min[j] = set[i][j];
-            else if (set[i][j] > box->max[j]) box->max[j] = set[i][j];
-        }
-    }
-    vox_dot_add (box->max, vox_voxel, box->max);
-}
-
 /**
    \brief Move dots with needed subspace close to offset
    \param in a set to be modified
@@ -194,6 +173,28 @@ static void vox_align (vox_dot dot)
     }
 }
 
+static void quantize_dot (const vox_dot dot, int q[])
+{
+    unsigned int i;
+    for (i=0; i<VOX_N; i++) q[i] = floorf (dot[i] / vox_voxel[i]);
+}
+
+static void decode_leaf (const struct vox_node *leaf, vox_dot *dots)
+{
+    const uint8_t *q8 = (const void*)&(leaf->data);
+    const uint16_t *q16 = (const void*)&(leaf->data);
+    unsigned int i, j;
+    float base[VOX_N];
+
+    for (j=0; j<VOX_N; j++) base[j] = rintf (leaf->bounding_box.min[j] / vox_voxel[j]);
+    for (i=0; i<leaf->dots_num; i++)
+    {
+        for (j=0; j<VOX_N; j++)
+            dots[i][j] = (base[j] + ((leaf->flags & VOX_QUANT8) ?
+                                     q8[4*i+j] : q16[4*i+j])) * vox_voxel[j];
+    }
+}
+
 static void update_bounding_box (struct vox_box *box, const vox_dot dot)
 {
     vox_dot dot_max;
@@ -209,26 +210,50 @@ static void update_bounding_box (struct vox_box *box, const vox_dot dot)
 
 #endif /* SSE_INTRIN */
 
-static void* node_alloc (int flavor)
+/*
+  All nodes of a tree (and arrays of voxels in its leafs) are allocated in
+  the tree's arena (see arena.h). The arena is created when the first node
+  of a tree is created and destroyed together with the whole tree.
+*/
+static int node_class (int flavor)
 {
-    /*
-      FIXME: We may need to be sure if vox_dot fields of node
-      structure are properly aligned in future, so use vox_alloc()
-      instead of malloc()
-    */
-    size_t size = offsetof (struct vox_node, data);
-    size_t addend;
+    if (flavor & VOX_DENSE_LEAF) return ARENA_DENSE_LEAF;
+    else if (flavor & VOX_BRICK) return ARENA_BRICK;
+    else if (flavor & VOX_LEAF) return ARENA_LEAF;
+    else return ARENA_INNER;
+}
 
-    if (flavor & VOX_DENSE_LEAF) addend = 0;
-    else if (flavor & VOX_LEAF) addend = sizeof (vox_dot*);
-    else addend = sizeof (vox_inner_data);
+static void* node_alloc (struct vox_arena *arena, int flavor)
+{
+    return arena_alloc (arena, node_class (flavor));
+}
 
-    return vox_alloc (size+addend);
+// Free one node (but not its children)
+static void node_free (struct vox_node *node)
+{
+    if (node->flags & VOX_LEAF)
+    {
+        if (node->flags & VOX_OVERFLOW) arena_free_large (node->data.dots);
+        else arena_free (node->data.dots, ARENA_DOTS);
+    }
+    arena_free (node, node_class (node->flags));
 }
 
-struct vox_node* vox_make_dense_leaf (const struct vox_box *box)
+// Free a subtree, returning its nodes to the arena
+static void destroy_subtree (struct vox_node *tree)
 {
-    struct vox_node *res = node_alloc (VOX_DENSE_LEAF);
+    unsigned int i;
+    if (VOX_FULLP (tree))
+    {
+        if (!(tree->flags & VOX_LEAF_MASK))
+            for (i=0; i<VOX_NS; i++) destroy_subtree (tree->data.inner.children[i]);
+        node_free (tree);
+    }
+}
+
+struct vox_node* make_dense_leaf (struct vox_arena *arena, const struct vox_box *box)
+{
+    struct vox_node *res = node_alloc (arena, VOX_DENSE_LEAF);
     size_t dim[3];
 
     vox_box_copy (&(res->bounding_box), box);
@@ -239,14 +264,115 @@ struct vox_node* vox_make_dense_leaf (const struct vox_box *box)
     return res;
 }
 
+struct vox_node* vox_make_dense_leaf (const struct vox_box *box)
+{
+    return make_dense_leaf (arena_new (), box);
+}
+
+/*
+  Bricks. A set of more than VOX_MAX_DOTS voxels becomes a brick if all of
+  them lay on the grid of a brick cell which starts at the minimal corner
+  of the set's bounding box. Insertion and deletion of voxels inside the
+  cell only flip bits of the mask.
+*/
+
+/*
+  Index of a voxel's bit in a brick cell with the origin origin or -1 if
+  the voxel cannot be stored in this cell.
+*/
+static int brick_index (const vox_dot origin, const vox_dot voxel)
+{
+    unsigned int i;
+    int k, idx = 0;
+
+    for (i=0; i<VOX_N; i++)
+    {
+        k = rintf ((voxel[i] - origin[i]) / vox_voxel[i]);
+        if (k < 0 || k >= VOX_BRICK_SIDE ||
+            origin[i] + k*vox_voxel[i] != voxel[i]) return -1;
+        idx |= k << (2*i);
+    }
+    return idx;
+}
+
+void brick_voxel (const struct vox_node *brick, int idx, vox_dot res)
+{
+    const float *origin = brick->data.brick.origin;
+    vox_dot_set (res,
+                 origin[0] + (idx & 3) * vox_voxel[0],
+                 origin[1] + ((idx >> 2) & 3) * vox_voxel[1],
+                 origin[2] + (idx >> 4) * vox_voxel[2]);
+}
+
+// Shrink the bounding box of a brick to its voxels
+static void brick_bounding_box (struct vox_node *brick)
+{
+    // Voxels with zero coordinate along each axis
+    static const uint64_t planes[VOX_N] = {
+        0x1111111111111111, 0x000f000f000f000f, 0x000000000000ffff
+    };
+    const vox_brick_data *data = &(brick->data.brick);
+    unsigned int i;
+    int k, lo, hi;
+
+    for (i=0; i<VOX_N; i++)
+    {
+        lo = VOX_BRICK_SIDE;
+        hi = -1;
+        for (k=0; k<VOX_BRICK_SIDE; k++)
+        {
+            if (data->mask & (planes[i] << (k << (2*i))))
+            {
+                lo = (k < lo) ? k : lo;
+                hi = k;
+            }
+        }
+        brick->bounding_box.min[i] = data->origin[i] + lo*vox_voxel[i];
+        brick->bounding_box.max[i] = data->origin[i] + (hi+1)*vox_voxel[i];
+    }
+}
+
+// Return NULL if the set cannot be stored in a brick
+static struct vox_node* make_brick (struct vox_arena *arena, const vox_dot set[], size_t n,
+                                    const struct vox_box *box)
+{
+    struct vox_node *brick;
+    uint64_t mask = 0;
+    unsigned int i;
+    size_t j;
+    int idx;
+
+    for (i=0; i<VOX_N; i++)
+        if (box->max[i] - box->min[i] > (VOX_BRICK_SIDE + 0.5) * vox_voxel[i]) return NULL;
+
+    for (j=0; j<n; j++)
+    {
+        idx = brick_index (box->min, set[j]);
+        if (idx < 0) return NULL;
+        mask |= (uint64_t)1 << idx;
+    }
+    // Sets with duplicates go to overflow leafs
+    if ((size_t)__builtin_popcountll (mask) != n) return NULL;
+
+    brick = node_alloc (arena, VOX_BRICK);
+    vox_box_copy (&(brick->bounding_box), box);
+    brick->flags = VOX_BRICK;
+    brick->dots_num = n;
+    vox_dot_copy (brick->data.brick.origin, box->min);
+    brick->data.brick.mask = mask;
+
+    return brick;
+}
+
 /*
   Self-explanatory. No, really.
   Being short: if number of voxels in a set is less or equal
   to maximum number allowed, create a leaf and store voxels there.
   Otherwise split the set into 2^N parts and proceed with each of subsets
-  recursively.
+  recursively. Subsets do not overlap, so if the set is big enough
+  (VOX_PARALLEL_THRESHOLD), the subtrees are built in parallel.
 */
-struct vox_node* vox_make_tree (vox_dot set[], size_t n)
+struct vox_node* make_tree (struct vox_arena *arena, vox_dot set[], size_t n)
 {
     struct vox_node *node  = NULL;
     int leafp, densep;
@@ -254,16 +380,18 @@ struct vox_node* vox_make_tree (vox_dot set[], size_t n)
     if (n > 0)
     {
         struct vox_box box;
-        calc_bounding_box (set, n, &box);
+        geom_kernels->bounding_box (set, n, &box);
         densep = (dense_set_p (&box, n)) ? VOX_DENSE_LEAF : 0;
         leafp = (n <= VOX_MAX_DOTS) ? VOX_LEAF : 0;
-        node = node_alloc (densep | leafp);
+        if (!(densep | leafp) && (node = make_brick (arena, set, n, &box)) != NULL)
+            goto done;
+        node = node_alloc (arena, densep | leafp);
         node->dots_num = n;
         vox_box_copy (&(node->bounding_box), &box);
         if (densep) node->flags = VOX_DENSE_LEAF;
         else if (leafp)
         {
-            node->data.dots = vox_alloc (VOX_MAX_DOTS*sizeof(vox_dot));
+            node->data.dots = arena_alloc (arena, ARENA_DOTS);
             memcpy (node->data.dots, set, n*sizeof(vox_dot));
             node->flags = VOX_LEAF;
         }
@@ -271,20 +399,23 @@ struct vox_node* vox_make_tree (vox_dot set[], size_t n)
         {
             int idx;
             vox_inner_data *inner = &(node->data.inner);
-            size_t new_offset, offset = 0;
+            size_t offsets[VOX_NS+1];
+            /* Blocks cannot capture arrays */
+            size_t *offs = offsets;
 
             node->flags = 0;
-            find_center (set, n, &(node->bounding_box), inner->center);
+            geom_kernels->find_center (set, n, &(node->bounding_box), inner->center);
+            offsets[0] = 0;
             for (idx=0; idx<VOX_NS; idx++)
             {
-                new_offset = sort_set (set, n, offset, idx, inner->center);
-                if (offset == 0 && new_offset == n) {
+                offsets[idx+1] = sort_set (set, n, offsets[idx], idx, inner->center);
+                if (offsets[idx] == 0 && offsets[idx+1] == n) {
                     /*
                      * In this case my current algorithm cannot divide voxels
                      * into two or more subspaces. We just create one overflowed
                      * leaf (meaning it has number of voxels > VOX_MAX_DOTS).
                      */
-                    struct vox_node *newnode = node_alloc (VOX_LEAF);
+                    struct vox_node *newnode = node_alloc (arena, VOX_LEAF);
                     vox_box_copy (&(newnode->bounding_box), &(node->bounding_box));
                     /*
                      * I set VOXOVERFLOW flag only for statistics and testing.
@@ -293,21 +424,41 @@ struct vox_node* vox_make_tree (vox_dot set[], size_t n)
                      */
                     newnode->flags = VOX_LEAF | VOX_OVERFLOW;
                     newnode->dots_num = n;
-                    newnode->data.dots = vox_alloc (n*sizeof(vox_dot));
+                    newnode->data.dots = arena_alloc_large (arena, n*sizeof(vox_dot));
                     memcpy (newnode->data.dots, set, n*sizeof(vox_dot));
                     /*
                      * We can free() the old node, since it has not any
                      * allocated children.
                      */
-                    free (node);
+                    node_free (node);
                     node = newnode;
-                    break;
+                    goto done;
                 }
-                inner->children[idx] = vox_make_tree (set+offset, new_offset-offset);
-                offset = new_offset;
+            }
+
+            if (n < VOX_PARALLEL_THRESHOLD)
+            {
+                for (idx=0; idx<VOX_NS; idx++)
+                    inner->children[idx] = make_tree (arena, set + offsets[idx],
+                                                      offsets[idx+1] - offsets[idx]);
+            }
+            else
+            {
+                // Arenas are not thread-safe, so each subtree gets its own
+                struct vox_arena *arenas[VOX_NS];
+                struct vox_arena **child_arenas = arenas;
+
+                for (idx=0; idx<VOX_NS; idx++) arenas[idx] = arena_new ();
+                dispatch_apply (VOX_NS, dispatch_get_global_queue (DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+                                ^(size_t i) {
+                                    inner->children[i] = make_tree (child_arenas[i], set + offs[i],
+                                                                    offs[i+1] - offs[i]);
+                                });
+                for (idx=0; idx<VOX_NS; idx++) arena_merge (arena, arenas[idx]);
             }
         }
     }
+done:
 #ifdef STATISTICS
     if (!(VOX_FULLP (node)))
     {
@@ -325,6 +476,7 @@ struct vox_node* vox_make_tree (vox_dot set[], size_t n)
                 VOXTREES_DENSE_DOTS (n);
             }
             else update_fill_ratio (&(node->bounding_box), n);
+            if (node->flags & VOX_BRICK) VOXTREES_BRICK_NODE();
             VOXTREES_LEAF_NODE();
             if (node->flags & VOX_OVERFLOW) {
                 VOXTREES_LEAF_OVERFLOW();
@@ -337,538 +489,2680 @@ struct vox_node* vox_make_tree (vox_dot set[], size_t n)
     return node;
 }
 
-size_t vox_voxels_in_tree (const struct vox_node *tree)
+struct vox_node* vox_make_tree (vox_dot set[], size_t n)
 {
-    return (VOX_FULLP (tree)) ? tree->dots_num : 0;
+    struct vox_arena *arena = arena_new ();
+    struct vox_node *tree = make_tree (arena, set, n);
+
+    if (!(VOX_FULLP (tree))) arena_destroy (arena);
+    return tree;
 }
 
-void vox_destroy_tree (struct vox_node *tree)
+/*
+  Z-order tree builder.
+
+  Voxels are placed on the grid of vox_voxel and their grid coordinates are
+  interleaved into 63-bit Morton codes (21 bits per axis), so that voxels of
+  any octant of the grid form a contiguous run of sorted codes. The codes are
+  sorted with LSD radix sort and the tree is built by splitting the sorted
+  array at octant boundaries.
+*/
+#define MORTON_BITS 21
+
+static uint64_t spread_bits (uint64_t x)
+{
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffff;
+    x = (x | x << 16) & 0x1f0000ff0000ff;
+    x = (x | x << 8)  & 0x100f00f00f00f00f;
+    x = (x | x << 4)  & 0x10c30c30c30c30c3;
+    x = (x | x << 2)  & 0x1249249249249249;
+    return x;
+}
+
+static int compact_bits (uint64_t x)
+{
+    x &= 0x1249249249249249;
+    x = (x ^ (x >> 2))  & 0x10c30c30c30c30c3;
+    x = (x ^ (x >> 4))  & 0x100f00f00f00f00f;
+    x = (x ^ (x >> 8))  & 0x1f0000ff0000ff;
+    x = (x ^ (x >> 16)) & 0x1f00000000ffff;
+    x = (x ^ (x >> 32)) & 0x1fffff;
+    return x;
+}
+
+static void morton_grid_position (uint64_t code, int q[])
 {
     unsigned int i;
-    if (VOX_FULLP (tree))
-    {
-        if (tree->flags & VOX_LEAF)
-            free (tree->data.dots);
-        else if (!(tree->flags & VOX_LEAF_MASK))
-            for (i=0; i<VOX_NS; i++) vox_destroy_tree (tree->data.inner.children[i]);
-        free (tree);
-    }
+    for (i=0; i<VOX_N; i++) q[i] = compact_bits (code >> i);
 }
 
-void vox_bounding_box (const struct vox_node* tree, struct vox_box *box)
+static void morton_dot (uint64_t code, const int origin[], vox_dot dot)
 {
-    vox_box_copy (box, &(tree->bounding_box));
+    int q[VOX_N];
+    morton_grid_position (code, q);
+    vox_dot_set (dot,
+                 (origin[0] + q[0]) * vox_voxel[0],
+                 (origin[1] + q[1]) * vox_voxel[1],
+                 (origin[2] + q[2]) * vox_voxel[2]);
 }
 
 /*
-  Turn a tree back to plain array
+  Sort codes using bits lowest bits as a key. Return a pointer to sorted
+  array, which is either codes or tmp.
 */
-static size_t flatten_tree (const struct vox_node *tree, vox_dot *set)
+static uint64_t* radix_sort (uint64_t *codes, uint64_t *tmp, size_t n, unsigned int bits)
 {
-    size_t count = 0;
-    if (VOX_FULLP (tree))
-    {
-        if (tree->flags & VOX_LEAF)
-        {
-            memcpy (set, tree->data.dots, tree->dots_num * sizeof(vox_dot));
-            count = tree->dots_num;
-        }
-        else if (tree->flags & VOX_DENSE_LEAF)
-        {
-            size_t i,j,k;
-            vox_dot current;
-            size_t dim[VOX_N];
-            /*
-              XXX: This requires reworking.
+    size_t i, count[256];
+    unsigned int shift;
+    uint64_t *swap;
 
-              Here I find the the number of voxels in a dense leaf along each
-              axis. This number is, of course, integer, but I have only
-              floating point coordinates of the bounding box. Therefore dim[]
-              will be calculated improperly if the precision of floating
-              point arithmetic is not enough.
-            */
-            get_dimensions (&(tree->bounding_box), dim);
-            assert (dim[0]*dim[1]*dim[2] == tree->dots_num);
-            current[0] = tree->bounding_box.min[0];
-            for (i=0; i<dim[0]; i++)
-            {
-                current[1] = tree->bounding_box.min[1];
-                for (j=0; j<dim[1]; j++)
-                {
-                    current[2] = tree->bounding_box.min[2];
-                    for (k=0; k<dim[2]; k++)
-                    {
-                        vox_dot_copy (set[count], current);
-                        current[2] += vox_voxel[2];
-                        count++;
-                    }
-                    current[1] += vox_voxel[1];
-                }
-                current[0] += vox_voxel[0];
-            }
-        }
-        else
+    for (shift=0; shift<bits; shift+=8)
+    {
+        size_t pos = 0;
+        memset (count, 0, sizeof (count));
+        for (i=0; i<n; i++) count[(codes[i] >> shift) & 0xff]++;
+        for (i=0; i<256; i++)
         {
-            unsigned int i;
-            for (i=0; i<VOX_NS; i++)
-            {
-                size_t subcount = flatten_tree (tree->data.inner.children[i], set);
-                set += subcount;
-                count += subcount;
-            }
+            size_t c = count[i];
+            count[i] = pos;
+            pos += c;
         }
+        for (i=0; i<n; i++) tmp[count[(codes[i] >> shift) & 0xff]++] = codes[i];
+        swap = codes; codes = tmp; tmp = swap;
     }
-    return count;
+
+    return codes;
 }
 
-struct vox_node* vox_rebuild_tree (const struct vox_node *tree)
+// Index of the first code which is not less than key
+static size_t lower_bound (const uint64_t *codes, size_t n, uint64_t key)
 {
-    struct vox_node *new_tree = NULL;
-    if (VOX_FULLP (tree))
+    size_t start = 0, end = n;
+    while (start < end)
     {
-        vox_dot *dots = vox_alloc (sizeof(vox_dot) * tree->dots_num);
-        flatten_tree (tree, dots);
-        new_tree = vox_make_tree (dots, tree->dots_num);
-        free (dots);
+        size_t mid = start + (end - start) / 2;
+        if (codes[mid] < key) start = mid + 1;
+        else end = mid;
     }
-    return new_tree;
+    return start;
 }
 
-static int voxel_in_tree (const struct vox_node *tree, const vox_dot voxel)
+static void box_union (struct vox_box *box, const struct vox_box *other)
 {
     unsigned int i;
-
-    if (VOX_FULLP (tree) &&
-        voxel_in_box (&(tree->bounding_box), voxel))
+    for (i=0; i<VOX_N; i++)
     {
-        if (tree->flags & VOX_DENSE_LEAF) return 1;
-        if (tree->flags & VOX_LEAF)
-        {
-            for (i=0; i<tree->dots_num; i++)
-                if (vox_dot_equalp (voxel, tree->data.dots[i])) return 1;
-        }
-        else
-        {
-            const vox_inner_data *inner = &(tree->data.inner);
-            i = get_subspace_idx (inner->center, voxel);
-            return voxel_in_tree (inner->children[i], voxel);
-        }
+        box->min[i] = fminf (box->min[i], other->min[i]);
+        box->max[i] = fmaxf (box->max[i], other->max[i]);
     }
-    return 0;
 }
 
-static void vox_insert_voxel_ (struct vox_node **tree_ptr, const vox_dot voxel);
-static struct vox_node* __attribute__((noinline)) // always inserts
-    insert_in_big_dense (struct vox_node *tree, const vox_dot voxel)
+static struct vox_node* morton_leaf (struct vox_arena *arena, const uint64_t *codes,
+                                     size_t n, const int origin[])
+{
+    struct vox_node *node;
+    vox_dot small_set[VOX_BRICK_VOXELS];
+    vox_dot *set = small_set;
+    size_t i;
+
+    /* More than VOX_BRICK_VOXELS codes here are possible only for duplicates */
+    if (n > VOX_BRICK_VOXELS) set = vox_alloc (n*sizeof(vox_dot));
+    for (i=0; i<n; i++) morton_dot (codes[i], origin, set[i]);
+    node = make_tree (arena, set, n);
+    if (set != small_set) free (set);
+
+    return node;
+}
+
+static struct vox_node* morton_node (struct vox_arena *arena, const uint64_t *codes,
+                                     size_t n, const int origin[])
 {
-    /*
-      Put a dense leaf and this voxel in a new inner node.
-      Benchmarks show that this is the slowest part of this function
-      (especially when compiled with SSE_INTRIN).
-    */
-    int idx1, idx2;
     struct vox_node *node;
     vox_inner_data *inner;
+    size_t bounds[VOX_NS+1];
+    /* Blocks cannot capture arrays */
+    size_t *b = bounds;
+    int q[VOX_N];
+    unsigned int i, level, shift;
+    uint64_t prefix;
 
-    node = node_alloc (0);
-    inner = &(node->data.inner);
-    memset (inner, 0, sizeof (vox_inner_data));
-    vox_box_copy (&(node->bounding_box), &(tree->bounding_box));
-    update_bounding_box (&(node->bounding_box), voxel);
+    /*
+      Codes which differ only in the lowest 2*VOX_N bits belong to one cell
+      of VOX_BRICK_SIDE^3 voxels, so they are stored in a brick (or a dense
+      leaf).
+    */
+    if (n <= VOX_MAX_DOTS || (codes[0] ^ codes[n-1]) < (1 << 2*VOX_N))
+        return morton_leaf (arena, codes, n, origin);
+
+    /*
+      All codes in this range share the bits above the highest differing
+      bit, so the octants at all coarser levels contain either all voxels
+      or none. Skip them and split at the first level where voxels diverge.
+    */
+    level = (63 - __builtin_clzll (codes[0] ^ codes[n-1])) / VOX_N;
+    shift = VOX_N * level;
+    prefix = codes[0] >> (shift + VOX_N);
+    bounds[0] = 0;
+    for (i=1; i<VOX_NS; i++)
+        bounds[i] = bounds[i-1] + lower_bound (codes + bounds[i-1], n - bounds[i-1],
+                                               ((prefix << VOX_N) | i) << shift);
+    bounds[VOX_NS] = n;
+
+    node = node_alloc (arena, 0);
+    node->flags = 0;
+    node->dots_num = n;
+    inner = &(node->data.inner);
+
+    /*
+      Octant digit i has bit j set if the voxel is not less than the center on
+      axis j, while subspace index has this bit set if the voxel is less than
+      the center. Hence the child with digit i goes to subspace i^(VOX_NS-1).
+    */
+    morton_grid_position (codes[0], q);
+    for (i=0; i<VOX_N; i++) q[i] = ((q[i] >> level) | 1) << level;
+    vox_dot_set (inner->center,
+                 (origin[0] + q[0]) * vox_voxel[0],
+                 (origin[1] + q[1]) * vox_voxel[1],
+                 (origin[2] + q[2]) * vox_voxel[2]);
+
+    if (n < VOX_PARALLEL_THRESHOLD)
+    {
+        for (i=0; i<VOX_NS; i++)
+            inner->children[i^(VOX_NS-1)] = (bounds[i] == bounds[i+1]) ? NULL :
+                morton_node (arena, codes + bounds[i], bounds[i+1] - bounds[i], origin);
+    }
+    else
+    {
+        struct vox_arena *arenas[VOX_NS];
+        struct vox_arena **child_arenas = arenas;
+
+        for (i=0; i<VOX_NS; i++) arenas[i] = arena_new ();
+        dispatch_apply (VOX_NS, dispatch_get_global_queue (DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+                        ^(size_t j) {
+                            inner->children[j^(VOX_NS-1)] = (b[j] == b[j+1]) ? NULL :
+                                morton_node (child_arenas[j], codes + b[j], b[j+1] - b[j], origin);
+                        });
+        for (i=0; i<VOX_NS; i++) arena_merge (arena, arenas[i]);
+    }
+
+    node->bounding_box.min[0] = INFINITY;
+    for (i=0; i<VOX_NS; i++)
+    {
+        const struct vox_node *child = inner->children[i];
+        if (!(VOX_FULLP (child))) continue;
+        if (node->bounding_box.min[0] == INFINITY)
+            vox_box_copy (&(node->bounding_box), &(child->bounding_box));
+        else box_union (&(node->bounding_box), &(child->bounding_box));
+    }
+
+    // Merge dense children which fill the whole bounding box
+    if (dense_set_p (&(node->bounding_box), n))
+    {
+        struct vox_node *dense = make_dense_leaf (arena, &(node->bounding_box));
+        destroy_subtree (node);
+        return dense;
+    }
+    WITH_STAT (VOXTREES_INNER_NODE());
+
+    return node;
+}
+
+struct vox_node* vox_make_tree_morton (const vox_dot set[], size_t n)
+{
+    struct vox_node *tree = NULL;
+    struct vox_arena *arena;
+    uint64_t *codes, *tmp, *sorted;
+    int q[VOX_N+1], min[VOX_N], max[VOX_N];
+    unsigned int i, bits;
+    size_t j;
+
+    if (n == 0) return NULL;
+
+    for (i=0; i<VOX_N; i++)
+    {
+        min[i] = INT_MAX;
+        max[i] = INT_MIN;
+    }
+    for (j=0; j<n; j++)
+    {
+        quantize_dot (set[j], q);
+        for (i=0; i<VOX_N; i++)
+        {
+            min[i] = (q[i] < min[i]) ? q[i] : min[i];
+            max[i] = (q[i] > max[i]) ? q[i] : max[i];
+        }
+    }
+
+    bits = 0;
+    for (i=0; i<VOX_N; i++)
+    {
+        uint64_t span = (int64_t)max[i] - min[i];
+        while (bits < 64 && (span >> bits)) bits++;
+    }
+
+    if (bits > MORTON_BITS)
+    {
+        // Too big for 63-bit codes, use the usual builder
+        vox_dot *copy = vox_alloc (n*sizeof(vox_dot));
+        memcpy (copy, set, n*sizeof(vox_dot));
+        tree = vox_make_tree (copy, n);
+        free (copy);
+        return tree;
+    }
+
+    codes = malloc (n*sizeof(uint64_t));
+    tmp = malloc (n*sizeof(uint64_t));
+    for (j=0; j<n; j++)
+    {
+        quantize_dot (set[j], q);
+        codes[j] =
+            spread_bits (q[0] - min[0]) |
+            spread_bits (q[1] - min[1]) << 1 |
+            spread_bits (q[2] - min[2]) << 2;
+    }
+    sorted = radix_sort (codes, tmp, n, VOX_N*bits);
+    arena = arena_new ();
+    tree = morton_node (arena, sorted, n, min);
+    free (codes);
+    free (tmp);
+
+    return tree;
+}
+
+size_t vox_voxels_in_tree (const struct vox_node *tree)
+{
+    return (VOX_FULLP (tree)) ? tree->dots_num : 0;
+}
+
+static void unmap_tree (struct vox_node *tree);
+
+void vox_destroy_tree (struct vox_node *tree)
+{
+    if (VOX_FULLP (tree))
+    {
+        // Loaded trees are mapped from a file
+        if (tree->flags & VOX_MAPPED) unmap_tree (tree);
+        // The whole frozen tree is one buffer which starts with the root
+        else if (tree->flags & VOX_FROZEN) free (tree);
+        // Ordinary trees are freed with all slabs of their arenas at once
+        else arena_destroy (arena_of (tree));
+    }
+}
+
+void vox_bounding_box (const struct vox_node* tree, struct vox_box *box)
+{
+    vox_box_copy (box, &(tree->bounding_box));
+}
+
+vox_dot* leaf_dots (const struct vox_node *leaf, vox_dot *buffer)
+{
+    if (!(leaf->flags & VOX_QUANT_MASK)) return VOX_DOTS (leaf);
+    decode_leaf (leaf, buffer);
+    return buffer;
+}
+
+/*
+  Frozen trees. Children of an inner node are placed one after another in
+  the buffer, then the children of each of them are placed recursively in
+  the same order. Sizes of nodes are multiples of FROZEN_ALIGN, so voxels
+  stored in frozen leaves are properly aligned.
+
+  If possible, voxels of frozen leafs are stored as 4 unsigned 8 or 16 bit
+  integers (the last one is unused) which are offsets from the bounding box
+  of the leaf in vox_voxel units. Quantization is used only if all voxels
+  can be restored exactly.
+*/
+#define FROZEN_ALIGN 16
+
+static int quantize_leaf (const struct vox_node *leaf, void *data)
+{
+    vox_dot buffer[VOX_MAX_DOTS], decoded[VOX_MAX_DOTS];
+    vox_dot *dots;
+    uint16_t q[4*VOX_MAX_DOTS];
+    int min[VOX_N+1], pos[VOX_N+1];
+    union
+    {
+        struct vox_node node;
+        char bytes[offsetof (struct vox_node, data) + sizeof (q)];
+    } tmp_leaf;
+    struct vox_node *tmp = &(tmp_leaf.node);
+    unsigned int i, j, max = 0;
+
+    if (leaf->dots_num > VOX_MAX_DOTS) return 0;
+
+    dots = leaf_dots (leaf, buffer);
+    quantize_dot (leaf->bounding_box.min, min);
+    for (i=0; i<leaf->dots_num; i++)
+    {
+        quantize_dot (dots[i], pos);
+        for (j=0; j<VOX_N; j++)
+        {
+            if (pos[j] < min[j] || pos[j] - min[j] > UINT16_MAX) return 0;
+            q[4*i+j] = pos[j] - min[j];
+            max = (q[4*i+j] > max) ? q[4*i+j] : max;
+        }
+        q[4*i+3] = 0;
+    }
+
+    // Check that voxels are restored exactly
+    tmp->dots_num = leaf->dots_num;
+    vox_box_copy (&(tmp->bounding_box), &(leaf->bounding_box));
+    tmp->flags = VOX_FROZEN | VOX_LEAF | ((max > UINT8_MAX) ? VOX_QUANT16 : VOX_QUANT8);
+    if (tmp->flags & VOX_QUANT8)
+        for (i=0; i<4*leaf->dots_num; i++) ((uint8_t*)&(tmp->data))[i] = q[i];
+    else memcpy (&(tmp->data), q, 4*leaf->dots_num*sizeof(uint16_t));
+    decode_leaf (tmp, decoded);
+    for (i=0; i<leaf->dots_num; i++)
+        if (!vox_dot_equalp (decoded[i], dots[i])) return 0;
+
+    if (data != NULL)
+        memcpy (data, &(tmp->data),
+                4*leaf->dots_num*((tmp->flags & VOX_QUANT8) ? sizeof(uint8_t) : sizeof(uint16_t)));
+    return tmp->flags & VOX_QUANT_MASK;
+}
+
+static size_t frozen_node_size (const struct vox_node *node)
+{
+    size_t size = offsetof (struct vox_node, data);
+
+    if (node->flags & VOX_LEAF)
+    {
+        int quant = quantize_leaf (node, NULL);
+        if (quant & VOX_QUANT8) size += 4*node->dots_num*sizeof(uint8_t);
+        else if (quant & VOX_QUANT16) size += 4*node->dots_num*sizeof(uint16_t);
+        else size += node->dots_num * sizeof (vox_dot);
+    }
+    else if (node->flags & VOX_BRICK) size += sizeof (vox_brick_data);
+    else if (!(node->flags & VOX_LEAF_MASK)) size += sizeof (vox_frozen_inner_data);
+    return (size + FROZEN_ALIGN - 1) & ~(size_t)(FROZEN_ALIGN - 1);
+}
+
+static size_t frozen_tree_size (const struct vox_node *tree)
+{
+    size_t size = 0;
+    unsigned int i;
+
+    if (VOX_FULLP (tree))
+    {
+        size = frozen_node_size (tree);
+        if (!(tree->flags & VOX_LEAF_MASK))
+            for (i=0; i<VOX_NS; i++) size += frozen_tree_size (VOX_CHILD (tree, i));
+    }
+    return size;
+}
+
+static void freeze_node (struct vox_node *dst, const struct vox_node *src)
+{
+    vox_dot buffer[VOX_MAX_DOTS];
+
+    vox_box_copy (&(dst->bounding_box), &(src->bounding_box));
+    dst->flags = (src->flags & ~(VOX_QUANT_MASK | VOX_MAPPED)) | VOX_FROZEN;
+    dst->dots_num = src->dots_num;
+    if (src->flags & VOX_LEAF)
+    {
+        int quant = quantize_leaf (src, &(dst->data));
+        dst->flags |= quant;
+        if (!quant)
+            memcpy (VOX_DOTS (dst), leaf_dots (src, buffer), src->dots_num * sizeof (vox_dot));
+    }
+    else if (src->flags & VOX_BRICK) dst->data.brick = src->data.brick;
+    else if (!(src->flags & VOX_LEAF_MASK))
+        vox_dot_copy (dst->data.frozen.center, src->data.inner.center);
+}
+
+/*
+  Place children of src (which is already copied to dst) starting at
+  position ptr of the buffer. Return the first free position.
+*/
+static char* freeze_children (struct vox_node *dst, const struct vox_node *src, char *ptr)
+{
+    unsigned int i;
+
+    if (src->flags & VOX_LEAF_MASK) return ptr;
+
+    for (i=0; i<VOX_NS; i++)
+    {
+        const struct vox_node *child = VOX_CHILD (src, i);
+        if (VOX_FULLP (child))
+        {
+            freeze_node ((struct vox_node*)ptr, child);
+            dst->data.frozen.children[i] = ptr - (char*)dst;
+            ptr += frozen_node_size (child);
+        }
+        else dst->data.frozen.children[i] = 0;
+    }
+
+    for (i=0; i<VOX_NS; i++)
+    {
+        const struct vox_node *child = VOX_CHILD (src, i);
+        if (VOX_FULLP (child))
+            ptr = freeze_children (VOX_CHILD (dst, i), child, ptr);
+    }
+
+    return ptr;
+}
+
+struct vox_node* vox_freeze_tree (const struct vox_node *tree)
+{
+    struct vox_node *frozen;
+    size_t size;
+
+    if (!(VOX_FULLP (tree))) return NULL;
+    size = frozen_tree_size (tree);
+    if (size > UINT32_MAX) return NULL;
+
+    frozen = vox_alloc (size);
+    freeze_node (frozen, tree);
+    freeze_children (frozen, tree, (char*)frozen + frozen_node_size (tree));
+
+    return frozen;
+}
+
+/*
+  Tree files. A tree file is a header followed by a frozen tree, which uses
+  only relative offsets, so it can be mapped to memory and searched in
+  place. The root is saved with VOX_MAPPED flag, telling vox_destroy_tree()
+  to unmap the file. The header size is a multiple of FROZEN_ALIGN, so the
+  nodes stay aligned in a mapped file.
+*/
+#define TREE_FILE_MAGIC "VOXTREE"
+#define TREE_FILE_VERSION 1
+
+struct tree_file_header
+{
+    char magic[8];
+    uint32_t version; // Also catches files with different byte order
+    uint32_t header_size;
+    uint32_t dot_size; // sizeof (vox_dot) differs in SSE and non-SSE builds
+    uint32_t node_size; // offsetof (struct vox_node, data)
+    float voxel[3]; // Quantized leafs and bricks depend on vox_voxel
+    uint32_t reserved;
+    uint64_t tree_size;
+};
+
+_Static_assert (sizeof (struct tree_file_header) % FROZEN_ALIGN == 0,
+                "Nodes must be aligned in tree files");
+
+#define SETERROR(x) if (error != NULL) *error = (x)
+#define SETSYSERROR() if (error != NULL) *error = strerror(errno)
+
+static void unmap_tree (struct vox_node *tree)
+{
+    struct tree_file_header *header =
+        (struct tree_file_header*)((char*)tree - sizeof (struct tree_file_header));
+    munmap (header, header->header_size + header->tree_size);
+}
+
+int vox_save_tree (const struct vox_node *tree, const char *filename, const char **error)
+{
+    struct tree_file_header header;
+    struct vox_node *frozen;
+    unsigned int flags;
+    size_t flags_end = offsetof (struct vox_node, flags) + sizeof (flags);
+    char *tmpname = NULL;
+    FILE *out;
+    int res = 0;
+
+    if (!(VOX_FULLP (tree)))
+    {
+        SETERROR ("Cannot save an empty tree");
+        return 0;
+    }
+
+    frozen = (tree->flags & VOX_FROZEN) ? (struct vox_node*)tree : vox_freeze_tree (tree);
+    if (frozen == NULL)
+    {
+        SETERROR ("The tree is too big");
+        return 0;
+    }
+
+    memset (&header, 0, sizeof (header));
+    strcpy (header.magic, TREE_FILE_MAGIC);
+    header.version = TREE_FILE_VERSION;
+    header.header_size = sizeof (header);
+    header.dot_size = sizeof (vox_dot);
+    header.node_size = offsetof (struct vox_node, data);
+    memcpy (header.voxel, vox_voxel, sizeof (header.voxel));
+    header.tree_size = frozen_tree_size (frozen);
+    flags = frozen->flags | VOX_MAPPED;
+
+    /*
+      Write to a temporary file and then rename it, so a tree loaded from
+      this file (which can be the tree we save) stays intact, and nobody
+      loads a partially written file.
+    */
+    tmpname = malloc (strlen (filename) + sizeof (".tmp"));
+    sprintf (tmpname, "%s.tmp", filename);
+    out = fopen (tmpname, "wb");
+    if (out == NULL)
+    {
+        SETSYSERROR();
+        goto done;
+    }
+
+    res = fwrite (&header, sizeof (header), 1, out) == 1 &&
+        fwrite (frozen, offsetof (struct vox_node, flags), 1, out) == 1 &&
+        fwrite (&flags, sizeof (flags), 1, out) == 1 &&
+        fwrite ((char*)frozen + flags_end, header.tree_size - flags_end, 1, out) == 1;
+    if (!res) SETSYSERROR();
+
+    if (fclose (out) != 0 && res)
+    {
+        SETSYSERROR();
+        res = 0;
+    }
+    if (res && rename (tmpname, filename) != 0)
+    {
+        SETSYSERROR();
+        res = 0;
+    }
+    if (!res) remove (tmpname);
+
+done:
+    free (tmpname);
+    if (frozen != tree) vox_destroy_tree (frozen);
+    return res;
+}
+
+struct vox_node* vox_load_tree (const char *filename, const char **error)
+{
+    struct tree_file_header header;
+    struct stat sb;
+    char *ptr = NULL;
+    int fd = open (filename, O_RDONLY);
+
+    if (fd == -1)
+    {
+        SETSYSERROR();
+        return NULL;
+    }
+
+    if (read (fd, &header, sizeof (header)) != sizeof (header) ||
+        memcmp (header.magic, TREE_FILE_MAGIC, sizeof (header.magic)) != 0)
+    {
+        SETERROR ("Not a tree file");
+        goto closefd;
+    }
+    if (header.version != TREE_FILE_VERSION || header.header_size != sizeof (header))
+    {
+        SETERROR ("Unsupported version of tree file");
+        goto closefd;
+    }
+    if (header.dot_size != sizeof (vox_dot) ||
+        header.node_size != offsetof (struct vox_node, data))
+    {
+        SETERROR ("The tree file was saved by incompatible build of voxtrees");
+        goto closefd;
+    }
+    if (memcmp (header.voxel, vox_voxel, sizeof (header.voxel)) != 0)
+    {
+        SETERROR ("The tree file was saved with different voxel size");
+        goto closefd;
+    }
+    if (fstat (fd, &sb) == -1)
+    {
+        SETSYSERROR();
+        goto closefd;
+    }
+    if (header.tree_size < header.node_size ||
+        (uint64_t)sb.st_size != header.header_size + header.tree_size)
+    {
+        SETERROR ("Wrong size of tree file");
+        goto closefd;
+    }
+
+    ptr = mmap (NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (ptr == MAP_FAILED)
+    {
+        SETSYSERROR();
+        ptr = NULL;
+    }
+    else ptr += header.header_size;
+
+closefd:
+    close (fd);
+    return (struct vox_node*)ptr;
+}
+
+/*
+  Turn a tree back to plain array
+*/
+static size_t flatten_tree (const struct vox_node *tree, vox_dot *set)
+{
+    size_t count = 0;
+    if (VOX_FULLP (tree))
+    {
+        if (tree->flags & VOX_LEAF)
+        {
+            // Quantized voxels are decoded right into the set
+            vox_dot *dots = leaf_dots (tree, set);
+            if (dots != set) memcpy (set, dots, tree->dots_num * sizeof(vox_dot));
+            count = tree->dots_num;
+        }
+        else if (tree->flags & VOX_BRICK)
+        {
+            uint64_t mask;
+            for (mask = tree->data.brick.mask; mask != 0; mask &= mask - 1)
+                brick_voxel (tree, __builtin_ctzll (mask), set[count++]);
+        }
+        else if (tree->flags & VOX_DENSE_LEAF)
+        {
+            size_t i,j,k;
+            vox_dot current;
+            size_t dim[VOX_N];
+            /*
+              XXX: This requires reworking.
+
+              Here I find the the number of voxels in a dense leaf along each
+              axis. This number is, of course, integer, but I have only
+              floating point coordinates of the bounding box. Therefore dim[]
+              will be calculated improperly if the precision of floating
+              point arithmetic is not enough.
+            */
+            get_dimensions (&(tree->bounding_box), dim);
+            assert (dim[0]*dim[1]*dim[2] == tree->dots_num);
+            current[0] = tree->bounding_box.min[0];
+            for (i=0; i<dim[0]; i++)
+            {
+                current[1] = tree->bounding_box.min[1];
+                for (j=0; j<dim[1]; j++)
+                {
+                    current[2] = tree->bounding_box.min[2];
+                    for (k=0; k<dim[2]; k++)
+                    {
+                        vox_dot_copy (set[count], current);
+                        current[2] += vox_voxel[2];
+                        count++;
+                    }
+                    current[1] += vox_voxel[1];
+                }
+                current[0] += vox_voxel[0];
+            }
+        }
+        else
+        {
+            unsigned int i;
+            for (i=0; i<VOX_NS; i++)
+            {
+                size_t subcount = flatten_tree (VOX_CHILD (tree, i), set);
+                set += subcount;
+                count += subcount;
+            }
+        }
+    }
+    return count;
+}
+
+/*
+  Dense-aware rebuilding. Dense leafs are not expanded to voxels: they are
+  collected as boxes and partitioned together with the other voxels, so
+  rebuilding costs as much as the number of nodes and stored voxels, not
+  the number of voxels in dense leafs. A box which crosses the center of a
+  node is cut into pieces, and join_trees() merges pieces and neighbouring
+  boxes back into one dense leaf when they make a solid box.
+*/
+static void count_primitives (const struct vox_node *tree, size_t *dots_num, size_t *boxes_num)
+{
+    unsigned int i;
+
+    if (VOX_FULLP (tree))
+    {
+        if (tree->flags & VOX_DENSE_LEAF) (*boxes_num)++;
+        else if (tree->flags & (VOX_LEAF | VOX_BRICK)) *dots_num += tree->dots_num;
+        else for (i=0; i<VOX_NS; i++) count_primitives (VOX_CHILD (tree, i), dots_num, boxes_num);
+    }
+}
+
+static void collect_primitives (const struct vox_node *tree, vox_dot *dots, size_t *dots_num,
+                                struct vox_box *boxes, size_t *boxes_num)
+{
+    unsigned int i;
+
+    if (VOX_FULLP (tree))
+    {
+        if (tree->flags & VOX_DENSE_LEAF)
+            vox_box_copy (&(boxes[(*boxes_num)++]), &(tree->bounding_box));
+        else if (tree->flags & (VOX_LEAF | VOX_BRICK))
+            *dots_num += flatten_tree (tree, dots + *dots_num);
+        else
+            for (i=0; i<VOX_NS; i++)
+                collect_primitives (VOX_CHILD (tree, i), dots, dots_num, boxes, boxes_num);
+    }
+}
+
+static size_t box_voxels (const struct vox_box *box)
+{
+    size_t dim[VOX_N];
+    get_dimensions (box, dim);
+    return dim[0]*dim[1]*dim[2];
+}
+
+/*
+  The center is the middle of the bounding box aligned to the grid, but a
+  face of a box which is the closest to the middle is preferred, so large
+  boxes are cut as rarely as possible.
+*/
+static void boxes_center (const struct vox_box *bb, const struct vox_box boxes[], size_t m,
+                          vox_dot center)
+{
+    unsigned int i;
+    size_t j;
+    float middle, face, best;
+
+    for (i=0; i<VOX_N; i++)
+    {
+        middle = (bb->min[i] + bb->max[i]) / 2;
+        best = ceilf (middle / vox_voxel[i]) * vox_voxel[i];
+        if (best >= bb->max[i]) best = bb->min[i] + vox_voxel[i];
+        center[i] = INFINITY;
+        for (j=0; j<2*m; j++)
+        {
+            face = (j & 1) ? boxes[j/2].max[i] : boxes[j/2].min[i];
+            if (face > bb->min[i] && face < bb->max[i] &&
+                fabsf (face - middle) < fabsf (center[i] - middle)) center[i] = face;
+        }
+        if (center[i] == INFINITY) center[i] = best;
+    }
+}
+
+// Cut the part of box which lies in subspace idx of center
+static int cut_box (const struct vox_box *box, const vox_dot center, int idx, struct vox_box *res)
+{
+    unsigned int i;
+
+    vox_box_copy (res, box);
+    for (i=0; i<VOX_N; i++)
+    {
+        if (idx & (1<<i)) res->max[i] = fminf (res->max[i], center[i]);
+        else res->min[i] = fmaxf (res->min[i], center[i]);
+        if (res->min[i] >= res->max[i]) return 0;
+    }
+    return 1;
+}
+
+static struct vox_node* make_tree_with_boxes (struct vox_arena *arena, vox_dot set[], size_t n,
+                                              const struct vox_box boxes[], size_t m)
+{
+    struct vox_node *children[VOX_NS];
+    struct vox_box bb, *pieces;
+    size_t offsets[VOX_NS+1], count[VOX_NS];
+    size_t j, total = n;
+    vox_dot center;
+    int idx;
+
+    if (m == 0) return make_tree (arena, set, n);
+    if (n == 0 && m == 1) return make_dense_leaf (arena, &(boxes[0]));
+
+    if (n > 0) geom_kernels->bounding_box (set, n, &bb);
+    else vox_box_copy (&bb, &(boxes[0]));
+    for (j=0; j<m; j++)
+    {
+        box_union (&bb, &(boxes[j]));
+        total += box_voxels (&(boxes[j]));
+    }
+    /*
+     * Voxels are counted exactly: float volumes of big boxes cannot tell a
+     * box without one voxel from the whole box.
+     */
+    if (box_voxels (&bb) == total) return make_dense_leaf (arena, &bb);
+
+    boxes_center (&bb, boxes, m, center);
+    pieces = vox_alloc (VOX_NS * m * sizeof (struct vox_box));
+    offsets[0] = 0;
+    for (idx=0; idx<VOX_NS; idx++)
+    {
+        offsets[idx+1] = sort_set (set, n, offsets[idx], idx, center);
+        count[idx] = 0;
+        for (j=0; j<m; j++)
+            if (cut_box (&(boxes[j]), center, idx, &(pieces[idx*m + count[idx]]))) count[idx]++;
+    }
+    for (idx=0; idx<VOX_NS; idx++)
+        children[idx] = make_tree_with_boxes (arena, set + offsets[idx],
+                                              offsets[idx+1] - offsets[idx],
+                                              pieces + idx*m, count[idx]);
+    free (pieces);
+
+    return join_trees (center, children);
+}
+
+static struct vox_node* rebuild_subtree (struct vox_arena *arena, const struct vox_node *tree)
+{
+    struct vox_node *new_tree;
+    struct vox_box *boxes;
+    size_t dots_num = 0, boxes_num = 0;
+    vox_dot *dots;
+
+    count_primitives (tree, &dots_num, &boxes_num);
+    dots = vox_alloc (sizeof(vox_dot) * dots_num);
+    boxes = vox_alloc (sizeof(struct vox_box) * boxes_num);
+    dots_num = boxes_num = 0;
+    collect_primitives (tree, dots, &dots_num, boxes, &boxes_num);
+    new_tree = make_tree_with_boxes (arena, dots, dots_num, boxes, boxes_num);
+    free (dots);
+    free (boxes);
+
+    return new_tree;
+}
+
+struct vox_node* vox_rebuild_tree (const struct vox_node *tree)
+{
+    struct vox_node *new_tree = NULL;
+    if (VOX_FULLP (tree))
+    {
+        struct vox_arena *arena = arena_new ();
+        new_tree = rebuild_subtree (arena, tree);
+        if (!(VOX_FULLP (new_tree))) arena_destroy (arena);
+    }
+    return new_tree;
+}
+
+/*
+  Greedy box extraction. Voxels are placed on the grid and sorted by keys
+  x:y:z (MORTON_BITS bits per axis), so runs of voxels along z are
+  contiguous in the sorted array. Starting from the first unused voxel, a
+  box is grown along z, then along y and then along x while all voxels of
+  the next row (or slice) are present and unused, like in greedy meshing.
+  Boxes with at least VOX_MIN_BOX_VOXELS voxels become dense leafs. If the
+  box is smaller, its first voxel is marked with 2 and all other voxels
+  are free again. Voxels which are not in boxes go to
+  make_tree_with_boxes() with the boxes.
+*/
+#define KEY_Y_SHIFT MORTON_BITS
+#define KEY_X_SHIFT (2*MORTON_BITS)
+
+struct box_grid
+{
+    const uint64_t *keys;
+    unsigned char *used;
+    size_t n;
+};
+
+/*
+  Check that the row of len voxels starting at key is in the grid and is
+  not used yet.
+*/
+static int grid_row_free_p (const struct box_grid *grid, uint64_t key, size_t len)
+{
+    size_t i, idx = lower_bound (grid->keys, grid->n, key);
+
+    if (idx + len > grid->n) return 0;
+    for (i=0; i<len; i++)
+        if (grid->keys[idx+i] != key + i || grid->used[idx+i]) return 0;
+    return 1;
+}
+
+static void grid_row_use (const struct box_grid *grid, uint64_t key, size_t len, int used)
+{
+    size_t idx = lower_bound (grid->keys, grid->n, key);
+    memset (grid->used + idx, used, len);
+}
+
+/*
+  Grow a box from the voxel idx. The size of the box is written to size,
+  the voxels of the box are marked as used.
+*/
+static void grow_box (const struct box_grid *grid, size_t idx, uint64_t size[])
+{
+    const uint64_t axis_mask = ((uint64_t)1 << MORTON_BITS) - 1;
+    uint64_t key = grid->keys[idx];
+    uint64_t y = (key >> KEY_Y_SHIFT) & axis_mask, x = key >> KEY_X_SHIFT;
+    uint64_t i, j;
+
+    size[2] = 1;
+    while (idx + size[2] < grid->n && grid->keys[idx + size[2]] == key + size[2] &&
+           !(grid->used[idx + size[2]]) && ((key + size[2]) & axis_mask) != 0) size[2]++;
+
+    for (size[1]=1; y + size[1] <= axis_mask; size[1]++)
+        if (!(grid_row_free_p (grid, key + (size[1] << KEY_Y_SHIFT), size[2]))) break;
+
+    for (size[0]=1; x + size[0] <= axis_mask; size[0]++)
+    {
+        for (j=0; j<size[1]; j++)
+            if (!(grid_row_free_p (grid, key + (size[0] << KEY_X_SHIFT) +
+                                   (j << KEY_Y_SHIFT), size[2]))) break;
+        if (j < size[1]) break;
+    }
+
+    for (i=0; i<size[0]; i++)
+        for (j=0; j<size[1]; j++)
+            grid_row_use (grid, key + (i << KEY_X_SHIFT) + (j << KEY_Y_SHIFT), size[2], 1);
+}
+
+static void grid_dot (uint64_t key, const int origin[], vox_dot dot)
+{
+    const uint64_t axis_mask = ((uint64_t)1 << MORTON_BITS) - 1;
+    vox_dot_set (dot,
+                 (origin[0] + (int)(key >> KEY_X_SHIFT)) * vox_voxel[0],
+                 (origin[1] + (int)((key >> KEY_Y_SHIFT) & axis_mask)) * vox_voxel[1],
+                 (origin[2] + (int)(key & axis_mask)) * vox_voxel[2]);
+}
+
+struct vox_node* vox_make_tree_boxes (vox_dot set[], size_t n)
+{
+    struct vox_node *tree;
+    struct vox_arena *arena;
+    struct vox_box *boxes;
+    struct box_grid grid;
+    uint64_t *keys, *tmp, *sorted, size[VOX_N];
+    int q[VOX_N+1], min[VOX_N], max[VOX_N];
+    unsigned int i;
+    size_t j, k, m, rest;
+
+    if (n == 0) return NULL;
+
+    for (i=0; i<VOX_N; i++)
+    {
+        min[i] = INT_MAX;
+        max[i] = INT_MIN;
+    }
+    for (j=0; j<n; j++)
+    {
+        quantize_dot (set[j], q);
+        for (i=0; i<VOX_N; i++)
+        {
+            min[i] = (q[i] < min[i]) ? q[i] : min[i];
+            max[i] = (q[i] > max[i]) ? q[i] : max[i];
+        }
+    }
+    // Too big for the keys, use the usual builder
+    for (i=0; i<VOX_N; i++)
+        if ((int64_t)max[i] - min[i] >= ((int64_t)1 << MORTON_BITS)) return vox_make_tree (set, n);
+
+    keys = malloc (n*sizeof(uint64_t));
+    tmp = malloc (n*sizeof(uint64_t));
+    for (j=0; j<n; j++)
+    {
+        quantize_dot (set[j], q);
+        keys[j] =
+            (uint64_t)(q[0] - min[0]) << KEY_X_SHIFT |
+            (uint64_t)(q[1] - min[1]) << KEY_Y_SHIFT |
+            (uint64_t)(q[2] - min[2]);
+    }
+    sorted = radix_sort (keys, tmp, n, VOX_N*MORTON_BITS);
+    // Duplicates are stored once
+    for (j=1, k=1; j<n; j++)
+        if (sorted[j] != sorted[k-1]) sorted[k++] = sorted[j];
+    grid.keys = sorted;
+    grid.n = k;
+    grid.used = calloc (grid.n, 1);
+
+    m = 0;
+    boxes = vox_alloc ((grid.n / VOX_MIN_BOX_VOXELS + 1) * sizeof (struct vox_box));
+    for (j=0; j<grid.n; j++)
+    {
+        if (grid.used[j]) continue;
+        grow_box (&grid, j, size);
+        if (size[0]*size[1]*size[2] < VOX_MIN_BOX_VOXELS)
+        {
+            // Too small, leave these voxels to the usual builder
+            for (i=0; i<size[0]; i++)
+                for (k=0; k<size[1]; k++)
+                    grid_row_use (&grid, grid.keys[j] + ((uint64_t)i << KEY_X_SHIFT) +
+                                  (k << KEY_Y_SHIFT), size[2], 0);
+            // No box which is not grown yet can contain this voxel
+            grid.used[j] = 2;
+            continue;
+        }
+        grid_dot (grid.keys[j], min, boxes[m].min);
+        grid_dot (grid.keys[j] + ((size[0]-1) << KEY_X_SHIFT) + ((size[1]-1) << KEY_Y_SHIFT) +
+                  (size[2]-1), min, boxes[m].max);
+        vox_dot_add (boxes[m].max, vox_voxel, boxes[m].max);
+        m++;
+    }
+
+    for (j=0, rest=0; j<grid.n; j++)
+    {
+        if (grid.used[j] == 1) continue;
+        grid_dot (grid.keys[j], min, set[rest]);
+        rest++;
+    }
+    free (keys);
+    free (tmp);
+    free (grid.used);
+
+    arena = arena_new ();
+    tree = make_tree_with_boxes (arena, set, rest, boxes, m);
+    if (!(VOX_FULLP (tree))) arena_destroy (arena);
+    free (boxes);
+
+    return tree;
+}
+
+/*
+  Local rebuilding, like in scapegoat trees. While descending to the place
+  of an edit, inner nodes with not more than VOX_REBUILD_MAX_VOXELS voxels
+  are remembered with their depth. When the edit is done, the topmost of
+  them which is more than twice as deep as a balanced tree with the same
+  number of voxels is rebuilt in place.
+*/
+#define REBUILD_PATH_LENGTH 64
+
+struct rebuild_path
+{
+    struct vox_node **nodes[REBUILD_PATH_LENGTH];
+    unsigned int depths[REBUILD_PATH_LENGTH];
+    unsigned int length, depth;
+};
+
+// Must be called for each inner node on the way down. path may be NULL
+static void path_add (struct rebuild_path *path, struct vox_node **tree_ptr)
+{
+    if (path == NULL) return;
+    path->depth++;
+    if (path->length < REBUILD_PATH_LENGTH &&
+        (*tree_ptr)->dots_num <= VOX_REBUILD_MAX_VOXELS)
+    {
+        path->nodes[path->length] = tree_ptr;
+        path->depths[path->length] = path->depth;
+        path->length++;
+    }
+}
+
+static unsigned int max_height (size_t n)
+{
+    unsigned int height = 1;
+    while (n > VOX_MAX_DOTS)
+    {
+        n >>= VOX_N;
+        height++;
+    }
+    return 2*height + 1;
+}
+
+static void rebuild_path (struct vox_arena *arena, const struct rebuild_path *path)
+{
+    struct vox_node *tree;
+    unsigned int i;
+
+    for (i=0; i<path->length; i++)
+    {
+        tree = *(path->nodes[i]);
+        // The subtree's height, counting the last node on the path
+        if (path->depth - path->depths[i] + 2 > max_height (tree->dots_num))
+        {
+            WITH_STAT (VOXTREES_SUBTREE_REBUILD (tree->dots_num));
+            *(path->nodes[i]) = rebuild_subtree (arena, tree);
+            destroy_subtree (tree);
+            break;
+        }
+    }
+}
+
+/*
+  Single descent editing. find_voxel() goes down to the place of the voxel
+  without changing anything and remembers which child it has taken in each
+  inner node on the way. If the voxel must be inserted (deleted) after all,
+  vox_insert_voxel_() (vox_delete_voxel_()) takes the same children, which
+  are still in cache, without checking bounding boxes and computing
+  subspaces again. Beyond EDIT_PATH_LENGTH inner nodes, they are computed
+  as usual.
+*/
+#define EDIT_PATH_LENGTH 128
+
+struct edit_path
+{
+    unsigned char idx[EDIT_PATH_LENGTH];
+    unsigned int length, pos;
+};
+
+static int next_subspace (struct edit_path *edit, const vox_inner_data *inner,
+                          const vox_dot voxel)
+{
+    if (edit != NULL && edit->pos < edit->length) return edit->idx[edit->pos++];
+#ifdef SSE_INTRIN
+    return get_subspace_idx_simd (_mm_load_ps(inner->center), _mm_load_ps(voxel));
+#else
+    return get_subspace_idx (inner->center, voxel);
+#endif
+}
+
+// edit may be NULL
+static int find_voxel (const struct vox_node *tree, const vox_dot voxel, struct edit_path *edit)
+{
+    unsigned int i;
+
+    if (edit != NULL) edit->length = edit->pos = 0;
+    while (VOX_FULLP (tree) &&
+           voxel_in_box (&(tree->bounding_box), voxel))
+    {
+        if (tree->flags & VOX_DENSE_LEAF) return 1;
+        if (tree->flags & VOX_LEAF)
+        {
+            vox_dot buffer[VOX_MAX_DOTS];
+            vox_dot *dots = leaf_dots (tree, buffer);
+            for (i=0; i<tree->dots_num; i++)
+                if (vox_dot_equalp (voxel, dots[i])) return 1;
+            return 0;
+        }
+        else if (tree->flags & VOX_BRICK)
+        {
+            int idx = brick_index (tree->data.brick.origin, voxel);
+            return idx >= 0 && (tree->data.brick.mask >> idx) & 1;
+        }
+
+        i = get_subspace_idx (tree->data.inner.center, voxel);
+        if (edit != NULL && edit->length < EDIT_PATH_LENGTH) edit->idx[edit->length++] = i;
+        tree = VOX_CHILD (tree, i);
+    }
+    return 0;
+}
+
+static int voxel_in_tree (const struct vox_node *tree, const vox_dot voxel)
+{
+    return find_voxel (tree, voxel, NULL);
+}
+
+static void vox_insert_voxel_ (struct vox_arena *arena, struct vox_node **tree_ptr,
+                               const vox_dot voxel, struct rebuild_path *path,
+                               struct edit_path *edit);
+static struct vox_node* __attribute__((noinline)) // always inserts
+    insert_in_big_dense (struct vox_arena *arena, struct vox_node *tree, const vox_dot voxel)
+{
+    /*
+      Put a dense leaf and this voxel in a new inner node.
+      Benchmarks show that this is the slowest part of this function
+      (especially when compiled with SSE_INTRIN).
+    */
+    int idx1, idx2;
+    struct vox_node *node;
+    vox_inner_data *inner;
+
+    node = node_alloc (arena, 0);
+    inner = &(node->data.inner);
+    memset (inner, 0, sizeof (vox_inner_data));
+    vox_box_copy (&(node->bounding_box), &(tree->bounding_box));
+    update_bounding_box (&(node->bounding_box), voxel);
     node->flags = 0;
     node->dots_num = tree->dots_num + 1;
     // Can we find another center of division easily?
     closest_vertex (&(tree->bounding_box), voxel, inner->center);
 #ifdef SSE_INTRIN
-    __v4sf inner_vector = _mm_load_ps (tree->bounding_box.min) +
-        _mm_load_ps (tree->bounding_box.max);
-    inner_vector /= _mm_set_ps1 (2.0);
-    __v4sf center = _mm_load_ps (inner->center);
-    idx1 = get_subspace_idx_simd (center, inner_vector);
-    idx2 = get_subspace_idx_simd (center, _mm_load_ps(voxel));
+    __v4sf inner_vector = _mm_load_ps (tree->bounding_box.min) +
+        _mm_load_ps (tree->bounding_box.max);
+    inner_vector /= _mm_set_ps1 (2.0);
+    __v4sf center = _mm_load_ps (inner->center);
+    idx1 = get_subspace_idx_simd (center, inner_vector);
+    idx2 = get_subspace_idx_simd (center, _mm_load_ps(voxel));
+#else
+    unsigned int i;
+    vox_dot inner_dot;
+    for (i=0; i<VOX_N; i++)
+        inner_dot[i] = (tree->bounding_box.min[i]+tree->bounding_box.max[i]) / 2;
+    idx1 = get_subspace_idx (inner->center, inner_dot);
+    idx2 = get_subspace_idx (inner->center, voxel);
+#endif
+    assert (idx1 != idx2);
+    inner->children[idx1] = tree;
+    // Insert voxel in an empty leaf
+    vox_insert_voxel_ (arena, &(inner->children[idx2]), voxel, NULL, NULL);
+
+    return node;
+}
+
+// always inserts, edit may be NULL
+static void vox_insert_voxel_ (struct vox_arena *arena, struct vox_node **tree_ptr,
+                               const vox_dot voxel, struct rebuild_path *path,
+                               struct edit_path *edit)
+{
+    struct vox_node *tree;
+    vox_dot *dots;
+    struct vox_box bb;
+    struct vox_node *node;
+
+again:
+    tree = *tree_ptr;
+    node = tree;
+
+    /*
+      Aggregate voxels in the dense leaf if possible.
+      Also update node's bounding box, only if this node
+      is not a dense one.
+    */
+    if (VOX_FULLP (tree))
+    {
+        vox_box_copy (&bb, &(tree->bounding_box));
+        update_bounding_box (&(tree->bounding_box), voxel);
+        if (dense_set_p (&(tree->bounding_box), tree->dots_num+1))
+        {
+            if (tree->flags & VOX_DENSE_LEAF) tree->dots_num++;
+            else
+            {
+                node = make_dense_leaf (arena, &(tree->bounding_box));
+                assert (node->dots_num == tree->dots_num+1);
+                destroy_subtree (tree);
+            }
+            goto done;
+        }
+        if (tree->flags & VOX_DENSE_LEAF) vox_box_copy (&(tree->bounding_box), &bb);
+    }
+    else
+    {
+        /*
+          If tree is an empty leaf, allocate a regular leaf node and store
+          the voxel there.
+        */
+        WITH_STAT (VOXTREES_LEAF_INSERTION());
+        dots = alloca (sizeof (vox_dot) + 16);
+        dots = (void*)(((unsigned long) dots + 15) & ~(unsigned long)15);
+        vox_dot_copy (dots[0], voxel);
+        node = make_tree (arena, dots, 1);
+        goto done;
+    }
+
+    if (tree->flags & VOX_DENSE_LEAF)
+    {
+        WITH_STAT (VOXTREES_DENSE_INSERTION());
+        if (tree->dots_num < VOX_MAX_DOTS)
+        {
+            /*
+              Downgrade to an ordinary leaf. This will result is lesser amount
+              of inner nodes.
+            */
+            dots = alloca (sizeof (vox_dot)*VOX_MAX_DOTS + 16);
+            dots = (void*)(((unsigned long) dots + 15) & ~(unsigned long)15);
+            flatten_tree (tree, dots);
+            vox_dot_copy (dots[tree->dots_num], voxel);
+            node = make_tree (arena, dots, tree->dots_num+1);
+            destroy_subtree (tree);
+        }
+        else node = insert_in_big_dense (arena, tree, voxel);
+    }
+    else if (tree->flags & VOX_LEAF)
+    {
+        WITH_STAT (VOXTREES_LEAF_INSERTION());
+        // We have enough space to add a voxel
+        if (tree->dots_num < VOX_MAX_DOTS)
+        {
+            vox_dot_copy (tree->data.dots[tree->dots_num], voxel);
+            tree->dots_num++;
+        }
+        // If not, create a new subtree with vox_make_tree()
+        else
+        {
+            assert (tree->dots_num == VOX_MAX_DOTS);
+            dots = alloca (sizeof (vox_dot)*(VOX_MAX_DOTS+1) + 16);
+            dots = (void*)(((unsigned long) dots + 15) & ~(unsigned long)15);
+            memcpy (dots, tree->data.dots, sizeof(vox_dot)*tree->dots_num);
+            vox_dot_copy (dots[tree->dots_num], voxel);
+            node = make_tree (arena, dots, tree->dots_num+1);
+            destroy_subtree (tree);
+        }
+    }
+    else if (tree->flags & VOX_BRICK)
+    {
+        int idx = brick_index (tree->data.brick.origin, voxel);
+
+        WITH_STAT (VOXTREES_BRICK_INSERTION());
+        if (idx >= 0)
+        {
+            // The bounding box is already updated
+            tree->data.brick.mask |= (uint64_t)1 << idx;
+            tree->dots_num++;
+        }
+        // The voxel is outside of the brick's cell
+        else
+        {
+            dots = alloca (sizeof (vox_dot)*(VOX_BRICK_VOXELS+1) + 16);
+            dots = (void*)(((unsigned long) dots + 15) & ~(unsigned long)15);
+            flatten_tree (tree, dots);
+            vox_dot_copy (dots[tree->dots_num], voxel);
+            node = make_tree (arena, dots, tree->dots_num+1);
+            destroy_subtree (tree);
+        }
+    }
+    else
+    {
+        /*
+          For inner node we need only to increment node's voxel number and
+          propagate changes further.
+        */
+        vox_inner_data *inner = &(tree->data.inner);
+        int idx = next_subspace (edit, inner, voxel);
+        tree->dots_num++;
+        path_add (path, tree_ptr);
+        tree_ptr = &(inner->children[idx]);
+        goto again; // Force tail call optimization.
+    }
+
+done:
+    *tree_ptr = node;
+}
+
+int vox_insert_voxel (struct vox_node **tree_ptr, vox_dot voxel)
+{
+    struct edit_path edit;
+    int res;
+
+    if (VOX_FULLP (*tree_ptr) && ((*tree_ptr)->flags & VOX_FROZEN)) return 0;
+    vox_align (voxel);
+    res = !(find_voxel (*tree_ptr, voxel, &edit));
+    if (res)
+    {
+        struct vox_arena *arena = (VOX_FULLP (*tree_ptr)) ? arena_of (*tree_ptr) : arena_new ();
+        struct rebuild_path path;
+        path.length = path.depth = 0;
+        vox_insert_voxel_ (arena, tree_ptr, voxel, &path, &edit);
+        rebuild_path (arena, &path);
+    }
+    return res;
+}
+
+int vox_insert_voxel_coord (struct vox_node **tree_ptr, float x, float y, float z)
+{
+    vox_dot dot;
+#ifdef SSE_INTRIN
+    _mm_store_ps (dot, _mm_set_ps (0, z, y, x));
+#else
+    dot[0] = x; dot[1] = y; dot[2] = z;
+#endif
+    return vox_insert_voxel (tree_ptr, dot);
+}
+
+/*
+  Helper function for deletion from dense stripes.
+  It always deletes if dense leaf is a stripe
+  (with bounding box of dimensions 1x1xN, 1xNx1 or Nx1x1).
+  Return NULL otherwise.
+*/
+static struct vox_node*
+delete_from_dense_stripe (struct vox_arena *arena, struct vox_node *tree, const vox_dot voxel)
+{
+    int idx, stripe, success;
+    struct vox_node *node, *child;
+    vox_dot other_side;
+    vox_inner_data *inner;
+    struct vox_box bb;
+
+    stripe = stripep (&(tree->bounding_box), &idx);
+    if (!stripe) return NULL;
+
+    // First special case. Delete "leftmost" voxel.
+    if (vox_dot_equalp (tree->bounding_box.min, voxel))
+    {
+        tree->dots_num--;
+        tree->bounding_box.min[idx] += vox_voxel[idx];
+        return tree;
+    }
+    vox_dot_add (voxel, vox_voxel, other_side);
+    // First special case. Delete "rightmost" voxel.
+    if (vox_dot_equalp (tree->bounding_box.max, other_side))
+    {
+        tree->dots_num--;
+        tree->bounding_box.max[idx] -= vox_voxel[idx];
+        return tree;
+    }
+
+    // Common case, create 1 inner node.
+    node = node_alloc (arena, 0);
+    inner = &(node->data.inner);
+
+    vox_box_copy (&(node->bounding_box), &(tree->bounding_box));
+    node->flags = 0;
+    node->dots_num = tree->dots_num - 1;
+    vox_dot_copy (inner->center, voxel);
+    memset (inner->children, 0, sizeof (inner->children));
+
+    success = divide_box (&(tree->bounding_box), voxel, &bb, 1<<idx);
+    assert (success);
+    child = make_dense_leaf (arena, &bb);
+    inner->children[1<<idx] = child;
+
+    success = divide_box (&(tree->bounding_box), voxel, &bb, 0);
+    assert (success);
+    child = make_dense_leaf (arena, &bb);
+    inner->children[0] = child;
+    assert (inner->children[0]->dots_num + inner->children[1<<idx]->dots_num ==
+            tree->dots_num);
+    child->dots_num--;
+    child->bounding_box.min[idx] += vox_voxel[idx];
+    destroy_subtree (tree);
+    return node;
+}
+
+static struct vox_node* __attribute__((noinline))
+    delete_from_big_dense (struct vox_arena *arena, struct vox_node *tree, const vox_dot voxel)
+{
+    struct vox_node *node;
+    vox_inner_data *inner;
+    struct vox_box bb;
+    int i, success;
+    vox_dot other_side;
+
+    // Maybe we are deleting from stripe.
+    node = delete_from_dense_stripe (arena, tree, voxel);
+    if (node != NULL) return node;
+
+    // No, special case 1, deletion of "leftmost" voxel.
+    if (vox_dot_equalp (tree->bounding_box.min, voxel))
+    {
+        vox_dot_add (voxel, vox_voxel, other_side);
+        // Create 1 inner node.
+        node = node_alloc (arena, 0);
+        inner = &(node->data.inner);
+        vox_box_copy (&(node->bounding_box), &(tree->bounding_box));
+        node->flags = 0;
+        node->dots_num = tree->dots_num - 1;
+        vox_dot_copy (inner->center, other_side);
+        memset (inner->children, 0, sizeof (inner->children));
+
+        for (i=0; i<VOX_NS-1; i++)
+        {
+            success = divide_box (&(tree->bounding_box), other_side, &bb, i);
+            if (!success) continue;
+            inner->children[i] = make_dense_leaf (arena, &bb);
+        }
+        destroy_subtree (tree);
+        return node;
+    }
+
+    // Most common case, create 2 nodes
+    node = node_alloc (arena, 0);
+    inner = &(node->data.inner);
+    vox_box_copy (&(node->bounding_box), &(tree->bounding_box));
+    node->flags = 0;
+    node->dots_num = tree->dots_num - 1;
+    vox_dot_copy (inner->center, voxel);
+    memset (inner->children, 0, sizeof (inner->children));
+
+    for (i=0; i<VOX_NS; i++)
+    {
+        success = divide_box (&(tree->bounding_box), voxel, &bb, i);
+        if (!success) continue;
+        inner->children[i] = make_dense_leaf (arena, &bb);
+    }
+
+    /*
+      Delete voxel using a special case in this function,
+      also deleting the original tree.
+
+      May be easily TCO'ed if needed.
+    */
+    inner->children[0] = delete_from_big_dense (arena, inner->children[0], voxel);
+    destroy_subtree (tree);
+    return node;
+}
+
+// It always deletes. edit may be NULL
+static void vox_delete_voxel_ (struct vox_arena *arena, struct vox_node **tree_ptr,
+                               const vox_dot voxel, struct rebuild_path *path,
+                               struct edit_path *edit)
+{
+    struct vox_node *tree, *node;
+    unsigned int i;
+
+again:
+    tree = *tree_ptr;
+    if (tree->dots_num == 1)
+    {
+        destroy_subtree (tree);
+        *tree_ptr = NULL;
+        return;
+    }
+
+    // XXX: update bounding box
+
+    if (tree->flags & VOX_LEAF)
+    {
+        WITH_STAT (VOXTREES_LEAF_DELETION());
+        for (i=0; i<tree->dots_num; i++)
+            if (vox_dot_equalp (tree->data.dots[i], voxel)) break;
+        assert (i < tree->dots_num);
+        tree->dots_num--;
+        memmove (tree->data.dots + i, tree->data.dots + i + 1,
+                 sizeof (vox_dot) * (tree->dots_num - i));
+    }
+    else if (tree->flags & VOX_BRICK)
+    {
+        WITH_STAT (VOXTREES_BRICK_DELETION());
+        tree->data.brick.mask &= ~((uint64_t)1 << brick_index (tree->data.brick.origin, voxel));
+        tree->dots_num--;
+        brick_bounding_box (tree);
+    }
+    else if (tree->flags & VOX_DENSE_LEAF)
+    {
+        WITH_STAT (VOXTREES_DENSE_DELETION());
+        // Downgrade to an ordinary leaf
+        if (tree->dots_num <= VOX_MAX_DOTS)
+        {
+            // Give it a try, what if this is the case?
+            node = delete_from_dense_stripe (arena, tree, voxel);
+            if (node)
+            {
+                *tree_ptr = node;
+                return;
+            }
+            vox_dot *set;
+            set = alloca (sizeof (vox_dot)*VOX_MAX_DOTS + 16);
+            set = (void*)(((unsigned long) set + 15) & ~(unsigned long)15);
+            flatten_tree (tree, set);
+            /*
+              XXX: Proper index may be calculated faster, if needed.
+              Just find it using loop now
+            */
+            for (i=0; i<tree->dots_num; i++)
+                if (vox_dot_equalp (set[i], voxel)) break;
+            assert (i < tree->dots_num);
+            memmove (set + i, set + i + 1,
+                     sizeof (vox_dot) * (tree->dots_num - i - 1));
+            *tree_ptr = make_tree (arena, set, tree->dots_num - 1);
+            destroy_subtree (tree);
+        }
+        /*
+          Divide our dense leaf into many dense leafs in 1 or 2 inner
+          nodes or return a new dense leaf as a special case
+        */
+        else *tree_ptr = delete_from_big_dense (arena, tree, voxel);
+    }
+    else
+    {
+        // Inner node
+        vox_inner_data *inner = &(tree->data.inner);
+        int idx = next_subspace (edit, inner, voxel);
+        node = inner->children[idx];
+        if (node->dots_num == tree->dots_num)
+        {
+            /*
+              This means that this child is the only child of its parent.
+              So we can remove this parent and connect the child to parent's
+              parent directly.
+            */
+            *tree_ptr = node;
+            node_free (tree); // Save the child.
+            goto again;
+        }
+        tree->dots_num--;
+        path_add (path, tree_ptr);
+        tree_ptr = &(inner->children[idx]);
+        goto again;
+    }
+}
+
+int vox_delete_voxel (struct vox_node **tree_ptr, vox_dot voxel)
+{
+    struct edit_path edit;
+    int res;
+
+    if (VOX_FULLP (*tree_ptr) && ((*tree_ptr)->flags & VOX_FROZEN)) return 0;
+    vox_align (voxel);
+    res = find_voxel (*tree_ptr, voxel, &edit);
+    if (res)
+    {
+        struct vox_arena *arena = arena_of (*tree_ptr);
+        struct rebuild_path path;
+        path.length = path.depth = 0;
+        vox_delete_voxel_ (arena, tree_ptr, voxel, &path, &edit);
+        // The last voxel is deleted
+        if (!(VOX_FULLP (*tree_ptr))) arena_destroy (arena);
+        else rebuild_path (arena, &path);
+    }
+    return res;
+}
+
+int vox_delete_voxel_coord (struct vox_node **tree_ptr, float x, float y, float z)
+{
+    vox_dot dot;
+#ifdef SSE_INTRIN
+    _mm_store_ps (dot, _mm_set_ps (0, z, y, x));
 #else
+    dot[0] = x; dot[1] = y; dot[2] = z;
+#endif
+    return vox_delete_voxel (tree_ptr, dot);
+}
+
+/*
+  Batch insertion and deletion. The set is aligned, sorted and cleared from
+  duplicates first. Then it is split between children of each inner node
+  with a counting sort (split_batch()), so each node is visited only once.
+  Changed leafs are rebuilt with make_tree() from their remaining voxels.
+  Dense leafs which are much bigger than the number of voxels edited in
+  them are edited voxel by voxel, because rebuilding is too expensive for
+  them.
+*/
+#define DENSE_REBUILD_RATIO 8
+
+static int dot_cmp (const void *a, const void *b)
+{
+    const float *d1 = a, *d2 = b;
     unsigned int i;
-    vox_dot inner_dot;
+
     for (i=0; i<VOX_N; i++)
-        inner_dot[i] = (tree->bounding_box.min[i]+tree->bounding_box.max[i]) / 2;
-    idx1 = get_subspace_idx (inner->center, inner_dot);
-    idx2 = get_subspace_idx (inner->center, voxel);
+    {
+        if (d1[i] < d2[i]) return -1;
+        if (d1[i] > d2[i]) return 1;
+    }
+    return 0;
+}
+
+// Align voxels, sort them and remove duplicates. Return the new size of the set
+static size_t prepare_batch (vox_dot set[], size_t n)
+{
+    size_t i, count = 0;
+
+    if (n == 0) return 0;
+    for (i=0; i<n; i++) vox_align (set[i]);
+    qsort (set, n, sizeof (vox_dot), dot_cmp);
+    for (i=1; i<n; i++)
+        if (dot_cmp (set[i], set[count])) vox_dot_copy (set[++count], set[i]);
+    return count + 1;
+}
+
+static int batch_subspace_idx (const struct vox_node *tree, const vox_dot dot)
+{
+#ifdef SSE_INTRIN
+    return get_subspace_idx_simd (_mm_load_ps (tree->data.inner.center), _mm_load_ps (dot));
+#else
+    return get_subspace_idx (tree->data.inner.center, dot);
 #endif
-    assert (idx1 != idx2);
-    inner->children[idx1] = tree;
-    // Insert voxel in an empty leaf
-    vox_insert_voxel_ (&(inner->children[idx2]), voxel);
+}
+
+/*
+  Split the set between children of an inner node and return offsets of
+  subsets. This is a counting sort which uses tmp (of the same size as the
+  set) as a scratch buffer. Children are processed one after another, so
+  they can use the same buffer.
+*/
+static void split_batch (const struct vox_node *tree, vox_dot set[], size_t n,
+                         size_t offsets[], vox_dot tmp[])
+{
+    size_t pos[VOX_NS];
+    size_t i;
+
+    memset (offsets, 0, (VOX_NS + 1) * sizeof (size_t));
+    for (i=0; i<n; i++) offsets[batch_subspace_idx (tree, set[i]) + 1]++;
+    for (i=0; i<VOX_NS; i++)
+    {
+        offsets[i+1] += offsets[i];
+        pos[i] = offsets[i];
+    }
+
+    memcpy (tmp, set, n * sizeof (vox_dot));
+    for (i=0; i<n; i++) vox_dot_copy (set[pos[batch_subspace_idx (tree, tmp[i])]++], tmp[i]);
+}
+
+static void children_bounding_box (struct vox_node *tree)
+{
+    unsigned int i;
+
+    for (i=0; i<VOX_NS; i++)
+    {
+        const struct vox_node *child = tree->data.inner.children[i];
+        if (VOX_FULLP (child)) box_union (&(tree->bounding_box), &(child->bounding_box));
+    }
+}
+
+struct vox_node* join_trees (const vox_dot center, struct vox_node *children[])
+{
+    struct vox_arena *arena;
+    struct vox_node *node, *last = NULL;
+    unsigned int i, count = 0;
+    size_t total = 0;
+
+    for (i=0; i<VOX_NS; i++)
+    {
+        if (VOX_FULLP (children[i]))
+        {
+            last = children[i];
+            total += children[i]->dots_num;
+            count++;
+        }
+    }
+    if (count <= 1) return last;
+    // Callers do not make trees with more voxels than dots_num can hold
+    assert (total <= UINT_MAX);
+
+    arena = arena_of (last);
+    node = node_alloc (arena, 0);
+    node->flags = 0;
+    node->dots_num = total;
+    vox_dot_copy (node->data.inner.center, center);
+    vox_box_copy (&(node->bounding_box), &(last->bounding_box));
+    for (i=0; i<VOX_NS; i++)
+    {
+        struct vox_node *child = children[i];
+        node->data.inner.children[i] = child;
+        if (VOX_FULLP (child) && arena_of (child) != arena) arena_merge (arena, arena_of (child));
+    }
+    children_bounding_box (node);
+
+    /*
+     * Joined parts of a solid volume make one dense leaf. Voxels are counted
+     * exactly, because float volumes cannot tell a big box with a hole from
+     * the whole box.
+     */
+    if (box_voxels (&(node->bounding_box)) == total)
+    {
+        struct vox_node *dense = make_dense_leaf (arena, &(node->bounding_box));
+        destroy_subtree (node);
+        node = dense;
+    }
+
+    return node;
+}
+
+static size_t insert_voxels (struct vox_arena *arena, struct vox_node **tree_ptr,
+                             vox_dot set[], size_t n, vox_dot tmp[])
+{
+    struct vox_node *tree = *tree_ptr;
+    size_t i, count = 0;
+
+    if (n == 0) return 0;
+    if (!(VOX_FULLP (tree)))
+    {
+        *tree_ptr = make_tree (arena, set, n);
+        return n;
+    }
+
+    if (tree->flags & VOX_LEAF_MASK)
+    {
+        // Keep only voxels which are not in the leaf
+        for (i=0; i<n; i++)
+            if (!voxel_in_tree (tree, set[i])) vox_dot_copy (set[count++], set[i]);
+        if (count == 0) return 0;
+
+        if ((tree->flags & VOX_DENSE_LEAF) && tree->dots_num > DENSE_REBUILD_RATIO * count)
+        {
+            for (i=0; i<count; i++) vox_insert_voxel_ (arena, tree_ptr, set[i], NULL, NULL);
+        }
+        else
+        {
+            vox_dot *dots = vox_alloc ((tree->dots_num + count) * sizeof (vox_dot));
+            flatten_tree (tree, dots);
+            memcpy (dots + tree->dots_num, set, count * sizeof (vox_dot));
+            *tree_ptr = make_tree (arena, dots, tree->dots_num + count);
+            destroy_subtree (tree);
+            free (dots);
+        }
+    }
+    else
+    {
+        size_t offsets[VOX_NS+1];
+        split_batch (tree, set, n, offsets, tmp);
+        for (i=0; i<VOX_NS; i++)
+            count += insert_voxels (arena, &(tree->data.inner.children[i]),
+                                    set + offsets[i], offsets[i+1] - offsets[i], tmp);
+        tree->dots_num += count;
+        children_bounding_box (tree);
+
+        // Aggregate voxels in a dense leaf if possible
+        if (dense_set_p (&(tree->bounding_box), tree->dots_num))
+        {
+            *tree_ptr = make_dense_leaf (arena, &(tree->bounding_box));
+            destroy_subtree (tree);
+        }
+    }
+
+    return count;
+}
+
+size_t vox_insert_voxels (struct vox_node **tree_ptr, vox_dot set[], size_t n)
+{
+    struct vox_arena *arena;
+    vox_dot *tmp;
+    size_t count;
+
+    if (VOX_FULLP (*tree_ptr) && ((*tree_ptr)->flags & VOX_FROZEN)) return 0;
+    n = prepare_batch (set, n);
+    if (n == 0) return 0;
+
+    arena = (VOX_FULLP (*tree_ptr)) ? arena_of (*tree_ptr) : arena_new ();
+    tmp = vox_alloc (n * sizeof (vox_dot));
+    count = insert_voxels (arena, tree_ptr, set, n, tmp);
+    free (tmp);
+    return count;
+}
+
+/*
+  Call this when voxels are deleted from children of an inner node. Empty
+  nodes are removed, the only remaining child is connected to the parent
+  directly, and the bounding box is shrunk otherwise.
+*/
+static void shrink_inner_node (struct vox_node **tree_ptr)
+{
+    struct vox_node *tree = *tree_ptr, *child, *last = NULL;
+    unsigned int i, children = 0;
 
-    return node;
+    for (i=0; i<VOX_NS; i++)
+    {
+        child = tree->data.inner.children[i];
+        if (!(VOX_FULLP (child))) continue;
+        if (children++ == 0) vox_box_copy (&(tree->bounding_box), &(child->bounding_box));
+        else box_union (&(tree->bounding_box), &(child->bounding_box));
+        last = child;
+    }
+
+    if (children <= 1)
+    {
+        node_free (tree);
+        *tree_ptr = last;
+    }
 }
 
-// always inserts
-static void vox_insert_voxel_ (struct vox_node **tree_ptr, const vox_dot voxel)
+static size_t delete_voxels (struct vox_arena *arena, struct vox_node **tree_ptr,
+                             vox_dot set[], size_t n, vox_dot tmp[])
 {
-    struct vox_node *tree;
-    vox_dot *dots;
-    struct vox_box bb;
-    struct vox_node *node;
+    struct vox_node *tree = *tree_ptr;
+    size_t i, count = 0;
 
-again:
-    tree = *tree_ptr;
-    node = tree;
+    if (n == 0 || !(VOX_FULLP (tree))) return 0;
 
-    /*
-      Aggregate voxels in the dense leaf if possible.
-      Also update node's bounding box, only if this node
-      is not a dense one.
-    */
-    if (VOX_FULLP (tree))
+    if (tree->flags & VOX_LEAF_MASK)
     {
-        vox_box_copy (&bb, &(tree->bounding_box));
-        update_bounding_box (&(tree->bounding_box), voxel);
-        if (dense_set_p (&(tree->bounding_box), tree->dots_num+1))
+        // Keep only voxels which are in the leaf
+        for (i=0; i<n; i++)
+            if (voxel_in_tree (tree, set[i])) vox_dot_copy (set[count++], set[i]);
+        if (count == 0) return 0;
+
+        if (count == tree->dots_num)
         {
-            if (tree->flags & VOX_DENSE_LEAF) tree->dots_num++;
-            else
-            {
-                node = vox_make_dense_leaf (&(tree->bounding_box));
-                assert (node->dots_num == tree->dots_num+1);
-                vox_destroy_tree (tree);
-            }
-            goto done;
+            destroy_subtree (tree);
+            *tree_ptr = NULL;
+        }
+        else if ((tree->flags & VOX_DENSE_LEAF) && tree->dots_num > DENSE_REBUILD_RATIO * count)
+        {
+            for (i=0; i<count; i++) vox_delete_voxel_ (arena, tree_ptr, set[i], NULL, NULL);
+        }
+        else
+        {
+            vox_dot *dots = vox_alloc (tree->dots_num * sizeof (vox_dot));
+            size_t remaining = 0;
+
+            flatten_tree (tree, dots);
+            qsort (set, count, sizeof (vox_dot), dot_cmp);
+            for (i=0; i<tree->dots_num; i++)
+                if (bsearch (dots[i], set, count, sizeof (vox_dot), dot_cmp) == NULL)
+                    vox_dot_copy (dots[remaining++], dots[i]);
+            *tree_ptr = make_tree (arena, dots, remaining);
+            destroy_subtree (tree);
+            free (dots);
         }
-        if (tree->flags & VOX_DENSE_LEAF) vox_box_copy (&(tree->bounding_box), &bb);
     }
     else
     {
-        /*
-          If tree is an empty leaf, allocate a regular leaf node and store
-          the voxel there.
-        */
-        WITH_STAT (VOXTREES_LEAF_INSERTION());
-        dots = alloca (sizeof (vox_dot) + 16);
-        dots = (void*)(((unsigned long) dots + 15) & ~(unsigned long)15);
-        vox_dot_copy (dots[0], voxel);
-        node = vox_make_tree (dots, 1);
-        goto done;
+        size_t offsets[VOX_NS+1];
+
+        split_batch (tree, set, n, offsets, tmp);
+        for (i=0; i<VOX_NS; i++)
+            count += delete_voxels (arena, &(tree->data.inner.children[i]),
+                                    set + offsets[i], offsets[i+1] - offsets[i], tmp);
+        tree->dots_num -= count;
+        if (count != 0) shrink_inner_node (tree_ptr);
     }
 
-    if (tree->flags & VOX_DENSE_LEAF)
+    return count;
+}
+
+size_t vox_delete_voxels (struct vox_node **tree_ptr, vox_dot set[], size_t n)
+{
+    struct vox_arena *arena;
+    vox_dot *tmp;
+    size_t count;
+
+    if (!(VOX_FULLP (*tree_ptr)) || ((*tree_ptr)->flags & VOX_FROZEN)) return 0;
+    n = prepare_batch (set, n);
+    if (n == 0) return 0;
+
+    arena = arena_of (*tree_ptr);
+    tmp = vox_alloc (n * sizeof (vox_dot));
+    count = delete_voxels (arena, tree_ptr, set, n, tmp);
+    free (tmp);
+    // All voxels are deleted
+    if (!(VOX_FULLP (*tree_ptr))) arena_destroy (arena);
+    return count;
+}
+
+/*
+  Region operations. A region is a box or a ball. A voxel belongs to the
+  region if its center is inside. Subtrees for parts of regions are built
+  geometrically: a box which is entirely inside the region becomes a dense
+  leaf, a box outside of it is dropped, and other boxes are divided into
+  octants until they are small enough to enumerate their voxels. Splitting
+  at corners of the region (or of a dense leaf) means that a box region
+  needs only a few levels of inner nodes.
+*/
+struct region
+{
+    int ball;
+    struct vox_box box; // Voxel-aligned bounding box of the region
+    vox_dot center;
+    float radius;
+};
+
+/*
+  What region_tree() builds. When filling, the result contains voxels of
+  the region and voxels of the dense box (if it is not NULL). When carving,
+  the result contains voxels of the dense box which are not in the region.
+*/
+struct region_op
+{
+    const struct region *region;
+    const struct vox_box *dense;
+    int carve;
+};
+
+enum {REGION_EMPTY, REGION_FULL, REGION_PARTIAL};
+
+static int voxel_in_region (const struct region *region, const vox_dot voxel)
+{
+    float dist = 0, d;
+    unsigned int i;
+
+    for (i=0; i<VOX_N; i++)
     {
-        WITH_STAT (VOXTREES_DENSE_INSERTION());
-        if (tree->dots_num < VOX_MAX_DOTS)
+        d = voxel[i] + vox_voxel[i]/2;
+        if (region->ball) dist += (d - region->center[i])*(d - region->center[i]);
+        else if (d < region->box.min[i] || d > region->box.max[i]) return 0;
+    }
+    return !(region->ball) || dist <= region->radius*region->radius;
+}
+
+static int boxes_interp (const struct vox_box *box1, const struct vox_box *box2)
+{
+    unsigned int i;
+
+    for (i=0; i<VOX_N; i++)
+        if (box1->min[i] >= box2->max[i] || box2->min[i] >= box1->max[i]) return 0;
+    return 1;
+}
+
+static int box_inside_p (const struct vox_box *box, const struct vox_box *outer)
+{
+    unsigned int i;
+
+    for (i=0; i<VOX_N; i++)
+        if (box->min[i] < outer->min[i] || box->max[i] > outer->max[i]) return 0;
+    return 1;
+}
+
+// Classify a voxel-aligned box with respect to the region
+static int region_box_class (const struct region *region, const struct vox_box *box)
+{
+    float near = 0, far = 0, lo, hi, d;
+    unsigned int i;
+
+    if (!(boxes_interp (box, &(region->box)))) return REGION_EMPTY;
+    if (!(region->ball))
+        return box_inside_p (box, &(region->box)) ? REGION_FULL : REGION_PARTIAL;
+
+    // Find the nearest and the farthest voxel centers in the box
+    for (i=0; i<VOX_N; i++)
+    {
+        lo = box->min[i] + vox_voxel[i]/2 - region->center[i];
+        hi = box->max[i] - vox_voxel[i]/2 - region->center[i];
+        d = (lo > 0) ? lo : ((hi < 0) ? -hi : 0);
+        near += d*d;
+        d = (-lo > hi) ? -lo : hi;
+        far += d*d;
+    }
+    if (near > region->radius*region->radius) return REGION_EMPTY;
+    return (far <= region->radius*region->radius) ? REGION_FULL : REGION_PARTIAL;
+}
+
+static int region_op_class (const struct region_op *op, const struct vox_box *box)
+{
+    int class = region_box_class (op->region, box);
+
+    if (op->carve)
+    {
+        if (class == REGION_FULL) return REGION_EMPTY;
+        if (class == REGION_EMPTY) return REGION_FULL;
+        return REGION_PARTIAL;
+    }
+    if (op->dense != NULL)
+    {
+        if (box_inside_p (box, op->dense)) return REGION_FULL;
+        if (class == REGION_EMPTY && boxes_interp (box, op->dense)) return REGION_PARTIAL;
+    }
+    return class;
+}
+
+static int region_op_voxelp (const struct region_op *op, const vox_dot voxel)
+{
+    if (op->carve) return !(voxel_in_region (op->region, voxel));
+    return voxel_in_region (op->region, voxel) ||
+        (op->dense != NULL && voxel_in_box (op->dense, voxel));
+}
+
+static int inside_interval_p (float x, float min, float max)
+{
+    return x > min && x < max;
+}
+
+// Choose a voxel-aligned center of subdivision for a box
+static void region_center (const struct region_op *op, const struct vox_box *box, vox_dot center)
+{
+    const struct vox_box *corners = (op->region->ball) ? NULL : &(op->region->box);
+    size_t dim[VOX_N];
+    unsigned int i;
+
+    get_dimensions (box, dim);
+    for (i=0; i<VOX_N; i++)
+    {
+        if (corners != NULL && inside_interval_p (corners->min[i], box->min[i], box->max[i]))
+            center[i] = corners->min[i];
+        else if (corners != NULL && inside_interval_p (corners->max[i], box->min[i], box->max[i]))
+            center[i] = corners->max[i];
+        else if (op->dense != NULL && inside_interval_p (op->dense->min[i], box->min[i], box->max[i]))
+            center[i] = op->dense->min[i];
+        else if (op->dense != NULL && inside_interval_p (op->dense->max[i], box->min[i], box->max[i]))
+            center[i] = op->dense->max[i];
+        else
         {
-            /*
-              Downgrade to an ordinary leaf. This will result is lesser amount
-              of inner nodes.
-            */
-            dots = alloca (sizeof (vox_dot)*VOX_MAX_DOTS + 16);
-            dots = (void*)(((unsigned long) dots + 15) & ~(unsigned long)15);
-            flatten_tree (tree, dots);
-            vox_dot_copy (dots[tree->dots_num], voxel);
-            node = vox_make_tree (dots, tree->dots_num+1);
-            vox_destroy_tree (tree);
+            // If the box is one voxel thick, all voxels are in the upper half
+            center[i] = box->min[i] + (dim[i] / 2) * vox_voxel[i];
         }
-        else node = insert_in_big_dense (tree, voxel);
     }
-    else if (tree->flags & VOX_LEAF)
+}
+
+static struct vox_node* region_tree (struct vox_arena *arena, const struct vox_box *box,
+                                     const struct region_op *op)
+{
+    struct vox_node *node, *child;
+    struct vox_box subbox;
+    unsigned int i, children = 0;
+    int class = region_op_class (op, box);
+
+    if (class == REGION_EMPTY) return NULL;
+    if (class == REGION_FULL) return make_dense_leaf (arena, box);
+
+    if (box_voxels (box) <= VOX_BRICK_VOXELS)
     {
-        WITH_STAT (VOXTREES_LEAF_INSERTION());
-        // We have enough space to add a voxel
-        if (tree->dots_num < VOX_MAX_DOTS)
+        vox_dot set[VOX_BRICK_VOXELS];
+        size_t dim[VOX_N], n = 0, j, k, l;
+
+        get_dimensions (box, dim);
+        for (j=0; j<dim[0]; j++)
+            for (k=0; k<dim[1]; k++)
+                for (l=0; l<dim[2]; l++)
+                {
+                    vox_dot_set (set[n],
+                                 box->min[0] + j*vox_voxel[0],
+                                 box->min[1] + k*vox_voxel[1],
+                                 box->min[2] + l*vox_voxel[2]);
+                    if (region_op_voxelp (op, set[n])) n++;
+                }
+        return (n != 0) ? make_tree (arena, set, n) : NULL;
+    }
+
+    node = node_alloc (arena, 0);
+    memset (&(node->data.inner), 0, sizeof (vox_inner_data));
+    node->flags = 0;
+    node->dots_num = 0;
+    region_center (op, box, node->data.inner.center);
+    for (i=0; i<VOX_NS; i++)
+    {
+        if (!(divide_box (box, node->data.inner.center, &subbox, i))) continue;
+        child = region_tree (arena, &subbox, op);
+        node->data.inner.children[i] = child;
+        if (!(VOX_FULLP (child))) continue;
+        if (children++ == 0) vox_box_copy (&(node->bounding_box), &(child->bounding_box));
+        else box_union (&(node->bounding_box), &(child->bounding_box));
+        node->dots_num += child->dots_num;
+    }
+
+    if (children <= 1)
+    {
+        shrink_inner_node (&node);
+        return node;
+    }
+    if (dense_set_p (&(node->bounding_box), node->dots_num))
+    {
+        child = make_dense_leaf (arena, &(node->bounding_box));
+        destroy_subtree (node);
+        node = child;
+    }
+    return node;
+}
+
+// Intersection of two boxes. Return 0 if it is empty.
+static int box_intersection (const struct vox_box *box1, const struct vox_box *box2,
+                             struct vox_box *res)
+{
+    unsigned int i;
+
+    for (i=0; i<VOX_N; i++)
+    {
+        res->min[i] = (box1->min[i] > box2->min[i]) ? box1->min[i] : box2->min[i];
+        res->max[i] = (box1->max[i] < box2->max[i]) ? box1->max[i] : box2->max[i];
+        if (res->min[i] >= res->max[i]) return 0;
+    }
+    return 1;
+}
+
+/*
+  Insert voxels of the region in the tree. Space is the part of space where
+  the voxels of the tree can be (it is limited by centers of the ancestors).
+*/
+static size_t insert_region (struct vox_arena *arena, struct vox_node **tree_ptr,
+                             const struct region *region, const struct vox_box *space)
+{
+    struct vox_node *tree = *tree_ptr, *node;
+    struct region_op op = {region, NULL, 0};
+    struct vox_box box, subspace;
+    size_t i, count = 0;
+
+    if (!(box_intersection (&(region->box), space, &box))) return 0;
+
+    if (!(VOX_FULLP (tree)))
+    {
+        *tree_ptr = region_tree (arena, &box, &op);
+        return (VOX_FULLP (*tree_ptr)) ? (*tree_ptr)->dots_num : 0;
+    }
+
+    if (tree->flags & VOX_DENSE_LEAF)
+    {
+        if (box_inside_p (&box, &(tree->bounding_box))) return 0;
+        op.dense = &(tree->bounding_box);
+        box_union (&box, &(tree->bounding_box));
+        node = region_tree (arena, &box, &op);
+        count = node->dots_num - tree->dots_num;
+        destroy_subtree (tree);
+        *tree_ptr = node;
+    }
+    else if (tree->flags & VOX_LEAF_MASK)
+    {
+        vox_dot *dots;
+
+        node = region_tree (arena, &box, &op);
+        if (!(VOX_FULLP (node))) return 0;
+
+        // Add old voxels to the new subtree
+        dots = vox_alloc (tree->dots_num * sizeof (vox_dot));
+        flatten_tree (tree, dots);
+        for (i=0; i<tree->dots_num; i++)
+            if (!(voxel_in_tree (node, dots[i]))) vox_insert_voxel_ (arena, &node, dots[i], NULL, NULL);
+        free (dots);
+
+        count = node->dots_num - tree->dots_num;
+        destroy_subtree (tree);
+        *tree_ptr = node;
+    }
+    else
+    {
+        for (i=0; i<VOX_NS; i++)
         {
-            vox_dot_copy (tree->data.dots[tree->dots_num], voxel);
-            tree->dots_num++;
+            if (divide_box (space, tree->data.inner.center, &subspace, i))
+                count += insert_region (arena, &(tree->data.inner.children[i]), region, &subspace);
         }
-        // If not, create a new subtree with vox_make_tree()
-        else
+        tree->dots_num += count;
+        children_bounding_box (tree);
+
+        if (dense_set_p (&(tree->bounding_box), tree->dots_num))
         {
-            assert (tree->dots_num == VOX_MAX_DOTS);
-            dots = alloca (sizeof (vox_dot)*(VOX_MAX_DOTS+1) + 16);
-            dots = (void*)(((unsigned long) dots + 15) & ~(unsigned long)15);
-            memcpy (dots, tree->data.dots, sizeof(vox_dot)*tree->dots_num);
-            vox_dot_copy (dots[tree->dots_num], voxel);
-            node = vox_make_tree (dots, tree->dots_num+1);
-            vox_destroy_tree (tree);
+            *tree_ptr = make_dense_leaf (arena, &(tree->bounding_box));
+            destroy_subtree (tree);
+        }
+    }
+
+    return count;
+}
+
+static size_t delete_region (struct vox_arena *arena, struct vox_node **tree_ptr,
+                             const struct region *region)
+{
+    struct vox_node *tree = *tree_ptr, *node;
+    size_t i, count = 0;
+    int class;
+
+    if (!(VOX_FULLP (tree))) return 0;
+    class = region_box_class (region, &(tree->bounding_box));
+    if (class == REGION_EMPTY) return 0;
+    if (class == REGION_FULL)
+    {
+        count = tree->dots_num;
+        destroy_subtree (tree);
+        *tree_ptr = NULL;
+        return count;
+    }
+
+    if (tree->flags & VOX_DENSE_LEAF)
+    {
+        struct region_op op = {region, &(tree->bounding_box), 1};
+
+        node = region_tree (arena, &(tree->bounding_box), &op);
+        count = tree->dots_num - ((VOX_FULLP (node)) ? node->dots_num : 0);
+        destroy_subtree (tree);
+        *tree_ptr = node;
+    }
+    else if (tree->flags & VOX_LEAF_MASK)
+    {
+        vox_dot *dots = vox_alloc (tree->dots_num * sizeof (vox_dot));
+        size_t remaining = 0;
+
+        flatten_tree (tree, dots);
+        for (i=0; i<tree->dots_num; i++)
+            if (!(voxel_in_region (region, dots[i]))) vox_dot_copy (dots[remaining++], dots[i]);
+        count = tree->dots_num - remaining;
+        if (count != 0)
+        {
+            *tree_ptr = make_tree (arena, dots, remaining);
+            destroy_subtree (tree);
         }
+        free (dots);
     }
     else
     {
-        /*
-          For inner node we need only to increment node's voxel number and
-          propagate changes further.
-        */
-        vox_inner_data *inner = &(tree->data.inner);
-#ifdef SSE_INTRIN
-        int idx = get_subspace_idx_simd (_mm_load_ps(inner->center), _mm_load_ps(voxel));
-#else
-        int idx = get_subspace_idx (inner->center, voxel);
-#endif
-        tree->dots_num++;
-        tree_ptr = &(inner->children[idx]);
-        goto again; // Force tail call optimization.
+        for (i=0; i<VOX_NS; i++)
+            count += delete_region (arena, &(tree->data.inner.children[i]), region);
+        tree->dots_num -= count;
+        if (count != 0) shrink_inner_node (tree_ptr);
+    }
+
+    return count;
+}
+
+static size_t modify_region (struct vox_node **tree_ptr, const struct region *region, int insert)
+{
+    static const struct vox_box space = {
+        {-INFINITY, -INFINITY, -INFINITY}, {INFINITY, INFINITY, INFINITY}
+    };
+    struct vox_arena *arena;
+    size_t count;
+    unsigned int i;
+
+    if (VOX_FULLP (*tree_ptr) && ((*tree_ptr)->flags & VOX_FROZEN)) return 0;
+    for (i=0; i<VOX_N; i++)
+        if (region->box.min[i] >= region->box.max[i]) return 0;
+
+    if (insert)
+    {
+        arena = (VOX_FULLP (*tree_ptr)) ? arena_of (*tree_ptr) : arena_new ();
+        count = insert_region (arena, tree_ptr, region, &space);
+    }
+    else
+    {
+        if (!(VOX_FULLP (*tree_ptr))) return 0;
+        arena = arena_of (*tree_ptr);
+        count = delete_region (arena, tree_ptr, region);
+    }
+
+    if (!(VOX_FULLP (*tree_ptr))) arena_destroy (arena);
+    return count;
+}
+
+static void box_region (const struct vox_box *box, struct region *region)
+{
+    unsigned int i;
+
+    region->ball = 0;
+    for (i=0; i<VOX_N; i++)
+    {
+        region->box.min[i] = floorf (box->min[i] / vox_voxel[i]) * vox_voxel[i];
+        region->box.max[i] = ceilf (box->max[i] / vox_voxel[i]) * vox_voxel[i];
+    }
+}
+
+static void ball_region (const vox_dot center, float radius, struct region *region)
+{
+    unsigned int i;
+
+    region->ball = 1;
+    vox_dot_copy (region->center, center);
+    region->radius = radius;
+    for (i=0; i<VOX_N; i++)
+    {
+        region->box.min[i] = floorf ((center[i] - radius) / vox_voxel[i]) * vox_voxel[i];
+        region->box.max[i] = ceilf ((center[i] + radius) / vox_voxel[i]) * vox_voxel[i];
     }
+}
 
-done:
-    *tree_ptr = node;
+size_t vox_insert_box (struct vox_node **tree_ptr, const struct vox_box *box)
+{
+    struct region region;
+    box_region (box, &region);
+    return modify_region (tree_ptr, &region, 1);
 }
 
-int vox_insert_voxel (struct vox_node **tree_ptr, vox_dot voxel)
+size_t vox_delete_box (struct vox_node **tree_ptr, const struct vox_box *box)
 {
-    int res;
+    struct region region;
+    box_region (box, &region);
+    return modify_region (tree_ptr, &region, 0);
+}
 
-    vox_align (voxel);
-    res = !(voxel_in_tree (*tree_ptr, voxel));
-    if (res) vox_insert_voxel_ (tree_ptr, voxel);
-    return res;
+size_t vox_insert_ball (struct vox_node **tree_ptr, const vox_dot center, float radius)
+{
+    struct region region;
+    ball_region (center, radius, &region);
+    return modify_region (tree_ptr, &region, 1);
 }
 
-int vox_insert_voxel_coord (struct vox_node **tree_ptr, float x, float y, float z)
+size_t vox_delete_ball (struct vox_node **tree_ptr, const vox_dot center, float radius)
 {
-    vox_dot dot;
-#ifdef SSE_INTRIN
-    _mm_store_ps (dot, _mm_set_ps (0, z, y, x));
-#else
-    dot[0] = x; dot[1] = y; dot[2] = z;
-#endif
-    return vox_insert_voxel (tree_ptr, dot);
+    struct region region;
+    ball_region (center, radius, &region);
+    return modify_region (tree_ptr, &region, 0);
 }
 
 /*
-  Helper function for deletion from dense stripes.
-  It always deletes if dense leaf is a stripe
-  (with bounding box of dimensions 1x1xN, 1xNx1 or Nx1x1).
-  Return NULL otherwise.
+  Versions of a tree. Modifications of a versioned tree copy nodes on the
+  path from the root to the modified leaf instead of changing them, so all
+  older versions remain valid and share unchanged subtrees with the latest
+  one. Nodes which are replaced are retired: they are put into the list of
+  the version they are last used in. Readers pin versions with
+  vox_acquire_version(). Retired nodes of the oldest versions are freed by
+  the writer when no one reads those versions. Modifications must be
+  serialized, but they can run concurrently with readers. The lock is held
+  only for a few instructions.
 */
-static struct vox_node*
-delete_from_dense_stripe (struct vox_node *tree, const vox_dot voxel)
+struct vox_tree_version
 {
-    int idx, stripe, success;
-    struct vox_node *node, *child;
-    vox_dot other_side;
-    vox_inner_data *inner;
-    struct vox_box bb;
+    struct vox_node *root;
+    unsigned int readers;
+    struct vox_node **retired; // Nodes which are replaced in the next version
+    size_t retired_num, retired_max;
+    struct vox_node *retired_tree; // Whole tree replaced in the next version
+    struct vox_arena *retired_arena;
+    struct vox_tree_version *next;
+};
+
+struct vox_tree_versions
+{
+    atomic_flag lock;
+    struct vox_arena *arena; // Arena for new nodes, NULL if there is no such arena
+    struct vox_tree_version *oldest, *latest;
+};
 
-    stripe = stripep (&(tree->bounding_box), &idx);
-    if (!stripe) return NULL;
+static void versions_lock (struct vox_tree_versions *versions)
+{
+    while (atomic_flag_test_and_set_explicit (&(versions->lock), memory_order_acquire));
+}
 
-    // First special case. Delete "leftmost" voxel.
-    if (vox_dot_equalp (tree->bounding_box.min, voxel))
+static void versions_unlock (struct vox_tree_versions *versions)
+{
+    atomic_flag_clear_explicit (&(versions->lock), memory_order_release);
+}
+
+static struct vox_tree_version* new_version (struct vox_node *root)
+{
+    struct vox_tree_version *version = calloc (1, sizeof (struct vox_tree_version));
+    version->root = root;
+    return version;
+}
+
+static void free_version (struct vox_tree_version *version, int free_nodes)
+{
+    size_t i;
+
+    if (free_nodes)
+        for (i=0; i<version->retired_num; i++) node_free (version->retired[i]);
+    vox_destroy_tree (version->retired_tree);
+    if (version->retired_arena != NULL) arena_destroy (version->retired_arena);
+    free (version->retired);
+    free (version);
+}
+
+static void retire_node (struct vox_tree_versions *versions, struct vox_node *node)
+{
+    struct vox_tree_version *version = versions->latest;
+
+    if (version->retired_num == version->retired_max)
     {
-        tree->dots_num--;
-        tree->bounding_box.min[idx] += vox_voxel[idx];
-        return tree;
+        version->retired_max = (version->retired_max != 0) ? 2*version->retired_max : 64;
+        version->retired = realloc (version->retired,
+                                    version->retired_max * sizeof (struct vox_node*));
     }
-    vox_dot_add (voxel, vox_voxel, other_side);
-    // First special case. Delete "rightmost" voxel.
-    if (vox_dot_equalp (tree->bounding_box.max, other_side))
+    version->retired[version->retired_num++] = node;
+}
+
+static void retire_subtree (struct vox_tree_versions *versions, struct vox_node *tree)
+{
+    unsigned int i;
+
+    if (!(VOX_FULLP (tree))) return;
+    if (!(tree->flags & VOX_LEAF_MASK))
+        for (i=0; i<VOX_NS; i++) retire_subtree (versions, tree->data.inner.children[i]);
+    retire_node (versions, tree);
+}
+
+// Free the oldest versions which are not read by anyone
+static void reclaim_versions (struct vox_tree_versions *versions)
+{
+    struct vox_tree_version *version, *next, *reclaimed;
+
+    versions_lock (versions);
+    reclaimed = versions->oldest;
+    for (version = versions->oldest;
+         version != versions->latest && version->readers == 0;
+         version = version->next);
+    versions->oldest = version;
+    versions_unlock (versions);
+
+    for (; reclaimed != version; reclaimed = next)
     {
-        tree->dots_num--;
-        tree->bounding_box.max[idx] -= vox_voxel[idx];
-        return tree;
+        next = reclaimed->next;
+        free_version (reclaimed, 1);
     }
 
-    // Common case, create 1 inner node.
-    node = node_alloc (0);
-    inner = &(node->data.inner);
+    // The arena is not needed anymore if the tree is empty
+    if (versions->oldest == versions->latest && !(VOX_FULLP (versions->latest->root)) &&
+        versions->arena != NULL)
+    {
+        arena_destroy (versions->arena);
+        versions->arena = NULL;
+    }
+}
 
-    vox_box_copy (&(node->bounding_box), &(tree->bounding_box));
-    node->flags = 0;
-    node->dots_num = tree->dots_num - 1;
-    vox_dot_copy (inner->center, voxel);
-    memset (inner->children, 0, sizeof (inner->children));
+static void publish_version (struct vox_tree_versions *versions, struct vox_node *root)
+{
+    struct vox_tree_version *version = new_version (root);
 
-    success = divide_box (&(tree->bounding_box), voxel, &bb, 1<<idx);
-    assert (success);
-    child = vox_make_dense_leaf (&bb);
-    inner->children[1<<idx] = child;
+    versions_lock (versions);
+    versions->latest->next = version;
+    versions->latest = version;
+    versions_unlock (versions);
+}
 
-    success = divide_box (&(tree->bounding_box), voxel, &bb, 0);
-    assert (success);
-    child = vox_make_dense_leaf (&bb);
-    inner->children[0] = child;
-    assert (inner->children[0]->dots_num + inner->children[1<<idx]->dots_num ==
-            tree->dots_num);
-    child->dots_num--;
-    child->bounding_box.min[idx] += vox_voxel[idx];
-    vox_destroy_tree (tree);
-    return node;
+static struct vox_node* clone_inner_node (struct vox_arena *arena, const struct vox_node *node)
+{
+    struct vox_node *copy = node_alloc (arena, 0);
+    memcpy (copy, node, offsetof (struct vox_node, data) + sizeof (vox_inner_data));
+    return copy;
 }
 
-static struct vox_node* __attribute__((noinline))
-    delete_from_big_dense (struct vox_node *tree, const vox_dot voxel)
+// Return a new version of the subtree with the voxel. The voxel must not be in the tree.
+static struct vox_node* cow_insert (struct vox_tree_versions *versions, struct vox_node *tree,
+                                    const vox_dot voxel)
 {
+    struct vox_arena *arena = versions->arena;
     struct vox_node *node;
-    vox_inner_data *inner;
-    struct vox_box bb;
-    int i, success;
-    vox_dot other_side;
-
-    // Maybe we are deleting from stripe.
-    node = delete_from_dense_stripe (tree, voxel);
-    if (node != NULL) return node;
+    struct vox_box box;
+    vox_dot *dots;
+    int idx;
 
-    // No, special case 1, deletion of "leftmost" voxel.
-    if (vox_dot_equalp (tree->bounding_box.min, voxel))
+    if (!(VOX_FULLP (tree)))
     {
-        vox_dot_add (voxel, vox_voxel, other_side);
-        // Create 1 inner node.
-        node = node_alloc (0);
-        inner = &(node->data.inner);
-        vox_box_copy (&(node->bounding_box), &(tree->bounding_box));
-        node->flags = 0;
-        node->dots_num = tree->dots_num - 1;
-        vox_dot_copy (inner->center, other_side);
-        memset (inner->children, 0, sizeof (inner->children));
-
-        for (i=0; i<VOX_NS-1; i++)
-        {
-            success = divide_box (&(tree->bounding_box), other_side, &bb, i);
-            if (!success) continue;
-            inner->children[i] = vox_make_dense_leaf (&bb);
-        }
-        vox_destroy_tree (tree);
-        return node;
+        vox_dot dot;
+        vox_dot_copy (dot, voxel);
+        return make_tree (arena, &dot, 1);
     }
 
-    // Most common case, create 2 nodes
-    node = node_alloc (0);
-    inner = &(node->data.inner);
-    vox_box_copy (&(node->bounding_box), &(tree->bounding_box));
-    node->flags = 0;
-    node->dots_num = tree->dots_num - 1;
-    vox_dot_copy (inner->center, voxel);
-    memset (inner->children, 0, sizeof (inner->children));
-
-    for (i=0; i<VOX_NS; i++)
+    vox_box_copy (&box, &(tree->bounding_box));
+    update_bounding_box (&box, voxel);
+    if (dense_set_p (&box, tree->dots_num + 1))
     {
-        success = divide_box (&(tree->bounding_box), voxel, &bb, i);
-        if (!success) continue;
-        inner->children[i] = vox_make_dense_leaf (&bb);
+        retire_subtree (versions, tree);
+        return make_dense_leaf (arena, &box);
     }
 
-    /*
-      Delete voxel using a special case in this function,
-      also deleting the original tree.
+    if ((tree->flags & VOX_DENSE_LEAF) && tree->dots_num >= VOX_MAX_DOTS)
+        // The dense leaf is not modified, it becomes a child of the new node
+        return insert_in_big_dense (arena, tree, voxel);
+    else if (tree->flags & VOX_LEAF_MASK)
+    {
+        dots = vox_alloc ((tree->dots_num + 1) * sizeof (vox_dot));
+        flatten_tree (tree, dots);
+        vox_dot_copy (dots[tree->dots_num], voxel);
+        node = make_tree (arena, dots, tree->dots_num + 1);
+        free (dots);
+    }
+    else
+    {
+        idx = batch_subspace_idx (tree, voxel);
+        node = clone_inner_node (arena, tree);
+        node->data.inner.children[idx] = cow_insert (versions, tree->data.inner.children[idx], voxel);
+        vox_box_copy (&(node->bounding_box), &box);
+        node->dots_num++;
+    }
 
-      May be easily TCO'ed if needed.
-    */
-    inner->children[0] = delete_from_big_dense (inner->children[0], voxel);
-    vox_destroy_tree (tree);
+    retire_node (versions, tree);
     return node;
 }
 
-// It always deletes.
-static void vox_delete_voxel_ (struct vox_node **tree_ptr, const vox_dot voxel)
+// Return a new version of the subtree without the voxel. The voxel must be in the tree.
+static struct vox_node* cow_delete (struct vox_tree_versions *versions, struct vox_node *tree,
+                                    const vox_dot voxel)
 {
-    struct vox_node *tree, *node;
-    unsigned int i;
+    struct vox_arena *arena = versions->arena;
+    struct vox_node *node;
+    size_t i, n = 0;
 
-again:
-    tree = *tree_ptr;
-    if (tree->dots_num == 1)
+    if (tree->dots_num == 1) node = NULL;
+    else if (tree->flags & VOX_DENSE_LEAF)
     {
-        vox_destroy_tree (tree);
-        *tree_ptr = NULL;
-        return;
-    }
-
-    // XXX: update bounding box
+        struct region region;
+        struct region_op op = {&region, &(tree->bounding_box), 1};
 
-    if (tree->flags & VOX_LEAF)
+        region.ball = 0;
+        vox_dot_copy (region.box.min, voxel);
+        vox_dot_add (voxel, vox_voxel, region.box.max);
+        node = region_tree (arena, &(tree->bounding_box), &op);
+    }
+    else if (tree->flags & VOX_LEAF_MASK)
     {
-        WITH_STAT (VOXTREES_LEAF_DELETION());
+        vox_dot *dots = vox_alloc (tree->dots_num * sizeof (vox_dot));
+
+        flatten_tree (tree, dots);
         for (i=0; i<tree->dots_num; i++)
-            if (vox_dot_equalp (tree->data.dots[i], voxel)) break;
-        assert (i < tree->dots_num);
-        tree->dots_num--;
-        memmove (tree->data.dots + i, tree->data.dots + i + 1,
-                 sizeof (vox_dot) * (tree->dots_num - i));
+            if (!vox_dot_equalp (dots[i], voxel)) vox_dot_copy (dots[n++], dots[i]);
+        node = make_tree (arena, dots, n);
+        free (dots);
     }
-    else if (tree->flags & VOX_DENSE_LEAF)
+    else
     {
-        WITH_STAT (VOXTREES_DENSE_DELETION());
-        // Downgrade to an ordinary leaf
-        if (tree->dots_num <= VOX_MAX_DOTS)
-        {
-            // Give it a try, what if this is the case?
-            node = delete_from_dense_stripe (tree, voxel);
-            if (node)
-            {
-                *tree_ptr = node;
-                return;
-            }
-            vox_dot *set;
-            set = alloca (sizeof (vox_dot)*VOX_MAX_DOTS + 16);
-            set = (void*)(((unsigned long) set + 15) & ~(unsigned long)15);
-            flatten_tree (tree, set);
-            /*
-              XXX: Proper index may be calculated faster, if needed.
-              Just find it using loop now
-            */
-            for (i=0; i<tree->dots_num; i++)
-                if (vox_dot_equalp (set[i], voxel)) break;
-            assert (i < tree->dots_num);
-            memmove (set + i, set + i + 1,
-                     sizeof (vox_dot) * (tree->dots_num - i - 1));
-            *tree_ptr = vox_make_tree (set, tree->dots_num - 1);
-            vox_destroy_tree (tree);
-        }
+        int idx = batch_subspace_idx (tree, voxel);
+        struct vox_node *child = cow_delete (versions, tree->data.inner.children[idx], voxel);
+
+        node = clone_inner_node (arena, tree);
+        node->data.inner.children[idx] = child;
+        node->dots_num--;
         /*
-          Divide our dense leaf into many dense leafs in 1 or 2 inner
-          nodes or return a new dense leaf as a special case
+          The copy is not a part of any version yet, so it can be freed
+          right here if it has only one child.
         */
-        else *tree_ptr = delete_from_big_dense (tree, voxel);
+        shrink_inner_node (&node);
     }
-    else
+
+    retire_node (versions, tree);
+    return node;
+}
+
+struct vox_tree_versions* vox_make_tree_versions (struct vox_node *tree)
+{
+    struct vox_tree_versions *versions = malloc (sizeof (struct vox_tree_versions));
+
+    atomic_flag_clear (&(versions->lock));
+    versions->arena = (VOX_FULLP (tree) && !(tree->flags & VOX_FROZEN)) ? arena_of (tree) : NULL;
+    versions->oldest = versions->latest = new_version (tree);
+    return versions;
+}
+
+void vox_destroy_tree_versions (struct vox_tree_versions *versions)
+{
+    struct vox_tree_version *version, *next;
+
+    // The arena is owned by the latest version if it is not empty
+    if (versions->arena != NULL && !(VOX_FULLP (versions->latest->root)))
+        arena_destroy (versions->arena);
+
+    /*
+      Retired nodes are in the arena of the latest version (or in arenas of
+      replaced trees), so they are not freed one by one.
+    */
+    for (version = versions->oldest; version != NULL; version = next)
     {
-        // Inner node
-        vox_inner_data *inner = &(tree->data.inner);
-#ifdef SSE_INTRIN
-        int idx = get_subspace_idx_simd (_mm_load_ps(inner->center), _mm_load_ps(voxel));
-#else
-        int idx = get_subspace_idx (inner->center, voxel);
-#endif
-        node = inner->children[idx];
-        if (node->dots_num == tree->dots_num)
+        next = version->next;
+        free_version (version, 0);
+    }
+    free (versions);
+}
+
+struct vox_node* vox_latest_version (const struct vox_tree_versions *versions)
+{
+    return versions->latest->root;
+}
+
+struct vox_node* vox_acquire_version (struct vox_tree_versions *versions)
+{
+    struct vox_node *root;
+
+    versions_lock (versions);
+    versions->latest->readers++;
+    root = versions->latest->root;
+    versions_unlock (versions);
+    return root;
+}
+
+void vox_release_version (struct vox_tree_versions *versions, const struct vox_node *tree)
+{
+    struct vox_tree_version *version;
+
+    versions_lock (versions);
+    for (version = versions->oldest; version != NULL; version = version->next)
+    {
+        if (version->root == tree && version->readers != 0)
         {
-            /*
-              This means that this child is the only child of its parent.
-              So we can remove this parent and connect the child to parent's
-              parent directly.
-            */
-            *tree_ptr = node;
-            free (tree); // Save the child.
-            goto again;
+            version->readers--;
+            break;
         }
-        tree->dots_num--;
-        tree_ptr = &(inner->children[idx]);
-        goto again;
     }
+    versions_unlock (versions);
 }
 
-int vox_delete_voxel (struct vox_node **tree_ptr, vox_dot voxel)
+int vox_versions_insert_voxel (struct vox_tree_versions *versions, vox_dot voxel)
 {
-    int res;
+    struct vox_node *tree = versions->latest->root;
 
+    if (VOX_FULLP (tree) && (tree->flags & VOX_FROZEN)) return 0;
     vox_align (voxel);
-    res = voxel_in_tree (*tree_ptr, voxel);
-    if (res) vox_delete_voxel_ (tree_ptr, voxel);
-    return res;
+    if (voxel_in_tree (tree, voxel)) return 0;
+
+    reclaim_versions (versions);
+    if (versions->arena == NULL) versions->arena = arena_new ();
+    publish_version (versions, cow_insert (versions, tree, voxel));
+    return 1;
 }
 
-int vox_delete_voxel_coord (struct vox_node **tree_ptr, float x, float y, float z)
+int vox_versions_delete_voxel (struct vox_tree_versions *versions, vox_dot voxel)
 {
-    vox_dot dot;
-#ifdef SSE_INTRIN
-    _mm_store_ps (dot, _mm_set_ps (0, z, y, x));
-#else
-    dot[0] = x; dot[1] = y; dot[2] = z;
-#endif
-    return vox_delete_voxel (tree_ptr, dot);
+    struct vox_node *tree = versions->latest->root;
+
+    if (VOX_FULLP (tree) && (tree->flags & VOX_FROZEN)) return 0;
+    vox_align (voxel);
+    if (!voxel_in_tree (tree, voxel)) return 0;
+
+    reclaim_versions (versions);
+    publish_version (versions, cow_delete (versions, tree, voxel));
+    return 1;
+}
+
+void vox_versions_replace_tree (struct vox_tree_versions *versions, struct vox_node *tree)
+{
+    struct vox_tree_version *latest = versions->latest;
+
+    reclaim_versions (versions);
+    // The old tree is destroyed with its arena when it is not read anymore
+    if (VOX_FULLP (latest->root)) latest->retired_tree = latest->root;
+    else latest->retired_arena = versions->arena;
+    versions->arena = (VOX_FULLP (tree) && !(tree->flags & VOX_FROZEN)) ? arena_of (tree) : NULL;
+    publish_version (versions, tree);
 }
 
 void vox_dump_tree (const struct vox_node *tree)
 {
     const char *leaf_str = "LEAF";
     const char *dense_str = "DENSE LEAF";
+    const char *brick_str = "BRICK";
     const char *inner_str = "INNER";
     const char *desc;
     unsigned int i;
@@ -877,9 +3171,11 @@ void vox_dump_tree (const struct vox_node *tree)
     {
         if (tree->flags & VOX_LEAF) desc = leaf_str;
         else if (tree->flags & VOX_DENSE_LEAF) desc = dense_str;
+        else if (tree->flags & VOX_BRICK) desc = brick_str;
         else desc = inner_str;
 
-        printf ("Node %p %s\n", tree, desc);
+        printf ("Node %p %s%s\n", tree, desc,
+                (tree->flags & VOX_FROZEN) ? " (FROZEN)" : "");
         printf ("Bounding box min <%f, %f, %f>\n",
                 tree->bounding_box.min[0],
                 tree->bounding_box.min[1],
@@ -892,12 +3188,22 @@ void vox_dump_tree (const struct vox_node *tree)
 
         if (tree->flags & VOX_LEAF)
         {
+            vox_dot buffer[VOX_MAX_DOTS];
+            vox_dot *dots = leaf_dots (tree, buffer);
             printf ("Dots:\n");
             for (i=0; i<tree->dots_num; i++)
                 printf ("<%f, %f, %f>\n",
-                        tree->data.dots[i][0],
-                        tree->data.dots[i][1],
-                        tree->data.dots[i][2]);
+                        dots[i][0],
+                        dots[i][1],
+                        dots[i][2]);
+        }
+        else if (tree->flags & VOX_BRICK)
+        {
+            printf ("Origin <%f, %f, %f>\n",
+                    tree->data.brick.origin[0],
+                    tree->data.brick.origin[1],
+                    tree->data.brick.origin[2]);
+            printf ("Mask %016llx\n", (unsigned long long)tree->data.brick.mask);
         }
         else if (!(tree->flags & VOX_LEAF_MASK))
         {
@@ -906,12 +3212,12 @@ void vox_dump_tree (const struct vox_node *tree)
                     tree->data.inner.center[1],
                     tree->data.inner.center[2]);
             printf ("Children:\n");
-            for (i=0; i<VOX_NS; i++) printf ("%p\n", tree->data.inner.children[i]);
+            for (i=0; i<VOX_NS; i++) printf ("%p\n", VOX_CHILD (tree, i));
         }
         printf ("------Node ends here------\n");
         if (!(tree->flags & VOX_LEAF_MASK))
         {
-            for (i=0; i<VOX_NS; i++) vox_dump_tree (tree->data.inner.children[i]);
+            for (i=0; i<VOX_NS; i++) vox_dump_tree (VOX_CHILD (tree, i));
             printf ("=======Node and children end here=======\n");
         }
     }
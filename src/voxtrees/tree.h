@@ -11,11 +11,18 @@
 #include "params.h"
 
 #ifdef VOXTREES_SOURCE
+#include <stdint.h>
 
 #define VOX_LEAF 1
 #define VOX_DENSE_LEAF 2
-#define VOX_LEAF_MASK 3
 #define VOX_OVERFLOW 4
+#define VOX_FROZEN 8
+#define VOX_QUANT8 16
+#define VOX_QUANT16 32
+#define VOX_QUANT_MASK 48
+#define VOX_BRICK 64
+#define VOX_MAPPED 128
+#define VOX_LEAF_MASK (VOX_LEAF | VOX_DENSE_LEAF | VOX_BRICK)
 #define VOX_LEAFP(node) (!(node) || ((node)->flags & VOX_LEAF_MASK))
 #define VOX_FULLP(node) ((node))
 
@@ -25,6 +32,30 @@ typedef struct
     struct vox_node *children[VOX_NS]; /**< \brief Children of this node */
 } vox_inner_data;
 
+/*
+  Inner node of a frozen tree. The center must be the first field here, like
+  in vox_inner_data, so it can be accessed as data.inner.center in both cases.
+*/
+typedef struct
+{
+    vox_dot center; /**< \brief Center of subdivision */
+    uint32_t children[VOX_NS]; /**< \brief Offsets of children from this node, 0 if no child */
+} vox_frozen_inner_data;
+
+/*
+  Brick is a leaf which covers a cell of VOX_BRICK_SIDE^3 voxels and stores
+  occupied voxels of the cell as a bit mask. Voxel (x, y, z) (in vox_voxel
+  units from the origin of the cell) is the bit x + 4y + 16z.
+*/
+#define VOX_BRICK_SIDE 4
+#define VOX_BRICK_VOXELS (VOX_BRICK_SIDE*VOX_BRICK_SIDE*VOX_BRICK_SIDE)
+
+typedef struct
+{
+    vox_dot origin; /**< \brief Minimal corner of the cell */
+    uint64_t mask; /**< \brief Occupied voxels of the cell */
+} vox_brick_data;
+
 struct vox_node
 {
     struct vox_box bounding_box;
@@ -34,8 +65,53 @@ struct vox_node
     {
         vox_dot *dots;
         vox_inner_data inner;
+        vox_frozen_inner_data frozen;
+        vox_brick_data brick;
     } data;
 };
+
+/*
+  Accessors which work for both ordinary and frozen trees. Voxels of a frozen
+  leaf are stored right in place of data field. VOX_DOTS() must not be used
+  with quantized leafs (see leaf_dots()).
+*/
+#define VOX_DOTS(node) (((node)->flags & VOX_FROZEN) ?                  \
+                        (vox_dot*)&((node)->data) : (node)->data.dots)
+#define VOX_CHILD(node, idx) (((node)->flags & VOX_FROZEN) ?            \
+                              (((node)->data.frozen.children[idx]) ?    \
+                               (struct vox_node*)((char*)(node) +       \
+                                                  (node)->data.frozen.children[idx]) : \
+                               NULL) :                                  \
+                              (node)->data.inner.children[idx])
+/*
+  Return voxels of a leaf node. Frozen leafs can store voxels as 8 or 16 bit
+  integer offsets from the leaf's bounding box on the grid of vox_voxel
+  (flags VOX_QUANT8 and VOX_QUANT16). These are decoded into buffer which
+  must have space for VOX_MAX_DOTS voxels.
+*/
+vox_dot* leaf_dots (const struct vox_node *leaf, vox_dot *buffer);
+
+/*
+  Store coordinates of the voxel which corresponds to bit idx of the brick
+  in res.
+*/
+void brick_voxel (const struct vox_node *brick, int idx, vox_dot res);
+
+struct vox_arena;
+
+/*
+  Make a tree of n voxels in set (like vox_make_tree()) or a dense leaf
+  covering box, allocating nodes in arena.
+*/
+struct vox_node* make_tree (struct vox_arena *arena, vox_dot set[], size_t n);
+struct vox_node* make_dense_leaf (struct vox_arena *arena, const struct vox_box *box);
+
+/*
+  Make one tree of trees children[i], which have voxels only in subspace i
+  of center. The children must be ordinary (not frozen) trees. They are
+  consumed: their arenas are merged into one.
+*/
+struct vox_node* join_trees (const vox_dot center, struct vox_node *children[]);
 #else /* VOXTREES_SOURCE */
 /**
    @struct vox_node
@@ -59,6 +135,92 @@ struct vox_node;
 **/
 VOX_EXPORT struct vox_node* vox_make_tree (vox_dot set[], size_t n);
 
+/**
+   \brief Turn a set of voxels into a tree using Z-order.
+
+   This works like vox_make_tree(), but the set is not modified. Voxels
+   are placed on the grid of `vox_voxel`, sorted by their Morton codes
+   with radix sort and the tree is built in one pass over the sorted
+   codes. This is several times faster than vox_make_tree() for large
+   sets. Voxels which are not multiple of `vox_voxel` are aligned to the
+   grid.
+
+   \param set a set of dots (of type vox_dot) to form a tree
+   \param n number of voxels in the set
+   \return a root node of the newly created tree
+**/
+VOX_EXPORT struct vox_node* vox_make_tree_morton (const vox_dot set[], size_t n);
+
+/**
+   \brief Turn a set of voxels into a tree, finding solid boxes first.
+
+   Solid axis-aligned boxes are extracted from the set with greedy merging
+   of voxels along z, y and x axes. Boxes of at least
+   `VOX_MIN_BOX_VOXELS` voxels become dense leafs, other voxels are
+   partitioned as in vox_make_tree(). This gives much fewer nodes than
+   vox_make_tree() for blocky volumes whose solid parts are not aligned
+   with centers of subdivision.
+
+   Voxels are aligned to the grid of `vox_voxel` like in
+   vox_make_tree_morton(). Duplicate voxels are stored once. The set is
+   modified and can be freed after creation.
+
+   \param set a set of dots (of type vox_dot) to form a tree
+   \param n number of voxels in the set
+   \return a root node of the newly created tree
+**/
+VOX_EXPORT struct vox_node* vox_make_tree_boxes (vox_dot set[], size_t n);
+
+/**
+   \brief Make a read-only copy of a tree in one contiguous buffer.
+
+   The copy uses 32-bit offsets instead of pointers to children, children
+   of each node are stored adjacently and voxels of leaf nodes are stored
+   right after their node. Such trees need less memory and are faster to
+   search in. Frozen trees cannot be modified: vox_insert_voxel() and
+   vox_delete_voxel() do nothing and return 0 for them. Use
+   vox_rebuild_tree() to get an ordinary tree back.
+
+   The original tree is not modified and must be destroyed as usual if
+   it is no longer needed.
+
+   \param tree a tree to freeze
+   \return a root node of the frozen tree or NULL if the tree is too big
+   to be frozen (more than 4GB)
+**/
+VOX_EXPORT struct vox_node* vox_freeze_tree (const struct vox_node *tree);
+
+/**
+   \brief Save a tree to a file.
+
+   The tree is saved in the frozen form (see vox_freeze_tree()), so the file
+   can be loaded with vox_load_tree() without any deserialization. The file
+   is not portable between SSE and non-SSE builds of voxtrees and between
+   machines with different byte order. It also depends on vox_voxel.
+
+   \param tree a tree to save
+   \param filename a name of the file
+   \param error pointer to error string
+   \return 1 on success, 0 otherwise. In the latter case, error will be set
+   to a static string describing the error.
+**/
+VOX_EXPORT int vox_save_tree (const struct vox_node *tree, const char *filename,
+                              const char **error);
+
+/**
+   \brief Load a tree saved with vox_save_tree().
+
+   The file is mapped to memory and the tree is used in place, so loading
+   is fast and pages of the file are read only when they are needed. The
+   loaded tree is frozen. It must be destroyed with vox_destroy_tree().
+
+   \param filename a name of the file
+   \param error pointer to error string
+   \return a loaded tree or NULL in case of error. In the latter case, error
+   will be set to a static string describing the error.
+**/
+VOX_EXPORT struct vox_node* vox_load_tree (const char *filename, const char **error);
+
 /**
    \brief Free resources used by a tree.
 
@@ -88,10 +250,13 @@ VOX_EXPORT struct vox_node* vox_rebuild_tree (const struct vox_node *tree);
 /**
    \brief Insert a voxel in the tree on the fly.
 
-   Many applications of this function will result in unbalanced tree.
-   You can rebalance the tree by recreating it with vox_rebuild_tree()
+   Subtrees which become too deep after insertion are rebuilt
+   automatically, but only if they have not more than
+   VOX_REBUILD_MAX_VOXELS voxels. You can rebalance the whole tree by
+   recreating it with vox_rebuild_tree().
 
-   \return 1 on success, 0 if the voxel was already in the tree.
+   \return 1 on success, 0 if the voxel was already in the tree or the
+   tree is frozen.
 **/
 VOX_EXPORT int vox_insert_voxel (struct vox_node **tree_ptr, vox_dot voxel);
 
@@ -106,10 +271,12 @@ VOX_EXPORT int vox_insert_voxel_coord (struct vox_node **tree_ptr, float x, floa
 /**
    \brief Delete a voxel from the tree on the fly.
 
-   You can call vox_rebuild_tree() after many applications of this
-   function to get a more balanced tree.
+   Subtrees are rebuilt automatically like in vox_insert_voxel(). You
+   can call vox_rebuild_tree() after many applications of this function
+   to get a more balanced tree.
 
-   \return 1 on success, 0 if there was no such voxel in the tree.
+   \return 1 on success, 0 if there was no such voxel in the tree or the
+   tree is frozen.
 **/
 VOX_EXPORT int vox_delete_voxel (struct vox_node **tree_ptr, vox_dot voxel);
 
@@ -121,6 +288,149 @@ VOX_EXPORT int vox_delete_voxel (struct vox_node **tree_ptr, vox_dot voxel);
 **/
 VOX_EXPORT int vox_delete_voxel_coord (struct vox_node **tree_ptr, float x, float y, float z);
 
+/**
+   \brief Insert many voxels in the tree at once.
+
+   This is faster than calling vox_insert_voxel() for each voxel,
+   because each node of the tree is visited only once and changed
+   leafs are rebuilt from all their voxels. The set is destructively
+   modified. Voxels which are already in the tree and duplicates in
+   the set are ignored.
+
+   \param set a set of voxels to insert
+   \param n number of voxels in the set
+   \return number of inserted voxels, 0 if the tree is frozen.
+**/
+VOX_EXPORT size_t vox_insert_voxels (struct vox_node **tree_ptr, vox_dot set[], size_t n);
+
+/**
+   \brief Delete many voxels from the tree at once.
+
+   This works like vox_insert_voxels(). Voxels which are not in the
+   tree are ignored. The set is destructively modified.
+
+   \param set a set of voxels to delete
+   \param n number of voxels in the set
+   \return number of deleted voxels, 0 if the tree is frozen.
+**/
+VOX_EXPORT size_t vox_delete_voxels (struct vox_node **tree_ptr, vox_dot set[], size_t n);
+
+/**
+   \brief Fill a box with voxels.
+
+   All voxels which intersect the box are inserted. Parts of the tree
+   are built directly from the box geometry, so big boxes become dense
+   leafs and the time does not depend on the number of voxels in the
+   box.
+
+   \return number of inserted voxels, 0 if the tree is frozen.
+**/
+VOX_EXPORT size_t vox_insert_box (struct vox_node **tree_ptr, const struct vox_box *box);
+
+/**
+   \brief Erase all voxels which intersect a box.
+
+   Dense leafs are cut by the box without splitting them voxel by
+   voxel.
+
+   \return number of deleted voxels, 0 if the tree is frozen.
+**/
+VOX_EXPORT size_t vox_delete_box (struct vox_node **tree_ptr, const struct vox_box *box);
+
+/**
+   \brief Fill a ball with voxels.
+
+   Voxels with centers inside the ball are inserted. This works like
+   vox_insert_box().
+
+   \return number of inserted voxels, 0 if the tree is frozen.
+**/
+VOX_EXPORT size_t vox_insert_ball (struct vox_node **tree_ptr, const vox_dot center, float radius);
+
+/**
+   \brief Erase all voxels with centers inside a ball.
+
+   \return number of deleted voxels, 0 if the tree is frozen.
+**/
+VOX_EXPORT size_t vox_delete_ball (struct vox_node **tree_ptr, const vox_dot center, float radius);
+
+/**
+   @struct vox_tree_versions
+   \brief Versions of a tree which can be read while the tree is modified.
+
+   Modifications of a versioned tree make a new version of the tree
+   which shares unchanged subtrees with the previous ones instead of
+   changing the tree in place. So a reader (e.g. a renderer) can work
+   with a stable version while the next one is built. Modifications
+   must be serialized, but they can run concurrently with readers.
+   Versions which are not read anymore are freed by modifications.
+**/
+struct vox_tree_versions;
+
+/**
+   \brief Start keeping versions of a tree.
+
+   The tree becomes the first version. The latest version of the tree
+   is still owned by the caller: it must not be modified by other
+   functions than the ones described below and must be destroyed with
+   vox_destroy_tree() when no longer needed.
+**/
+VOX_EXPORT struct vox_tree_versions* vox_make_tree_versions (struct vox_node *tree);
+
+/**
+   \brief Free all versions of the tree except the latest.
+
+   No one must read old versions at this moment.
+**/
+VOX_EXPORT void vox_destroy_tree_versions (struct vox_tree_versions *versions);
+
+/**
+   \brief Return the latest version of the tree.
+
+   This must be called only from the thread which modifies the tree.
+**/
+VOX_EXPORT struct vox_node* vox_latest_version (const struct vox_tree_versions *versions);
+
+/**
+   \brief Get the latest version of the tree for reading.
+
+   The version is valid until it is released with
+   vox_release_version(). This function can be called from any thread.
+**/
+VOX_EXPORT struct vox_node* vox_acquire_version (struct vox_tree_versions *versions);
+
+/**
+   \brief Release a version acquired with vox_acquire_version().
+
+   This function can be called from any thread.
+**/
+VOX_EXPORT void vox_release_version (struct vox_tree_versions *versions, const struct vox_node *tree);
+
+/**
+   \brief Make a new version of the tree with a voxel inserted.
+
+   \return 1 on success, 0 if the voxel was already in the tree or the
+   tree is frozen.
+**/
+VOX_EXPORT int vox_versions_insert_voxel (struct vox_tree_versions *versions, vox_dot voxel);
+
+/**
+   \brief Make a new version of the tree with a voxel deleted.
+
+   \return 1 on success, 0 if there was no such voxel in the tree or
+   the tree is frozen.
+**/
+VOX_EXPORT int vox_versions_delete_voxel (struct vox_tree_versions *versions, vox_dot voxel);
+
+/**
+   \brief Make another tree the new version.
+
+   Use this to replace the tree with its rebuilt copy, for example. The
+   old tree is destroyed when no one reads it. The new tree must not
+   share nodes with the old one.
+**/
+VOX_EXPORT void vox_versions_replace_tree (struct vox_tree_versions *versions, struct vox_node *tree);
+
 /**
    \brief Dump a tree to standard output stream.
 
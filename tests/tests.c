@@ -7,6 +7,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <stdint.h>
+#include <limits.h>
 
 #include <voxrnd/camera.h>
 #include <voxrnd/vect-ops.h>
@@ -211,12 +213,10 @@ static void rot_saves_norm ()
     CU_ASSERT (fabsf (dot_product (vect, vect) - dot_product (res, res)) < precise_check);
 }
 
-static struct vox_node* prepare_tree ()
+static size_t make_ball (vox_dot set[])
 {
     int i,j,k;
     size_t counter = 0;
-    vox_dot *set = aligned_alloc (16, sizeof (vox_dot) * 1000000);
-    struct vox_node *tree;
 
     // Make a ball with radius 50 and center (0, 0, 0)
     for (i=-50; i<50; i++) {
@@ -231,6 +231,15 @@ static struct vox_node* prepare_tree ()
         }
     }
 
+    return counter;
+}
+
+static struct vox_node* prepare_tree ()
+{
+    vox_dot *set = aligned_alloc (16, sizeof (vox_dot) * 1000000);
+    size_t counter = make_ball (set);
+    struct vox_node *tree;
+
     tree = vox_make_tree (set, counter);
     free (set);
     return tree;
@@ -267,6 +276,20 @@ static void check_tree (struct vox_node *tree)
                 CU_ASSERT_FATAL (dot_betweenp (&(tree->bounding_box), tmp));
             }
         }
+        else if (tree->flags & VOX_BRICK)
+        {
+            // Each voxel is one bit of the mask
+            uint64_t mask = tree->data.brick.mask;
+            CU_ASSERT_FATAL (__builtin_popcountll (mask) == tree->dots_num);
+            for (i=0; i<VOX_BRICK_VOXELS; i++)
+            {
+                if (!((mask >> i) & 1)) continue;
+                brick_voxel (tree, i, tmp);
+                CU_ASSERT_FATAL (dot_betweenp (&(tree->bounding_box), tmp));
+                vox_dot_add (tmp, vox_voxel, tmp);
+                CU_ASSERT_FATAL (dot_betweenp (&(tree->bounding_box), tmp));
+            }
+        }
         else
         {
             vox_inner_data inner = tree->data.inner;
@@ -388,12 +411,12 @@ static void test_tree_ins()
     check_tree (tree);
     vox_destroy_tree (tree);
 
-    // Make a fake tree with dense leaf as root
-    tree = vox_alloc (sizeof (struct vox_node));
-    vox_dot_set (tree->bounding_box.min, 5, 5, 5);
-    vox_dot_set (tree->bounding_box.max, 10, 10,10);
-    tree->dots_num = 125;
-    tree->flags = VOX_DENSE_LEAF;
+    // Make a tree with dense leaf as root
+    struct vox_box box;
+    vox_dot_set (box.min, 5, 5, 5);
+    vox_dot_set (box.max, 10, 10,10);
+    tree = vox_make_dense_leaf (&box);
+    CU_ASSERT (tree->dots_num == 125 && tree->flags == VOX_DENSE_LEAF);
     res = vox_insert_voxel (&tree, dot2);
     CU_ASSERT (!res);
     res = vox_insert_voxel (&tree, dot1);
@@ -658,6 +681,552 @@ static void test_tree_g676d50c ()
     CU_ASSERT (leaf != NULL);
 }
 
+static void test_tree_brick ()
+{
+    vox_dot set[VOX_BRICK_VOXELS], dot, origin, dir, res;
+    struct vox_node *tree;
+    const struct vox_node *leaf;
+    int i, j, k, n = 0;
+
+    // Checkerboard 4x4x4 is stored in one brick
+    for (i=0; i<4; i++)
+        for (j=0; j<4; j++)
+            for (k=0; k<4; k++)
+                if ((i+j+k) % 2 == 0)
+                {
+                    vox_dot_set (set[n], i, j, k);
+                    n++;
+                }
+    tree = vox_make_tree (set, n);
+    CU_ASSERT_FATAL (tree->flags == VOX_BRICK);
+    CU_ASSERT (vox_voxels_in_tree (tree) == 32);
+    check_tree (tree);
+
+    // Rays hit the first voxel in a row
+    vox_dot_set (origin, -10, 1.5, 0.5);
+    vox_dot_set (dir, 1, 0, 0);
+    leaf = vox_ray_tree_intersection (tree, origin, dir, res);
+    vox_dot_set (dot, 1, 1.5, 0.5);
+    CU_ASSERT (leaf == tree && vect_eq (res, dot, precise_check));
+
+    // Insertion and deletion inside the brick only flip bits
+    vox_dot_set (dot, 1, 1, 0);
+    CU_ASSERT (vox_delete_voxel (&tree, dot));
+    CU_ASSERT (tree->flags == VOX_BRICK && vox_voxels_in_tree (tree) == 31);
+    leaf = vox_ray_tree_intersection (tree, origin, dir, res);
+    vox_dot_set (dot, 3, 1.5, 0.5);
+    CU_ASSERT (leaf == tree && vect_eq (res, dot, precise_check));
+    vox_dot_set (dot, 0, 1, 0);
+    CU_ASSERT (vox_insert_voxel (&tree, dot));
+    CU_ASSERT (tree->flags == VOX_BRICK && vox_voxels_in_tree (tree) == 32);
+    leaf = vox_ray_tree_intersection (tree, origin, dir, res);
+    vox_dot_set (dot, 0, 1.5, 0.5);
+    CU_ASSERT (leaf == tree && vect_eq (res, dot, precise_check));
+    check_tree (tree);
+
+    // This ray crosses only one empty cell of the brick
+    vox_dot_set (origin, 2.6, -0.5, 0.5);
+    vox_dot_set (dir, 1, 1, 0);
+    CU_ASSERT (vox_ray_tree_intersection (tree, origin, dir, res) == NULL);
+    vox_dot_set (origin, 1.6, -0.5, 0.5);
+    leaf = vox_ray_tree_intersection (tree, origin, dir, res);
+    vox_dot_set (dot, 2.1, 0, 0.5);
+    CU_ASSERT (leaf == tree && vect_eq (res, dot, precise_check));
+
+    // Insertion outside of the brick's cell
+    vox_dot_set (dot, 10, 0, 0);
+    CU_ASSERT (vox_insert_voxel (&tree, dot));
+    CU_ASSERT (!(tree->flags & VOX_LEAF_MASK));
+    CU_ASSERT (vox_voxels_in_tree (tree) == 33);
+    check_tree (tree);
+    vox_destroy_tree (tree);
+
+    /*
+      A ray which starts on a face between cells (1, y, 1) and (2, y, 1)
+      and goes away from it touches (1, 1, 1) only if it steps along x
+      first.
+    */
+    vox_dot_set (set[0], 0, 0, 0);
+    vox_dot_set (set[1], 1, 1, 1);
+    for (i=0; i<4; i++)
+        for (j=0; j<4; j++) vox_dot_set (set[2 + 4*i + j], i, j, 3);
+    tree = vox_make_tree (set, 18);
+    CU_ASSERT_FATAL (tree->flags == VOX_BRICK);
+    vox_dot_set (origin, 2, 0.5, 1.5);
+    vox_dot_set (dir, 0.1, 1, 0);
+    CU_ASSERT (vox_ray_tree_intersection (tree, origin, dir, res) == NULL);
+    vox_dot_set (dir, -0.1, 1, 0);
+    leaf = vox_ray_tree_intersection (tree, origin, dir, res);
+    vox_dot_set (dot, 1.95, 1, 1.5);
+    CU_ASSERT (leaf == tree && vect_eq (res, dot, precise_check));
+    vox_destroy_tree (tree);
+}
+
+// Compare packet search with search ray by ray
+static void check_packet (const struct vox_node *tree, const vox_dot origin,
+                          const vox_dot dirs[], unsigned int n)
+{
+    vox_dot res[VOX_PACKET_SIZE], res1;
+    const struct vox_node *leafs[VOX_PACKET_SIZE], *leaf;
+    unsigned int i, hits;
+
+    hits = vox_ray_tree_intersection_packet (tree, origin, dirs, n, res, leafs);
+    for (i=0; i<n; i++)
+    {
+        leaf = vox_ray_tree_intersection (tree, origin, dirs[i], res1);
+        CU_ASSERT_FATAL ((leaf != NULL) == ((hits >> i) & 1));
+        CU_ASSERT_FATAL (leaf == leafs[i]);
+        if (leaf != NULL) CU_ASSERT (vect_eq (res[i], res1, 1e-3));
+    }
+    CU_ASSERT (hits >> n == 0);
+}
+
+static void test_packet_search ()
+{
+    struct vox_node *tree = prepare_tree ();
+    struct vox_node *frozen = vox_freeze_tree (tree);
+    vox_dot origin, dirs[VOX_PACKET_SIZE], res[VOX_PACKET_SIZE];
+    const struct vox_node *leafs[VOX_PACKET_SIZE];
+    int i, j;
+
+    srand (13);
+    vox_dot_set (origin, 100.3, 0.7, -0.2);
+    for (i=0; i<100; i++)
+    {
+        // Coherent rays like in a 4x4 block of pixels
+        float y = rand() % 100 - 50, z = rand() % 100 - 50;
+        for (j=0; j<VOX_PACKET_SIZE; j++)
+            vox_dot_set (dirs[j], -100, y + j%4 * 0.3, z + j/4 * 0.3);
+        check_packet (tree, origin, dirs, VOX_PACKET_SIZE);
+        check_packet (frozen, origin, dirs, VOX_PACKET_SIZE);
+        check_packet (tree, origin, dirs, 5);
+
+        // Not coherent at all
+        for (j=0; j<VOX_PACKET_SIZE; j++)
+            vox_dot_set (dirs[j], rand() % 200 - 100, rand() % 200 - 100, rand() % 200 - 100);
+        check_packet (tree, origin, dirs, VOX_PACKET_SIZE);
+    }
+
+    CU_ASSERT (vox_ray_tree_intersection_packet (NULL, origin, dirs, VOX_PACKET_SIZE,
+                                                 res, leafs) == 0);
+    vox_destroy_tree (tree);
+    vox_destroy_tree (frozen);
+}
+
+static int tree_depth (const struct vox_node *tree)
+{
+    int i, depth, max = 0;
+
+    if (!(VOX_FULLP (tree))) return 0;
+    if (tree->flags & VOX_LEAF_MASK) return 1;
+    for (i=0; i<VOX_NS; i++)
+    {
+        depth = tree_depth (tree->data.inner.children[i]);
+        max = (depth > max) ? depth : max;
+    }
+    return max + 1;
+}
+
+static void test_tree_local_rebuild ()
+{
+    struct vox_node *tree = NULL;
+    vox_dot dot;
+    int i, j, k, n = 0;
+
+    // Deletions from a big dense leaf produce deep subtrees
+    for (i=0; i<20; i++)
+        for (j=0; j<20; j++)
+            for (k=0; k<20; k++)
+            {
+                vox_dot_set (dot, i, j, k);
+                vox_insert_voxel (&tree, dot);
+            }
+    CU_ASSERT (tree->flags & VOX_DENSE_LEAF);
+    for (i=0; i<20; i++)
+        for (j=0; j<20; j++)
+            for (k=0; k<20; k++)
+            {
+                vox_dot_set (dot, i, j, k);
+                if ((7*i + 13*j + 29*k) % 5 == 0) CU_ASSERT (vox_delete_voxel (&tree, dot));
+                else n++;
+            }
+
+    // They are rebuilt on the fly (without rebuilding it is 23 levels deep)
+    check_tree (tree);
+    CU_ASSERT (vox_voxels_in_tree (tree) == n);
+    CU_ASSERT (tree_depth (tree) <= 11);
+    for (i=0; i<20; i++)
+        for (j=0; j<20; j++)
+            for (k=0; k<20; k++)
+            {
+                vox_dot_set (dot, i + 0.5, j + 0.5, k + 0.5);
+                CU_ASSERT_FATAL (vox_tree_ball_collidep (tree, dot, 0.1) ==
+                                 ((7*i + 13*j + 29*k) % 5 != 0));
+            }
+    vox_destroy_tree (tree);
+}
+
+// Compare trees in the cube [from, to]^3
+static void check_same_voxels (const struct vox_node *tree1, const struct vox_node *tree2,
+                               int from, int to)
+{
+    vox_dot dot;
+    int i, j, k;
+
+    CU_ASSERT (vox_voxels_in_tree (tree1) == vox_voxels_in_tree (tree2));
+    for (i=from; i<=to; i++)
+        for (j=from; j<=to; j++)
+            for (k=from; k<=to; k++)
+            {
+                vox_dot_set (dot, i + 0.5, j + 0.5, k + 0.5);
+                CU_ASSERT_FATAL (vox_tree_ball_collidep (tree1, dot, 0.1) ==
+                                 vox_tree_ball_collidep (tree2, dot, 0.1));
+            }
+}
+
+static void test_tree_batch ()
+{
+    vox_dot *set = vox_alloc (sizeof (vox_dot) * 35*35*35);
+    vox_dot *batch = vox_alloc (sizeof (vox_dot) * 5000);
+    struct vox_node *tree1, *tree2, *frozen;
+    size_t n = 0, count;
+    int i, j, k;
+
+    // Half-filled cube with a dense core
+    srand (7);
+    for (i=0; i<30; i++)
+        for (j=0; j<30; j++)
+            for (k=0; k<30; k++)
+            {
+                if ((i >= 10 && i < 20 && j >= 10 && j < 20 && k >= 10 && k < 20) ||
+                    rand() % 2)
+                {
+                    vox_dot_set (set[n], i, j, k);
+                    n++;
+                }
+            }
+    tree1 = vox_make_tree (set, n);
+    tree2 = vox_rebuild_tree (tree1);
+
+    // The batch has duplicates and voxels which are already in the tree
+    for (i=0; i<5000; i++) vox_dot_set (batch[i], rand() % 35, rand() % 35, rand() % 35);
+    count = 0;
+    for (i=0; i<5000; i++) count += vox_insert_voxel (&tree2, batch[i]);
+    CU_ASSERT (vox_insert_voxels (&tree1, batch, 5000) == count);
+    check_tree (tree1);
+    check_same_voxels (tree1, tree2, -1, 35);
+
+    for (i=0; i<5000; i++) vox_dot_set (batch[i], rand() % 35, rand() % 35, rand() % 35);
+    count = 0;
+    for (i=0; i<5000; i++) count += vox_delete_voxel (&tree2, batch[i]);
+    CU_ASSERT (vox_delete_voxels (&tree1, batch, 5000) == count);
+    check_tree (tree1);
+    check_same_voxels (tree1, tree2, -1, 35);
+
+    // Frozen trees cannot be modified
+    frozen = vox_freeze_tree (tree1);
+    CU_ASSERT (vox_insert_voxels (&frozen, batch, 5000) == 0);
+    CU_ASSERT (vox_delete_voxels (&frozen, batch, 5000) == 0);
+    vox_destroy_tree (frozen);
+
+    // Delete everything and build the tree again
+    n = 0;
+    for (i=0; i<35; i++)
+        for (j=0; j<35; j++)
+            for (k=0; k<35; k++)
+            {
+                vox_dot_set (set[n], i, j, k);
+                n++;
+            }
+    CU_ASSERT (vox_delete_voxels (&tree1, set, n) == vox_voxels_in_tree (tree2));
+    CU_ASSERT (tree1 == NULL);
+    vox_destroy_tree (tree1);
+    vox_destroy_tree (tree2);
+
+    tree1 = NULL;
+    for (i=0; i<1000; i++) vox_dot_set (set[i], i % 10, (i / 10) % 10, i / 100);
+    CU_ASSERT (vox_insert_voxels (&tree1, set, 1000) == 1000);
+    CU_ASSERT (tree1->flags & VOX_DENSE_LEAF);
+    vox_destroy_tree (tree1);
+
+    free (set);
+    free (batch);
+}
+
+static int voxel_in_ball (int i, int j, int k, const vox_dot center, float radius)
+{
+    float x = i + 0.5 - center[0], y = j + 0.5 - center[1], z = k + 0.5 - center[2];
+    return x*x + y*y + z*z <= radius*radius;
+}
+
+static void test_tree_regions ()
+{
+    vox_dot *set = vox_alloc (sizeof (vox_dot) * 40*40*40);
+    struct vox_node *tree1, *tree2;
+    struct vox_box box;
+    vox_dot center;
+    size_t n = 0, count;
+    int i, j, k;
+
+    // Carve a box out of a dense leaf
+    vox_dot_set (box.min, 0, 0, 0);
+    vox_dot_set (box.max, 40, 40, 40);
+    tree1 = vox_make_dense_leaf (&box);
+    vox_dot_set (box.min, 10, 10, 10);
+    vox_dot_set (box.max, 30, 30, 30);
+    CU_ASSERT (vox_delete_box (&tree1, &box) == 20*20*20);
+    CU_ASSERT (vox_voxels_in_tree (tree1) == 40*40*40 - 20*20*20);
+    check_tree (tree1);
+    for (i=0; i<40; i++)
+        for (j=0; j<40; j++)
+            for (k=0; k<40; k++)
+                if (i < 10 || i >= 30 || j < 10 || j >= 30 || k < 10 || k >= 30)
+                {
+                    vox_dot_set (set[n], i, j, k);
+                    n++;
+                }
+    tree2 = vox_make_tree (set, n);
+    check_same_voxels (tree1, tree2, -1, 40);
+    vox_destroy_tree (tree2);
+
+    // Fill it back (with a bigger box)
+    vox_dot_set (box.min, 5.5, 5.5, 5.5);
+    vox_dot_set (box.max, 34.5, 34.5, 34.5);
+    CU_ASSERT (vox_insert_box (&tree1, &box) == 20*20*20);
+    CU_ASSERT (tree1->flags & VOX_DENSE_LEAF);
+    CU_ASSERT (vox_voxels_in_tree (tree1) == 40*40*40);
+
+    // Carve a ball and compare with voxel by voxel deletion
+    vox_dot_set (center, 35, 17.3, 20);
+    tree2 = vox_make_dense_leaf (&(tree1->bounding_box));
+    count = 0;
+    for (i=0; i<40; i++)
+        for (j=0; j<40; j++)
+            for (k=0; k<40; k++)
+            {
+                if (!voxel_in_ball (i, j, k, center, 12.5)) continue;
+                vox_dot_set (set[0], i, j, k);
+                count += vox_delete_voxel (&tree2, set[0]);
+            }
+    CU_ASSERT (vox_delete_ball (&tree1, center, 12.5) == count);
+    check_tree (tree1);
+    check_same_voxels (tree1, tree2, -1, 40);
+
+    // Fill a ball in a sparse tree
+    n = 0;
+    srand (3);
+    for (i=0; i<40; i++)
+        for (j=0; j<40; j++)
+            for (k=0; k<40; k++)
+                if (rand() % 3 == 0)
+                {
+                    vox_dot_set (set[n], i, j, k);
+                    n++;
+                }
+    vox_destroy_tree (tree1);
+    vox_destroy_tree (tree2);
+    tree1 = vox_make_tree (set, n);
+    tree2 = vox_rebuild_tree (tree1);
+    vox_dot_set (center, 20, 10, 30.5);
+    count = 0;
+    for (i=-10; i<50; i++)
+        for (j=-10; j<50; j++)
+            for (k=-10; k<50; k++)
+            {
+                if (!voxel_in_ball (i, j, k, center, 15)) continue;
+                vox_dot_set (set[0], i, j, k);
+                count += vox_insert_voxel (&tree2, set[0]);
+            }
+    CU_ASSERT (vox_insert_ball (&tree1, center, 15) == count);
+    check_tree (tree1);
+    check_same_voxels (tree1, tree2, -10, 50);
+
+    vox_dot_set (center, 5, 30, 20);
+    count = 0;
+    for (i=-10; i<50; i++)
+        for (j=-10; j<50; j++)
+            for (k=-10; k<50; k++)
+            {
+                if (!voxel_in_ball (i, j, k, center, 17)) continue;
+                vox_dot_set (set[0], i, j, k);
+                count += vox_delete_voxel (&tree2, set[0]);
+            }
+    CU_ASSERT (vox_delete_ball (&tree1, center, 17) == count);
+    check_tree (tree1);
+    check_same_voxels (tree1, tree2, -10, 50);
+
+    // Delete everything
+    vox_dot_set (box.min, -20, -20, -20);
+    vox_dot_set (box.max, 60, 60, 60);
+    CU_ASSERT (vox_delete_box (&tree1, &box) == vox_voxels_in_tree (tree2));
+    CU_ASSERT (tree1 == NULL);
+    vox_destroy_tree (tree2);
+    free (set);
+}
+
+static void test_tree_dense_rebuild ()
+{
+    struct vox_node *tree1, *tree2;
+    struct vox_box box;
+    vox_dot center, dot;
+    int i;
+
+    // A dense leaf with a hole and a carved ball
+    vox_dot_set (box.min, 0, 0, 0);
+    vox_dot_set (box.max, 40, 40, 40);
+    tree1 = vox_make_dense_leaf (&box);
+    vox_dot_set (box.min, 10, 10, 10);
+    vox_dot_set (box.max, 30, 30, 30);
+    vox_delete_box (&tree1, &box);
+    vox_dot_set (center, 35, 17.3, 20);
+    vox_delete_ball (&tree1, center, 12.5);
+    tree2 = vox_rebuild_tree (tree1);
+    check_tree (tree2);
+    check_same_voxels (tree1, tree2, -1, 40);
+    vox_destroy_tree (tree1);
+    vox_destroy_tree (tree2);
+
+    /*
+      Two adjacent boxes of 1.6 * 10^9 voxels become one dense leaf (this
+      would need more than 20GB if they were expanded to voxels)
+    */
+    vox_dot_set (box.min, 0, 0, 0);
+    vox_dot_set (box.max, 1000, 1000, 1000);
+    tree1 = vox_make_dense_leaf (&box);
+    vox_dot_set (box.min, 1000, 0, 0);
+    vox_dot_set (box.max, 1600, 1000, 1000);
+    vox_insert_box (&tree1, &box);
+    tree2 = vox_rebuild_tree (tree1);
+    CU_ASSERT_FATAL (tree2 != NULL);
+    CU_ASSERT (tree2->flags & VOX_DENSE_LEAF);
+    CU_ASSERT (vox_voxels_in_tree (tree2) == 1600000000);
+    vox_destroy_tree (tree2);
+
+    // Some voxels around and inside the boxes
+    srand (5);
+    for (i=0; i<1000; i++)
+    {
+        vox_dot_set (dot, rand() % 2000 - 200, rand() % 1200 - 100, rand() % 1200 - 100);
+        vox_insert_voxel (&tree1, dot);
+    }
+    tree2 = vox_rebuild_tree (tree1);
+    CU_ASSERT (vox_voxels_in_tree (tree1) == vox_voxels_in_tree (tree2));
+    for (i=0; i<10000; i++)
+    {
+        vox_dot_set (dot, rand() % 2000 - 199.5, rand() % 1200 - 99.5, rand() % 1200 - 99.5);
+        CU_ASSERT_FATAL (vox_tree_ball_collidep (tree1, dot, 0.1) ==
+                         vox_tree_ball_collidep (tree2, dot, 0.1));
+    }
+    vox_destroy_tree (tree1);
+    vox_destroy_tree (tree2);
+
+    /*
+      A box of 10^9 voxels without one voxel. Float volumes of this size
+      cannot tell it from the whole box.
+    */
+    vox_dot_set (box.min, 0, 0, 0);
+    vox_dot_set (box.max, 1000, 1000, 1000);
+    tree1 = vox_make_dense_leaf (&box);
+    vox_dot_set (dot, 500, 500, 500);
+    CU_ASSERT (vox_delete_voxel (&tree1, dot));
+    tree2 = vox_rebuild_tree (tree1);
+    CU_ASSERT_FATAL (tree2 != NULL);
+    CU_ASSERT (!(tree2->flags & VOX_DENSE_LEAF));
+    CU_ASSERT (vox_voxels_in_tree (tree2) == 999999999);
+    vox_dot_set (center, 500.5, 500.5, 500.5);
+    CU_ASSERT (!vox_tree_ball_collidep (tree2, center, 0.1));
+    vox_dot_set (center, 501.5, 500.5, 500.5);
+    CU_ASSERT (vox_tree_ball_collidep (tree2, center, 0.1));
+    vox_destroy_tree (tree1);
+    vox_destroy_tree (tree2);
+}
+
+static void test_tree_versions ()
+{
+    vox_dot *set = vox_alloc (sizeof (vox_dot) * 30*30*30);
+    struct vox_node *tree, *snapshot, *copy, *reference;
+    struct vox_tree_versions *versions;
+    vox_dot dot;
+    size_t n = 0;
+    int i, j, k, res;
+
+    srand (11);
+    for (i=0; i<30; i++)
+        for (j=0; j<30; j++)
+            for (k=0; k<30; k++)
+            {
+                if ((i < 10 && j < 10 && k < 10) || rand() % 2)
+                {
+                    vox_dot_set (set[n], i, j, k);
+                    n++;
+                }
+            }
+    tree = vox_make_tree (set, n);
+    reference = vox_rebuild_tree (tree);
+    versions = vox_make_tree_versions (tree);
+
+    // The snapshot does not change when new versions are made
+    snapshot = vox_acquire_version (versions);
+    copy = vox_rebuild_tree (snapshot);
+    for (i=0; i<3000; i++)
+    {
+        vox_dot_set (dot, rand() % 32, rand() % 32, rand() % 32);
+        if (rand() % 2)
+        {
+            res = vox_insert_voxel (&reference, dot);
+            CU_ASSERT (vox_versions_insert_voxel (versions, dot) == res);
+        }
+        else
+        {
+            res = vox_delete_voxel (&reference, dot);
+            CU_ASSERT (vox_versions_delete_voxel (versions, dot) == res);
+        }
+    }
+    check_tree (vox_latest_version (versions));
+    check_same_voxels (vox_latest_version (versions), reference, -1, 32);
+    check_same_voxels (snapshot, copy, -1, 32);
+    vox_release_version (versions, snapshot);
+    vox_destroy_tree (copy);
+
+    // Replace the latest version with a rebuilt copy
+    vox_versions_replace_tree (versions, vox_rebuild_tree (vox_latest_version (versions)));
+    check_same_voxels (vox_latest_version (versions), reference, -1, 32);
+    for (i=0; i<1000; i++)
+    {
+        vox_dot_set (dot, rand() % 32, rand() % 32, rand() % 32);
+        res = vox_delete_voxel (&reference, dot);
+        CU_ASSERT (vox_versions_delete_voxel (versions, dot) == res);
+    }
+    check_tree (vox_latest_version (versions));
+    check_same_voxels (vox_latest_version (versions), reference, -1, 32);
+    vox_destroy_tree (reference);
+    vox_destroy_tree (vox_latest_version (versions));
+    vox_destroy_tree_versions (versions);
+
+    // Delete all voxels and insert them again
+    versions = vox_make_tree_versions (NULL);
+    for (i=0; i<10; i++)
+    {
+        vox_dot_set (dot, i, 0, 0);
+        CU_ASSERT (vox_versions_insert_voxel (versions, dot));
+    }
+    snapshot = vox_acquire_version (versions);
+    for (i=0; i<10; i++)
+    {
+        vox_dot_set (dot, i, 0, 0);
+        CU_ASSERT (vox_versions_delete_voxel (versions, dot));
+    }
+    CU_ASSERT (vox_latest_version (versions) == NULL);
+    CU_ASSERT (vox_voxels_in_tree (snapshot) == 10);
+    vox_release_version (versions, snapshot);
+    vox_dot_set (dot, 0, 0, 0);
+    CU_ASSERT (vox_versions_insert_voxel (versions, dot));
+    CU_ASSERT (vox_voxels_in_tree (vox_latest_version (versions)) == 1);
+    vox_destroy_tree (vox_latest_version (versions));
+    vox_destroy_tree_versions (versions);
+    free (set);
+}
+
 static void test_camera (const char *name)
 {
     printf (" %s...", name);
@@ -893,8 +1462,681 @@ static CU_TestInfo vectops_tests[] = {
 };
 
 /* Tree construction and search (voxtrees) */
+static void test_tree_cons_morton ()
+{
+    vox_dot *set = aligned_alloc (16, sizeof (vox_dot) * 1000000);
+    size_t i, counter = make_ball (set);
+    struct vox_node *tree = vox_make_tree_morton (set, counter);
+    vox_dot dot;
+
+    check_tree (tree);
+    CU_ASSERT (vox_voxels_in_tree (tree) == counter);
+    // All voxels are found in the tree
+    for (i=0; i<counter; i++) {
+        vox_dot_add (set[i], half_voxel, dot);
+        CU_ASSERT_FATAL (vox_tree_ball_collidep (tree, dot, 0.1));
+    }
+
+    vox_destroy_tree (tree);
+    free (set);
+}
+
+static size_t tree_nodes (const struct vox_node *tree)
+{
+    size_t i, count = 1;
+
+    if (!(VOX_FULLP (tree))) return 0;
+    if (!(tree->flags & VOX_LEAF_MASK))
+        for (i=0; i<VOX_NS; i++) count += tree_nodes (tree->data.inner.children[i]);
+    return count;
+}
+
+static void test_tree_cons_boxes ()
+{
+    vox_dot *set = aligned_alloc (16, sizeof (vox_dot) * 60*60*60);
+    struct vox_node *tree1, *tree2;
+    size_t n = 0;
+    int i, j, k;
+
+    // Two blocks which are not aligned with anything, a stair and some noise
+    srand (11);
+    for (i=0; i<60; i++)
+        for (j=0; j<60; j++)
+            for (k=0; k<60; k++)
+            {
+                if ((i >= 3 && i < 37 && j >= 5 && j < 29 && k >= 1 && k < 50) ||
+                    (i >= 41 && i < 58 && j >= 13 && j < 59 && k >= 7 && k < 31) ||
+                    (j >= 31 && k < i / 3) || rand() % 50 == 0)
+                {
+                    vox_dot_set (set[n], i, j, k);
+                    n++;
+                }
+            }
+    tree1 = vox_make_tree (set, n);
+    // Duplicates are not stored
+    memcpy (set + n, set, 100 * sizeof (vox_dot));
+    tree2 = vox_make_tree_boxes (set, n + 100);
+    check_tree (tree2);
+    check_same_voxels (tree1, tree2, -1, 60);
+    CU_ASSERT (tree_nodes (tree2) < tree_nodes (tree1) / 2);
+    vox_destroy_tree (tree1);
+    vox_destroy_tree (tree2);
+
+    // Only small boxes
+    n = 0;
+    for (i=0; i<20; i++)
+        for (j=0; j<20; j++)
+            for (k=0; k<20; k++)
+                if ((i + j + k) % 3 == 0)
+                {
+                    vox_dot_set (set[n], i, j, k);
+                    n++;
+                }
+    tree1 = vox_make_tree (set, n);
+    tree2 = vox_make_tree_boxes (set, n);
+    check_tree (tree2);
+    check_same_voxels (tree1, tree2, -1, 20);
+    vox_destroy_tree (tree1);
+    vox_destroy_tree (tree2);
+
+    CU_ASSERT (vox_make_tree_boxes (set, 0) == NULL);
+    free (set);
+}
+
+// Freeze a leaf made of set and compare the frozen leaf with the original one
+static void check_frozen_leaf (vox_dot set[], int quant)
+{
+    struct vox_node *leaf = vox_make_tree (set, VOX_MAX_DOTS);
+    struct vox_node *frozen = vox_freeze_tree (leaf);
+    const struct vox_node *leaf1, *leaf2;
+    vox_dot origin, dir, res1, res2, center;
+    float radius;
+    int i, j, k;
+
+    CU_ASSERT_FATAL (leaf->flags & VOX_LEAF);
+    CU_ASSERT_FATAL (frozen != NULL);
+    CU_ASSERT ((frozen->flags & VOX_QUANT_MASK) == quant);
+    CU_ASSERT (vox_voxels_in_tree (frozen) == VOX_MAX_DOTS);
+
+    for (i=0; i<VOX_MAX_DOTS; i++)
+    {
+        for (j=0; j<100; j++)
+        {
+            // Rays from outside aim near the voxel, so some of them miss
+            for (k=0; k<VOX_N; k++)
+            {
+                origin[k] = set[i][k] + (rand() % 2 ? 1 : -1) * (rand() % 100 + 10);
+                dir[k] = set[i][k] + 1.6 * rand() / RAND_MAX - 0.3 - origin[k];
+                center[k] = set[i][k] + 3.0 * rand() / RAND_MAX - 1;
+            }
+            leaf1 = vox_ray_tree_intersection (leaf, origin, dir, res1);
+            leaf2 = vox_ray_tree_intersection (frozen, origin, dir, res2);
+            CU_ASSERT_FATAL ((leaf1 == NULL) == (leaf2 == NULL));
+            if (leaf1 != NULL) CU_ASSERT (vox_dot_equalp (res1, res2));
+
+            radius = (float)rand() / RAND_MAX;
+            CU_ASSERT (vox_tree_ball_collidep (leaf, center, radius) ==
+                       vox_tree_ball_collidep (frozen, center, radius));
+        }
+    }
+
+    vox_destroy_tree (leaf);
+    vox_destroy_tree (frozen);
+}
+
+static void test_tree_freeze ()
+{
+    struct vox_node *working_tree = prepare_tree ();
+    struct vox_node *frozen = vox_freeze_tree (working_tree);
+    struct vox_node *rebuilt;
+    vox_dot origin, dir, res1, res2, dot;
+    vox_dot set[VOX_MAX_DOTS];
+    const struct vox_node *leaf1, *leaf2;
+    int i;
+
+    CU_ASSERT (frozen->flags & VOX_FROZEN);
+    CU_ASSERT (vox_voxels_in_tree (frozen) == vox_voxels_in_tree (working_tree));
+
+    // Search must give the same results
+    for (i=0; i<1000; i++) {
+        vox_dot_set (origin, 100, rand() % 100 - 50, rand() % 100 - 50);
+        vox_dot_set (dir, -1, (float)rand()/RAND_MAX - 0.5, (float)rand()/RAND_MAX - 0.5);
+        leaf1 = vox_ray_tree_intersection (working_tree, origin, dir, res1);
+        leaf2 = vox_ray_tree_intersection (frozen, origin, dir, res2);
+        CU_ASSERT_FATAL ((leaf1 == NULL) == (leaf2 == NULL));
+        if (leaf1 != NULL) CU_ASSERT (vox_dot_equalp (res1, res2));
+        CU_ASSERT (vox_tree_ball_collidep (working_tree, origin, 60) ==
+                   vox_tree_ball_collidep (frozen, origin, 60));
+    }
+
+    // Frozen trees cannot be modified
+    vox_dot_set (dot, 0, 0, 0);
+    CU_ASSERT (!vox_delete_voxel (&frozen, dot));
+    vox_dot_set (dot, 100, 100, 100);
+    CU_ASSERT (!vox_insert_voxel (&frozen, dot));
+
+    // But can be turned back to ordinary trees
+    rebuilt = vox_rebuild_tree (frozen);
+    check_tree (rebuilt);
+    CU_ASSERT (!(rebuilt->flags & VOX_FROZEN));
+    CU_ASSERT (vox_voxels_in_tree (rebuilt) == vox_voxels_in_tree (working_tree));
+
+    vox_destroy_tree (working_tree);
+    vox_destroy_tree (frozen);
+    vox_destroy_tree (rebuilt);
+
+    // Sparse voxels are stored with wider offsets in frozen leafs
+    for (i=0; i<VOX_MAX_DOTS; i++)
+        vox_dot_set (set[i], 1000*i, 300*(i%3), -500*(i%2));
+    working_tree = vox_make_tree (set, VOX_MAX_DOTS);
+    frozen = vox_freeze_tree (working_tree);
+    for (i=0; i<VOX_MAX_DOTS; i++)
+    {
+        vox_dot_set (dot, 1000*i + 0.5, 300*(i%3) + 0.5, -500*(i%2) + 0.5);
+        CU_ASSERT (vox_tree_ball_collidep (frozen, dot, 0.1));
+        vox_dot_set (dot, 1000*i + 10, 300*(i%3), -500*(i%2));
+        CU_ASSERT (!vox_tree_ball_collidep (frozen, dot, 0.1));
+    }
+    vox_destroy_tree (working_tree);
+    vox_destroy_tree (frozen);
+
+    // Small offsets fit into 8 bits, bigger offsets into 16 bits
+    for (i=0; i<VOX_MAX_DOTS; i++) vox_dot_set (set[i], 37 + i, -12 + 40*i, 5 - 2*i);
+    check_frozen_leaf (set, VOX_QUANT8);
+    for (i=0; i<VOX_MAX_DOTS; i++) vox_dot_set (set[i], 37 + i, -12 + 40*i, 5 + 10000*i);
+    check_frozen_leaf (set, VOX_QUANT16);
+
+    // Voxels are stored as floats if offsets are too big or not on the grid
+    for (i=0; i<VOX_MAX_DOTS; i++) vox_dot_set (set[i], 37 + i, -12 + 40*i, 5 + 70000*i);
+    check_frozen_leaf (set, 0);
+    for (i=0; i<VOX_MAX_DOTS; i++) vox_dot_set (set[i], 37 + i, -12 + 40*i + 0.25, 5 - 2*i);
+    check_frozen_leaf (set, 0);
+}
+
+static void test_tree_files ()
+{
+    struct vox_node *working_tree = prepare_tree ();
+    struct vox_node *loaded, *reloaded, *rebuilt;
+    const char *filename = "test-tree.vox";
+    const char *error;
+    vox_dot origin, dir, res1, res2;
+    const struct vox_node *leaf1, *leaf2;
+    FILE *file;
+    int i;
+
+    CU_ASSERT_FATAL (vox_save_tree (working_tree, filename, &error));
+    loaded = vox_load_tree (filename, &error);
+    CU_ASSERT_FATAL (loaded != NULL);
+    CU_ASSERT (loaded->flags & VOX_FROZEN);
+    CU_ASSERT (vox_voxels_in_tree (loaded) == vox_voxels_in_tree (working_tree));
+
+    // Search must give the same results
+    for (i=0; i<1000; i++) {
+        vox_dot_set (origin, 100, rand() % 100 - 50, rand() % 100 - 50);
+        vox_dot_set (dir, -1, (float)rand()/RAND_MAX - 0.5, (float)rand()/RAND_MAX - 0.5);
+        leaf1 = vox_ray_tree_intersection (working_tree, origin, dir, res1);
+        leaf2 = vox_ray_tree_intersection (loaded, origin, dir, res2);
+        CU_ASSERT_FATAL ((leaf1 == NULL) == (leaf2 == NULL));
+        if (leaf1 != NULL) CU_ASSERT (vox_dot_equalp (res1, res2));
+        CU_ASSERT (vox_tree_ball_collidep (working_tree, origin, 60) ==
+                   vox_tree_ball_collidep (loaded, origin, 60));
+    }
+
+    // Loaded trees can be saved again and rebuilt
+    CU_ASSERT (vox_save_tree (loaded, filename, &error));
+    reloaded = vox_load_tree (filename, &error);
+    CU_ASSERT_FATAL (reloaded != NULL);
+    rebuilt = vox_rebuild_tree (reloaded);
+    check_tree (rebuilt);
+    check_same_voxels (working_tree, rebuilt, -60, 60);
+    vox_destroy_tree (reloaded);
+    vox_destroy_tree (rebuilt);
+    vox_destroy_tree (loaded);
+
+    // Voxel size is stored in the file
+    vox_dot_set (vox_voxel, 2, 2, 2);
+    CU_ASSERT (vox_load_tree (filename, &error) == NULL);
+    vox_dot_set (vox_voxel, 1, 1, 1);
+
+    // Invalid files are rejected
+    CU_ASSERT (!vox_save_tree (NULL, filename, &error));
+    file = fopen (filename, "w");
+    fprintf (file, "This is not a tree");
+    fclose (file);
+    CU_ASSERT (vox_load_tree (filename, &error) == NULL);
+    remove (filename);
+    CU_ASSERT (vox_load_tree (filename, &error) == NULL);
+
+    vox_destroy_tree (working_tree);
+}
+
+static void test_read_raw_data ()
+{
+    struct vox_node *tree1, *tree2;
+    const char *filename = "test-data.raw";
+    const char *error;
+    unsigned int dim[3] = {19, 7, 37};
+    unsigned int samplesize, i, l;
+    uint32_t min, max, maxval;
+    FILE *file;
+
+    for (samplesize=1; samplesize<=4; samplesize++)
+    {
+        file = fopen (filename, "w");
+        CU_ASSERT_FATAL (file != NULL);
+        for (i=0; i<dim[0]*dim[1]*dim[2]*samplesize; i++) fputc (rand() % 256, file);
+        fclose (file);
+
+        maxval = (samplesize == 4) ? UINT32_MAX : (1U << 8*samplesize) - 1;
+        min = maxval / 3;
+        max = 2 * (maxval / 3);
+        tree1 = vox_read_raw_data (filename, dim, samplesize, ^(unsigned int sample) {
+                return sample >= min && sample <= max;
+            }, &error);
+        tree2 = vox_read_raw_data_range (filename, dim, samplesize, min, max, &error);
+        CU_ASSERT_FATAL (tree2 != NULL);
+        check_same_voxels (tree1, tree2, -1, 40);
+        vox_destroy_tree (tree1);
+        vox_destroy_tree (tree2);
+
+        // Lookup tables
+        if (samplesize <= 2)
+        {
+            unsigned char *lut = malloc (maxval + 1);
+            for (i=0; i<=maxval; i++) lut[i] = (i % 3 == 0);
+            tree1 = vox_read_raw_data (filename, dim, samplesize, ^(unsigned int sample) {
+                    return sample % 3 == 0;
+                }, &error);
+            tree2 = vox_read_raw_data_lut (filename, dim, samplesize, lut, &error);
+            CU_ASSERT_FATAL (tree2 != NULL);
+            check_same_voxels (tree1, tree2, -1, 40);
+            vox_destroy_tree (tree1);
+            vox_destroy_tree (tree2);
+            free (lut);
+        }
+        else CU_ASSERT (vox_read_raw_data_lut (filename, dim, samplesize, NULL, &error) == NULL);
+
+        // Maximum is clamped to the maximal value of a sample
+        tree1 = vox_read_raw_data_range (filename, dim, samplesize, 0, UINT_MAX, &error);
+        CU_ASSERT (vox_voxels_in_tree (tree1) == dim[0]*dim[1]*dim[2]);
+        vox_destroy_tree (tree1);
+        if (samplesize < 4)
+            CU_ASSERT (vox_read_raw_data_range (filename, dim, samplesize,
+                                                maxval + 1, UINT_MAX, &error) == NULL);
+    }
+
+    /*
+      Volumes with more than VOX_READER_BRICK_SAMPLES samples are read in
+      bricks. Make a noisy ball with a solid cube inside.
+    */
+    {
+        unsigned int big_dim[3] = {130, 129, 140};
+        size_t size = big_dim[0]*big_dim[1]*big_dim[2], idx;
+        unsigned char *samples = malloc (size);
+        unsigned int j, k;
+        vox_dot dot;
+
+        for (i=0, idx=0; i<big_dim[0]; i++)
+            for (j=0; j<big_dim[1]; j++)
+                for (k=0; k<big_dim[2]; k++, idx++)
+                {
+                    int x = i - 65, y = j - 64, z = k - 70;
+                    if (abs (x) < 30 && abs (y) < 30 && abs (z) < 30) samples[idx] = 255;
+                    else samples[idx] = (x*x + y*y + z*z < 60*60) ? rand() % 256 : 0;
+                }
+        file = fopen (filename, "w");
+        fwrite (samples, size, 1, file);
+        fclose (file);
+
+        tree1 = vox_read_raw_data_range (filename, big_dim, 1, 100, 255, &error);
+        check_tree (tree1);
+        for (i=0, idx=0; i<big_dim[0]; i++)
+            for (j=0; j<big_dim[1]; j++)
+                for (k=0; k<big_dim[2]; k++, idx++)
+                {
+                    vox_dot_set (dot, i + 0.5, j + 0.5, k + 0.5);
+                    CU_ASSERT_FATAL (vox_tree_ball_collidep (tree1, dot, 0.1) ==
+                                     (samples[idx] >= 100));
+                }
+        vox_destroy_tree (tree1);
+
+        // Solid volume is read without making voxels
+        memset (samples, 255, size);
+        file = fopen (filename, "w");
+        fwrite (samples, size, 1, file);
+        fclose (file);
+        tree1 = vox_read_raw_data_range (filename, big_dim, 1, 100, 255, &error);
+        CU_ASSERT_FATAL (tree1 != NULL);
+        CU_ASSERT (tree1->flags & VOX_DENSE_LEAF);
+        CU_ASSERT (vox_voxels_in_tree (tree1) == size);
+        vox_destroy_tree (tree1);
+        free (samples);
+    }
+
+    /*
+      A solid volume of more than 2^24 samples with one hole. Float volumes
+      of this size cannot tell it from the solid volume.
+    */
+    {
+        unsigned int big_dim[3] = {320, 256, 256};
+        size_t size = (size_t)big_dim[0]*big_dim[1]*big_dim[2];
+        unsigned char *samples = malloc (size);
+        vox_dot dot;
+
+        memset (samples, 255, size);
+        samples[(200*big_dim[1] + 100)*big_dim[2] + 50] = 0;
+        file = fopen (filename, "w");
+        fwrite (samples, size, 1, file);
+        fclose (file);
+        free (samples);
+
+        for (l=0; l<2; l++)
+        {
+            // Test block (serial reading) and range of samples
+            tree1 = (l == 0) ?
+                vox_read_raw_data (filename, big_dim, 1, ^(unsigned int sample) {
+                        return sample != 0;
+                    }, &error) :
+                vox_read_raw_data_range (filename, big_dim, 1, 1, 255, &error);
+            CU_ASSERT_FATAL (tree1 != NULL);
+            CU_ASSERT (!(tree1->flags & VOX_DENSE_LEAF));
+            CU_ASSERT (vox_voxels_in_tree (tree1) == size - 1);
+            vox_dot_set (dot, 200.5, 100.5, 50.5);
+            CU_ASSERT (!vox_tree_ball_collidep (tree1, dot, 0.1));
+            vox_dot_set (dot, 200.5, 100.5, 51.5);
+            CU_ASSERT (vox_tree_ball_collidep (tree1, dot, 0.1));
+            vox_destroy_tree (tree1);
+        }
+    }
+
+    // Wrong sizes
+    for (l=0; l<3; l++) dim[l]++;
+    CU_ASSERT (vox_read_raw_data_range (filename, dim, 1, 0, 255, &error) == NULL);
+    CU_ASSERT (vox_read_raw_data_range (filename, dim, 5, 0, 255, &error) == NULL);
+    remove (filename);
+}
+
+static void test_density_tree ()
+{
+    struct vox_density_tree *dtree;
+    struct vox_node *tree;
+    const char *filename = "test-data.raw";
+    const char *error;
+    unsigned int dim[3] = {37, 45, 29};
+    unsigned int thresholds[2] = {1000, 40000};
+    unsigned int i, j, k, t, min, max;
+    struct vox_box box;
+    vox_dot origin, dir, res1, res2, center;
+    FILE *file;
+
+    // A noisy ball with denser core
+    file = fopen (filename, "w");
+    CU_ASSERT_FATAL (file != NULL);
+    for (i=0; i<dim[0]; i++)
+        for (j=0; j<dim[1]; j++)
+            for (k=0; k<dim[2]; k++)
+            {
+                int x = i - 18, y = j - 22, z = k - 14;
+                int r2 = x*x + y*y + z*z;
+                unsigned int sample = rand() % 1000;
+                if (r2 < 14*14) sample += rand() % 30000;
+                if (r2 < 7*7) sample += 30000;
+                fputc (sample & 0xff, file);
+                fputc (sample >> 8, file);
+            }
+    fclose (file);
+
+    dtree = vox_read_density_data (filename, dim, 2, &error);
+    CU_ASSERT_FATAL (dtree != NULL);
+    vox_density_tree_range (dtree, &min, &max);
+    CU_ASSERT (min < 1000 && max >= 60000);
+    vox_density_tree_bounding_box (dtree, &box);
+    CU_ASSERT (box.max[0] == dim[0]*vox_voxel[0] && box.max[1] == dim[1]*vox_voxel[1] &&
+               box.max[2] == dim[2]*vox_voxel[2]);
+
+    // The same density tree is searched with different thresholds
+    for (t=0; t<2; t++)
+    {
+        tree = vox_read_raw_data_range (filename, dim, 2, thresholds[t], 65535, &error);
+        CU_ASSERT_FATAL (tree != NULL);
+        vox_dot_set (center, dim[0]*vox_voxel[0]/2, dim[1]*vox_voxel[1]/2, dim[2]*vox_voxel[2]/2);
+        for (i=0; i<1000; i++)
+        {
+            // Rays which only touch an edge of a voxel are ignored here
+            vox_dot_set (origin, rand() % 200 - 100.37, rand() % 200 - 100.71, rand() % 200 - 100.13);
+            vox_dot_set (dir,
+                         center[0] - origin[0] + (rand() % 40 - 20) + 0.1,
+                         center[1] - origin[1] + (rand() % 40 - 20) + 0.2,
+                         center[2] - origin[2] + (rand() % 40 - 20) + 0.3);
+            if (vox_ray_tree_intersection (tree, origin, dir, res1) != NULL)
+            {
+                CU_ASSERT_FATAL (vox_ray_density_intersection (dtree, thresholds[t], 65535,
+                                                               origin, dir, res2));
+                CU_ASSERT (vox_abs_metric (res1, res2) <= 1e-3 * vox_abs_metric (res1, origin));
+            }
+            else CU_ASSERT_FATAL (!(vox_ray_density_intersection (dtree, thresholds[t], 65535,
+                                                                  origin, dir, res2)));
+        }
+        vox_destroy_tree (tree);
+    }
+    // No solid samples
+    CU_ASSERT (!(vox_ray_density_intersection (dtree, 65000, 65535, origin, dir, res2)));
+    vox_destroy_density_tree (dtree);
+
+    CU_ASSERT (vox_read_density_data (filename, dim, 5, &error) == NULL);
+    dim[0]++;
+    CU_ASSERT (vox_read_density_data (filename, dim, 2, &error) == NULL);
+    remove (filename);
+}
+
+/*
+  A pillar with a spiral staircase around it. Voxels are added to set at
+  position (x, y).
+*/
+static size_t make_pillar (vox_dot set[], float x, float y)
+{
+    size_t n = 0;
+    int i, j, k;
+
+    for (k=0; k<32; k++)
+        for (i=0; i<8; i++)
+            for (j=0; j<8; j++)
+                if ((i-4)*(i-4) + (j-4)*(j-4) < 9 || (i + j + k) % 7 == 0)
+                {
+                    vox_dot_set (set[n], x+i, y+j, k);
+                    n++;
+                }
+    return n;
+}
+
+static void test_dag ()
+{
+    struct vox_node *working_tree = prepare_tree ();
+    struct vox_node *frozen = vox_freeze_tree (working_tree);
+    struct vox_node *tree;
+    struct vox_dag *dag, *single;
+    struct vox_box box1, box2;
+    vox_dot origin, dir, res1, res2;
+    vox_dot *set = vox_alloc (sizeof (vox_dot) * 64 * 8*8*32);
+    const struct vox_node *leaf;
+    size_t n;
+    int i, j, hit;
+
+    // Search must give the same results
+    dag = vox_make_dag (working_tree);
+    CU_ASSERT_FATAL (dag != NULL);
+    CU_ASSERT (vox_voxels_in_dag (dag) == vox_voxels_in_tree (working_tree));
+    vox_bounding_box (working_tree, &box1);
+    vox_dag_bounding_box (dag, &box2);
+    CU_ASSERT (vox_dot_equalp (box1.min, box2.min) && vox_dot_equalp (box1.max, box2.max));
+    for (i=0; i<1000; i++) {
+        vox_dot_set (origin, 100, rand() % 100 - 50, rand() % 100 - 50);
+        vox_dot_set (dir, -1, (float)rand()/RAND_MAX - 0.5, (float)rand()/RAND_MAX - 0.5);
+        leaf = vox_ray_tree_intersection (working_tree, origin, dir, res1);
+        hit = vox_ray_dag_intersection (dag, origin, dir, res2);
+        CU_ASSERT_FATAL ((leaf != NULL) == hit);
+        if (hit) CU_ASSERT (vox_abs_metric (res1, res2) < 1e-3);
+    }
+    vox_destroy_dag (dag);
+
+    // Frozen trees give the same DAG
+    dag = vox_make_dag (frozen);
+    CU_ASSERT_FATAL (dag != NULL);
+    CU_ASSERT (vox_voxels_in_dag (dag) == vox_voxels_in_tree (frozen));
+    vox_destroy_dag (dag);
+    vox_destroy_tree (working_tree);
+    vox_destroy_tree (frozen);
+    CU_ASSERT (vox_make_dag (NULL) == NULL);
+
+    // Pillars in a row of 64 share all their nodes
+    n = make_pillar (set, 0, 0);
+    tree = vox_make_tree (set, n);
+    single = vox_make_dag (tree);
+    vox_destroy_tree (tree);
+
+    n = 0;
+    for (i=0; i<8; i++)
+        for (j=0; j<8; j++) n += make_pillar (set + n, 64*i, 64*j);
+    tree = vox_make_tree (set, n);
+    dag = vox_make_dag (tree);
+    CU_ASSERT_FATAL (dag != NULL);
+    CU_ASSERT (vox_voxels_in_dag (dag) == n);
+    CU_ASSERT (vox_dag_size (dag) < 2 * vox_dag_size (single));
+    for (i=0; i<1000; i++) {
+        vox_dot_set (origin, rand() % 600 - 50, rand() % 600 - 50, 100);
+        vox_dot_set (dir, (float)rand()/RAND_MAX - 0.5, (float)rand()/RAND_MAX - 0.5, -1);
+        leaf = vox_ray_tree_intersection (tree, origin, dir, res1);
+        hit = vox_ray_dag_intersection (dag, origin, dir, res2);
+        CU_ASSERT_FATAL ((leaf != NULL) == hit);
+        if (hit) CU_ASSERT (vox_abs_metric (res1, res2) < 1e-3);
+    }
+    vox_destroy_dag (dag);
+    vox_destroy_dag (single);
+    vox_destroy_tree (tree);
+
+    // Copies of the same voxel make an overflowed leaf with more than VOX_MAX_DOTS voxels
+    for (i=0; i<1000; i++) vox_dot_set (set[i], rand() % 100, rand() % 100, rand() % 100);
+    for (; i<1000 + 8*VOX_MAX_DOTS; i++) vox_dot_set (set[i], 50, 50, 50);
+    tree = vox_make_tree (set, i);
+    dag = vox_make_dag (tree);
+    CU_ASSERT_FATAL (dag != NULL);
+    CU_ASSERT (vox_voxels_in_dag (dag) == vox_voxels_in_tree (tree));
+    for (i=0; i<1000; i++) {
+        vox_dot_set (origin, -50, rand() % 200 - 50, rand() % 200 - 50);
+        // Aim at the overflowed leaf
+        vox_dot_set (dir, 100.5, 50.5 - origin[1], 50.5 - origin[2]);
+        leaf = vox_ray_tree_intersection (tree, origin, dir, res1);
+        hit = vox_ray_dag_intersection (dag, origin, dir, res2);
+        CU_ASSERT_FATAL ((leaf != NULL) == hit);
+        if (hit) CU_ASSERT (vox_abs_metric (res1, res2) < 1e-3);
+    }
+    vox_destroy_dag (dag);
+    vox_destroy_tree (tree);
+    free (set);
+}
+
+#define ISA_VOXELS 20000
+#define ISA_TESTS 500
+
+/*
+  Trees built and searched with any instruction set available must be the
+  same.
+*/
+static void test_isa ()
+{
+    enum vox_isa isa, saved = vox_current_isa ();
+    vox_dot *set = vox_alloc (sizeof (vox_dot) * (ISA_VOXELS + 40));
+    vox_dot *copy = vox_alloc (sizeof (vox_dot) * (ISA_VOXELS + 40));
+    vox_dot origin[ISA_TESTS], dir[ISA_TESTS], center[ISA_TESTS];
+    vox_dot res[ISA_TESTS], ref_res[ISA_TESTS], closest;
+    float radius[ISA_TESTS], dist;
+    int hits[ISA_TESTS], ref_hits[ISA_TESTS];
+    int collides[ISA_TESTS], ref_collides[ISA_TESTS];
+    struct vox_box box, ref_box;
+    struct vox_node *tree;
+    size_t n = ISA_VOXELS + 40, ref_n = 0;
+    int i, j, k, used = 0;
+
+    srand (17);
+    for (i=0; i<ISA_VOXELS; i++)
+        vox_dot_set (set[i], rand() % 100, rand() % 100, rand() % 100);
+    // Copies of the same voxel make an overflowed leaf
+    for (; i<n; i++) vox_dot_set (set[i], 50, 50, 50);
+
+    for (i=0; i<ISA_TESTS; i++)
+    {
+        vox_dot_set (origin[i], -50, rand() % 200 - 50, rand() % 200 - 50);
+        if (i & 1)
+            vox_dot_set (dir[i], 1, (float)rand()/RAND_MAX - 0.5, (float)rand()/RAND_MAX - 0.5);
+        else
+            // Aim at the overflowed leaf
+            vox_dot_set (dir[i], 100.5, 100.5 - origin[i][1], 100.5 - origin[i][2]);
+        vox_dot_set (center[i], rand() % 1000 / 10.0, rand() % 1000 / 10.0, rand() % 1000 / 10.0);
+        radius[i] = 2.0 * rand() / RAND_MAX;
+    }
+
+    for (isa = VOX_ISA_GENERIC; isa <= VOX_ISA_AVX512; isa++)
+    {
+        if (!vox_use_isa (isa)) continue;
+        CU_ASSERT (vox_current_isa () == isa);
+        memcpy (copy, set, n * sizeof (vox_dot));
+        tree = vox_make_tree (copy, n);
+        CU_ASSERT_FATAL (tree != NULL);
+        vox_bounding_box (tree, &box);
+        for (i=0; i<ISA_TESTS; i++)
+        {
+            hits[i] = vox_ray_tree_intersection (tree, origin[i], dir[i], res[i]) != NULL;
+            collides[i] = vox_tree_ball_collidep (tree, center[i], radius[i]);
+        }
+
+        if (used++ == 0)
+        {
+            ref_n = vox_voxels_in_tree (tree);
+            vox_box_copy (&ref_box, &box);
+            memcpy (ref_res, res, sizeof (res));
+            memcpy (ref_hits, hits, sizeof (hits));
+            memcpy (ref_collides, collides, sizeof (collides));
+        }
+        else
+        {
+            CU_ASSERT (vox_voxels_in_tree (tree) == ref_n);
+            CU_ASSERT (vox_dot_equalp (box.min, ref_box.min) &&
+                       vox_dot_equalp (box.max, ref_box.max));
+            for (i=0; i<ISA_TESTS; i++)
+            {
+                CU_ASSERT (hits[i] == ref_hits[i]);
+                if (hits[i] && ref_hits[i]) CU_ASSERT (vox_dot_equalp (res[i], ref_res[i]));
+                CU_ASSERT (collides[i] == ref_collides[i]);
+            }
+        }
+        vox_destroy_tree (tree);
+    }
+    CU_ASSERT (used > 0);
+
+    // Check collisions against naive search unless the ball touches a voxel
+    for (i=0; i<ISA_TESTS; i++)
+    {
+        float min_dist = INFINITY;
+        for (j=0; j<n; j++)
+        {
+            for (k=0; k<VOX_N; k++)
+                closest[k] = fminf (fmaxf (center[i][k], set[j][k]), set[j][k] + vox_voxel[k]);
+            dist = vox_sqr_metric (closest, center[i]);
+            min_dist = fminf (min_dist, dist);
+        }
+        if (min_dist < 0.999 * radius[i] * radius[i]) CU_ASSERT (ref_collides[i]);
+        if (min_dist > 1.001 * radius[i] * radius[i]) CU_ASSERT (!ref_collides[i]);
+    }
+
+    vox_use_isa (saved);
+    free (set);
+    free (copy);
+}
+
 static CU_TestInfo voxtrees_tests[] = {
     { "tree construction", test_tree_cons },
+    { "tree construction (Z-order)", test_tree_cons_morton },
+    { "tree construction (boxes)", test_tree_cons_boxes },
     { "insertion", test_tree_ins },
     { "deletion (case 1)", test_tree_del1 },
     { "deletion (case 2)", test_tree_del2 },
@@ -904,6 +2146,19 @@ static CU_TestInfo voxtrees_tests[] = {
     { "insertion type transitions", test_tree_ins_trans },
     { "deletion type transitions", test_tree_del_trans },
     { "search (commit 676d50c)", test_tree_g676d50c },
+    { "frozen trees", test_tree_freeze },
+    { "bricks", test_tree_brick },
+    { "packet search", test_packet_search },
+    { "local rebuilding", test_tree_local_rebuild },
+    { "dense-aware rebuilding", test_tree_dense_rebuild },
+    { "batch insertion and deletion", test_tree_batch },
+    { "region insertion and deletion", test_tree_regions },
+    { "tree versions", test_tree_versions },
+    { "tree files", test_tree_files },
+    { "raw data reading", test_read_raw_data },
+    { "density trees", test_density_tree },
+    { "DAGs", test_dag },
+    { "instruction sets", test_isa },
     { "test M-trees", test_mtree },
     { "test M-tree search", test_mtree_search },
     CU_TEST_INFO_NULL